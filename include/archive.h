@@ -13,9 +13,16 @@
 #define ARCHIVE_H
 
 #include <wx/wx.h>
+#include <wx/hashmap.h>
+#include <wx/clntdata.h>
 
 #include <sstream>
 #include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 /**
  * @file archive.h
@@ -119,6 +126,150 @@ template <class T> bool ShouldInsert(const T& value, const T& def)
 class Archive
 {
 public:
+    /**
+     * @brief A reference to a string owned by the archive.
+     *
+     * This is used for the attribute names, which are interned so that all
+     * the items of an archive share a single copy of each name and the
+     * attributes can be found by comparing pointers, and for the sort keys
+     * returned by @c GetItems(). It converts implicitly to the string itself.
+     */
+    class Key
+    {
+    public:
+        explicit Key(const wxString *name) : m_name(name) { }
+
+        /// Returns the string.
+        const wxString& GetName() const { return *m_name; }
+        operator const wxString&() const { return *m_name; }
+
+        bool operator==(const Key& other) const
+            { return m_name == other.m_name; }
+        bool operator!=(const Key& other) const
+            { return m_name != other.m_name; }
+
+    private:
+        const wxString *m_name;     ///< The referenced string.
+    };
+
+    /**
+     * @brief An attribute value.
+     *
+     * A value is usually a string, but the @c Insert() overloads for
+     * integers, points, sizes and rectangles store a list of integers and
+     * those for images store raw bytes. These are kept as they are by the
+     * binary format and only converted to text when the string is used,
+     * for example when saving as XML.
+     *
+     * When an archive is loaded from a file with @c Archive::Load(), the
+     * values may refer to the file data and are only converted to @c
+     * wxString when they are first read. This converts implicitly to the
+     * value string.
+     */
+    class Value
+    {
+    public:
+        /// The kinds of value.
+        enum Type
+        {
+            Type_String,    ///< Text.
+            Type_Ints,      ///< List of integers, see GetInts().
+            Type_Bytes      ///< Raw bytes, see GetBytes().
+        };
+
+        /// Function converting the raw data of a value.
+        typedef wxString (*Decoder)(const char *data, size_t len);
+
+        /// A value that is already a string.
+        explicit Value(const wxString& str)
+          : m_type(Type_String), m_str(str), m_converted(true),
+            m_data(NULL), m_len(0), m_decode(NULL)
+        { }
+
+        /**
+         * @brief A value that is converted from @a data by @a decode when
+         * it's first used.
+         *
+         * The data must remain valid for as long as the value.
+         */
+        Value(const char *data, size_t len, Decoder decode)
+          : m_type(Type_String), m_converted(false),
+            m_data(data), m_len(len), m_decode(decode)
+        { }
+
+        /// A list of integers, its string is comma separated.
+        explicit Value(const std::vector<wxInt64>& ints);
+
+        /// A copy of @a len raw bytes, their string is base64.
+        Value(const void *data, size_t len);
+
+        /**
+         * @brief A @c Type_Ints or @c Type_Bytes value referring to its
+         * encoding in a binary archive in memory.
+         *
+         * The data must remain valid for as long as the value.
+         */
+        Value(Type type, const char *data, size_t len)
+          : m_type(type), m_converted(false),
+            m_data(data), m_len(len), m_decode(NULL)
+        {
+            wxASSERT(type != Type_String);
+        }
+
+        /// Returns the kind of value.
+        Type GetType() const { return m_type; }
+
+        /// Returns the value, converting it if necessary.
+        const wxString& GetString() const {
+            return m_converted ? m_str : Convert();
+        }
+        operator const wxString&() const { return GetString(); }
+
+        /**
+         * @brief Get the integers of a @c Type_Ints value.
+         *
+         * Returns false for the other types, which must be parsed from
+         * GetString() instead.
+         */
+        bool GetInts(std::vector<wxInt64>& ints) const;
+
+        /**
+         * @brief Get the bytes of a @c Type_Bytes value.
+         *
+         * Returns false for the other types. The data remains valid for as
+         * long as the value.
+         */
+        bool GetBytes(const char **data, size_t *len) const {
+            if (m_type != Type_Bytes)
+                return false;
+            *data = m_data;
+            *len = m_len;
+            return true;
+        }
+
+    private:
+        /// Converts the data to m_str.
+        const wxString& Convert() const;
+
+        Type m_type;                    ///< The kind of value.
+        mutable wxString m_str;         ///< The value once converted.
+        mutable bool m_converted;       ///< True if m_str is set.
+
+        /**
+         * The data of the value, either in the file or in m_own. For
+         * Type_Ints it's the encoding of the binary format, the number of
+         * integers followed by each as a signed varint.
+         */
+        const char *m_data;
+        size_t m_len;                   ///< Length of m_data.
+        Decoder m_decode;               ///< Converts m_data to a string.
+
+        /// The data when it doesn't refer to a file, shared by the copies.
+        std::shared_ptr<const std::string> m_own;
+
+        friend class Archive;
+    };
+
     /**
      * @brief Serialisation archive item, holds an object in the archive.
      *
@@ -142,12 +293,13 @@ public:
     {
     private:
         /**
-         * @brief Map used to store item attributes.
+         * @brief List used to store item attributes.
          *
-         * A map with string keys and string values used for storing the items
-         * attributes.
+         * The values are strings and the names are interned by the archive.
+         * Items only have a few attributes, so a linear search comparing the
+         * name pointers is faster than a map.
          */
-        typedef std::map<wxString, wxString> StringMap;
+        typedef std::vector<std::pair<Key, Value> > AttribList;
 
         /**
          * @brief Item constructor.
@@ -169,8 +321,25 @@ public:
     public:
         //@{
         /** @brief The class of the object, alphanumerics only. */
-        void SetClass(const wxString& name) { m_class = name; }
-        wxString GetClass() const { return m_class; }
+        void SetClass(const wxString& name);
+        const wxString& GetClass() const { return m_class->first; }
+        //@}
+
+        //@{
+        /**
+         * @brief Data associated with the item's class name.
+         *
+         * The class names are interned by the archive and the data is
+         * shared by all its items of the same class. It is @c NULL until
+         * set and can be used to remember what the class name resolves to,
+         * e.g. the factory creating the objects of this class, instead of
+         * looking it up again for every item.
+         *
+         * The archive takes ownership of the data, deleting any previously
+         * set for the class, and deletes it when it's cleared or destroyed.
+         */
+        wxClientData *GetClassData() const { return m_class->second.get(); }
+        void SetClassData(wxClientData *data) { m_class->second.reset(data); }
         //@}
 
         /**
@@ -182,7 +351,7 @@ public:
          *
          * @see Archive::MakeId()
          */
-        wxString GetId() const { return m_id; }
+        const wxString& GetId() const { return m_id; }
         /**
          * @brief Returns the item's sort key.
          *
@@ -190,7 +359,16 @@ public:
          * @c Archive::GetItems. It can be set when the @c Item is created
          * with @c Archive::Put or set latter with @c Archive::SortItem.
          */
-        wxString GetSort() const { return m_sort; }
+        const wxString& GetSort() const { return m_sort; }
+
+        /**
+         * @brief Returns the item's index in the archive.
+         *
+         * The items are numbered densely from 0 in the order they were added,
+         * so the index can be used with @c Archive::GetByIndex() or to key
+         * arrays. It changes if an item before it is removed.
+         */
+        size_t GetIndex() const { return m_index; }
 
         //@{
         /**
@@ -284,6 +462,7 @@ public:
         /** @cond */
         bool Put(const wxString& name, const wxString& value = wxEmptyString);
         bool Put(const wxString& name, const wxChar *value);
+        bool Put(const wxString& name, const Value& value);
         /** @endcond */
 
         /**
@@ -352,6 +531,14 @@ public:
 
         /** @brief Returns true if an attribute exists with the given name. */
         bool Has(const wxString& name) const;
+        /**
+         * @brief Returns the value of an attribute as it's stored, or NULL
+         * if there is no attribute with the given name.
+         *
+         * Lets @c Extract() overloads read typed values, see @c
+         * Value::GetInts(), without converting them to text.
+         */
+        const Value *GetValue(const wxString& name) const;
         /** @brief Removes an attribute. */
         bool Remove(const wxString& name);
 
@@ -406,8 +593,8 @@ public:
 
         //@{
         /** @brief An iterator type for returning the Item's attributes. */
-        typedef StringMap::iterator iterator;
-        typedef StringMap::const_iterator const_iterator;
+        typedef AttribList::iterator iterator;
+        typedef AttribList::const_iterator const_iterator;
         //@}
 
         //@{
@@ -423,11 +610,24 @@ public:
         //@}
 
     private:
+        /// Find an attribute by name, returns end if not found.
+        const_iterator Find(const wxString& name) const;
+
         Archive& m_archive;     ///< Back pointer to the archive.
-        wxString m_class;       ///< Class of the item.
+
+        /// Class of the item and its data, in Archive::m_classes.
+        std::pair<const wxString, std::unique_ptr<wxClientData> > *m_class;
+
         wxString m_id;          ///< Unique id of the item.
         wxString m_sort;        ///< Optional sort order.
-        StringMap m_attribs;    ///< Items attributes map.
+        AttribList m_attribs;   ///< Items attributes.
+        size_t m_index;         ///< Position in Archive::m_list.
+
+        /// The object this item was created for by PutObject(), if any.
+        const void *m_object;
+
+        /// True if the item is in Archive::m_pending.
+        bool m_pending;
 
         /// Optional pointer to another instance of the same item.
         wxObject *m_instance;
@@ -438,23 +638,87 @@ public:
         friend class Archive;
     };
 
+    /**
+     * @brief Receives the items while an archive is being loaded.
+     *
+     * Pass an object implementing this interface to @c Archive::Load() to
+     * process the items as soon as they have been read, instead of waiting
+     * for the whole archive to be loaded.
+     *
+     * When the archive was written by @c Archive::Save(), the items are
+     * read in the order of their sort keys, see @c Archive::IsSorted().
+     */
+    class Consumer
+    {
+    public:
+        Consumer() = default;
+        Consumer(const Consumer&) = delete;
+        Consumer(Consumer&&) = delete;
+        Consumer& operator=(const Consumer&) = delete;
+        Consumer& operator=(Consumer&&) = delete;
+        virtual ~Consumer() = default;
+
+        /**
+         * @brief Called when an item and all its attributes have been read.
+         *
+         * The item remains in the archive after this call.
+         *
+         * @returns @c false to stop loading, in which case @c
+         * Archive::Load() fails.
+         */
+        virtual bool OnItem(Item& item) = 0;
+    };
+
 private:
     /**
-     * @brief Map used to store the archive items.
+     * @brief Hash map used to find the archive items by their ids.
+     */
+    typedef std::unordered_map<wxString, Item*, wxStringHash, wxStringEqual>
+        ItemMap;
+
+    /**
+     * @brief Hash map used to find the items created by @c PutObject().
+     */
+    typedef std::unordered_map<const void*, Item*> ObjectMap;
+
+    /**
+     * @brief Set of the interned attribute names.
      *
-     * Map with string keys and items as values.
+     * The elements of an unordered set don't move, so @c Key can point to
+     * them.
      */
-    typedef std::map<wxString, Item*> ItemMap;
+    typedef std::unordered_set<wxString, wxStringHash, wxStringEqual> NameSet;
 
     /**
-     * @brief Map used to store sort order of the items.
+     * @brief Map of the interned class names to their data.
      *
-     * Notice that this map is always used, even if no explicit sort order is
-     * set.
+     * As for @c NameSet, the elements don't move and the items point to
+     * them.
      */
-    typedef std::multimap<wxString, Item*> SortMap;
+    typedef std::unordered_map<wxString, std::unique_ptr<wxClientData>,
+                               wxStringHash, wxStringEqual> ClassMap;
+
+    /**
+     * @brief Index of the items in sort key order.
+     *
+     * The entries are the item's sort key and the item itself, ordered by
+     * the key and then by the item index, so that the items with the same
+     * key are in the order they were added.
+     */
+    typedef std::vector<std::pair<Key, Item*> > SortIndex;
 
 public:
+    /**
+     * @brief The formats in which an archive can be saved.
+     *
+     * @c Load() recognizes the format automatically.
+     */
+    enum Format
+    {
+        Format_Xml,     ///< Human readable XML, the default.
+        Format_Binary   ///< Compact binary format, faster to load and save.
+    };
+
     Archive();
     Archive(const Archive&) = delete;
     Archive(Archive&&) = delete;
@@ -465,10 +729,68 @@ public:
     /** @brief Deletes all the <code>Item</code> objects in the archive. */
     void Clear();
 
-    /** @brief Load a previously saved archive from a stream.  */
-    bool Load(wxInputStream& stream);
-    /** @brief Save the archive to a stream. */
-    bool Save(wxOutputStream& stream) const;
+    /**
+     * @brief Load a previously saved archive from a stream.
+     *
+     * The archive may be in any of the supported formats, see @c
+     * GetFormat(), and may be gzip compressed. It is parsed as it is read,
+     * without building an XML document in memory first.
+     *
+     * @param stream The stream to read from.
+     * @param consumer If not @c NULL, its @c Consumer::OnItem() is called
+     * for every item as soon as it is complete.
+     */
+    bool Load(wxInputStream& stream, Consumer *consumer = NULL);
+    /**
+     * @brief Load a previously saved archive from a file.
+     *
+     * The file is mapped into memory and parsed in place, when possible,
+     * and the attribute values are only converted to strings when they are
+     * read. The archive keeps the file mapped until it is cleared.
+     *
+     * @param path The file to read.
+     * @param consumer As for the stream overload.
+     */
+    bool Load(const wxString& path, Consumer *consumer = NULL);
+    /**
+     * @brief Save the archive to a stream.
+     *
+     * Both formats store exactly the same items, so an archive can be
+     * loaded from one format and saved in the other. The data is buffered
+     * and written to the stream in large blocks as the items are generated.
+     */
+    bool Save(wxOutputStream& stream, Format format = Format_Xml) const;
+    /**
+     * @brief Save the archive to a file.
+     *
+     * If @a compress is true, the data is compressed in the gzip format as
+     * it is written. @c Load() uncompresses such archives automatically.
+     */
+    bool Save(const wxString& path,
+              Format format = Format_Xml,
+              bool compress = false) const;
+
+    /**
+     * @brief Decode the images stored in the archive using several threads.
+     *
+     * Decoding the images stored by @c Insert() for @c wxImage, @c wxBitmap
+     * and @c wxIcon attributes is usually the slowest part of extracting
+     * them. This decodes all those which weren't extracted yet up front,
+     * sharing the work between @a threads threads, one per CPU by default,
+     * and keeps the results with their items, so that @c Extract() only
+     * needs to convert them afterwards.
+     *
+     * Must be called from the main thread, while nothing else uses the
+     * archive.
+     */
+    void DecodeImages(unsigned threads = 0);
+
+    /**
+     * @brief The format of the archive last loaded by @c Load().
+     *
+     * @c Format_Xml if nothing was loaded.
+     */
+    Format GetFormat() const { return m_format; }
 
     //@{
     /**
@@ -484,6 +806,16 @@ public:
     /** @brief Same as !IsStoring(). */
     bool IsExtracting() const { return !m_storing; }
 
+    /**
+     * @brief True if the loaded archive had its items in sort key order.
+     *
+     * @c Save() always writes the items in this order, so that the items
+     * sorted first, e.g. those referenced by others, can be used by a @c
+     * Consumer before the rest of the archive is loaded. Archives written
+     * by the older versions kept them in id order instead.
+     */
+    bool IsSorted() const { return m_sorted; }
+
     /**
      * @brief Add an <code>Item</code> to the archive.
      *
@@ -502,7 +834,26 @@ public:
     Item *Put(const wxString& classname,
               const wxString& id,
               const wxString& sortkey = wxEmptyString);
-    /** @brief Delete an <code>Item</code> in the archive. */
+    /**
+     * @brief Add an <code>Item</code> for the given object.
+     *
+     * This is the same as <code>Put(classname, MakeId(obj), sortkey)</code>
+     * but the item can then be found with @c FindObject() without making
+     * the id string.
+     *
+     * @returns a pointer to the newly created <code>Item</code>, or NULL
+     * if the object is already in the archive.
+     */
+    Item *PutObject(const wxString& classname,
+                    const void *obj,
+                    const wxString& sortkey = wxEmptyString);
+    /**
+     * @brief Delete an <code>Item</code> in the archive.
+     *
+     * This invalidates all the iterators returned by @c GetItems(), not
+     * just those referring to the removed item. When removing items while
+     * iterating, collect their ids first and remove them after the loop.
+     */
     bool Remove(const wxString& id);
 
     //@{
@@ -514,6 +865,36 @@ public:
     const Item *Get(const wxString& id) const;
     //@}
 
+    /**
+     * @brief Returns the <code>Item</code> added with @c PutObject() for
+     * the given object or NULL.
+     */
+    Item *FindObject(const void *obj) const;
+
+    //@{
+    /**
+     * @brief Access to the items by their index.
+     *
+     * @see Item::GetIndex()
+     */
+    size_t GetCount() const { return m_list.size(); }
+    Item *GetByIndex(size_t index) const { return m_list[index]; }
+    //@}
+
+    /**
+     * @brief Returns the interned attribute name.
+     *
+     * Adds it if it's not interned yet.
+     */
+    Key Intern(const wxString& name);
+
+    /**
+     * @brief Returns the interned attribute name if it is used.
+     *
+     * @returns @c false if no item has an attribute with this name.
+     */
+    bool FindKey(const wxString& name, Key *key) const;
+
     //@{
     /**
      * @brief Equivalent to <code>@link
@@ -558,8 +939,8 @@ public:
 
     //@{
     /** @brief An iterator type for returning the @c Archive's @c Items. */
-    typedef SortMap::iterator iterator;
-    typedef SortMap::const_iterator const_iterator;
+    typedef SortIndex::iterator iterator;
+    typedef SortIndex::const_iterator const_iterator;
     //@}
 
     //@{
@@ -583,6 +964,10 @@ public:
      * @endcode
      *
      * The items are returned in the order of their sort keys.
+     *
+     * The iterators remain valid while items are added or given new sort
+     * keys, but are invalidated by @c Remove() and by the next call to @c
+     * %GetItems() after such changes.
      */
     iterator_pair GetItems(const wxString& prefix = wxEmptyString);
     const_iterator_pair GetItems(const wxString& prefix = wxEmptyString) const;
@@ -592,51 +977,122 @@ private:
     /**
      * Ensure that all items are in sorted order in m_sort.
      *
-     * Does nothing if the items are already sorted or calls SortAdd() for all
-     * of them if they are not.
+     * Builds the index when it's first needed, afterwards merges the items
+     * added or given a new key since the last call in a single pass.
      */
     void Sort() const;
 
     /**
-     * Adds an item to m_sort.
+     * Queue an item to be merged into m_sort by the next Sort().
      *
-     * Simply inserts the item with its sort key into m_sort map.
+     * Does nothing if the index isn't built yet.
      */
     void SortAdd(Item *item) const;
 
     /**
      * Removes an item from m_sort.
      *
-     * Removes the item from m_sort map. Notice that this is a relatively
-     * expensive operation as the entire range of the items with the same sort
-     * key needs to be checked.
+     * This merges the pending items first, so that the item can be found
+     * with a binary search.
      */
     void SortRemove(Item *item) const;
 
+    /**
+     * Returns the interned class name entry, adding it if necessary.
+     *
+     * The items are usually added in runs of the same class, so the last
+     * entry returned is checked first.
+     */
+    ClassMap::value_type *InternClass(const wxString& name);
+
+    /** The ordering of m_sort. */
+    static bool SortLess(const SortIndex::value_type& a,
+                         const SortIndex::value_type& b);
+
     /**
      * Implementation of the public GetItems().
      */
     iterator_pair DoGetItems(const wxString& prefix) const;
 
-    /// The map containing all the items.
+    /**
+     * Implementations of Load() and Save() for the different formats.
+     */
+    //@{
+    bool LoadAny(wxInputStream& stream, Consumer *consumer);
+    bool LoadXml(wxInputStream& stream, Consumer *consumer);
+    bool LoadXml(const char *data, size_t len, Consumer *consumer);
+    bool LoadBinary(wxInputStream& stream, Consumer *consumer);
+    bool LoadBinary(const char *data, size_t len, Consumer *consumer);
+    bool SaveXml(wxOutputStream& stream) const;
+    bool SaveBinary(wxOutputStream& stream) const;
+    //@}
+
+    /// All the items, in the order they were added.
+    std::vector<Item*> m_list;
+
+    /// The items by their ids.
     ItemMap m_items;
 
+    /// The items added by PutObject().
+    ObjectMap m_objects;
+
+    /// The interned attribute names.
+    NameSet m_names;
+
+    /// The interned class names, see Item::GetClassData().
+    ClassMap m_classes;
+
+    /// The entry returned by the last InternClass() call or NULL.
+    ClassMap::value_type *m_lastClass;
+
+    /// A file mapped into memory.
+    class Mapping;
+
+    /// The file loaded by Load(path), the values may refer to it.
+    Mapping *m_mapping;
+
     /**
-     * Map containing items in their sort order.
+     * Index of the items in their sort order.
      *
-     * This map may be empty, Sort() must be called before accessing it to
-     * ensure that it is initialized.
+     * This is only built by the first call to Sort(), which must be called
+     * before accessing it. Until the next call it may contain stale entries
+     * for the items in m_pending.
      */
-    mutable SortMap m_sort;
+    mutable SortIndex m_sort;
+
+    /// Items to be merged into m_sort by the next Sort().
+    mutable std::vector<Item*> m_pending;
+
+    /// True once m_sort was built.
+    mutable bool m_indexed;
 
     /**
      * True if we're storing the items or false if we're extracting them.
      */
     bool m_storing;
+
+    /**
+     * True if the items were loaded in sort key order.
+     */
+    bool m_sorted;
+
+    /**
+     * Format of the loaded archive.
+     */
+    Format m_format;
 };
 
 /** @cond */
 
+bool Insert(Archive::Item& arc, const wxString& name, int value);
+bool Extract(const Archive::Item& arc, const wxString& name, int& value);
+
+bool Insert(Archive::Item& arc, const wxString& name, unsigned value);
+bool Extract(const Archive::Item& arc, const wxString& name, unsigned& value);
+
+bool Insert(Archive::Item& arc, const wxString& name, long value);
+bool Extract(const Archive::Item& arc, const wxString& name, long& value);
+
 bool Insert(Archive::Item& arc, const wxString& name, const wxPoint& value);
 bool Extract(const Archive::Item& arc, const wxString& name, wxPoint& value);
 
@@ -708,6 +1164,10 @@ inline const wxChar *c_str(const wxString& str) { return str; }
  * then store the string using the @c wxString overloads of @c
  * Archive::Item::Put and @c Archive::Item::Get().
  *
+ * Numeric types can instead store an @c Archive::Value holding a list of
+ * integers, which the binary format keeps without going through text, and
+ * read it back with @c Archive::Item::GetValue().
+ *
  * If the @c MyType value is itself an object that can't reasonably be
  * converted to a simple string, then it can be stored as a separate object
  * using @c Archive::Put(), and then its id stored as the @c wxString value of
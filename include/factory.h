@@ -14,6 +14,7 @@
 
 #include <wx/wx.h>
 
+#include <typeindex>
 #include <typeinfo>
 #include <unordered_map>
 
@@ -54,7 +55,7 @@ namespace impl
         virtual const wxObject *GetDefault() const = 0;
 
         /// Returns the name of this factory.
-        wxString GetName() const { return m_name; }
+        const wxString& GetName() const { return m_name; }
 
         /**
          * @brief Get factory for creating objects of the given type.
@@ -78,7 +79,7 @@ namespace impl
          * Neither @a type nor @a name can be changed later.
          */
         FactoryBase(const std::type_info& type, const wxString& name)
-          : m_type(wxString::FromAscii(type.name())), m_name(name) { }
+          : m_type(type), m_name(name) { }
 
         /**
          * @brief Register this factory so that Get() could find it.
@@ -95,8 +96,8 @@ namespace impl
         void Unregister();
 
     private:
-        /// The type name of the objects created by this factory from type info.
-        wxString m_type;
+        /// The type of the objects created by this factory.
+        std::type_index m_type;
 
         /// The name of this factory as specified in ctor.
         wxString m_name;
@@ -229,10 +230,20 @@ public:
     /**
      * @brief Returns the name used to define the <code>Impl</code>.
      */
-    wxString GetName() const {
+    const wxString& GetName() const {
         return m_impl->GetName();
     }
 
+    /**
+     * @brief Returns the factory implementation, which can be passed to the
+     * constructor later.
+     *
+     * This is only used internally, to avoid looking the factory up again.
+     */
+    FactoryBase *GetImpl() const {
+        return m_impl;
+    }
+
     /**
      * @brief Implementation of untyped base factory interface for this factory.
      *
@@ -21,13 +21,17 @@
     using wxInfoDC = wxClientDC;
 #endif
 
+#include <functional>
 #include <iterator>
 #include <list>
 #include <memory>
+#include <type_traits>
+#include <vector>
 
 #include "factory.h"
 #include "archive.h"
 #include "coords.h"
+#include "graphstats.h"
 #include "iterrange.h"
 
 /**
@@ -56,6 +60,7 @@ class Graph;
 class GraphElement;
 class GraphNode;
 class TipWindow;
+class GraphOverviewCtrl;
 
 /*
  * Implementation classes
@@ -65,11 +70,39 @@ namespace impl
     class GraphIteratorImpl;
     class GraphDiagram;
     class GraphCanvas;
+    class SpatialIndex;
+    class AdjacencyIndex;
+    class GraphAnalysis;
+    class UndoJournal;
+    class LayoutJob;
+    class LayoutHistory;
+    class LayoutCache;
+    class GraphLoader;
+    class GraphHandler;
+    class GraphNodeHandler;
+
+    /// Reapplies one side of a change recorded by Graph for Undo().
+    typedef std::function<void(GraphElement&)> UndoAction;
+
+    /**
+     * @brief The memory used by a value captured by an UndoAction,
+     * including the memory it allocates.
+     *
+     * Counted against the limit of Graph::SetUndoLimit().
+     */
+    //@{
+    template <class V> size_t GetUndoBytes(const V&) { return sizeof(V); }
+    inline size_t GetUndoBytes(const wxString& str)
+    {
+        return sizeof(str) + (str.length() + 1) * sizeof(wxChar);
+    }
+    size_t GetUndoBytes(const wxFont& font);
+    //@}
 
     /**
      * @brief Conditions allowing to filter the elements being iterated on.
      *
-     * This is not used in the public API but only by Graph::IterImpl() and
+     * This is not used in the public API but only by Graph::Iter() and
      * related methods.
      */
     enum IteratorFilter
@@ -86,8 +119,12 @@ namespace impl
      * This class is a standard-like iterator, in particular it provides the
      * same member typedefs as the standard iterators.
      *
-     * It is implemented using "pImpl" idiom so the real iteration logic is in
-     * the internal GraphIteratorImpl class.
+     * The iterators over the lists of shapes and over the edge end points,
+     * which are the only kinds used by the library itself, store their state
+     * directly in this object, so that creating, copying and advancing them
+     * doesn't need any heap allocations nor virtual function calls. Any other
+     * kind of iterator can still be implemented using "pImpl" idiom by
+     * deriving from the internal GraphIteratorImpl class.
      */
     class GraphIteratorBase
     {
@@ -115,6 +152,34 @@ namespace impl
         /// Constructor from the internal implementation object.
         GraphIteratorBase(GraphIteratorImpl *impl);
 
+        /**
+         * Constructor for iterating over a range of a list of shapes.
+         *
+         * @param begin The beginning of the range to iterate over.
+         * @param end The end of the range to iterate over.
+         * @param classinfo Type of elements to restrict iteration to, if
+         * @c NULL iterate over elements of any type.
+         * @param which One of IteratorFilter enum elements.
+         * @param node Only used if @a which is InEdges or OutEdges and
+         * specifies the node whose incoming or outgoing edges we want to
+         * iterate over.
+         */
+        GraphIteratorBase(const wxList::iterator& begin,
+                          const wxList::iterator& end,
+                          wxClassInfo *classinfo,
+                          int which,
+                          const GraphNode *node = NULL);
+
+        /**
+         * Constructor for iterating over the nodes connected by a line.
+         *
+         * If @a end is true, the iterator is positioned one past the target
+         * node, otherwise it is positioned at the source node.
+         */
+        GraphIteratorBase(GraphLineShape *line,
+                          wxClassInfo *classinfo,
+                          bool end);
+
         ~GraphIteratorBase();
 
         /// Dereference an iterator. Must be valid.
@@ -163,7 +228,45 @@ namespace impl
         //@}
 
     private:
-        /// The implementation object owned by the iterator.
+        /// The kind of the iterator, determining which fields are used.
+        enum Kind
+        {
+            Kind_None,      ///< Default constructed, invalid, iterator.
+            Kind_List,      ///< Iterator over a list of shapes.
+            Kind_Pair,      ///< Iterator over the edge end points.
+            Kind_Impl       ///< Iterator using GraphIteratorImpl.
+        };
+
+        /// Return the element at the current position, may be @c NULL.
+        GraphElement *Get() const;
+
+        /// Return true if the current element passes the filters.
+        bool Accept() const;
+
+        /// Copy the iteration state from another iterator.
+        void Assign(const GraphIteratorBase& it);
+
+        Kind m_kind = Kind_None;            ///< The kind of the iterator.
+
+        wxList::iterator m_it;              ///< Current list position.
+        wxList::iterator m_end;             ///< One past the last position.
+        const GraphNode *m_node = NULL;     ///< Node for edge filters.
+
+        GraphLineShape *m_line = NULL;      ///< The line for Kind_Pair.
+
+        /**
+         * Position for Kind_Pair iterators.
+         *
+         * This is 0 for the position just before the beginning, 1 for the
+         * source node, 2 for the target one and 3 for the position right
+         * after end.
+         */
+        int m_pos = 0;
+
+        wxClassInfo *m_classinfo = NULL;    ///< Type of accepted elements.
+        int m_which = All;                  ///< Kind of elements to include.
+
+        /// The implementation object owned by Kind_Impl iterators.
         std::unique_ptr<GraphIteratorImpl> m_impl;
     };
 
@@ -283,6 +386,18 @@ public:
     /// Ctor from the internal implementation object.
     GraphIterator(impl::GraphIteratorImpl *impl) : Base(impl) { }
 
+    /// Ctor for iterating over a list of shapes, used internally.
+    GraphIterator(const wxList::iterator& begin,
+                  const wxList::iterator& end,
+                  wxClassInfo *classinfo,
+                  int which,
+                  const GraphNode *node = NULL)
+      : Base(begin, end, classinfo, which, node) { }
+
+    /// Ctor for iterating over the edge end points, used internally.
+    GraphIterator(GraphLineShape *line, wxClassInfo *classinfo, bool end)
+      : Base(line, classinfo, end) { }
+
     ~GraphIterator() = default;
 
     /// Dereference an iterator. Must be valid.
@@ -381,6 +496,17 @@ public:
         Style_Custom
     };
 
+    /**
+     * @brief How much of the element is drawn.
+     *
+     * @see GetDetailLevel()
+     */
+    enum DetailLevel {
+        Detail_Hidden,  /**< The element is not drawn at all. */
+        Detail_Low,     /**< Only a simplified outline is drawn. */
+        Detail_Full     /**< The element is drawn normally. */
+    };
+
     /** @brief Constructor. */
     GraphElement(const wxColour& colour,
                  const wxColour& bgcolour,
@@ -460,6 +586,31 @@ public:
      */
     virtual void OnDraw(wxDC& dc);
 
+    /**
+     * @brief Called by the graph control instead of OnDraw() when the
+     * element is too small on the screen to be drawn in full.
+     *
+     * GraphNode draws a filled rectangle and GraphEdge a plain polyline
+     * without arrowheads; derived classes can override these to draw a
+     * different simplified outline.
+     *
+     * @see GetDetailLevel()
+     */
+    virtual void OnDrawLowDetail(wxDC& dc) = 0;
+
+    /**
+     * @brief Returns a number from the DetailLevel enumeration indicating
+     * how the element must be drawn on @a dc.
+     *
+     * The GraphNode and GraphEdge implementations compare the size of the
+     * element on the device with the thresholds set by
+     * GraphCtrl::SetNodeDetailThreshold(),
+     * GraphCtrl::SetEdgeDetailThreshold() and
+     * GraphCtrl::SetEdgeHideThreshold(). Derived classes can override it to
+     * use a different policy for some kinds of elements.
+     */
+    virtual DetailLevel GetDetailLevel(const wxDC& dc) const = 0;
+
     /**
      * @brief Returns the shape that represents this graph element in the
      * underlying graphics library.
@@ -570,6 +721,19 @@ protected:
     /** @brief The DPI of the graph's nominal pixels. */
     virtual wxSize GetDPI() const;
 
+    /**
+     * @brief Records the change of a property for Graph::Undo().
+     *
+     * Called by the setters before changing the property from @a old to
+     * @a value. Undoing or redoing the change calls @a setter with one or
+     * the other. Nothing is recorded if the element is not in a graph or
+     * the value doesn't change.
+     */
+    template <class T, class V>
+    void RecordChange(void (T::*setter)(V),
+                      const typename std::decay<V>::type& old,
+                      const typename std::decay<V>::type& value);
+
 private:
     impl::Initialisor m_initalise;          ///< Initialization counter.
 
@@ -658,7 +822,7 @@ public:
 
     //@{
     /** @brief Width of the line. */
-    virtual void SetLineWidth(int width) { m_linewidth = width; Refresh(); }
+    virtual void SetLineWidth(int width);
     virtual int GetLineWidth() const { return m_linewidth; }
     //@}
 
@@ -751,6 +915,18 @@ public:
     /** @brief Overridable returning the pen that will be used. */
     wxPen GetPen() const override { return wxPen(GetColour(), m_linewidth); }
 
+    /**
+     * @brief Draws the edge as a plain polyline, without the arrowheads.
+     */
+    void OnDrawLowDetail(wxDC& dc) override;
+
+    /**
+     * @brief Hides the edge if it spans less than the edge hide threshold
+     * on @a dc and drops the arrowheads if they're smaller than the edge
+     * detail threshold.
+     */
+    DetailLevel GetDetailLevel(const wxDC& dc) const override;
+
 protected:
     void UpdateShape() override { }
 
@@ -762,14 +938,6 @@ protected:
     bool MoveFront();
 
 private:
-    /**
-     * @brief Return iterator for one the edge connection points.
-     *
-     * If @a end is false, returns the starting point, otherwise the end one.
-     */
-    impl::GraphIteratorImpl *IterImpl(
-        GraphLineShape *line, wxClassInfo *classinfo, bool end) const;
-
     /**
      * @brief Returns the nodes connected by this edge.
      *
@@ -778,6 +946,19 @@ private:
      */
     template <class T> IterPair<T> Iter() const;
 
+    /**
+     * @brief Update the edge counts of the nodes connected by this edge.
+     *
+     * Must be called with 1 after connecting the edge and with -1 before
+     * disconnecting it.
+     */
+    void UpdateEdgeCounts(int delta) const;
+
+    /** @cond */
+    friend class Graph;
+    friend class impl::UndoJournal;
+    /** @endcond */
+
     int m_arrowsize;        ///< Size of the arrow head, if any. Default is 10.
     int m_linewidth;        ///< Width of the line in pixels. Default is 1.
 
@@ -789,8 +970,8 @@ template <class T> IterPair<T> GraphEdge::Iter() const
     GraphLineShape *line = GetShape();
 
     return std::make_pair(
-        GraphIterator<T>(IterImpl(line, CLASSINFO(T), false)),
-        GraphIterator<T>(IterImpl(line, CLASSINFO(T), true)));
+        GraphIterator<T>(line, CLASSINFO(T), false),
+        GraphIterator<T>(line, CLASSINFO(T), true));
 }
 
 template <class T> IterPair<const T> GraphEdge::GetNodes() const
@@ -850,7 +1031,13 @@ public:
     /** @brief Destructor. */
     ~GraphNode() override;
 
-    GraphNode(const GraphNode&) = default;
+    /**
+     * @brief Copy constructor.
+     *
+     * Notice that the copy is not connected to anything, so its edge counts
+     * are zero.
+     */
+    GraphNode(const GraphNode& node);
     GraphNode(GraphNode&&) = delete;
     GraphNode& operator=(const GraphNode&) = delete;
     GraphNode& operator=(GraphNode&&) = delete;
@@ -938,7 +1125,7 @@ public:
     /** @endcond */
 
     /**
-     * @brief Returns the number of edges in to this node. Takes linear time.
+     * @brief Returns the number of edges in to this node.
      */
     size_t GetInEdgeCount() const;
 
@@ -958,8 +1145,7 @@ public:
     /** @endcond */
 
     /**
-     * @brief Returns the number of edges out from this node. Takes linear
-     * time.
+     * @brief Returns the number of edges out from this node.
      */
     size_t GetOutEdgeCount() const;
 
@@ -1006,6 +1192,25 @@ public:
      */
     void SetShape(wxShape *shape) override;
 
+    /**
+     * @brief Invalidates the bounds of the node so that it redraws, and
+     * discards its cached bitmap, if any.
+     *
+     * @see Graph::SetNodeBitmapCache()
+     */
+    void Refresh() override;
+
+    /**
+     * @brief Draws the node as a rectangle filled with its background colour.
+     */
+    void OnDrawLowDetail(wxDC& dc) override;
+
+    /**
+     * @brief Returns @c Detail_Low if the node is narrower or shorter than
+     * the node detail threshold on @a dc.
+     */
+    DetailLevel GetDetailLevel(const wxDC& dc) const override;
+
     /**
      * @brief This can be overridden to give the node a custom shape.
      *
@@ -1065,15 +1270,16 @@ private:
     wxList *GetLines() const;
 
     /**
-     * @brief Return iterator for all edges connecting to this node.
-     *
-     * This is used by Iter() below.
+     * Implementation of SetPosition(), moves the node to the already snapped
+     * position @a pt without sending any event.
+     */
+    void DoSetPosition(wxReadOnlyDC& dc, const wxPoint& pt);
+
+    /**
+     * Record for Graph::Undo() a resize already done to the shape, e.g. by
+     * its sizing handles, from the position @a pos and size @a size.
      */
-    impl::GraphIteratorImpl *IterImpl(
-        const wxList::iterator& begin,
-        const wxList::iterator& end,
-        wxClassInfo *classinfo,
-        int which) const;
+    void RecordResize(const wxPoint& pos, const wxSize& size);
 
     /**
      * @brief Return a range of iterators over all edges connecting to this
@@ -1087,12 +1293,37 @@ private:
      */
     template <class T> IterPair<T> Iter(int which = impl::All) const;
 
+    /**
+     * @brief Draw the node from its cached bitmap, rendering it first if
+     * necessary.
+     *
+     * @a rc is the area covered by the node drawing. Returns @c false if the
+     * node must be drawn directly instead.
+     *
+     * @see Graph::SetNodeBitmapCache()
+     */
+    bool DrawCached(wxDC& dc, const wxRect& rc);
+
     wxColour m_textcolour;      ///< Colour of the node text.
     wxString m_text;            ///< Node text content.
     wxString m_tooltip;         ///< Tooltip shown for the node.
     wxString m_rank;            ///< Node rank for layout.
     wxFont m_font;              ///< Font used to render the node text.
 
+    size_t m_inEdgeCount;       ///< Number of edges in to this node.
+    size_t m_outEdgeCount;      ///< Number of edges out from this node.
+
+    wxBitmap m_bitmap;          ///< Cached rendering, see DrawCached().
+    wxSize m_bitmapSize;        ///< Size of the area cached in m_bitmap.
+    double m_bitmapScale;       ///< Zoom tier m_bitmap was rendered for.
+
+    /** @cond */
+    friend class Graph;
+    friend class GraphEdge;
+    friend class impl::GraphNodeHandler;
+    friend class impl::UndoJournal;
+    /** @endcond */
+
     DECLARE_DYNAMIC_CLASS(GraphNode)
 };
 
@@ -1154,8 +1385,8 @@ template <class T> IterPair<T> GraphNode::Iter(int which) const
     }
 
     return std::make_pair(
-        GraphIterator<T>(IterImpl(begin, end, CLASSINFO(T), which)),
-        GraphIterator<T>(IterImpl(end, end, CLASSINFO(T), which)));
+        GraphIterator<T>(begin, end, CLASSINFO(T), which, this),
+        GraphIterator<T>(end, end, CLASSINFO(T), which, this));
 }
 
 /**
@@ -1214,9 +1445,31 @@ public:
      */
     virtual double GetZoom() const;
 
+    //@{
+    /**
+     * @brief Stretch a snapshot of the graph while zooming with the wheel.
+     *
+     * When enabled, the visible area is rendered once when a Ctrl+wheel zoom
+     * starts, and then only this image is scaled around the mouse for each
+     * notch. The graph is drawn again at full quality once the wheel has
+     * been still for a short time, which keeps zooming large graphs
+     * responsive. Off by default.
+     */
+    void SetProgressiveZoom(bool progressive);
+    bool GetProgressiveZoom() const { return m_progressiveZoom; }
+    //@}
+
     /**
      * @brief Sets the Graph object that this GraphCtrl will operate on.
      * The GraphCtrl does not take ownership.
+     *
+     * A graph can be shown by several controls at once, e.g. a main view
+     * and an overview, each with its own zoom and scroll position. They
+     * all display the same elements, selection and caches, so nothing is
+     * duplicated. The nodes can only be dragged and connected in the first
+     * control given the graph, the others allow selecting, panning and
+     * zooming. If the first one is given another graph or destroyed, the
+     * next one takes its role.
      */
     virtual void SetGraph(Graph *graph);
     /**
@@ -1396,6 +1649,76 @@ public:
     static int GetRightDragMode()           { return sm_rightDrag; }
     //@}
 
+    //@{
+    /**
+     * @brief The size in screen pixels below which nodes are drawn with low
+     * detail.
+     *
+     * When the width or the height of a node on the screen is less than this
+     * its text, icon and border are skipped and it is drawn as a filled
+     * rectangle. The default is 16, zero always draws the nodes in full.
+     *
+     * @see GraphElement::GetDetailLevel()
+     */
+    void SetNodeDetailThreshold(int pixels);
+    int GetNodeDetailThreshold() const { return m_nodeDetail; }
+    //@}
+
+    //@{
+    /**
+     * @brief The arrowhead size in screen pixels below which edges are drawn
+     * with low detail.
+     *
+     * Such edges are drawn as plain polylines without the arrowheads. The
+     * default is 3, zero always draws the edges in full.
+     *
+     * @see GraphElement::GetDetailLevel()
+     */
+    void SetEdgeDetailThreshold(int pixels);
+    int GetEdgeDetailThreshold() const { return m_edgeDetail; }
+    //@}
+
+    //@{
+    /**
+     * @brief The length in screen pixels below which edges aren't drawn.
+     *
+     * The default is 1, so that only the edges which would be smaller than
+     * a pixel are dropped. Zero always draws them.
+     *
+     * @see GraphElement::GetDetailLevel()
+     */
+    void SetEdgeHideThreshold(int pixels);
+    int GetEdgeHideThreshold() const { return m_edgeHide; }
+    //@}
+
+    /**
+     * @brief The drawing backend used to paint the graph.
+     *
+     * @see SetRenderer()
+     */
+    enum Renderer {
+        Renderer_DC,        /**< Classic wxDC drawing, the default. */
+        Renderer_Graphics   /**< wxGraphicsContext drawing. */
+    };
+
+    //@{
+    /**
+     * @brief The drawing backend used to paint the graph.
+     *
+     * @c Renderer_Graphics paints through a wxGraphicsContext, using
+     * Direct2D under Windows and Cairo elsewhere when they are available,
+     * which is faster on high resolution displays. The lines of the edges
+     * drawn one after the other are stroked together, as one path for each
+     * pen, unless the edges are of a derived class or have a custom style or
+     * shape. It is normally selected right after creating the control. The node bitmap cache (see
+     * Graph::SetNodeBitmapCache()) is only used with @c Renderer_DC.
+     *
+     * Returns @c false if the renderer isn't available in this build.
+     */
+    bool SetRenderer(Renderer renderer);
+    Renderer GetRenderer() const { return m_renderer; }
+    //@}
+
     /**
      * @brief Converts a point from screen coordinates to the coordinate
      * system used by the graph.
@@ -1413,6 +1736,20 @@ public:
      */
     virtual wxWindow *GetCanvas() const;
 
+    //@{
+    /**
+     * @brief Timings and counters of the costly operations of all the graphs
+     * and archives in the process.
+     *
+     * They show e.g. whether a slow update was spent in the layout, drawing
+     * or bounds checking. They are only collected if the library is compiled
+     * with @c GRAPH_STATS defined, otherwise GetStats() returns zeros and
+     * the instrumentation costs nothing.
+     */
+    static GraphStats GetStats();
+    static void ResetStats();
+    //@}
+
     /**
      * Size event handler.
      *
@@ -1427,6 +1764,13 @@ public:
      */
     void OnChar(wxKeyEvent& event);
 
+    /**
+     * Key down and up event handler.
+     *
+     * Used to update the cursor when Shift is pressed or released.
+     */
+    void OnKey(wxKeyEvent& event);
+
     /**
      * Mouse wheel event handler.
      *
@@ -1448,6 +1792,13 @@ public:
      */
     void OnMouseLeave(wxMouseEvent& event);
 
+    /**
+     * Mouse button release event handler.
+     *
+     * Used to restore the cursor which may have been changed by dragging.
+     */
+    void OnMouseUp(wxMouseEvent& event);
+
     /**
      * Timer event handler for the tooltip timer.
      *
@@ -1459,7 +1810,8 @@ public:
     /**
      * Idle event handler.
      *
-     * Used for scrollbar and cursor updating.
+     * Does the idle work that couldn't be done by DoIdleWork() while the
+     * mouse was being dragged, nothing otherwise.
      */
     void OnIdle(wxIdleEvent& event);
 
@@ -1479,16 +1831,59 @@ public:
     /** Default value for the constructor's name parameter. */
     static const wxChar DefaultName[];
 
+    /**
+     * An unlikely colour used for the transparent parts of the bitmaps
+     * cached for drawing, e.g. the node bitmaps and the designer grid.
+     */
+    static const wxColour BitmapMaskColour;
+
 protected:
     /** Returns the DPI used by the control. */
     wxSize GetDPI() const override;
 
 private:
+    friend class Graph;
+    friend class GraphOverviewCtrl;
+    friend class impl::GraphCanvas;
+
+    /// The kinds of work deferred by ScheduleIdleWork().
+    enum IdleWork
+    {
+        Idle_Bounds = 1,        ///< Update the scrollbars.
+        Idle_Tip = 2,           ///< Update the tooltip for m_ptTip.
+        Idle_Cursor = 4         ///< Set the cursor for m_cursorShift.
+    };
+
+    /**
+     * @brief Schedule work to be done once the pending events are processed.
+     *
+     * The work requested by all the events handled until then is coalesced
+     * into a single DoIdleWork() call, so nothing at all is done in the idle
+     * time unless something has changed.
+     *
+     * @param work A combination of IdleWork values.
+     */
+    void ScheduleIdleWork(int work);
+
+    /**
+     * @brief Do the work scheduled by ScheduleIdleWork().
+     *
+     * The work is left pending while the mouse is dragged, and picked up by
+     * OnIdle() afterwards.
+     */
+    void DoIdleWork();
+
+    /**
+     * @brief Schedule a cursor update if the Shift state has changed.
+     */
+    void UpdateCursor(bool shift);
+
     /**
      * @brief Show or hide the tooltip at the given position.
      *
      * This function is called to update the state of the tooltip. It is done
-     * on mouse move, when we get focus and also from idle time.
+     * after the mouse moves, when we get focus and after the scrollbars are
+     * updated.
      *
      * It may call either OpenTip() or CloseTip().
      */
@@ -1509,7 +1904,45 @@ private:
      */
     void CloseTip(const wxPoint& pt = wxDefaultPosition);
 
+    /**
+     * @brief Add or remove an overview showing the graph of this control.
+     *
+     * @see GraphOverviewCtrl::SetGraphCtrl()
+     */
+    //@{
+    void AddOverview(GraphOverviewCtrl *overview);
+    void RemoveOverview(GraphOverviewCtrl *overview);
+    //@}
+
+    /**
+     * @brief Tell the overviews that the area given in graph coordinates
+     * changed, that the graph bounds may have, and that the visible area
+     * moved or was resized.
+     */
+    //@{
+    void RefreshOverviews(const wxRect& rcGraph);
+    void CheckOverviewBounds();
+    void RefreshOverviewViews();
+    //@}
+
     impl::Initialisor m_initalise;  ///< Initialization counter.
+
+    /**
+        @name Idle work data.
+
+        These are initialised before the canvas, whose size events already
+        schedule work.
+     */
+    //@{
+    int m_idleWork;                 ///< The IdleWork values pending.
+    bool m_idleScheduled;           ///< True if DoIdleWork() is queued.
+    wxPoint m_ptTip;                ///< Screen position to check the tip at.
+    int m_cursorShift;              ///< Shift state of the cursor or -1.
+    //@}
+
+    /// The overviews showing the graph, also told of the canvas size events.
+    std::vector<GraphOverviewCtrl*> m_overviews;
+
     impl::GraphCanvas *m_canvas;    ///< The associated canvas.
     Graph *m_graph;                 ///< The associated graph object.
 
@@ -1528,6 +1961,16 @@ private:
     bool m_tipopen;                 ///< True if a tooltip is currently shown,
     //@}
 
+    /// Level of detail thresholds in pixels, see SetNodeDetailThreshold().
+    //@{
+    int m_nodeDetail;
+    int m_edgeDetail;
+    int m_edgeHide;
+    //@}
+
+    Renderer m_renderer;            ///< See SetRenderer().
+    bool m_progressiveZoom;         ///< See SetProgressiveZoom().
+
     static int sm_leftDrag;         ///< DragMode value for left mouse button.
     static int sm_rightDrag;        ///< DragMode value for right mouse button.
 
@@ -1557,6 +2000,48 @@ template <class T> void GraphCtrl::SetMargin(const wxSize& size)
     SetMargin(Pixels::From<T>(size, GetDPI()));
 }
 
+/**
+ * @brief The resolution and font metrics of a headless graph.
+ *
+ * A Graph constructed with a GraphMetrics doesn't create any window until
+ * it is shown in a GraphCtrl. Its elements are measured with the DC returned
+ * by CreateDC() instead of one for the screen, so it can be loaded, laid out,
+ * exported or drawn onto a bitmap in a process that has no windows.
+ *
+ * The default implementation measures the text with a memory DC scaled to
+ * the DPI passed to the ctor. Derive from it to use other font metrics.
+ */
+class GraphMetrics
+{
+public:
+    /** @brief Constructor taking the DPI of the graph's nominal pixels. */
+    explicit GraphMetrics(const wxSize& dpi = wxSize(96, 96));
+    /** @brief Destructor. */
+    virtual ~GraphMetrics();
+
+    GraphMetrics(const GraphMetrics&) = delete;
+    GraphMetrics(GraphMetrics&&) = delete;
+    GraphMetrics& operator=(const GraphMetrics&) = delete;
+    GraphMetrics& operator=(GraphMetrics&&) = delete;
+
+    /** @brief The DPI of the graph's nominal pixels. */
+    virtual wxSize GetDPI() const { return m_dpi; }
+
+    /** @brief The font of the elements that don't have their own. */
+    virtual wxFont GetFont() const;
+
+    /**
+     * @brief Return a new DC for measuring the graph's elements.
+     *
+     * Its logical units must be the graph's nominal pixels at GetDPI(). The
+     * caller deletes it.
+     */
+    virtual wxReadOnlyDC *CreateDC() const;
+
+private:
+    wxSize m_dpi;
+};
+
 /**
  * @brief Holds a graph for editing using a GraphCtrl.
  *
@@ -1588,8 +2073,10 @@ public:
      * @brief Constructor.
      *
      * @param handler The graph's parent, the handler of its events.
+     * @param metrics If not NULL the graph is headless, see GraphMetrics.
+     *                The graph takes ownership of it.
      */
-    Graph(wxEvtHandler *handler = NULL);
+    Graph(wxEvtHandler *handler = NULL, GraphMetrics *metrics = NULL);
     /** @brief Destructor. */
     ~Graph() override;
 
@@ -1598,7 +2085,12 @@ public:
     Graph& operator=(const Graph&) = delete;
     Graph& operator=(Graph&&) = delete;
 
-    /** @brief Clear all the graph's data. */
+    /**
+     * @brief Clear all the graph's data.
+     *
+     * The pool of the shapes' event handlers is released at once, see
+     * GetMemoryUsage(). The elements and their shapes are deleted one by one.
+     */
     virtual void New();
 
     /**
@@ -1637,6 +2129,39 @@ public:
                            GraphNode& to,
                            GraphEdge *edge = NULL);
 
+    /**
+     * @brief Describes an edge to add with AddBatch().
+     */
+    struct EdgeSpec
+    {
+        GraphNode *from;    ///< The source node.
+        GraphNode *to;      ///< The target node.
+        GraphEdge *edge;    ///< The edge or NULL to create a GraphEdge.
+    };
+
+    /**
+     * @brief Adds many nodes and edges to the graph at once. The Graph
+     * object takes ownership of them.
+     *
+     * Instead of the per element events sent by Add(), a single
+     * @c EVT_GRAPH_BATCH_ADD event is sent before adding anything, and the
+     * whole insertion is done inside a single update, see BeginUpdate().
+     *
+     * The nodes are added at the origin with the default size, so normally
+     * @a layout should be left @c true to lay out the graph with LayoutAll()
+     * once they have all been added. Otherwise the caller should position
+     * them itself, preferably inside a GraphUpdateLocker scope.
+     *
+     * The edge endpoints must be either among @a nodes or already in the
+     * graph. The edges between nodes that were not added are deleted.
+     *
+     * @returns @c false if the event was vetoed, in which case all the nodes
+     * and edges are deleted.
+     */
+    virtual bool AddBatch(const std::vector<GraphNode*>& nodes,
+                          const std::vector<EdgeSpec>& edges,
+                          bool layout = true);
+
     /** @brief Deletes the given node or edge. */
     virtual void Delete(GraphElement *element);
     /**
@@ -1645,9 +2170,28 @@ public:
      */
     virtual void Delete(const iterator_pair& range);
 
+    /**
+     * @brief Deletes many nodes and edges at once.
+     *
+     * Instead of the per element events sent by Delete(), a single
+     * @c EVT_GRAPH_BATCH_DELETE event is sent before deleting anything. The
+     * nodes remaining in its list are then deleted with all their edges,
+     * together with the edges in @a range, inside a single update and
+     * without refreshing each element separately. The graph bounds and
+     * the layout history are updated once at the end.
+     *
+     * @returns @c false if the event was vetoed, in which case nothing is
+     * deleted.
+     */
+    virtual bool DeleteBatch(const iterator_pair& range);
+
     /**
      * @brief Invokes a layout engine to lay out the graph.
      *
+     * In incremental mode, if only a few nodes were added since the last
+     * layout, they are placed next to their neighbours instead and the rest
+     * of the graph is left unchanged, see SetIncrementalLayout().
+     *
      * @param fixed A node in the graph that will not move, defaults to the
      * top leftmost node.
      * @param ranksep The vertical separation in inches.
@@ -1660,6 +2204,10 @@ public:
      * @brief Invokes a layout engine to lay out the subset of the graph
      * specified by the given iterator range.
      *
+     * The graph is passed to the layout engine directly, without going
+     * through the dot text format. To see the dot equivalent of the graph
+     * being laid out, enable the "graphlayout" trace mask.
+     *
      * @param range An iterator range of nodes to lay out.
      * @param fixed A node in the graph that will not move defaults to the
      * top leftmost node with an external edge connection.
@@ -1671,49 +2219,183 @@ public:
                         double ranksep = DEFAULT_VERT_SPACING_IN_INCHES,
                         double nodesep = DEFAULT_HORZ_SPACING_IN_INCHES);
 
+    //@{
     /**
-     * @brief Finds an empty space for a new node.
+     * @brief Enables or disables incremental layout mode.
      *
-     * Searches in a grid like pattern searching across then down line by
-     * line. Begins from a default start position below any existing
-     * connected nodes.
+     * In this mode LayoutAll() remembers which nodes it has laid out. If
+     * only a few nodes were added since then, the next call places each of
+     * them one rank below its laid out parents, or above its children, next
+     * to the existing nodes. It doesn't run the layout engine, so it is
+     * fast even for big graphs.
      *
-     * @param spacing The grid spacing for the search pattern.
-     * @param columns The columns for the grid pattern or 0 for the default.
+     * A full layout is still done if too many nodes were added, or if an
+     * edge was added between two nodes which were already laid out, as this
+     * may change the ranks of the whole graph.
      *
-     * @tparam T @c Points or @c Twips specifying the units of @c spacing.
-     * If omitted defaults to pixels. The return value is always in pixels.
+     * The mode is off by default.
      */
-    template <class T>
-    wxPoint FindSpace(const wxSize& spacing, int columns = 0);
+    void SetIncrementalLayout(bool incremental = true);
+    bool IsIncrementalLayout() const;
+    //@}
+
+    //@{
     /**
-     * @brief Finds an empty space for a new node.
+     * @brief Enables or disables laying out connected components separately.
      *
-     * Searches in a grid like pattern starting at <code>position</code>,
-     * searching across then down line by line.
+     * When this is enabled, Layout() and LayoutAsync() split the nodes
+     * into groups connected by edges or by having the same rank, lay out
+     * each group on its own and pack the results in rows, separated by
+     * @a nodesep horizontally and @a ranksep vertically.
      *
-     * @param position Start searching at this point.
-     * @param spacing The grid spacing for the search pattern.
-     * @param columns The columns for the grid pattern or 0 for the default.
+     * This is much faster for graphs made of many disconnected parts.
      *
-     * @tparam T @c Points or @c Twips specifying the units of @c position and
-     * @c spacing.  If omitted defaults to pixels. The return value is always
-     * in pixels.
+     * The layouts of the components are cached, so laying out again only
+     * passes the components changed since the previous layout to the
+     * layout engine. The cache is saved with the graph by Serialise(), so
+     * the same holds for a graph reopened with Deserialise(). Without this
+     * mode the whole graph can only be reused if nothing changed at all.
+     *
+     * The mode is off by default.
      */
-    template <class T>
-    wxPoint FindSpace(const wxPoint& position,
-                      const wxSize& spacing,
-                      int columns = 0);
-    /** @cond */
-    wxPoint FindSpace(const wxSize& spacing, int columns = 0);
-    wxPoint FindSpace(const wxPoint& position,
-                      const wxSize& spacing,
-                      int columns = 0);
+    void SetComponentLayout(bool separate = true);
+    bool IsComponentLayout() const;
+    //@}
+
+    /**
+     * @brief Starts laying out the graph in a background thread.
+     *
+     * This is the asynchronous version of LayoutAll(), see LayoutAsync().
+     */
+    virtual bool LayoutAllAsync(const GraphNode *fixed = NULL,
+                                double ranksep = DEFAULT_VERT_SPACING_IN_INCHES,
+                                double nodesep = DEFAULT_HORZ_SPACING_IN_INCHES);
+    /**
+     * @brief Starts laying out the subset of the graph specified by the
+     * given iterator range in a background thread.
+     *
+     * The node sizes, ranks and edges are copied before returning, and the
+     * layout engine then runs in a worker thread without blocking the GUI.
+     * @c EVT_GRAPH_LAYOUT_PROGRESS events are sent while it runs. When it
+     * finishes, the nodes are moved to their new positions in the main
+     * thread and @c EVT_GRAPH_LAYOUT_DONE is sent.
+     *
+     * Nodes deleted while the layout runs are skipped and nodes added are
+     * left where they are. Starting another layout cancels the one in
+     * progress, if any.
+     *
+     * The parameters are the same as for Layout().
+     *
+     * @return @c false if the layout couldn't be started.
+     */
+    virtual bool LayoutAsync(const node_iterator_pair& range,
+                             const GraphNode *fixed = NULL,
+                             double ranksep = DEFAULT_VERT_SPACING_IN_INCHES,
+                             double nodesep = DEFAULT_HORZ_SPACING_IN_INCHES);
+
+    /**
+     * @brief Cancels the layout started by LayoutAsync(), if any.
+     *
+     * The nodes are not moved and @c EVT_GRAPH_LAYOUT_CANCEL is sent. Notice
+     * that the layout engine can't be interrupted in the middle of the
+     * layout, so the worker thread may continue to run for a while, but its
+     * results are discarded.
+     */
+    void CancelLayout();
+
+    /**
+     * @brief Returns @c true if a layout started by LayoutAsync() hasn't
+     * finished yet.
+     */
+    bool IsLayoutRunning() const;
+
+    /**
+     * @brief Finds an empty space for a new node.
+     *
+     * Searches in a grid like pattern searching across then down line by
+     * line. Begins from a default start position below any existing
+     * connected nodes.
+     *
+     * @param spacing The grid spacing for the search pattern.
+     * @param columns The columns for the grid pattern or 0 for the default.
+     *
+     * @tparam T @c Points or @c Twips specifying the units of @c spacing.
+     * If omitted defaults to pixels. The return value is always in pixels.
+     */
+    template <class T>
+    wxPoint FindSpace(const wxSize& spacing, int columns = 0);
+    /**
+     * @brief Finds an empty space for a new node.
+     *
+     * Searches in a grid like pattern starting at <code>position</code>,
+     * searching across then down line by line.
+     *
+     * @param position Start searching at this point.
+     * @param spacing The grid spacing for the search pattern.
+     * @param columns The columns for the grid pattern or 0 for the default.
+     *
+     * @tparam T @c Points or @c Twips specifying the units of @c position and
+     * @c spacing.  If omitted defaults to pixels. The return value is always
+     * in pixels.
+     */
+    template <class T>
+    wxPoint FindSpace(const wxPoint& position,
+                      const wxSize& spacing,
+                      int columns = 0);
+    /** @cond */
+    wxPoint FindSpace(const wxSize& spacing, int columns = 0);
+    wxPoint FindSpace(const wxPoint& position,
+                      const wxSize& spacing,
+                      int columns = 0);
+    /** @endcond */
+
+    /**
+     * @brief Finds empty spaces for several new nodes at once.
+     *
+     * This is the same as calling FindSpace() @a count times adding a node
+     * at each returned position in between, but is more efficient as the
+     * search continues from the last space found instead of starting again.
+     * It is useful for placing the nodes of a bulk import.
+     *
+     * @param count The number of spaces to find.
+     * @param spacing The grid spacing for the search pattern.
+     * @param columns The columns for the grid pattern or 0 for the default.
+     *
+     * @tparam T @c Points or @c Twips specifying the units of @c spacing.
+     * If omitted defaults to pixels. The returned positions are always in
+     * pixels.
+     */
+    template <class T>
+    std::vector<wxPoint> FindSpaces(size_t count,
+                                    const wxSize& spacing,
+                                    int columns = 0);
+    /**
+     * @brief Finds empty spaces for several new nodes at once starting at
+     * <code>position</code>.
+     *
+     * @see FindSpaces(size_t, const wxSize&, int)
+     */
+    template <class T>
+    std::vector<wxPoint> FindSpaces(size_t count,
+                                    const wxPoint& position,
+                                    const wxSize& spacing,
+                                    int columns = 0);
+    /** @cond */
+    std::vector<wxPoint> FindSpaces(size_t count,
+                                    const wxSize& spacing,
+                                    int columns = 0);
+    std::vector<wxPoint> FindSpaces(size_t count,
+                                    const wxPoint& position,
+                                    const wxSize& spacing,
+                                    int columns = 0);
     /** @endcond */
 
     /**
      * @brief Adds the nodes and edges specified by the given iterator range
      * to the current selection.
+     *
+     * All the elements are selected together and the graph is repainted
+     * once, without calling GraphElement::Select() for each of them.
      */
     virtual void Select(const iterator_pair& range);
     /** @brief Adds all elements in the graph to the current selection. */
@@ -1722,6 +2404,8 @@ public:
     /**
      * @brief Removes the nodes and edges specified by the given iterator
      * range from the current selection.
+     *
+     * As with Select(), this doesn't call GraphElement::Unselect().
      */
     virtual void Unselect(const iterator_pair& range);
     /** @brief Removes all elements in the graph from the current selection. */
@@ -1763,6 +2447,8 @@ public:
      * @brief An iterator range returning all the nodes and edges currently
      * selected.
      *
+     * The elements are returned in the order in which they were selected.
+     *
      * @tparam T An element type. If given returns all the elements of that
      * type in the selection. If omitted defaults to @c GraphElement.
      */
@@ -1783,21 +2469,22 @@ public:
     //@}
 
     /**
-     * @brief Returns the number of nodes in the graph. Takes linear time.
+     * @brief Returns the number of nodes in the graph. Takes constant time.
      */
     size_t GetNodeCount() const;
     /**
-     * @brief Returns the number of elements in the graph. Takes linear time.
+     * @brief Returns the number of elements in the graph. Takes constant
+     * time.
      */
     size_t GetElementCount() const;
     /**
      * @brief Returns the number of elements in the current selection. Takes
-     * linear time.
+     * constant time.
      */
     size_t GetSelectionCount() const;
     /**
      * @brief Returns the number of nodes in the current selection. Takes
-     * linear time.
+     * constant time.
      */
     size_t GetSelectionNodeCount() const;
 
@@ -1805,24 +2492,63 @@ public:
     /**
      * @brief Write a text representation of the graph and all its elements
      * or a subrange of them.
+     *
+     * When writing to a stream, @a format can be used to write the compact
+     * binary representation instead, Deserialise() recognizes both.
+     *
+     * When the whole graph is written, the cached layouts are written with
+     * it, see SetComponentLayout().
      */
     virtual bool Serialise(wxOutputStream& out,
-                           const iterator_pair& range = iterator_pair());
+                           const iterator_pair& range = iterator_pair(),
+                           Archive::Format format = Archive::Format_Xml);
     virtual bool Serialise(Archive& archive,
                            const iterator_pair& range = iterator_pair());
     //@}
 
+    /** @brief Vector image formats supported by Export(). */
+    enum ExportFormat {
+        Export_SVG      /**< Scalable Vector Graphics. */
+    };
+
+    /**
+     * @brief Write the graph, or a subrange of its elements, as a vector
+     * image.
+     *
+     * The image is written directly from the element geometry, without
+     * drawing on a DC. Nodes are written as their outline shape and text,
+     * and edges as polylines with arrowheads. The nodes with a custom
+     * style are written as rectangles, as their OnDraw() can't be used
+     * here. Each distinct combination of colours, line width and font is
+     * written once as a CSS class.
+     */
+    virtual bool Export(wxOutputStream& out,
+                        ExportFormat format = Export_SVG,
+                        const iterator_pair& range = iterator_pair());
+
     //@{
     /**
      * @brief Load a serialised graph.
+     *
+     * When reading from a stream or a file, the elements are created while
+     * it is being parsed if it was written by Serialise(). The current graph
+     * is only cleared once the graph settings have been read, so if the
+     * stream can't be read or isn't a graph archive at all, it is left as it
+     * was, with its undo history. If it turns out to be invalid after that,
+     * the graph is left empty and @c false is returned. Reading from a file
+     * maps it into memory instead of copying it, see Archive::Load().
      */
     virtual bool Deserialise(wxInputStream& in);
+    virtual bool Deserialise(const wxString& path);
     virtual bool Deserialise(Archive& archive);
     //@}
 
     //@{
     /**
      * @brief Import serialised elements into the current graph.
+     *
+     * As with Deserialise(), the elements are created while the stream is
+     * being parsed and those read before an error are kept.
      */
     virtual bool DeserialiseInto(wxInputStream& in, const wxPoint& pt);
     virtual bool DeserialiseInto(Archive& archive, const wxPoint& pt);
@@ -1858,56 +2584,97 @@ public:
     virtual wxSize GetGridSpacing() const;
     /** @endcond */
 
-    /** @brief Undo the last operation. Not yet implemented. */
-    virtual void Undo() { wxFAIL; }
-    /** @brief Redo the last Undo. Not yet implemented. */
-    virtual void Redo() { wxFAIL; }
+    /**
+     * @brief Undo the last operation.
+     *
+     * The graph records the nodes and edges added and deleted, the nodes
+     * moved and resized and the changes made by the element setters, such
+     * as SetColour(), SetStyle() or GraphNode::SetText().
+     *
+     * All the changes made inside an update, see BeginUpdate(), form a
+     * single operation, so that e.g. dragging a selection or laying out the
+     * graph is undone at once. Outside of an update each call is an
+     * operation on its own.
+     *
+     * Undoing doesn't send the events that the original changes sent,
+     * except that an element created again is positioned as when loading.
+     */
+    virtual void Undo();
+    /** @brief Redo the last Undo. */
+    virtual void Redo();
 
     /**
      * @brief Indicates the previous operation could be undone with Undo.
-     * Not yet implemented.
      */
-    virtual bool CanUndo() const { wxFAIL; return false; }
+    virtual bool CanUndo() const;
     /**
      * @brief Indicates the previous Undo could be redone with Redo.
-     * Not yet implemented.
      */
-    virtual bool CanRedo() const { wxFAIL; return false; }
+    virtual bool CanRedo() const;
+
+    //@{
+    /**
+     * @brief The approximate memory in bytes the operations remembered for
+     * Undo() and Redo() can use.
+     *
+     * The oldest operations are forgotten to stay below it. The moves and
+     * resizes take a few dozen bytes per node, the added and deleted
+     * elements about the size of their binary serialised form. Zero
+     * disables undo. DEFAULT_UNDO_LIMIT is used by default.
+     */
+    void SetUndoLimit(size_t bytes);
+    size_t GetUndoLimit() const;
+    //@}
+
+    /// Forget all the operations remembered for Undo() and Redo().
+    void ClearUndo();
+
+    /// The default value of SetUndoLimit(), 16MiB.
+    static constexpr size_t DEFAULT_UNDO_LIMIT = 16 << 20;
 
     /**
      * @brief Cut the current selection to the clipboard.
-     * Not yet implemented.
+     *
+     * This is Copy() followed by Clear().
      */
-    virtual bool Cut() { wxFAIL; return false; }
+    virtual bool Cut();
     /**
      * @brief Copy the current selection to the clipboard.
-     * Not yet implemented.
+     *
+     * The elements are put on the clipboard in the binary archive format,
+     * see Archive::Format_Binary, under a private clipboard format. They are
+     * only encoded when another process asks for them, pasting into a graph
+     * of the same process uses the archive as it was copied.
      */
-    virtual bool Copy() { wxFAIL; return false; }
+    virtual bool Copy();
     /**
      * @brief Paste from the clipboard, replacing the current selection.
-     * Not yet implemented.
+     *
+     * The pasted elements are placed together in an empty space found by
+     * FindSpace() and become the new selection.
      */
-    virtual bool Paste() { wxFAIL; return false; }
+    virtual bool Paste();
     /**
      * @brief Delete the nodes and edges in the current selection.
+     *
+     * The selection is deleted with DeleteBatch(), so a single
+     * @c EVT_GRAPH_BATCH_DELETE event is sent rather than an event for each
+     * node and edge.
      */
-    void Clear() { Delete(GetSelection()); }
+    void Clear() { DeleteBatch(GetSelection()); }
 
     /**
-     * @brief True if the selection is non-empty. Not yet implemented.
+     * @brief True if the selection is non-empty.
      */
-    virtual bool CanCut() const { wxFAIL; return false; }
+    virtual bool CanCut() const;
     /**
      * @brief Indicates that the current selection is non-empty.
-     * Not yet implemented.
      */
-    virtual bool CanCopy() const { wxFAIL; return false; }
+    virtual bool CanCopy() const;
     /**
      * @brief Indicates that there is graph data in the clipboard.
-     * Not yet implemented.
      */
-    virtual bool CanPaste() const { wxFAIL; return false; }
+    virtual bool CanPaste() const;
     /**
      * @brief True if the selection is non-empty.
      */
@@ -1933,6 +2700,28 @@ public:
      */
     void RefreshBounds();
 
+    //@{
+    /**
+     * @brief Groups a sequence of changes to the graph together.
+     *
+     * Between BeginUpdate() and the matching EndUpdate() the elements don't
+     * repaint themselves and the scrollbars are not updated. Instead the
+     * area covered by the changes is accumulated and it is repainted once
+     * when the outermost EndUpdate() is called, followed by a single
+     * @c EVT_GRAPH_CHANGED event if anything changed.
+     *
+     * The edges of the nodes moved or resized during the update are also
+     * only rerouted by the outermost EndUpdate(), once each, so their
+     * GetBounds() and control points aren't up to date until then.
+     *
+     * The calls can be nested. GraphUpdateLocker can be used to make sure
+     * they are balanced.
+     */
+    void BeginUpdate();
+    void EndUpdate();
+    bool IsUpdating() const { return m_updateCount > 0; }
+    //@}
+
     //@{
     /**
      * @brief The graph's parent, the handler of its events.
@@ -1950,6 +2739,29 @@ public:
     /** @brief The DPI of the graph's nominal pixels. */
     wxSize GetDPI() const { return m_dpi; }
 
+    /**
+     * @brief The metrics of a headless graph, or NULL if it was constructed
+     * without them.
+     *
+     * @see GraphMetrics
+     */
+    const GraphMetrics *GetMetrics() const { return m_metrics; }
+
+    /**
+     * @brief Return an estimate of the memory used by the graph in bytes.
+     *
+     * This counts the elements and their shapes at the sizes of their
+     * classes, the pool of the shapes' event handlers, the internal indexes
+     * and the undo history. The memory allocated by the elements themselves,
+     * such as the text of the nodes, isn't included.
+     *
+     * Only the shapes' event handlers are allocated from a pool owned by the
+     * graph. The elements are created by the application, often before they
+     * are added to a graph, and their shapes by overridable factory methods
+     * and by OGL, so both of these are allocated on the heap as usual.
+     */
+    size_t GetMemoryUsage() const;
+
     //@{
     /**
      * @brief The graph's default font.
@@ -1975,6 +2787,66 @@ public:
     const GraphNode *HitTest(const wxPoint& pt) const;
     /** @endcond */
 
+    /**
+     * @brief Returns true if an edge connects the two nodes.
+     *
+     * If @a directed is true only an edge going from @a from to @a to
+     * counts, otherwise an edge in either direction does. The edges of the
+     * nodes are not iterated over, so this is cheap even for nodes with many
+     * edges.
+     */
+    bool AreConnected(const GraphNode& from,
+                      const GraphNode& to,
+                      bool directed = false) const;
+
+    /**
+     * @brief Queries about the directed paths between the nodes.
+     *
+     * A topological order of the nodes is kept up to date as the edges are
+     * added and removed, each change only costing a search of the nodes
+     * between the ends of the new edge in the current order, if any. So
+     * these are cheap to call on every change or while dragging, e.g.
+     * WouldCreateCycle() can be used by an @c EVT_GRAPH_CONNECT_FEEDBACK
+     * handler to remove the sources which would make a pipeline cyclic.
+     *
+     * IsAcyclic() and the @c false results of IsReachable() for nodes in
+     * the wrong order are found in constant time, the other results need a
+     * search bounded by the order. GetUpstream() and GetDownstream() return
+     * the nodes from which @a node can be reached and those reachable from
+     * it, and GetTopologicalOrder() all the nodes, all in topological order
+     * unless the graph has a cycle, in which case GetTopologicalOrder()
+     * returns an empty vector.
+     *
+     * If the graph has a cycle, the order is recomputed the first time it's
+     * needed after an edge is removed, and IsReachable() searches all the
+     * paths until then.
+     */
+    //@{
+    bool IsAcyclic() const;
+    bool IsReachable(const GraphNode& from, const GraphNode& to) const;
+    bool WouldCreateCycle(const GraphNode& from, const GraphNode& to) const;
+    std::vector<GraphNode*> GetUpstream(const GraphNode& node) const;
+    std::vector<GraphNode*> GetDownstream(const GraphNode& node) const;
+    std::vector<GraphNode*> GetTopologicalOrder() const;
+    //@}
+
+    //@{
+    /**
+     * @brief Enables keeping a rendered bitmap of each node.
+     *
+     * When enabled, each node is drawn once into a bitmap for the zoom tier
+     * just above the current zoom, 25%, 50%, 100% or 200%, and later paints
+     * only blit it, so scrolling costs roughly one blit per visible node.
+     * The bitmap is discarded whenever the node is refreshed, which all the
+     * setters affecting its appearance do. The selection handles are still
+     * drawn directly, as are the nodes when printing or above 200% zoom.
+     *
+     * Uses a bitmap per visible node, so it's off by default.
+     */
+    void SetNodeBitmapCache(bool cache);
+    bool IsNodeBitmapCache() const { return m_nodeBitmapCache; }
+    //@}
+
     /**
      * @brief Render the graph onto a DC for printing or export to bitmap.
      */
@@ -1989,6 +2861,14 @@ public:
      */
     wxRect GetDrawRect() const { return m_rcDraw; }
 
+    /**
+     * @brief Returns the number of shapes which were not drawn during the
+     * last redraw because they were outside of the area being drawn.
+     *
+     * This is only useful for diagnostics.
+     */
+    size_t GetSkippedShapeCount() const;
+
 protected:
     /**
      * Implementations of Add().
@@ -2006,35 +2886,179 @@ protected:
 private:
     /** @cond */
     friend void GraphCtrl::SetGraph(Graph *graph);
+    friend class GraphEdge;
+    friend class GraphNode;
+    friend class impl::GraphLoader;
+    friend class impl::GraphHandler;
+    friend class impl::GraphCanvas;
+    friend class impl::UndoJournal;
+    friend class GraphElement;
     /** @endcond */
 
     /// Set the canvas used for the graph display.
     void SetCanvas(impl::GraphCanvas *canvas);
 
+    /// Handle the events sent by the layout worker thread.
+    void OnLayoutThread(wxThreadEvent& event);
+
     /// Get the canvas used for the graph display. Never @c NULL.
     impl::GraphCanvas *GetCanvas() const;
 
     /// Get the associated control.
     GraphCtrl *GetCtrl() const;
 
+    /**
+     * Get the control drawing into the DC, if it's one of the controls
+     * showing the graph, or the associated one otherwise.
+     */
+    GraphCtrl *GetCtrl(const wxDC& dc) const;
+
+    /**
+     * Add or remove the canvas of another control showing the graph.
+     *
+     * @see GraphCtrl::SetGraph()
+     */
+    //@{
+    void AddView(impl::GraphCanvas *canvas);
+    void RemoveView(impl::GraphCanvas *canvas);
+    //@}
+
+    /**
+     * Refresh the area given in graph coordinates in all the views, and in
+     * the overviews of all the controls showing the graph.
+     */
+    void RefreshViews(const wxRect& rcGraph);
+
+    /**
+     * Schedule a scrollbars update in all the views, and a check of the
+     * bounds in all the overviews.
+     */
+    void CheckViewBounds();
+
     /// Get the list of all shapes in the graph.
     wxList *GetShapeList() const;
 
+    /**
+     * @brief Get the shortest list containing all elements of the given
+     * type satisfying the given IteratorFilter condition.
+     *
+     * This is the list of selected shapes for impl::Selected, the list of
+     * node or edge shapes for these types or the list of all shapes.
+     */
+    wxList *GetShapeList(wxClassInfo *classinfo, int which) const;
+
     /// Delete an element from the graph.
     void DoDelete(GraphElement *element);
 
     /**
-     * @brief Creates a new iterator over graph elements.
+     * @brief Select or unselect all the given elements at once.
+     *
+     * This is the implementation of Select() and Unselect() for ranges.
+     * Each element whose state changes goes through its own Select() or
+     * Unselect(), inside a single update so that the graph is repainted
+     * only once for all of them.
+     */
+    void SelectElements(const std::vector<GraphElement*>& elements,
+                        bool select);
+
+    /**
+     * @brief Select the elements intersecting the rectangle.
+     *
+     * Used for rubber banding. The selected elements outside the rectangle
+     * are unselected unless @a extend is true. The nodes are found with the
+     * spatial index and only the edges of those nodes are tested, so an
+     * edge crossing the rectangle without either of its ends in it is not
+     * selected.
+     */
+    void SelectRect(const wxRect& rc, bool extend);
+
+    /**
+     * @brief Helpers for FindSpace() and FindSpaces().
+     *
+     * Return the default start position below the connected nodes and the
+     * number of columns to use if @a columns is 0.
+     */
+    //@{
+    wxPoint GetSpaceStart(const wxSize& spacing) const;
+    int GetSpaceColumns(const wxSize& spacing, int columns) const;
+    //@}
+
+    /**
+     * @brief Helpers for Deserialise() and DeserialiseInto().
+     *
+     * RestoreSettings() applies the settings stored in the graph item when
+     * replacing the graph, PrepareImport() computes the offset and font
+     * used by the imported elements and DeserialiseElement() creates a
+     * single element.
+     */
+    //@{
+    void RestoreSettings(Archive::Item& item);
+    void PrepareImport(Archive::Item& item, const wxPoint& pt);
+    GraphElement *DeserialiseElement(Archive::Item& arc);
+    //@}
+
+    /**
+     * @brief Record the change of a property of the element for Undo().
+     *
+     * Called by GraphElement::RecordChange(), @a undo restores the old value
+     * and @a redo sets the new one. @a bytes is the memory used by the
+     * values they capture.
+     */
+    void RecordChange(GraphElement& element,
+                      const impl::UndoAction& undo,
+                      const impl::UndoAction& redo,
+                      size_t bytes);
+
+    /// Finish loading the graph with the loader after Archive::Load(),
+    /// emptying it if it was cleared but @a ok is false.
+    bool FinishDeserialise(impl::GraphLoader& loader, bool ok);
+
+    /**
+     * @brief Update the hit testing index and the graph bounds after the
+     * node was moved or resized.
      *
-     * The returned iterator starts at @a begin and goes until @a end. It will
-     * only return the elements of the given @a classinfo (i.e. skip all the
-     * rest) and also filter them by IteratorFilter enum elements.
+     * Called by GraphNode whenever the node bounds change.
+     */
+    void UpdateIndex(const GraphNode& node);
+
+    /**
+     * @brief Add a new node to the hit testing index, the graph bounds and
+     * the topological order.
      */
-    static impl::GraphIteratorImpl *IterImpl(
-        const wxList::iterator& begin,
-        const wxList::iterator& end,
-        wxClassInfo *classinfo,
-        int which);
+    void InsertIndex(const GraphNode& node);
+
+    /**
+     * @brief Update the adjacency index and the topological order after an
+     * edge between the two nodes was connected or before it's disconnected.
+     *
+     * Called by GraphEdge::UpdateEdgeCounts() with the same @a delta.
+     */
+    void UpdateAdjacency(const GraphNode& from, const GraphNode& to, int delta);
+
+    /**
+     * @brief Update the graph bounds after a node bounds changed from
+     * @a old to @a rc.
+     *
+     * Either rectangle is empty if the node was added or removed. The bounds
+     * are grown to include the new rectangle unless the node moved away from
+     * their edge, in which case they're recomputed by the next GetBounds().
+     */
+    void UpdateBounds(const wxRect& old, const wxRect& rc);
+
+    /// Schedule the scrollbars update after the bounds changed.
+    void BoundsChanged();
+
+    /**
+     * @brief Add a rectangle in graph coordinates to the area repainted by
+     * EndUpdate().
+     */
+    void Invalidate(const wxRect& rc);
+
+    /**
+     * @brief Update the hit testing index after the node was brought to the
+     * front of the Z-order.
+     */
+    void RaiseIndex(const GraphNode& node);
 
     /**
      * @brief Return a pair of iterators defining a range with all elements of
@@ -2043,8 +3067,6 @@ private:
      * This method returns the begin and end iterators defining a range of all
      * elements satisfying the given condition @a which and of the specified
      * type @a classinfo if it is non-NULL or of type @c T by default.
-     *
-     * @see IterImpl()
      */
     template <class T> IterPair<T>
     Iter(int which = impl::All, wxClassInfo *classinfo = NULL) const;
@@ -2066,8 +3088,10 @@ private:
     /**
      * @brief Bounding box coordinates.
      *
-     * This is computed on demand, use GetBounds() to access it and
-     * RefreshBounds() to invalidate.
+     * This is maintained incrementally by UpdateBounds() as long as the
+     * nodes only grow it, and recomputed on demand from the spatial index
+     * when it is empty. Use GetBounds() to access it and RefreshBounds() to
+     * invalidate.
      */
     mutable wxRect m_rcBounds;
 
@@ -2081,19 +3105,99 @@ private:
     mutable wxRect m_rcDraw;
 
     /**
-     * @brief Current hit testing region.
+     * @brief Spatial index of the nodes.
+     *
+     * Used by HitTest() to avoid walking all the nodes of the graph.
+     */
+    impl::SpatialIndex *m_index;
+
+    /**
+     * @brief Counts of the edges between the pairs of nodes.
+     *
+     * Used by AreConnected() to avoid walking the edges of the nodes.
+     */
+    impl::AdjacencyIndex *m_adjacency;
+
+    /**
+     * @brief Topological order of the nodes.
+     *
+     * Used by IsReachable() and the related methods.
+     */
+    impl::GraphAnalysis *m_analysis;
+
+    /**
+     * @brief State of the update started by BeginUpdate().
+     *
+     * The nesting level, the area to repaint in graph coordinates and
+     * whether the bounds need checking and the change event sending when
+     * the update ends.
+     *
+     * @see BeginUpdate(), EndUpdate()
+     */
+    //@{
+    int m_updateCount;
+    wxRect m_rcDirty;
+    bool m_checkBounds;
+    bool m_changed;
+    //@}
+
+    /**
+     * @brief The layout running in the background, if any.
+     *
+     * Shared with the worker thread, which may outlive it if the layout is
+     * cancelled.
+     *
+     * @see LayoutAsync(), CancelLayout()
+     */
+    std::shared_ptr<impl::LayoutJob> m_layoutJob;
+
+    /**
+     * @brief The canvases of the controls showing the graph other than the
+     * one the shapes belong to.
+     *
+     * @see GraphCtrl::SetGraph()
+     */
+    std::vector<impl::GraphCanvas*> m_views;
+
+    /**
+     * @brief Nodes placed by the previous layouts.
+     *
+     * Used by the incremental layout mode.
+     *
+     * @see SetIncrementalLayout()
+     */
+    impl::LayoutHistory *m_history;
+
+    /**
+     * @brief The layouts computed before, found by the hash of the nodes,
+     * edges and separations laid out.
+     *
+     * Shared with the layout jobs, which never modify it.
+     *
+     * @see SetComponentLayout()
+     */
+    std::shared_ptr<const impl::LayoutCache> m_layoutCache;
+
+    /**
+     * @brief The operations that can be undone and redone.
+     *
+     * @see Undo(), Redo()
+     */
+    impl::UndoJournal *m_journal;
+
+    /**
+     * @brief Lay out the connected components separately.
      *
-     * Used only in HitTest() to optimize consecutive calls to it for close
-     * locations.
+     * @see SetComponentLayout()
      */
-    mutable wxRect m_rcHit;
+    bool m_componentLayout;
 
     /**
-     * @brief Last node returned by HitTest().
+     * @brief Draw the nodes from cached bitmaps.
      *
-     * This is another optimization used in HitTest().
+     * @see SetNodeBitmapCache()
      */
-    mutable const GraphNode *m_nodeHit;
+    bool m_nodeBitmapCache;
 
     /**
      * @brief Event handler used for generation of all the events.
@@ -2105,14 +3209,50 @@ private:
      */
     wxEvtHandler *m_handler;
 
+    /**
+     * @brief The metrics of a headless graph, or NULL.
+     *
+     * @see GetMetrics()
+     */
+    GraphMetrics *m_metrics;
+
     /**
      * @brief Screen resolution in dots per inches.
      *
-     * Set in ctor and used for coordinate units transformations.
+     * Set in ctor, from the metrics if any, and used for coordinate units
+     * transformations.
      */
     wxSize m_dpi;
 
     DECLARE_DYNAMIC_CLASS(Graph)
+    DECLARE_EVENT_TABLE()
+};
+
+/**
+ * @brief Calls Graph::BeginUpdate() in its ctor and Graph::EndUpdate() in its
+ * dtor.
+ *
+ * This makes sure that the changes made in a scope are repainted together
+ * even if it is left early.
+ */
+class GraphUpdateLocker
+{
+public:
+    /** @brief Begins an update of the given graph. */
+    explicit GraphUpdateLocker(Graph& graph) : m_graph(graph)
+    {
+        m_graph.BeginUpdate();
+    }
+    /** @brief Ends the update, repainting the graph if it was outermost. */
+    ~GraphUpdateLocker() { m_graph.EndUpdate(); }
+
+    GraphUpdateLocker(const GraphUpdateLocker&) = delete;
+    GraphUpdateLocker(GraphUpdateLocker&&) = delete;
+    GraphUpdateLocker& operator=(const GraphUpdateLocker&) = delete;
+    GraphUpdateLocker& operator=(GraphUpdateLocker&&) = delete;
+
+private:
+    Graph& m_graph;
 };
 
 // Inline definitions
@@ -2140,6 +3280,26 @@ wxPoint Graph::FindSpace(const wxPoint& position,
                      columns);
 }
 
+template <class T>
+std::vector<wxPoint> Graph::FindSpaces(size_t count,
+                                       const wxSize& spacing,
+                                       int columns)
+{
+    return FindSpaces(count, Pixels::From<T>(spacing, m_dpi), columns);
+}
+
+template <class T>
+std::vector<wxPoint> Graph::FindSpaces(size_t count,
+                                       const wxPoint& position,
+                                       const wxSize& spacing,
+                                       int columns)
+{
+    return FindSpaces(count,
+                      Pixels::From<T>(position, m_dpi),
+                      Pixels::From<T>(spacing, m_dpi),
+                      columns);
+}
+
 template <class T> void Graph::SetGridSpacing(int spacing)
 {
     SetGridSpacing(Pixels::From<T>(spacing, m_dpi.y));
@@ -2165,6 +3325,26 @@ template <class T> const T *Graph::HitTest(const wxPoint& pt) const
     return dynamic_cast<T*>(HitTest(pt));
 }
 
+template <class T, class V>
+void GraphElement::RecordChange(void (T::*setter)(V),
+                                const typename std::decay<V>::type& old,
+                                const typename std::decay<V>::type& value)
+{
+    Graph *graph = GetGraph();
+
+    if (graph && !(old == value)) {
+        graph->RecordChange(*this,
+            [setter, old](GraphElement& e) {
+                (static_cast<T&>(e).*setter)(old);
+            },
+            [setter, value](GraphElement& e) {
+                (static_cast<T&>(e).*setter)(value);
+            },
+            2 * sizeof(setter) +
+                impl::GetUndoBytes(old) + impl::GetUndoBytes(value));
+    }
+}
+
 Graph::const_iterator_pair Graph::GetElements() const
 {
     return GetElements<const GraphElement>();
@@ -2213,7 +3393,10 @@ template <class T> IterPair<const T> Graph::GetSelection() const
 template <class T>
 IterPair<T> Graph::Iter(int which, wxClassInfo *classinfo) const
 {
-    wxList *list = GetShapeList();
+    if (!classinfo)
+        classinfo = CLASSINFO(T);
+
+    wxList *list = GetShapeList(classinfo, which);
     wxList::iterator begin, end;
 
     if (list) {
@@ -2221,12 +3404,9 @@ IterPair<T> Graph::Iter(int which, wxClassInfo *classinfo) const
         end = list->end();
     }
 
-    if (!classinfo)
-        classinfo = CLASSINFO(T);
-
     return std::make_pair(
-        GraphIterator<T>(IterImpl(begin, end, classinfo, which)),
-        GraphIterator<T>(IterImpl(end, end, classinfo, which)));
+        GraphIterator<T>(begin, end, classinfo, which),
+        GraphIterator<T>(end, end, classinfo, which));
 }
 
 template <class T, class U> IterPair<T> Graph::Iter(int which) const
@@ -2249,7 +3429,8 @@ class GraphEvent : public wxNotifyEvent
 public:
     /**
      * @brief A list type used by @c EVT_GRAPH_CONNECT and @c
-     * EVT_GRAPH_CONNECT_FEEDBACK to provide a list of all the source nodes.
+     * EVT_GRAPH_CONNECT_FEEDBACK to provide a list of all the source nodes,
+     * and by @c EVT_GRAPH_BATCH_ADD for the nodes being added.
      */
     typedef std::list<GraphNode*> NodeList;
 
@@ -2300,7 +3481,8 @@ public:
     //@{
     /**
      * @brief A list provided by @c EVT_GRAPH_CONNECT and
-     * @c EVT_GRAPH_CONNECT_FEEDBACK of all the source nodes.
+     * @c EVT_GRAPH_CONNECT_FEEDBACK of all the source nodes, or by
+     * @c EVT_GRAPH_BATCH_ADD of the nodes being added.
      */
     void SetSources(NodeList& sources)  { m_sources = &sources; }
     NodeList& GetSources() const        { return *m_sources; }
@@ -2314,6 +3496,15 @@ public:
     double GetZoom() const              { return m_zoom; }
     //@}
 
+    //@{
+    /**
+     * @brief The percentage of the work done for
+     * @c EVT_GRAPH_LAYOUT_PROGRESS.
+     */
+    void SetProgress(int percent)       { m_progress = percent; }
+    int GetProgress() const             { return m_progress; }
+    //@}
+
     /**
      * @brief The node being added, deleted, clicked, etc.
      *
@@ -2363,6 +3554,7 @@ private:
     GraphEdge *m_edge;      ///< The edge being added, deleted &c.
     NodeList *m_sources;    ///< Source nodes for connection events.
     double m_zoom;          ///< New zoom factor for zoom events.
+    int m_progress;         ///< Percentage done for layout progress events.
 
     DECLARE_DYNAMIC_CLASS(GraphEvent)
 };
@@ -2407,6 +3599,15 @@ BEGIN_DECLARE_EVENT_TYPES()
     DECLARE_EVENT_TYPE(Evt_Graph_Connect_Feedback, wxEVT_USER_FIRST + 1107)
     DECLARE_EVENT_TYPE(Evt_Graph_Connect, wxEVT_USER_FIRST + 1108)
 
+    DECLARE_EVENT_TYPE(Evt_Graph_Layout_Progress, wxEVT_USER_FIRST + 1118)
+    DECLARE_EVENT_TYPE(Evt_Graph_Layout_Done, wxEVT_USER_FIRST + 1119)
+    DECLARE_EVENT_TYPE(Evt_Graph_Layout_Cancel, wxEVT_USER_FIRST + 1120)
+
+    // 1121 is Evt_GraphTree_Drop in graphtree.h.
+    DECLARE_EVENT_TYPE(Evt_Graph_Batch_Add, wxEVT_USER_FIRST + 1122)
+    DECLARE_EVENT_TYPE(Evt_Graph_Batch_Delete, wxEVT_USER_FIRST + 1123)
+    DECLARE_EVENT_TYPE(Evt_Graph_Changed, wxEVT_USER_FIRST + 1124)
+
     // GraphCtrl Events
 
     DECLARE_EVENT_TYPE(Evt_Graph_Node_Click, wxEVT_USER_FIRST + 1109)
@@ -2513,6 +3714,25 @@ END_DECLARE_EVENT_TYPES()
  */
 #define EVT_GRAPH_ELEMENT_DELETE(fn) EVT_GRAPH_NODE_DELETE(fn) EVT_GRAPH_EDGE_DELETE(fn)
 
+/**
+ * @brief Fired when Graph::AddBatch() is about to add many elements.
+ *
+ * @c GetSources() returns the list of the nodes that will be added. Removing
+ * a node from the list cancels the addition of this node and of its edges,
+ * and deletes them. Vetoing the event cancels the whole batch.
+ */
+#define EVT_GRAPH_BATCH_ADD(fn) DECLARE_GRAPH_EVT0(Batch_Add, fn)
+
+/**
+ * @brief Fired when Graph::DeleteBatch() is about to delete many elements.
+ *
+ * @c GetSources() returns the list of the nodes that will be deleted.
+ * Removing a node from the list keeps it and the edges connecting it to the
+ * other kept nodes, unless they were given to DeleteBatch() themselves.
+ * Vetoing the event cancels the whole batch.
+ */
+#define EVT_GRAPH_BATCH_DELETE(fn) DECLARE_GRAPH_EVT0(Batch_Delete, fn)
+
 /**
  * @brief Fires during node dragging each time the cursor hovers over
  * a potential target node, and allows the application to decide whether
@@ -2522,6 +3742,10 @@ END_DECLARE_EVENT_TYPES()
  * the target node.  Removing nodes from the sources list disallows just that
  * connection while permitting other sources to connect. Vetoing the event
  * disallows all connections (it's equivalent to clearing the list).
+ *
+ * The sources already connected to the target are not in the list. Handlers
+ * checking other pairs of nodes should use Graph::AreConnected() rather than
+ * walking the node edges, as this event is sent often.
  */
 #define EVT_GRAPH_CONNECT_FEEDBACK(fn) DECLARE_GRAPH_EVT0(Connect_Feedback, fn)
 /**
@@ -2534,6 +3758,33 @@ END_DECLARE_EVENT_TYPES()
  */
 #define EVT_GRAPH_CONNECT(fn) DECLARE_GRAPH_EVT0(Connect, fn)
 
+/**
+ * @brief Fires while a layout started by Graph::LayoutAsync() is running.
+ *
+ * <code>GraphEvent::GetProgress()</code> returns the percentage of the work
+ * done. Vetoing the event cancels the layout.
+ */
+#define EVT_GRAPH_LAYOUT_PROGRESS(fn) DECLARE_GRAPH_EVT0(Layout_Progress, fn)
+/**
+ * @brief Fires when a layout started by Graph::LayoutAsync() has finished
+ * and the nodes were moved to their new positions.
+ */
+#define EVT_GRAPH_LAYOUT_DONE(fn) DECLARE_GRAPH_EVT0(Layout_Done, fn)
+/**
+ * @brief Fires when a layout started by Graph::LayoutAsync() is cancelled
+ * or fails.
+ */
+#define EVT_GRAPH_LAYOUT_CANCEL(fn) DECLARE_GRAPH_EVT0(Layout_Cancel, fn)
+
+/**
+ * @brief Fires when Graph::EndUpdate() ends an update during which the
+ * graph was changed.
+ *
+ * This is sent once for all the changes made during the update, after the
+ * changed area was refreshed.
+ */
+#define EVT_GRAPH_CHANGED(fn) DECLARE_GRAPH_EVT0(Changed, fn)
+
 // GraphCtrl Events
 
 /**
@@ -0,0 +1,152 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        graphoverview.h
+// Purpose:     Overview of a graph shown by a GraphCtrl
+// Author:      Mike Wetherell
+// Modified by:
+// Created:     October 2026
+// RCS-ID:      $Id$
+// Copyright:   (c) 2026 TT-Solutions SARL
+// Licence:     wxWindows licence
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef GRAPHOVERVIEW_H
+#define GRAPHOVERVIEW_H
+
+#include "graphctrl.h"
+
+#include <vector>
+
+/**
+ * @file graphoverview.h
+ * @brief Overview of a graph shown by a GraphCtrl.
+ */
+
+namespace tt_solutions {
+
+/**
+ * @brief Shows the whole graph of a GraphCtrl scaled down, with the area
+ * visible in the GraphCtrl, to navigate it without zooming out.
+ *
+ * The graph is drawn once into a thumbnail the size of the control, split
+ * into tiles, and after that only the tiles in which nodes or edges were
+ * added, moved or deleted are drawn again. Scrolling or zooming the
+ * GraphCtrl only moves the rectangle showing its visible area, and
+ * clicking or dragging in the overview scrolls the GraphCtrl to centre the
+ * point under the mouse.
+ *
+ * The thumbnail covers the bounds of the graph with a margin, so that it
+ * needs to be drawn entirely again only when the graph outgrows it or
+ * becomes much smaller, or the overview is resized. RefreshThumbnail() can
+ * be used to redraw it after changes not affecting any element, e.g. of the
+ * font of the graph.
+ *
+ * @code
+ *  GraphOverviewCtrl *overview = new GraphOverviewCtrl(panel, m_graphctrl);
+ * @endcode
+ */
+class GraphOverviewCtrl : public wxControl
+{
+public:
+    /**
+     * @brief Constructor.
+     *
+     * @param parent The parent window.
+     * @param ctrl The GraphCtrl whose graph is shown, can be set later with
+     *  SetGraphCtrl().
+     */
+    GraphOverviewCtrl(wxWindow *parent = NULL,
+                      GraphCtrl *ctrl = NULL,
+                      wxWindowID id = wxID_ANY,
+                      const wxPoint& pos = wxDefaultPosition,
+                      const wxSize& size = wxDefaultSize,
+                      long style = wxBORDER,
+                      const wxString& name = DefaultName);
+    ~GraphOverviewCtrl() override;
+
+    GraphOverviewCtrl(const GraphOverviewCtrl&) = delete;
+    GraphOverviewCtrl(GraphOverviewCtrl&&) = delete;
+    GraphOverviewCtrl& operator=(const GraphOverviewCtrl&) = delete;
+    GraphOverviewCtrl& operator=(GraphOverviewCtrl&&) = delete;
+
+    /**
+     * @brief Set the GraphCtrl whose graph is shown, or @c NULL to show
+     * nothing.
+     */
+    void SetGraphCtrl(GraphCtrl *ctrl);
+    /** @brief Returns the GraphCtrl whose graph is shown. */
+    GraphCtrl *GetGraphCtrl() const { return m_ctrl; }
+
+    /** @brief Draw the whole thumbnail again the next time it's painted. */
+    void RefreshThumbnail();
+
+    /** @brief Convert from the overview's client coordinates. */
+    wxPoint OverviewToGraph(const wxPoint& pt) const;
+    /** @brief Convert to the overview's client coordinates. */
+    wxPoint GraphToOverview(const wxPoint& ptGraph) const;
+    /** @brief Convert to the overview's client coordinates. */
+    wxRect GraphToOverview(const wxRect& rcGraph) const;
+
+    /** Default value for the constructor's name parameter. */
+    static const wxChar DefaultName[];
+
+    /**
+     * @name Event handlers.
+     */
+    //@{
+    void OnPaint(wxPaintEvent& event);
+    void OnSize(wxSizeEvent& event);
+    void OnMouse(wxMouseEvent& event);
+    void OnCaptureLost(wxMouseCaptureLostEvent& event);
+    //@}
+
+private:
+    friend class GraphCtrl;
+
+    /**
+     * @brief Called by the GraphCtrl.
+     *
+     * When the area given in graph coordinates has to be redrawn, when the
+     * bounds of the graph may have changed, when the area visible in the
+     * GraphCtrl has moved or changed size, and when it shows another graph.
+     */
+    //@{
+    void GraphRectChanged(const wxRect& rcGraph);
+    void GraphBoundsChanged();
+    void ViewChanged();
+    void GraphChanged() { RefreshThumbnail(); }
+    //@}
+
+    /// Fit the thumbnail to the bounds of the graph and the client size.
+    void FitThumbnail();
+
+    /// True if the graph has outgrown the thumbnail or is much smaller.
+    bool NeedsFit() const;
+
+    /// Draw the tiles marked as dirty into m_thumbnail.
+    void DrawTiles();
+
+    /// The area of the GraphCtrl visible, in graph coordinates.
+    wxRect GetViewRect() const;
+
+    /// Scroll the GraphCtrl to centre the point under the mouse.
+    void ScrollCtrl(const wxPoint& pt);
+
+    GraphCtrl *m_ctrl;              ///< The control showing the graph.
+    wxBitmap m_thumbnail;           ///< The graph scaled down.
+    wxPoint m_origin;               ///< The graph point at the top left.
+    double m_scale;                 ///< Thumbnail pixels per graph unit.
+    int m_cols;                     ///< Number of tiles across.
+    int m_rows;                     ///< Number of tiles down.
+    std::vector<bool> m_dirty;      ///< Tiles to draw again, by rows.
+    bool m_anyDirty;                ///< True if any of m_dirty is set.
+    bool m_fit;                     ///< FitThumbnail() is needed.
+    bool m_checkBounds;             ///< NeedsFit() should be checked.
+    wxRect m_rcView;                ///< The view rectangle drawn.
+
+    DECLARE_EVENT_TABLE()
+    DECLARE_DYNAMIC_CLASS(GraphOverviewCtrl)
+};
+
+} // namespace tt_solutions
+
+#endif // GRAPHOVERVIEW_H
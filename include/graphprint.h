@@ -13,6 +13,8 @@
 
 #include <wx/prntbase.h>
 
+#include <functional>
+
 #include "graphctrl.h"
 
 /**
@@ -384,6 +386,110 @@ private:
     GraphPages *m_graphpages;
 };
 
+/**
+ * @brief Renders a graph into an image one tile at a time.
+ *
+ * Rendering a large graph into a single bitmap needs a bitmap the size of
+ * the whole output, and then a copy of it when converting it to a @c wxImage
+ * for saving. This class instead draws the graph into a bitmap of at most
+ * the tile size, converts it and moves on to the next tile.
+ *
+ * Render() pastes the tiles into an image of the whole output. RenderRows()
+ * passes each row of tiles to a callback instead and only keeps that row in
+ * memory. The tiles are drawn one after the other on the calling thread, as
+ * drawing the shapes isn't thread safe.
+ *
+ * @code
+ *  GraphTiles tiles(graph, graph->GetBounds(), wxSize(w, h));
+ *  wxImage image(w, h, false);
+ *  if (tiles.Render(image))
+ *      image.SaveFile(filename, wxBITMAP_TYPE_PNG);
+ * @endcode
+ *
+ * @see Graph::Draw()
+ */
+class GraphTiles
+{
+public:
+    /** @brief The default width and height of the tiles, in pixels. */
+    static constexpr int DEFAULT_TILE_SIZE = 1024;
+
+    /**
+     * @brief Constructor.
+     *
+     * @param graph The graph to render.
+     * @param rcGraph The area of the graph to render, in graph coordinates.
+     * @param size The size of the output in pixels, @a rcGraph is scaled
+     *  to fit it.
+     * @param tileSize The maximal size of a single tile.
+     */
+    GraphTiles(const Graph *graph,
+               const wxRect& rcGraph,
+               const wxSize& size,
+               const wxSize& tileSize = wxSize(DEFAULT_TILE_SIZE,
+                                               DEFAULT_TILE_SIZE));
+
+    /** @brief The number of tiles across. */
+    int GetCols() const { return m_cols; }
+    /** @brief The number of tiles down. */
+    int GetRows() const { return m_rows; }
+
+    /**
+     * @brief The area of the output covered by the given tile, in pixels.
+     */
+    wxRect GetTileRect(int col, int row) const;
+
+    /**
+     * @brief Render a single tile.
+     *
+     * Only the elements intersecting the tile are drawn. Returns an invalid
+     * image if the tile couldn't be rendered.
+     */
+    wxImage RenderTile(int col,
+                       int row,
+                       const wxColour& background = *wxWHITE) const;
+
+    /**
+     * @brief Render all the tiles into @a image, at the given position.
+     *
+     * @a image must already have been created and be large enough.
+     */
+    bool Render(wxImage& image,
+                const wxPoint& pos = wxPoint(),
+                const wxColour& background = *wxWHITE) const;
+
+    /**
+     * @brief Called by RenderRows() with each row of tiles.
+     *
+     * @a strip has the width of the whole output and the height of the row,
+     * @a y is the position of the row in the output. Returning @c false
+     * stops the rendering.
+     */
+    typedef std::function<bool(const wxImage& strip, int y)> RowSink;
+
+    /**
+     * @brief Render the output a row of tiles at a time, passing each row
+     * to @a sink.
+     *
+     * Only the row being rendered is held in memory, so the output can be
+     * written out a row at a time without an image of the whole output.
+     * Returns @c false if a tile couldn't be rendered or @a sink returned
+     * @c false.
+     */
+    bool RenderRows(const RowSink& sink,
+                    const wxColour& background = *wxWHITE) const;
+
+private:
+    const Graph *m_graph;               ///< The graph being rendered.
+    wxRect m_rcGraph;                   ///< Area of the graph rendered.
+    wxSize m_size;                      ///< Size of the output.
+    wxSize m_tileSize;                  ///< Maximal size of a tile.
+    double m_scaleX;                    ///< Horizontal output scale.
+    double m_scaleY;                    ///< Vertical output scale.
+    int m_cols;                         ///< Number of tiles across.
+    int m_rows;                         ///< Number of tiles down.
+};
+
 } // namespace tt_solutions
 
 #endif // GRAPHPRINT_H
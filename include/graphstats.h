@@ -0,0 +1,201 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        graphstats.h
+// Purpose:     Optional timings and counters of the costly operations
+// Author:      Mike Wetherell
+// Modified by:
+// Created:     October 2026
+// RCS-ID:      $Id$
+// Copyright:   (c) 2026 TT-Solutions SARL
+// Licence:     wxWindows licence
+/////////////////////////////////////////////////////////////////////////////
+
+#ifndef GRAPHSTATS_H
+#define GRAPHSTATS_H
+
+#include <wx/wx.h>
+#include <wx/thread.h>
+#include <chrono>
+#include <initializer_list>
+#include <utility>
+
+/**
+ * @file graphstats.h
+ * @brief Optional timings and counters of the costly operations.
+ *
+ * The statistics are only recorded if the library is compiled with
+ * @c GRAPH_STATS defined. Otherwise the instrumentation compiles to nothing
+ * and GraphCtrl::GetStats() always returns zeros. They are stored in the
+ * library, so whether @c GRAPH_STATS is defined when compiling the
+ * application makes no difference.
+ */
+
+namespace tt_solutions {
+
+/**
+ * @brief Timings and counters of the operations likely to be slow.
+ *
+ * They are collected for the whole process rather than per graph, as the
+ * layout can be computed in a worker thread and the archives are not tied
+ * to a graph. See GraphCtrl::GetStats().
+ */
+struct GraphStats
+{
+    /// The number of times an operation was done and how long it took.
+    struct Timer
+    {
+        unsigned long count = 0;        ///< Number of times done.
+        double total = 0;               ///< Total time in seconds.
+        double longest = 0;             ///< Longest time in seconds.
+
+        /// The average time in seconds.
+        double GetAverage() const { return count ? total / count : 0; }
+    };
+
+    /**
+     * @brief The steps of Graph::Layout() and Graph::LayoutAsync().
+     *
+     * Collecting the nodes and edges to lay out, creating the graphviz graph
+     * from them, running the dot engine and moving the nodes.
+     */
+    //@{
+    Timer layoutCollect;
+    Timer layoutGraph;
+    Timer layoutEngine;
+    Timer layoutApply;
+    //@}
+
+    /// The layouts reused from the layout cache instead of being computed.
+    unsigned long layoutCached = 0;
+
+    /// Redrawing the diagram, and the shapes drawn or outside of the area.
+    //@{
+    Timer redraw;
+    unsigned long shapesDrawn = 0;
+    unsigned long shapesCulled = 0;
+    //@}
+
+    /// Computing the bounds of the graph to update the scrollbars.
+    Timer checkBounds;
+
+    /**
+     * @brief Graph::HitTest() calls, those finding a node and the nodes
+     * compared to the point.
+     *
+     * The candidates per test show how well the spatial index narrows down
+     * the search.
+     */
+    //@{
+    unsigned long hitTests = 0;
+    unsigned long hitTestHits = 0;
+    unsigned long hitTestCandidates = 0;
+    //@}
+
+    /// Archive::Load(), Archive::Save() and Archive::DecodeImages().
+    //@{
+    Timer archiveLoad;
+    Timer archiveSave;
+    Timer archiveDecode;
+    //@}
+};
+
+namespace impl {
+
+#ifdef GRAPH_STATS
+
+/// The statistics of the process and the lock protecting them.
+//@{
+GraphStats& GetStatsData();
+wxCriticalSection& GetStatsLock();
+//@}
+
+/// Records the time until it is destroyed in a GraphStats::Timer.
+class StatsTimer
+{
+public:
+    explicit StatsTimer(GraphStats::Timer GraphStats::*timer)
+      : m_timer(timer),
+        m_start(std::chrono::steady_clock::now())
+    { }
+
+    StatsTimer(const StatsTimer&) = delete;
+    StatsTimer(StatsTimer&&) = delete;
+    StatsTimer& operator=(const StatsTimer&) = delete;
+    StatsTimer& operator=(StatsTimer&&) = delete;
+
+    ~StatsTimer()
+    {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - m_start;
+
+        wxCriticalSectionLocker lock(GetStatsLock());
+        GraphStats::Timer& timer = GetStatsData().*m_timer;
+        timer.count++;
+        timer.total += elapsed.count();
+        if (elapsed.count() > timer.longest)
+            timer.longest = elapsed.count();
+    }
+
+private:
+    GraphStats::Timer GraphStats::*m_timer;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+/// Add to a counter of GraphStats.
+inline void AddStat(unsigned long GraphStats::*counter, unsigned long n)
+{
+    wxCriticalSectionLocker lock(GetStatsLock());
+    GetStatsData().*counter += n;
+}
+
+/// A counter of GraphStats and the amount to add to it.
+typedef std::pair<unsigned long GraphStats::*, unsigned long> StatsDelta;
+
+/// Add to several counters of GraphStats, taking the lock only once.
+inline void AddStats(std::initializer_list<StatsDelta> deltas)
+{
+    wxCriticalSectionLocker lock(GetStatsLock());
+    GraphStats& stats = GetStatsData();
+    for (const StatsDelta& delta : deltas)
+        stats.*delta.first += delta.second;
+}
+
+/**
+ * @brief Time the rest of the enclosing scope in the GraphStats::Timer
+ * member @a name.
+ */
+#define GRAPH_STATS_TIMER(name) \
+    tt_solutions::impl::StatsTimer graphStatsTimer_##name( \
+        &tt_solutions::GraphStats::name)
+
+/// Add @a n to the GraphStats counter member @a name.
+#define GRAPH_STATS_ADD(name, n) \
+    tt_solutions::impl::AddStat(&tt_solutions::GraphStats::name, (n))
+
+/**
+ * @brief Add to several GraphStats counters at once, each argument being a
+ * GRAPH_STATS_COUNT(name, n).
+ *
+ * For the frequent operations, where taking the lock for each counter with
+ * GRAPH_STATS_ADD() would cost too much.
+ */
+#define GRAPH_STATS_ADD_ALL(...) \
+    tt_solutions::impl::AddStats({ __VA_ARGS__ })
+
+/// Adding @a n to the GraphStats counter member @a name.
+#define GRAPH_STATS_COUNT(name, n) \
+    tt_solutions::impl::StatsDelta(&tt_solutions::GraphStats::name, (n))
+
+#else // !GRAPH_STATS
+
+#define GRAPH_STATS_TIMER(name)
+#define GRAPH_STATS_ADD(name, n)
+#define GRAPH_STATS_ADD_ALL(...)
+#define GRAPH_STATS_COUNT(name, n)
+
+#endif // GRAPH_STATS/!GRAPH_STATS
+
+} // namespace impl
+
+} // namespace tt_solutions
+
+#endif // GRAPHSTATS_H
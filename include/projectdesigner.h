@@ -62,6 +62,7 @@ public:
 
     void SetText(const wxString& text) override;
     void SetFont(const wxFont& font) override;
+    void SetBackgroundColour(const wxColour& colour) override;
 
     //@{
     /** @brief The node's id. */
@@ -179,6 +180,7 @@ private:
     wxString m_id;              ///< Unique project id.
     wxString m_result;          ///< Result label.
     wxIcon m_icon;              ///< Node icon.
+    wxBitmap m_iconBitmap;      ///< Icon on the background, see IconCache.
     int m_cornerRadius;         ///< Corner radius in pixels.
     int m_borderThickness;      ///< Border thickness.
     wxRect m_rcIcon;            ///< Icon area.
@@ -273,6 +275,29 @@ private:
     /// Common part of all ctors.
     void Init();
 
+    /**
+     * Return a strip of the background gradient of the given width.
+     *
+     * The strip is cached and the background is drawn by tiling it
+     * vertically, so that only the part of the canvas needing to be repainted,
+     * e.g. the strip exposed by scrolling, is filled. Returns an invalid
+     * bitmap if @a width is not positive.
+     */
+    const wxBitmap& GetBackgroundTile(int width);
+
+    /**
+     * Return the grid lines drawn on a transparent bitmap.
+     *
+     * The layer covers the canvas of the given @a size plus one grid cell, so
+     * that it can be blitted at the offset matching the scroll position. It
+     * is cached and only redrawn when the canvas size, the grid spacing, the
+     * zoom or the grid colour change.
+     */
+    const wxBitmap& GetGridLayer(const wxSize& size,
+                                 const wxSize& spacing,
+                                 double scaleX,
+                                 double scaleY);
+
     /**
      * @brief Colours defining the background.
      *
@@ -284,6 +309,18 @@ private:
      */
     wxColour m_background[2];
 
+    /// Cached strip of the gradient, see GetBackgroundTile().
+    wxBitmap m_backgroundTile;
+
+    /// Cached grid lines and their parameters, see GetGridLayer().
+    //@{
+    wxBitmap m_gridLayer;
+    wxSize m_gridSize;
+    wxSize m_gridSpacing;
+    wxRealPoint m_gridScale;
+    wxColour m_gridColour;
+    //@}
+
     /// True if the grid is shown. True by default.
     bool m_showGrid;
 
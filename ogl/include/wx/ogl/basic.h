@@ -558,8 +558,10 @@ class WXDLLIMPEXP_OGL wxPolygonShape: public wxShape
   wxPolygonShape();
   ~wxPolygonShape();
 
-  // Takes a list of wxRealPoints; each point is an OFFSET from the centre.
-  // Deletes user's points in destructor.
+  // Takes the points; each point is an OFFSET from the centre.
+  virtual void Create(const wxOGLPoints& points);
+  // Compatibility version taking a list of wxRealPoints, which are copied and
+  // deleted immediately together with the list.
   virtual void Create(wxList *points);
   virtual void ClearPoints();
 
@@ -605,8 +607,10 @@ class WXDLLIMPEXP_OGL wxPolygonShape: public wxShape
   // Does the copying for this object
   void Copy(wxShape& copy) override;
 
-  inline wxList *GetPoints() { return m_points; }
-  inline wxList *GetOriginalPoints() { return m_originalPoints; }
+  inline wxOGLPoints& GetPoints() { return m_points; }
+  inline const wxOGLPoints& GetPoints() const { return m_points; }
+  inline wxOGLPoints& GetOriginalPoints() { return m_originalPoints; }
+  inline const wxOGLPoints& GetOriginalPoints() const { return m_originalPoints; }
 
   // Rotate about the given axis by the given amount in radians
   void Rotate(double x, double y, double theta) override;
@@ -618,8 +622,8 @@ class WXDLLIMPEXP_OGL wxPolygonShape: public wxShape
   void SetOriginalHeight(double h) { m_originalHeight = h; }
 
  private:
-  wxList*       m_points;
-  wxList*       m_originalPoints;
+  wxOGLPoints   m_points;
+  wxOGLPoints   m_originalPoints;
   double        m_boundWidth;
   double        m_boundHeight;
   double        m_originalWidth;
@@ -23,6 +23,7 @@
 #include <vector>
 
 using wxOGLPoints = std::vector<wxRealPoint>;
+using wxOGLTextLines = std::vector<wxString>;
 
 #ifndef wxHAS_INFO_DC
     using wxReadOnlyDC = wxDC;
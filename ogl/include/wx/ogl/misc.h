@@ -30,6 +30,13 @@ WXDLLIMPEXP_OGL void oglCentreText(wxReadOnlyDC& dc, wxList *text, double m_xpos
 // Given a string, returns a list of strings that fit within the given
 // width of box. Height is ignored.
 WXDLLIMPEXP_OGL wxStringList* oglFormatText(wxReadOnlyDC& dc, const wxString& text, double width, double height, int formatMode = 0);
+// Same but filling a vector. The lines are cached by text, font and format
+// mode, so formatting the same text again, e.g. while resizing the shape,
+// only measures it again if the lines change.
+WXDLLIMPEXP_OGL void oglFormatText(wxReadOnlyDC& dc, const wxString& text, double width, double height, int formatMode, wxOGLTextLines& lines);
+
+// Forget the lines cached by oglFormatText, done by wxOGLCleanUp.
+WXDLLIMPEXP_OGL void oglClearFormatCache();
 
 // Centres the list of wxShapeTextLine strings, doesn't clip.
 // Doesn't actually draw into the DC.
@@ -46,7 +53,9 @@ WXDLLIMPEXP_OGL void oglDrawFormattedText(wxDC& context, wxList *text_list,
                        double m_xpos, double m_ypos, double width, double height,
                        int formatMode = FORMAT_CENTRE_HORIZ | FORMAT_CENTRE_VERT);
 
-// Give it a list of points, finds the centre.
+// Give it the points, finds the centre.
+WXDLLIMPEXP_OGL void oglFindPolylineCentroid(const wxOGLPoints& points, double *x, double *y);
+// Compatibility version taking a list of wxRealPoints.
 WXDLLIMPEXP_OGL void oglFindPolylineCentroid(wxList *points, double *x, double *y);
 
 WXDLLIMPEXP_OGL void oglCheckLineIntersection(double x1, double y1, double x2, double y2,
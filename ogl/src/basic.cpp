@@ -596,16 +596,13 @@ void wxShape::FormatText(wxReadOnlyDC& dc, const wxString& s, int i)
 
   region->GetSize(&w, &h);
 
-  wxStringList *stringList = oglFormatText(dc, s, (w-2*m_textMarginX), (h-2*m_textMarginY), region->GetFormatMode());
-  auto stringNode = stringList->GetFirst();
-  while (stringNode)
+  wxOGLTextLines lines;
+  oglFormatText(dc, s, (w-2*m_textMarginX), (h-2*m_textMarginY), region->GetFormatMode(), lines);
+  for (size_t j = 0; j < lines.size(); j++)
   {
-    const wxString& t = stringNode->GetData();
-    wxShapeTextLine *line = new wxShapeTextLine(0.0, 0.0, t);
+    wxShapeTextLine *line = new wxShapeTextLine(0.0, 0.0, lines[j]);
     region->GetFormattedText().Append((wxObject *)line);
-    stringNode = stringNode->GetNext();
   }
-  delete stringList;
   double actualW = w;
   double actualH = h;
   // Don't try to resize an object with more than one image (this case should be dealt
@@ -47,74 +47,59 @@ IMPLEMENT_DYNAMIC_CLASS(wxPolygonShape, wxShape)
 
 wxPolygonShape::wxPolygonShape()
 {
-  m_points = nullptr;
-  m_originalPoints = nullptr;
+  m_boundWidth = 0.0;
+  m_boundHeight = 0.0;
+  m_originalWidth = 0.0;
+  m_originalHeight = 0.0;
 }
 
-void wxPolygonShape::Create(wxList *the_points)
+void wxPolygonShape::Create(const wxOGLPoints& the_points)
 {
   ClearPoints();
 
-  if (!the_points)
+  m_originalPoints = the_points;
+  m_points = the_points;
+
+  if (!m_points.empty())
   {
-      m_originalPoints = new wxList;
-      m_points = new wxList;
+      CalculateBoundingBox();
+      m_originalWidth = m_boundWidth;
+      m_originalHeight = m_boundHeight;
+      SetDefaultRegionSize();
   }
-  else
-  {
-      m_originalPoints = the_points;
+}
+
+void wxPolygonShape::Create(wxList *the_points)
+{
+  wxOGLPoints points;
 
-      // Duplicate the list of points
-      m_points = new wxList;
+  if (the_points)
+  {
+      points.reserve(the_points->GetCount());
 
+      // Take ownership of the list as before, but only keep the copy
       wxObjectList::compatibility_iterator node = the_points->GetFirst();
       while (node)
       {
           wxRealPoint *point = (wxRealPoint *)node->GetData();
-          wxRealPoint *new_point = new wxRealPoint(point->x, point->y);
-          m_points->Append((wxObject*) new_point);
+          points.push_back(*point);
+          delete point;
           node = node->GetNext();
       }
-      CalculateBoundingBox();
-      m_originalWidth = m_boundWidth;
-      m_originalHeight = m_boundHeight;
-      SetDefaultRegionSize();
+      delete the_points;
   }
+
+  Create(points);
 }
 
 wxPolygonShape::~wxPolygonShape()
 {
-    ClearPoints();
 }
 
 void wxPolygonShape::ClearPoints()
 {
-  if (m_points)
-  {
-    wxObjectList::compatibility_iterator node = m_points->GetFirst();
-    while (node)
-    {
-      wxRealPoint *point = (wxRealPoint *)node->GetData();
-      delete point;
-      m_points->Erase(node);
-      node = m_points->GetFirst();
-    }
-    delete m_points;
-    m_points = nullptr;
-  }
-  if (m_originalPoints)
-  {
-    wxObjectList::compatibility_iterator node = m_originalPoints->GetFirst();
-    while (node)
-    {
-      wxRealPoint *point = (wxRealPoint *)node->GetData();
-      delete point;
-      m_originalPoints->Erase(node);
-      node = m_originalPoints->GetFirst();
-    }
-    delete m_originalPoints;
-    m_originalPoints = nullptr;
-  }
+  m_points.clear();
+  m_originalPoints.clear();
 }
 
 
@@ -133,17 +118,13 @@ void wxPolygonShape::CalculateBoundingBox()
   double top = 10000;
   double bottom = -10000;
 
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  while (node)
+  for (const auto& point : m_points)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    if (point->x < left) left = point->x;
-    if (point->x > right) right = point->x;
-
-    if (point->y < top) top = point->y;
-    if (point->y > bottom) bottom = point->y;
+    if (point.x < left) left = point.x;
+    if (point.x > right) right = point.x;
 
-    node = node->GetNext();
+    if (point.y < top) top = point.y;
+    if (point.y > bottom) bottom = point.y;
   }
   m_boundWidth = right - left;
   m_boundHeight = bottom - top;
@@ -161,17 +142,13 @@ void wxPolygonShape::CalculatePolygonCentre()
   double top = 10000;
   double bottom = -10000;
 
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  while (node)
+  for (const auto& point : m_points)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    if (point->x < left) left = point->x;
-    if (point->x > right) right = point->x;
-
-    if (point->y < top) top = point->y;
-    if (point->y > bottom) bottom = point->y;
+    if (point.x < left) left = point.x;
+    if (point.x > right) right = point.x;
 
-    node = node->GetNext();
+    if (point.y < top) top = point.y;
+    if (point.y > bottom) bottom = point.y;
   }
   double bwidth = right - left;
   double bheight = bottom - top;
@@ -179,47 +156,47 @@ void wxPolygonShape::CalculatePolygonCentre()
   double newCentreX = (double)(left + (bwidth/2.0));
   double newCentreY = (double)(top + (bheight/2.0));
 
-  node = m_points->GetFirst();
-  while (node)
+  for (auto& point : m_points)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    point->x -= newCentreX;
-    point->y -= newCentreY;
-    node = node->GetNext();
+    point.x -= newCentreX;
+    point.y -= newCentreY;
   }
   m_xpos += newCentreX;
   m_ypos += newCentreY;
 }
 
-bool PolylineHitTest(double n, double xvec[], double yvec[],
-                           double x1, double y1, double x2, double y2)
+// Check whether the line (x1, y1) -> (x2, y2) crosses the closed polyline of
+// the given points, all offset by (xoffset, yoffset).
+static bool PolylineHitTest(const wxOGLPoints& points,
+                            double xoffset, double yoffset,
+                            double x1, double y1, double x2, double y2)
 {
   bool isAHit = false;
-  int i;
-  double lastx = xvec[0];
-  double lasty = yvec[0];
+  const size_t n = points.size();
+  double firstx = points[0].x + xoffset;
+  double firsty = points[0].y + yoffset;
+  double lastx = firstx;
+  double lasty = firsty;
 
-  double min_ratio = 1.0;
   double line_ratio;
   double other_ratio;
 
-  for (i = 1; i < n; i++)
+  for (size_t i = 1; i < n; i++)
   {
-    oglCheckLineIntersection(x1, y1, x2, y2, lastx, lasty, xvec[i], yvec[i],
+    const double x = points[i].x + xoffset;
+    const double y = points[i].y + yoffset;
+    oglCheckLineIntersection(x1, y1, x2, y2, lastx, lasty, x, y,
                             &line_ratio, &other_ratio);
     if (line_ratio != 1.0)
       isAHit = true;
-    lastx = xvec[i];
-    lasty = yvec[i];
-
-    if (line_ratio < min_ratio)
-      min_ratio = line_ratio;
+    lastx = x;
+    lasty = y;
   }
 
   // Do last (implicit) line if last and first doubles are not identical
-  if (!(xvec[0] == lastx && yvec[0] == lasty))
+  if (!(firstx == lastx && firsty == lasty))
   {
-    oglCheckLineIntersection(x1, y1, x2, y2, lastx, lasty, xvec[0], yvec[0],
+    oglCheckLineIntersection(x1, y1, x2, y2, lastx, lasty, firstx, firsty,
                             &line_ratio, &other_ratio);
     if (line_ratio != 1.0)
       isAHit = true;
@@ -230,6 +207,9 @@ bool PolylineHitTest(double n, double xvec[], double yvec[],
 
 bool wxPolygonShape::HitTest(double x, double y, int *attachment, double *distance)
 {
+  if (m_points.empty())
+    return false;
+
   // Imagine four lines radiating from this point. If all of these lines hit the polygon,
   // we're inside it, otherwise we're not. Obviously we'd need more radiating lines
   // to be sure of correct results for very strange (concave) shapes.
@@ -248,39 +228,18 @@ bool wxPolygonShape::HitTest(double x, double y, int *attachment, double *distan
   endPointsX[3] = (double)(x - 1000.0);
   endPointsY[3] = y;
 
-  // Store polygon points in an array
-  int np = m_points->GetCount();
-  double *xpoints = new double[np];
-  double *ypoints = new double[np];
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  int i = 0;
-  while (node)
-  {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    xpoints[i] = point->x + m_xpos;
-    ypoints[i] = point->y + m_ypos;
-    node = node->GetNext();
-    i ++;
-  }
-
   // We assume it's inside the polygon UNLESS one or more
   // lines don't hit the outline.
   bool isContained = true;
 
   int noPoints = 4;
-  for (i = 0; i < noPoints; i++)
+  int i;
+  for (i = 0; i < noPoints && isContained; i++)
   {
-    if (!PolylineHitTest(np, xpoints, ypoints, x, y, endPointsX[i], endPointsY[i]))
+    if (!PolylineHitTest(m_points, m_xpos, m_ypos,
+                         x, y, endPointsX[i], endPointsY[i]))
       isContained = false;
   }
-/*
-  if (isContained)
-    ClipsErrorFunction("It's a hit!\n");
-  else
-    ClipsErrorFunction("No hit.\n");
-*/
-  delete[] xpoints;
-  delete[] ypoints;
 
   if (!isContained)
     return false;
@@ -320,18 +279,11 @@ void wxPolygonShape::SetSize(double new_width, double new_height, bool WXUNUSED(
   double x_proportion = (double)(fabs(new_width/m_originalWidth));
   double y_proportion = (double)(fabs(new_height/m_originalHeight));
 
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  wxObjectList::compatibility_iterator original_node = m_originalPoints->GetFirst();
-  while (node && original_node)
+  const size_t n = wxMin(m_points.size(), m_originalPoints.size());
+  for (size_t i = 0; i < n; i++)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    wxRealPoint *original_point = (wxRealPoint *)original_node->GetData();
-
-    point->x = (original_point->x * x_proportion);
-    point->y = (original_point->y * y_proportion);
-
-    node = node->GetNext();
-    original_node = original_node->GetNext();
+    m_points[i].x = (m_originalPoints[i].x * x_proportion);
+    m_points[i].y = (m_originalPoints[i].y * y_proportion);
   }
 
 //  CalculateBoundingBox();
@@ -343,27 +295,8 @@ void wxPolygonShape::SetSize(double new_width, double new_height, bool WXUNUSED(
 // Make the original points the same as the working points
 void wxPolygonShape::UpdateOriginalPoints()
 {
-  if (!m_originalPoints) m_originalPoints = new wxList;
-  wxObjectList::compatibility_iterator original_node = m_originalPoints->GetFirst();
-  while (original_node)
-  {
-    wxObjectList::compatibility_iterator next_node = original_node->GetNext();
-    wxRealPoint *original_point = (wxRealPoint *)original_node->GetData();
-    delete original_point;
-    m_originalPoints->Erase(original_node);
-
-    original_node = next_node;
-  }
+  m_originalPoints = m_points;
 
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  while (node)
-  {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    wxRealPoint *original_point = new wxRealPoint(point->x, point->y);
-    m_originalPoints->Append((wxObject*) original_point);
-
-    node = node->GetNext();
-  }
   CalculateBoundingBox();
   m_originalWidth = m_boundWidth;
   m_originalHeight = m_boundHeight;
@@ -371,22 +304,24 @@ void wxPolygonShape::UpdateOriginalPoints()
 
 void wxPolygonShape::AddPolygonPoint(int pos)
 {
-  wxObjectList::compatibility_iterator node = m_points->Item(pos);
-  if (!node) node = m_points->GetFirst();
-  wxRealPoint *firstPoint = (wxRealPoint *)node->GetData();
+  if (m_points.empty())
+    return;
 
-  wxObjectList::compatibility_iterator node2 = m_points->Item(pos + 1);
-  if (!node2) node2 = m_points->GetFirst();
-  wxRealPoint *secondPoint = (wxRealPoint *)node2->GetData();
+  const size_t n = m_points.size();
+  const size_t first = pos >= 0 && size_t(pos) < n ? pos : 0;
+  const size_t second = first + 1 < n ? first + 1 : 0;
 
-  double x = (double)((secondPoint->x - firstPoint->x)/2.0 + firstPoint->x);
-  double y = (double)((secondPoint->y - firstPoint->y)/2.0 + firstPoint->y);
-  wxRealPoint *point = new wxRealPoint(x, y);
+  const wxRealPoint& firstPoint = m_points[first];
+  const wxRealPoint& secondPoint = m_points[second];
 
-  if (pos >= (int) (m_points->GetCount() - 1))
-    m_points->Append((wxObject*) point);
+  double x = (double)((secondPoint.x - firstPoint.x)/2.0 + firstPoint.x);
+  double y = (double)((secondPoint.y - firstPoint.y)/2.0 + firstPoint.y);
+
+  // This may reallocate the points, the control points are recreated below
+  if (second == 0)
+    m_points.push_back(wxRealPoint(x, y));
   else
-    m_points->Insert(node2, (wxObject*) point);
+    m_points.insert(m_points.begin() + second, wxRealPoint(x, y));
 
   UpdateOriginalPoints();
 
@@ -399,12 +334,9 @@ void wxPolygonShape::AddPolygonPoint(int pos)
 
 void wxPolygonShape::DeletePolygonPoint(int pos)
 {
-  wxObjectList::compatibility_iterator node = m_points->Item(pos);
-  if (node)
+  if (pos >= 0 && size_t(pos) < m_points.size())
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    delete point;
-    m_points->Erase(node);
+    m_points.erase(m_points.begin() + pos);
     UpdateOriginalPoints();
     if (m_selected)
     {
@@ -419,7 +351,7 @@ bool wxPolygonShape::GetPerimeterPoint(double x1, double y1,
                                      double x2, double y2,
                                      double *x3, double *y3)
 {
-  int n = m_points->GetCount();
+  const size_t n = m_points.size();
 
   // First check for situation where the line is vertical,
   // and we would want to connect to a point on that vertical --
@@ -429,62 +361,49 @@ bool wxPolygonShape::GetPerimeterPoint(double x1, double y1,
   {
     // Look for the point we'd be connecting to. This is
     // a heuristic...
-    wxObjectList::compatibility_iterator node = m_points->GetFirst();
-    while (node)
+    for (const auto& point : m_points)
     {
-      wxRealPoint *point = (wxRealPoint *)node->GetData();
-      if (point->x == 0.0)
+      if (point.x == 0.0)
       {
-        if ((y2 > y1) && (point->y > 0.0))
+        if ((y2 > y1) && (point.y > 0.0))
         {
-          *x3 = point->x + m_xpos;
-          *y3 = point->y + m_ypos;
+          *x3 = point.x + m_xpos;
+          *y3 = point.y + m_ypos;
           return true;
         }
-        else if ((y2 < y1) && (point->y < 0.0))
+        else if ((y2 < y1) && (point.y < 0.0))
         {
-          *x3 = point->x + m_xpos;
-          *y3 = point->y + m_ypos;
+          *x3 = point.x + m_xpos;
+          *y3 = point.y + m_ypos;
           return true;
         }
       }
-      node = node->GetNext();
     }
   }
 
-  double *xpoints = new double[n];
-  double *ypoints = new double[n];
+  std::vector<double> xpoints(n);
+  std::vector<double> ypoints(n);
 
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  int i = 0;
-  while (node)
+  for (size_t i = 0; i < n; i++)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    xpoints[i] = point->x + m_xpos;
-    ypoints[i] = point->y + m_ypos;
-    node = node->GetNext();
-    i ++;
+    xpoints[i] = m_points[i].x + m_xpos;
+    ypoints[i] = m_points[i].y + m_ypos;
   }
 
-  oglFindEndForPolyline(n, xpoints, ypoints,
+  oglFindEndForPolyline(n, xpoints.data(), ypoints.data(),
                         x1, y1, x2, y2, x3, y3);
 
-  delete[] xpoints;
-  delete[] ypoints;
-
   return true;
 }
 
 void wxPolygonShape::OnDraw(wxDC& dc)
 {
-    int n = m_points->GetCount();
-    wxPoint *intPoints = new wxPoint[n];
-    int i;
-    for (i = 0; i < n; i++)
+    const size_t n = m_points.size();
+    std::vector<wxPoint> intPoints(n);
+    for (size_t i = 0; i < n; i++)
     {
-      wxRealPoint* point = (wxRealPoint*) m_points->Item(i)->GetData();
-      intPoints[i].x = WXROUND(point->x);
-      intPoints[i].y = WXROUND(point->y);
+      intPoints[i].x = WXROUND(m_points[i].x);
+      intPoints[i].y = WXROUND(m_points[i].y);
     }
 
     if (m_shadowMode != SHADOW_NONE)
@@ -493,7 +412,7 @@ void wxPolygonShape::OnDraw(wxDC& dc)
         dc.SetBrush(* m_shadowBrush);
       dc.SetPen(* g_oglTransparentPen);
 
-      dc.DrawPolygon(n, intPoints, WXROUND(m_xpos + m_shadowOffsetX), WXROUND(m_ypos + m_shadowOffsetY));
+      dc.DrawPolygon(n, intPoints.data(), WXROUND(m_xpos + m_shadowOffsetX), WXROUND(m_ypos + m_shadowOffsetY));
     }
 
     if (m_pen)
@@ -505,9 +424,7 @@ void wxPolygonShape::OnDraw(wxDC& dc)
     }
     if (m_brush)
       dc.SetBrush(* m_brush);
-    dc.DrawPolygon(n, intPoints, WXROUND(m_xpos), WXROUND(m_ypos));
-
-    delete[] intPoints;
+    dc.DrawPolygon(n, intPoints.data(), WXROUND(m_xpos), WXROUND(m_ypos));
 }
 
 void wxPolygonShape::OnDrawOutline(wxDC& dc, double x, double y, double w, double h)
@@ -517,48 +434,42 @@ void wxPolygonShape::OnDrawOutline(wxDC& dc, double x, double y, double w, doubl
   double x_proportion = (double)(fabs(w/m_originalWidth));
   double y_proportion = (double)(fabs(h/m_originalHeight));
 
-  int n = m_originalPoints->GetCount();
-  wxPoint *intPoints = new wxPoint[n];
-  int i;
-  for (i = 0; i < n; i++)
+  const size_t n = m_originalPoints.size();
+  std::vector<wxPoint> intPoints(n);
+  for (size_t i = 0; i < n; i++)
   {
-    wxRealPoint* point = (wxRealPoint*) m_originalPoints->Item(i)->GetData();
-    intPoints[i].x = WXROUND(x_proportion * point->x);
-    intPoints[i].y = WXROUND(y_proportion * point->y);
+    intPoints[i].x = WXROUND(x_proportion * m_originalPoints[i].x);
+    intPoints[i].y = WXROUND(y_proportion * m_originalPoints[i].y);
   }
-  dc.DrawPolygon(n, intPoints, WXROUND(x), WXROUND(y));
-  delete[] intPoints;
+  dc.DrawPolygon(n, intPoints.data(), WXROUND(x), WXROUND(y));
 }
 
 // Make as many control points as there are vertices.
 void wxPolygonShape::MakeControlPoints()
 {
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  while (node)
+  for (auto& point : m_points)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
     wxPolygonControlPoint *control = new wxPolygonControlPoint(m_canvas, this, CONTROL_POINT_SIZE,
-      point, point->x, point->y);
+      &point, point.x, point.y);
     m_canvas->AddShape(control);
     m_controlPoints.Append(control);
-    node = node->GetNext();
   }
 }
 
 void wxPolygonShape::ResetControlPoints()
 {
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
   wxObjectList::compatibility_iterator controlPointNode = m_controlPoints.GetFirst();
-  while (node && controlPointNode)
+  for (auto& point : m_points)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
+    if (!controlPointNode)
+      break;
+
     wxPolygonControlPoint *controlPoint = (wxPolygonControlPoint *)controlPointNode->GetData();
 
-    controlPoint->m_xoffset = point->x;
-    controlPoint->m_yoffset = point->y;
-    controlPoint->m_polygonVertex = point;
+    controlPoint->m_xoffset = point.x;
+    controlPoint->m_yoffset = point.y;
+    controlPoint->m_polygonVertex = &point;
 
-    node = node->GetNext();
     controlPointNode = controlPointNode->GetNext();
   }
 }
@@ -572,27 +483,8 @@ void wxPolygonShape::Copy(wxShape& copy)
 
   wxPolygonShape& polyCopy = (wxPolygonShape&) copy;
 
-  polyCopy.ClearPoints();
-
-  polyCopy.m_points = new wxList;
-  polyCopy.m_originalPoints = new wxList;
-
-  wxObjectList::compatibility_iterator node = m_points->GetFirst();
-  while (node)
-  {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    wxRealPoint *new_point = new wxRealPoint(point->x, point->y);
-    polyCopy.m_points->Append((wxObject*) new_point);
-    node = node->GetNext();
-  }
-  node = m_originalPoints->GetFirst();
-  while (node)
-  {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    wxRealPoint *new_point = new wxRealPoint(point->x, point->y);
-    polyCopy.m_originalPoints->Append((wxObject*) new_point);
-    node = node->GetNext();
-  }
+  polyCopy.m_points = m_points;
+  polyCopy.m_originalPoints = m_originalPoints;
   polyCopy.m_boundWidth = m_boundWidth;
   polyCopy.m_boundHeight = m_boundHeight;
   polyCopy.m_originalWidth = m_originalWidth;
@@ -601,7 +493,7 @@ void wxPolygonShape::Copy(wxShape& copy)
 
 int wxPolygonShape::GetNumberOfAttachments() const
 {
-  int maxN = (m_points ? (m_points->GetCount() - 1) : 0);
+  int maxN = (!m_points.empty() ? (int(m_points.size()) - 1) : 0);
   wxObjectList::compatibility_iterator node = m_attachmentPoints.GetFirst();
   while (node)
   {
@@ -616,11 +508,11 @@ int wxPolygonShape::GetNumberOfAttachments() const
 bool wxPolygonShape::GetAttachmentPosition(int attachment, double *x, double *y,
                                          int nth, int no_arcs, wxLineShape *line)
 {
-  if ((m_attachmentMode == ATTACHMENT_MODE_EDGE) && m_points && attachment < (int) m_points->GetCount())
+  if ((m_attachmentMode == ATTACHMENT_MODE_EDGE) && attachment >= 0 && attachment < (int) m_points.size())
   {
-    wxRealPoint *point = (wxRealPoint *)m_points->Item(attachment)->GetData();
-    *x = point->x + m_xpos;
-    *y = point->y + m_ypos;
+    const wxRealPoint& point = m_points[attachment];
+    *x = point.x + m_xpos;
+    *y = point.y + m_ypos;
     return true;
   }
   else
@@ -629,10 +521,10 @@ bool wxPolygonShape::GetAttachmentPosition(int attachment, double *x, double *y,
 
 bool wxPolygonShape::AttachmentIsValid(int attachment) const
 {
-  if (!m_points)
+  if (m_points.empty())
     return false;
 
-  if ((attachment >= 0) && (attachment < (int) m_points->GetCount()))
+  if ((attachment >= 0) && (attachment < (int) m_points.size()))
     return true;
 
   wxObjectList::compatibility_iterator node = m_attachmentPoints.GetFirst();
@@ -665,25 +557,19 @@ void wxPolygonShape::Rotate(double x, double y, double theta)
         node = node->GetNext();
     }
 
-    node = m_points->GetFirst();
-    while (node)
+    for (auto& point : m_points)
     {
-        wxRealPoint *point = (wxRealPoint *)node->GetData();
-        double x1 = point->x;
-        double y1 = point->y;
-        point->x = x1*cosTheta - y1*sinTheta + x*(1.0 - cosTheta) + y*sinTheta;
-        point->y = x1*sinTheta + y1*cosTheta + y*(1.0 - cosTheta) + x*sinTheta;
-        node = node->GetNext();
+        double x1 = point.x;
+        double y1 = point.y;
+        point.x = x1*cosTheta - y1*sinTheta + x*(1.0 - cosTheta) + y*sinTheta;
+        point.y = x1*sinTheta + y1*cosTheta + y*(1.0 - cosTheta) + x*sinTheta;
     }
-    node = m_originalPoints->GetFirst();
-    while (node)
+    for (auto& point : m_originalPoints)
     {
-        wxRealPoint *point = (wxRealPoint *)node->GetData();
-        double x1 = point->x;
-        double y1 = point->y;
-        point->x = x1*cosTheta - y1*sinTheta + x*(1.0 - cosTheta) + y*sinTheta;
-        point->y = x1*sinTheta + y1*cosTheta + y*(1.0 - cosTheta) + x*sinTheta;
-        node = node->GetNext();
+        double x1 = point.x;
+        double y1 = point.y;
+        point.x = x1*cosTheta - y1*sinTheta + x*(1.0 - cosTheta) + y*sinTheta;
+        point.y = x1*sinTheta + y1*cosTheta + y*(1.0 - cosTheta) + x*sinTheta;
     }
 
     m_rotation = theta;
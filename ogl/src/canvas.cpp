@@ -58,8 +58,7 @@ wxShapeCanvas::wxShapeCanvas(wxWindow *parent, wxWindowID id,
                              const wxPoint& pos,
                              const wxSize& size,
                              long style,
-                             const wxString& name):
-  wxScrolledWindow(parent, id, pos, size, style, name)
+                             const wxString& name)
 {
   m_shapeDiagram = nullptr;
   m_dragState = NoDragging;
@@ -70,6 +69,11 @@ wxShapeCanvas::wxShapeCanvas(wxWindow *parent, wxWindowID id,
   m_firstDragY = 0;
   m_checkTolerance = true;
 
+  // Without a parent the window isn't created, the canvas can then only be
+  // used for measuring its shapes off screen.
+  if (parent)
+    wxScrolledWindow::Create(parent, id, pos, size, style, name);
+
   SetBackgroundColour(wxSystemSettings::GetColour(wxSYS_COLOUR_LISTBOX));
 }
 
@@ -183,16 +183,13 @@ void wxLineShape::FormatText(wxReadOnlyDC& dc, const wxString& s, int i)
     region->SetSize(w, h);
   }
 
-  wxStringList *string_list = oglFormatText(dc, s, (w-5), (h-5), region->GetFormatMode());
-  auto stringNode = string_list->GetFirst();
-  while (stringNode)
+  wxOGLTextLines lines;
+  oglFormatText(dc, s, (w-5), (h-5), region->GetFormatMode(), lines);
+  for (size_t j = 0; j < lines.size(); j++)
   {
-    const wxString& t = stringNode->GetData();
-    wxShapeTextLine *line = new wxShapeTextLine(0.0, 0.0, t);
+    wxShapeTextLine *line = new wxShapeTextLine(0.0, 0.0, lines[j]);
     region->GetFormattedText().Append((wxObject *)line);
-    stringNode = stringNode->GetNext();
   }
-  delete string_list;
   double actualW = w;
   double actualH = h;
   if (region->GetFormatMode() & FORMAT_SIZE_TO_CONTENTS)
@@ -27,11 +27,13 @@
 #endif
 
 #include <ctype.h>
+#include <float.h>
 #include <math.h>
 #include <stdlib.h>
 
 #include "wx/ogl/ogl.h"
 
+#include <unordered_map>
 #include <vector>
 
 wxFont*         g_oglNormalFont;
@@ -68,6 +70,8 @@ void wxOGLInitialize()
 
 void wxOGLCleanUp()
 {
+    oglClearFormatCache();
+
     if (oglBuffer)
     {
         delete[] oglBuffer;
@@ -370,14 +374,43 @@ void oglGetCentredTextExtent(wxReadOnlyDC& dc, wxList *text_list,
   *actual_width = max_width;
 }
 
-// Format a string to a list of strings that fit in the given box.
-// Interpret %n and 10 or 13 as a new line.
-wxStringList *oglFormatText(wxReadOnlyDC& dc, const wxString& text, double width, double WXUNUSED(height), int formatMode)
+// The line breaks found by oglFormatText for a text in a given font.
+// Wrapping only compares the extents of the candidate lines with the width
+// of the box, so the same breaks are found for any width from the widest
+// line found fitting (m_minWidth) up to the narrowest found not fitting
+// (m_maxWidth, excluded). This means that resizing a shape only measures
+// the words again when a line break actually moves.
+struct wxOGLFormattedText
 {
-  // First, parse the string into a list of words
-  wxStringList word_list;
+  wxFont m_font;
+  wxSize m_ppi;
+  double m_scaleX;
+  double m_scaleY;
+  int m_formatMode;
+  double m_minWidth;
+  double m_maxWidth;
+  wxOGLTextLines m_lines;
+};
+
+typedef std::unordered_map<wxString, std::vector<wxOGLFormattedText>,
+                           wxStringHash, wxStringEqual> wxOGLFormatCache;
+
+static wxOGLFormatCache oglFormatCache;
+
+// The cache is emptied when it holds this many texts, and only the most
+// recent formattings of each text are kept.
+static const size_t oglFormatCacheTexts = 1024;
+static const size_t oglFormatCacheWidths = 8;
 
-  // Make new lines into empty strings at this point
+void oglClearFormatCache()
+{
+  oglFormatCache.clear();
+}
+
+// Split the text into words, with an empty string for each new line.
+// Interpret %n and 10 or 13 as a new line.
+static void oglSplitWords(const wxString& text, std::vector<wxString>& words)
+{
   wxString::const_iterator i = text.begin(), end = text.end();
   wxString word;
   bool end_word = false; bool new_line = false;
@@ -426,34 +459,37 @@ wxStringList *oglFormatText(wxReadOnlyDC& dc, const wxString& text, double width
     if (i == end) end_word = true;
     if (end_word)
     {
-      word_list.Add(word);
+      words.push_back(word);
       word.clear();
       end_word = false;
     }
     if (new_line)
     {
-      word_list.Append(nullptr);
+      words.push_back(wxEmptyString);
       new_line = false;
     }
   }
+}
 
-  // Now, make a list of strings which can fit in the box
-  wxStringList *string_list = new wxStringList;
-
+// Wrap the words to the width, recording the range of widths giving the
+// same lines in the formatted text.
+static void oglWrapWords(wxReadOnlyDC& dc, const std::vector<wxString>& words,
+                         double width, wxOGLFormattedText& formatted)
+{
+  wxOGLTextLines& lines = formatted.m_lines;
   wxString buffer;
-  wxStringList::compatibility_iterator node = word_list.GetFirst();
   wxCoord x, y;
 
-  while (node)
+  for (size_t i = 0; i < words.size(); i++)
   {
     wxString oldBuffer(buffer);
 
-    wxString s = node->GetData();
+    const wxString& s = words[i];
     if (s.empty())
     {
       // FORCE NEW LINE
       if (buffer.Length() > 0)
-        string_list->Add(buffer);
+        lines.push_back(buffer);
 
       buffer.Empty();
     }
@@ -466,21 +502,87 @@ wxStringList *oglFormatText(wxReadOnlyDC& dc, const wxString& text, double width
       dc.GetTextExtent(buffer, &x, &y);
 
       // Don't fit within the bounding box if we're fitting shape to contents
-      if ((x > width) && !(formatMode & FORMAT_SIZE_TO_CONTENTS))
+      if (formatted.m_formatMode & FORMAT_SIZE_TO_CONTENTS)
+        continue;
+
+      if (x > width)
       {
+        if (x < formatted.m_maxWidth)
+          formatted.m_maxWidth = x;
+
         // Deal with first word being wider than box
         if (oldBuffer.Length() > 0)
-          string_list->Add(oldBuffer);
+          lines.push_back(oldBuffer);
 
         buffer.Empty();
         buffer += s;
       }
+      else if (x > formatted.m_minWidth)
+        formatted.m_minWidth = x;
     }
-
-    node = node->GetNext();
   }
   if (buffer.Length() != 0)
-    string_list->Add(buffer);
+    lines.push_back(buffer);
+}
+
+// Break a string into the lines that fit in the given box, reusing the
+// lines found for the same text, font and format mode when they are still
+// valid for the width.
+void oglFormatText(wxReadOnlyDC& dc, const wxString& text, double width, double WXUNUSED(height), int formatMode, wxOGLTextLines& lines)
+{
+  const wxFont font = dc.GetFont();
+  const wxSize ppi = dc.GetPPI();
+  double scaleX, scaleY;
+  dc.GetUserScale(&scaleX, &scaleY);
+
+  std::vector<wxOGLFormattedText>& entries = oglFormatCache[text];
+
+  for (size_t i = 0; i < entries.size(); i++)
+  {
+    const wxOGLFormattedText& entry = entries[i];
+    if (entry.m_formatMode == formatMode && entry.m_ppi == ppi &&
+        entry.m_scaleX == scaleX && entry.m_scaleY == scaleY &&
+        width >= entry.m_minWidth && width < entry.m_maxWidth &&
+        entry.m_font == font)
+    {
+      lines = entry.m_lines;
+      return;
+    }
+  }
+
+  wxOGLFormattedText formatted;
+  formatted.m_font = font;
+  formatted.m_ppi = ppi;
+  formatted.m_scaleX = scaleX;
+  formatted.m_scaleY = scaleY;
+  formatted.m_formatMode = formatMode;
+  formatted.m_minWidth = -DBL_MAX;
+  formatted.m_maxWidth = DBL_MAX;
+
+  std::vector<wxString> words;
+  oglSplitWords(text, words);
+  oglWrapWords(dc, words, width, formatted);
+
+  lines = formatted.m_lines;
+
+  if (entries.size() >= oglFormatCacheWidths)
+    entries.erase(entries.begin());
+  entries.push_back(formatted);
+
+  if (oglFormatCache.size() > oglFormatCacheTexts)
+    oglFormatCache.clear();
+}
+
+// Format a string to a list of strings that fit in the given box.
+// Interpret %n and 10 or 13 as a new line.
+wxStringList *oglFormatText(wxReadOnlyDC& dc, const wxString& text, double width, double height, int formatMode)
+{
+  wxOGLTextLines lines;
+  oglFormatText(dc, text, width, height, formatMode, lines);
+
+  wxStringList *string_list = new wxStringList;
+  for (size_t i = 0; i < lines.size(); i++)
+    string_list->Add(lines[i]);
 
   return string_list;
 }
@@ -521,22 +623,34 @@ void oglDrawFormattedText(wxDC& dc, wxList *text_list,
  *
  */
 
-void oglFindPolylineCentroid(wxList *points, double *x, double *y)
+void oglFindPolylineCentroid(const wxOGLPoints& points, double *x, double *y)
 {
   double xcount = 0;
   double ycount = 0;
 
+  for (const auto& point : points)
+  {
+    xcount += point.x;
+    ycount += point.y;
+  }
+
+  *x = (xcount/points.size());
+  *y = (ycount/points.size());
+}
+
+void oglFindPolylineCentroid(wxList *points, double *x, double *y)
+{
+  wxOGLPoints copy;
+  copy.reserve(points->GetCount());
+
   wxObjectList::compatibility_iterator node = points->GetFirst();
   while (node)
   {
-    wxRealPoint *point = (wxRealPoint *)node->GetData();
-    xcount += point->x;
-    ycount += point->y;
+    copy.push_back(*(wxRealPoint *)node->GetData());
     node = node->GetNext();
   }
 
-  *x = (xcount/points->GetCount());
-  *y = (ycount/points->GetCount());
+  oglFindPolylineCentroid(copy, x, y);
 }
 
 /*
@@ -0,0 +1,739 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        graphbench.cpp
+// Purpose:     Benchmarks for the graph editor
+// Author:      Mike Wetherell
+// Modified by:
+// Created:     October 2026
+// RCS-ID:      $Id$
+// Copyright:   (c) TT-solutions
+// Licence:     wxWindows licence
+/////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @file graphbench.cpp
+ * @brief Benchmarks timing the graph operations on synthetic graphs.
+ *
+ * The program generates graphs of the requested shapes and sizes, times the
+ * main Graph operations on them and writes the results as CSV, one line per
+ * operation, to the standard output or to the file given by @c --output:
+ *
+ * @code
+ *  generator,nodes,edges,operation,count,seconds
+ *  dag,1000,1987,build,1,0.012345
+ * @endcode
+ *
+ * @c count is the number of calls timed together and @c seconds the best
+ * time over the repetitions. The graphs are headless, measured with a
+ * GraphMetrics rather than a window, and drawn into a memory DC.
+ *
+ * With @c --check the program instead runs a few checks of the behaviour
+ * of the graph operations and exits with a failure status if any of them
+ * doesn't pass.
+ */
+
+// For compilers that support precompilation, includes "wx/wx.h".
+#include <wx/wxprec.h>
+
+#ifdef __BORLANDC__
+    #pragma hdrstop
+#endif
+
+// for all others, include the necessary headers
+#ifndef WX_PRECOMP
+    #include <wx/wx.h>
+#endif
+
+#include <wx/cmdline.h>
+#include <wx/mstream.h>
+#include <wx/txtstrm.h>
+#include <wx/wfstream.h>
+#include <wx/tokenzr.h>
+#include <wx/ogl/ogl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "archive.h"
+#include "testnodes.h"
+
+using datactics::ProjectNode;
+
+using namespace tt_solutions;
+using namespace std;
+
+namespace {
+
+// ----------------------------------------------------------------------------
+// Graph generators
+// ----------------------------------------------------------------------------
+
+/// The shape of a generated graph, its edges are pairs of node indices.
+struct Shape
+{
+    size_t nodes;
+    vector<pair<size_t, size_t>> edges;
+};
+
+/// Each node gets one to three edges from random earlier nodes.
+Shape MakeDag(size_t count, mt19937& rng)
+{
+    Shape shape = { count, {} };
+
+    for (size_t i = 1; i < count; i++) {
+        uniform_int_distribution<size_t> parent(0, i - 1);
+        size_t n = 1 + rng() % 3;
+
+        for (size_t j = 0; j < n; j++)
+            shape.edges.push_back(make_pair(parent(rng), i));
+    }
+
+    return shape;
+}
+
+/// A square lattice with edges going right and down.
+Shape MakeGrid(size_t count, mt19937&)
+{
+    size_t side = max<size_t>(1, size_t(sqrt(double(count))));
+    Shape shape = { side * side, {} };
+
+    for (size_t i = 0; i < shape.nodes; i++) {
+        if ((i + 1) % side)
+            shape.edges.push_back(make_pair(i, i + 1));
+        if (i + side < shape.nodes)
+            shape.edges.push_back(make_pair(i, i + side));
+    }
+
+    return shape;
+}
+
+/**
+ * Preferential attachment: each new node is connected to two of the
+ * existing nodes chosen with a probability proportional to their degree,
+ * giving a few hubs with many edges.
+ */
+Shape MakeHubs(size_t count, mt19937& rng)
+{
+    Shape shape = { count, {} };
+    vector<size_t> ends;
+
+    for (size_t i = 1; i < count; i++) {
+        for (int j = 0; j < 2; j++) {
+            size_t target = 0;
+            if (!ends.empty()) {
+                uniform_int_distribution<size_t> pick(0, ends.size() - 1);
+                target = ends[pick(rng)];
+            }
+
+            shape.edges.push_back(make_pair(target, i));
+            ends.push_back(target);
+            ends.push_back(i);
+        }
+    }
+
+    return shape;
+}
+
+typedef Shape (*Generator)(size_t count, mt19937& rng);
+
+const struct
+{
+    const wxChar *name;
+    Generator make;
+}
+generators[] = {
+    { _T("dag"),  MakeDag  },
+    { _T("grid"), MakeGrid },
+    { _T("hubs"), MakeHubs },
+};
+
+/// Create the n-th node, alternating the test node classes.
+GraphNode *MakeNode(size_t n)
+{
+    switch (n % 4) {
+        case 0:  return new SearchNode;
+        case 1:  return new SortNode;
+        case 2:  return new MergeNode;
+        default: break;
+    }
+
+    return new ProjectNode(_T("Operation"),
+                           wxString::Format(_T("Result %lu"),
+                                            static_cast<unsigned long>(n)));
+}
+
+// ----------------------------------------------------------------------------
+// Checks
+// ----------------------------------------------------------------------------
+
+/// Vetoes Graph::AddBatch() and lets the other events through.
+class BatchVetoHandler : public wxEvtHandler
+{
+public:
+    bool ProcessEvent(wxEvent& event) override
+    {
+        if (event.GetEventType() == Evt_Graph_Batch_Add) {
+            static_cast<GraphEvent&>(event).Veto();
+            return true;
+        }
+
+        return wxEvtHandler::ProcessEvent(event);
+    }
+};
+
+/**
+ * A vetoed AddBatch() must add nothing, including the edges between the
+ * nodes which were already in the graph.
+ */
+bool CheckBatchVeto()
+{
+    BatchVetoHandler handler;
+    Graph graph;
+    graph.SetEventHandler(&handler);
+
+    GraphNode *a = graph.Add(MakeNode(0));
+    GraphNode *b = graph.Add(MakeNode(1));
+    if (!a || !b)
+        return false;
+
+    vector<GraphNode*> nodes;
+    nodes.push_back(MakeNode(2));
+
+    vector<Graph::EdgeSpec> edges;
+    Graph::EdgeSpec existing = { a, b, NULL };
+    Graph::EdgeSpec added = { a, nodes[0], new GraphEdge };
+    edges.push_back(existing);
+    edges.push_back(added);
+
+    const bool ok = !graph.AddBatch(nodes, edges, false) &&
+                    graph.GetNodeCount() == 2 &&
+                    graph.GetElementCount() == 2 &&
+                    !graph.AreConnected(*a, *b);
+
+    graph.SetEventHandler(NULL);
+    return ok;
+}
+
+/// Removes the first node from the sources of the batch events.
+class BatchRefuseHandler : public wxEvtHandler
+{
+public:
+    bool ProcessEvent(wxEvent& event) override
+    {
+        const wxEventType type = event.GetEventType();
+
+        if (type == Evt_Graph_Batch_Add || type == Evt_Graph_Batch_Delete) {
+            GraphEvent::NodeList& sources =
+                static_cast<GraphEvent&>(event).GetSources();
+            if (!sources.empty())
+                sources.pop_front();
+            return true;
+        }
+
+        return wxEvtHandler::ProcessEvent(event);
+    }
+};
+
+/**
+ * A node removed from the sources of AddBatch() must not be added, nor any
+ * of the edges to it, while the rest of the batch is.
+ */
+bool CheckBatchRefuse()
+{
+    BatchRefuseHandler handler;
+    Graph graph;
+    graph.SetEventHandler(&handler);
+
+    GraphNode *a = graph.Add(MakeNode(0));
+    if (!a)
+        return false;
+
+    vector<GraphNode*> nodes;
+    nodes.push_back(MakeNode(1));
+    nodes.push_back(MakeNode(2));
+    GraphNode *refused = nodes[0];
+    GraphNode *b = nodes[1];
+
+    vector<Graph::EdgeSpec> edges;
+    Graph::EdgeSpec toRefused = { a, refused, new GraphEdge };
+    Graph::EdgeSpec fromRefused = { refused, b, new GraphEdge };
+    Graph::EdgeSpec added = { a, b, NULL };
+    edges.push_back(toRefused);
+    edges.push_back(fromRefused);
+    edges.push_back(added);
+
+    const bool ok = graph.AddBatch(nodes, edges, false) &&
+                    graph.GetNodeCount() == 2 &&
+                    graph.GetElementCount() == 3 &&
+                    graph.AreConnected(*a, *b);
+
+    graph.SetEventHandler(NULL);
+    return ok;
+}
+
+/**
+ * Clear() deletes the selection as a batch, and a node removed from the
+ * sources of its event must be kept, while the edges to the deleted nodes
+ * are not.
+ */
+bool CheckClearRefuse()
+{
+    BatchRefuseHandler handler;
+    Graph graph;
+    graph.SetEventHandler(&handler);
+
+    GraphNode *a = graph.Add(MakeNode(0));
+    GraphNode *b = graph.Add(MakeNode(1));
+    GraphNode *c = graph.Add(MakeNode(2));
+    if (!a || !b || !c || !graph.Add(*a, *b) || !graph.Add(*b, *c))
+        return false;
+
+    graph.SelectAll();
+    graph.Clear();
+
+    const bool ok = graph.GetNodeCount() == 1 &&
+                    graph.GetElementCount() == 1;
+
+    graph.SetEventHandler(NULL);
+    return ok;
+}
+
+/**
+ * Points, rectangles and integers are stored as typed values, which the
+ * binary format keeps as they are, while the XML format has their text.
+ */
+bool CheckArchiveValues()
+{
+    const wxPoint pt(3, -7);
+    const wxRect rc(-1, 2, 30, 40);
+    const int n = -123456;
+
+    Archive archive;
+    Archive::Item *item = archive.Put(_T("value"), _T("v1"));
+    item->Put(_T("pt"), pt);
+    item->Put(_T("rc"), rc);
+    item->Put(_T("n"), n);
+
+    if (item->Get(_T("pt")) != _T("3,-7") ||
+            item->GetValue(_T("rc"))->GetType() != Archive::Value::Type_Ints)
+        return false;
+
+    for (Archive::Format format : { Archive::Format_Binary,
+                                    Archive::Format_Xml }) {
+        wxMemoryOutputStream out;
+        if (!archive.Save(out, format))
+            return false;
+
+        wxMemoryInputStream in(out);
+        Archive loaded;
+        if (!loaded.Load(in))
+            return false;
+
+        const Archive::Item *copy = loaded.Get(_T("v1"));
+        if (!copy ||
+                copy->Get<wxPoint>(_T("pt")) != pt ||
+                copy->Get<wxRect>(_T("rc")) != rc ||
+                copy->Get<int>(_T("n")) != n ||
+                copy->Get(_T("rc")) != _T("-1,2,30,40"))
+            return false;
+
+        const bool typed = copy->GetValue(_T("pt"))->GetType() ==
+                           Archive::Value::Type_Ints;
+        if (typed != (format == Archive::Format_Binary))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * A binary archive with a string length much longer than the data must
+ * fail to load rather than try to allocate the length.
+ */
+bool CheckArchiveCorrupt()
+{
+    // Signature, version 1, no flags, one string 2^40 bytes long.
+    const char data[] = "\x89GEA\x01\x00\x01\x80\x80\x80\x80\x80\x20" "abc";
+
+    wxMemoryInputStream in(data, sizeof(data) - 1);
+    Archive archive;
+    wxLogNull nolog;
+
+    return !archive.Load(in);
+}
+
+/**
+ * Resizing a node with its sizing handles must be undoable, including the
+ * move of the centre when the opposite corner is kept in place.
+ */
+bool CheckResizeUndo()
+{
+    // the frame is never shown, the control only provides the canvas
+    wxFrame *frame = new wxFrame(NULL, wxID_ANY, _T("graphbench"));
+    GraphCtrl *ctrl = new GraphCtrl(frame);
+    Graph graph;
+    ctrl->SetGraph(&graph);
+
+    GraphNode *node = graph.Add(MakeNode(0), wxPoint(100, 100));
+    bool ok = node != NULL;
+
+    if (ok) {
+        const wxPoint pos = node->GetPosition();
+        const wxSize size = node->GetSize();
+        wxShape *shape = node->GetShape();
+
+        // as if the bottom right handle was dragged by (40, 20)
+        wxControlPoint handle(shape->GetCanvas(), shape, CONTROL_POINT_SIZE,
+                              size.x / 2.0, size.y / 2.0,
+                              CONTROL_POINT_DIAGONAL);
+        wxControlPoint::sm_controlPointDragEndWidth = size.x + 40;
+        wxControlPoint::sm_controlPointDragEndHeight = size.y + 20;
+        wxControlPoint::sm_controlPointDragPosX = pos.x + 20;
+        wxControlPoint::sm_controlPointDragPosY = pos.y + 10;
+
+        shape->GetEventHandler()->OnSizingEndDragLeft(
+            &handle, pos.x + size.x / 2.0 + 40, pos.y + size.y / 2.0 + 20);
+
+        ok = node->GetSize() != size && graph.CanUndo();
+        graph.Undo();
+        ok = ok && node->GetSize() == size && node->GetPosition() == pos;
+    }
+
+    ctrl->SetGraph(NULL);
+    frame->Destroy();
+    return ok;
+}
+
+/// The checks run by @c --check.
+const struct
+{
+    const wxChar *name;
+    bool (*run)();
+}
+checks[] = {
+    { _T("batch-veto"),      CheckBatchVeto      },
+    { _T("batch-refuse"),    CheckBatchRefuse    },
+    { _T("clear-refuse"),    CheckClearRefuse    },
+    { _T("archive-values"),  CheckArchiveValues  },
+    { _T("archive-corrupt"), CheckArchiveCorrupt },
+    { _T("resize-undo"),     CheckResizeUndo     },
+};
+
+// ----------------------------------------------------------------------------
+// Benchmark
+// ----------------------------------------------------------------------------
+
+/**
+ * Times the operations on one generated graph.
+ *
+ * Run() does all the operations once, keeping the best time of each over
+ * the calls, Write() outputs them.
+ */
+class Benchmark
+{
+public:
+    Benchmark(const wxString& generator,
+              const Shape& shape,
+              bool layout)
+      : m_generator(generator),
+        m_shape(shape),
+        m_layout(layout)
+    { }
+
+    Benchmark(const Benchmark&) = delete;
+    Benchmark(Benchmark&&) = delete;
+    Benchmark& operator=(const Benchmark&) = delete;
+    Benchmark& operator=(Benchmark&&) = delete;
+
+    void Run(mt19937& rng);
+    void Write(wxTextOutputStream& out) const;
+
+private:
+    /// Call @a func, recording the time taken for @a count operations.
+    void Time(const wxString& operation,
+              size_t count,
+              const function<void()>& func);
+
+    struct Result
+    {
+        size_t count;
+        double seconds;
+    };
+
+    wxString m_generator;
+    const Shape& m_shape;
+    bool m_layout;
+
+    vector<wxString> m_order;           ///< Operations in the order run.
+    map<wxString, Result> m_results;
+};
+
+void Benchmark::Time(const wxString& operation,
+                     size_t count,
+                     const function<void()>& func)
+{
+    auto start = chrono::steady_clock::now();
+    func();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    auto it = m_results.find(operation);
+
+    if (it == m_results.end()) {
+        Result result = { count, elapsed.count() };
+        m_results[operation] = result;
+        m_order.push_back(operation);
+    }
+    else if (elapsed.count() < it->second.seconds) {
+        it->second.seconds = elapsed.count();
+    }
+}
+
+void Benchmark::Run(mt19937& rng)
+{
+    unique_ptr<Graph> graph(new Graph(NULL, new GraphMetrics));
+
+    // the nodes are created outside of the timing, as the test nodes load
+    // their icons from files
+    vector<GraphNode*> nodes;
+    for (size_t i = 0; i < m_shape.nodes; i++)
+        nodes.push_back(MakeNode(i));
+
+    vector<Graph::EdgeSpec> edges;
+    for (const auto& edge : m_shape.edges) {
+        Graph::EdgeSpec spec = { nodes[edge.first], nodes[edge.second], NULL };
+        edges.push_back(spec);
+    }
+
+    Time(_T("build"), 1, [&] { graph->AddBatch(nodes, edges, false); });
+
+    // spread the nodes out so that the other operations don't all work on
+    // a single pile, the layout below moves them again
+    {
+        GraphUpdateLocker noUpdates(*graph);
+        wxSize spacing = nodes.empty() ? wxSize() : nodes[0]->GetSize() * 2;
+        spacing.IncTo(wxSize(1, 1));
+        vector<wxPoint> spaces =
+            graph->FindSpaces(nodes.size(), wxPoint(), spacing);
+        for (size_t i = 0; i < nodes.size(); i++)
+            nodes[i]->SetPosition(spaces[i]);
+    }
+
+    if (m_layout)
+        Time(_T("layout"), 1, [&] { graph->LayoutAll(); });
+
+    const wxRect bounds = graph->GetBounds();
+
+    constexpr size_t HIT_TESTS = 10000;
+    vector<wxPoint> points;
+    uniform_int_distribution<int> x(bounds.x, bounds.GetRight());
+    uniform_int_distribution<int> y(bounds.y, bounds.GetBottom());
+    for (size_t i = 0; i < HIT_TESTS; i++)
+        points.push_back(wxPoint(x(rng), y(rng)));
+
+    Time(_T("hittest"), HIT_TESTS, [&] {
+        for (const auto& pt : points)
+            graph->HitTest(pt);
+    });
+
+    constexpr size_t FIND_SPACES = 100;
+    Time(_T("findspace"), FIND_SPACES, [&] {
+        for (size_t i = 0; i < FIND_SPACES; i++)
+            graph->FindSpace(wxSize(100, 50));
+    });
+
+    // the whole graph is drawn scaled down to fit the bitmap
+    wxBitmap bitmap(1024, 768);
+    Time(_T("redraw"), 1, [&] {
+        wxMemoryDC dc(bitmap);
+        dc.SetBackground(*wxWHITE_BRUSH);
+        dc.Clear();
+        double scale = min(1.0, min(double(bitmap.GetWidth()) / bounds.width,
+                                    double(bitmap.GetHeight()) /
+                                        bounds.height));
+        dc.SetUserScale(scale, scale);
+        dc.SetLogicalOrigin(bounds.x, bounds.y);
+        graph->Draw(&dc, bounds);
+    });
+
+    wxMemoryOutputStream xml, binary;
+
+    Time(_T("serialise-xml"), 1, [&] { graph->Serialise(xml); });
+    Time(_T("serialise-binary"), 1, [&] {
+        graph->Serialise(binary, Graph::iterator_pair(),
+                         Archive::Format_Binary);
+    });
+
+    // deserialising replaces the graph, so it is done last
+    wxMemoryInputStream inxml(xml);
+    Time(_T("deserialise-xml"), 1, [&] { graph->Deserialise(inxml); });
+
+    wxMemoryInputStream inbinary(binary);
+    Time(_T("deserialise-binary"), 1, [&] { graph->Deserialise(inbinary); });
+}
+
+void Benchmark::Write(wxTextOutputStream& out) const
+{
+    for (const auto& operation : m_order) {
+        const Result& result = m_results.find(operation)->second;
+
+        out << m_generator << _T(",")
+            << m_shape.nodes << _T(",")
+            << m_shape.edges.size() << _T(",")
+            << operation << _T(",")
+            << result.count << _T(",")
+            << wxString::Format(_T("%.6f"), result.seconds) << endl;
+    }
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------------
+// The application
+// ----------------------------------------------------------------------------
+
+/**
+ * Runs the benchmarks from OnRun() instead of a main loop.
+ */
+class BenchApp : public wxApp
+{
+public:
+    BenchApp() : m_repeat(3), m_seed(1), m_layout(true), m_check(false) { }
+
+    void OnInitCmdLine(wxCmdLineParser& parser) override;
+    bool OnCmdLineParsed(wxCmdLineParser& parser) override;
+    int OnRun() override;
+
+private:
+    vector<size_t> m_sizes;
+    vector<size_t> m_generators;    ///< Indices into generators[].
+    long m_repeat;
+    long m_seed;
+    bool m_layout;
+    bool m_check;
+    wxString m_output;
+};
+
+// the report is written to stdout, so use main() and a console subsystem
+wxIMPLEMENT_APP_CONSOLE(BenchApp);
+
+void BenchApp::OnInitCmdLine(wxCmdLineParser& parser)
+{
+    wxApp::OnInitCmdLine(parser);
+
+    parser.AddOption(_T("g"), _T("generator"),
+                     _T("comma separated list of dag, grid and hubs"));
+    parser.AddOption(_T("n"), _T("nodes"),
+                     _T("comma separated list of the graph sizes"));
+    parser.AddOption(_T("r"), _T("repeat"),
+                     _T("number of runs to keep the best time of"),
+                     wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption(_T("s"), _T("seed"),
+                     _T("seed of the random graphs"),
+                     wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption(_T("o"), _T("output"),
+                     _T("write the results to this file"));
+    parser.AddSwitch(_T(""), _T("no-layout"),
+                     _T("don't time the graphviz layout"));
+    parser.AddSwitch(_T(""), _T("check"),
+                     _T("run the checks instead of the benchmarks"));
+}
+
+bool BenchApp::OnCmdLineParsed(wxCmdLineParser& parser)
+{
+    if (!wxApp::OnCmdLineParsed(parser))
+        return false;
+
+    wxString value = _T("dag,grid,hubs");
+    parser.Found(_T("generator"), &value);
+
+    for (const auto& name : wxStringTokenize(value, _T(","))) {
+        size_t i = 0;
+        while (i < WXSIZEOF(generators) && name != generators[i].name)
+            i++;
+
+        if (i == WXSIZEOF(generators)) {
+            wxLogError(_T("Unknown generator '%s'."), name.c_str());
+            return false;
+        }
+
+        m_generators.push_back(i);
+    }
+
+    value = _T("100,1000,10000");
+    parser.Found(_T("nodes"), &value);
+
+    for (const auto& size : wxStringTokenize(value, _T(","))) {
+        unsigned long n;
+        if (!size.ToULong(&n) || !n) {
+            wxLogError(_T("Invalid graph size '%s'."), size.c_str());
+            return false;
+        }
+
+        m_sizes.push_back(n);
+    }
+
+    parser.Found(_T("repeat"), &m_repeat);
+    parser.Found(_T("seed"), &m_seed);
+    parser.Found(_T("output"), &m_output);
+    m_layout = !parser.Found(_T("no-layout"));
+    m_check = parser.Found(_T("check"));
+
+    return m_repeat > 0;
+}
+
+int BenchApp::OnRun()
+{
+    wxLog::SetActiveTarget(new wxLogStderr);
+    wxInitAllImageHandlers();
+
+    if (m_check) {
+        int status = EXIT_SUCCESS;
+
+        for (const auto& check : checks) {
+            if (!check.run()) {
+                wxLogError(_T("Check '%s' failed."), check.name);
+                status = EXIT_FAILURE;
+            }
+        }
+
+        return status;
+    }
+
+    unique_ptr<wxOutputStream> file;
+    unique_ptr<wxOutputStream> console;
+    wxOutputStream *stream;
+
+    if (!m_output.empty()) {
+        file.reset(new wxFileOutputStream(m_output));
+        if (!file->IsOk())
+            return EXIT_FAILURE;
+        stream = file.get();
+    }
+    else {
+        console.reset(new wxFFileOutputStream(stdout));
+        stream = console.get();
+    }
+
+    wxTextOutputStream out(*stream);
+    out << _T("generator,nodes,edges,operation,count,seconds") << endl;
+
+    for (const auto gen : m_generators) {
+        for (const auto size : m_sizes) {
+            mt19937 rng(static_cast<unsigned>(m_seed));
+            Shape shape = generators[gen].make(size, rng);
+            Benchmark bench(generators[gen].name, shape, m_layout);
+
+            for (long i = 0; i < m_repeat; i++)
+                bench.Run(rng);
+
+            bench.Write(out);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -397,6 +397,7 @@ public:
     void OnSizeNode(GraphEvent& event);
     void OnAddEdge(GraphEvent& event);
     void OnDeleteEdge(GraphEvent& event);
+    void OnDeleteBatch(GraphEvent& event);
     void OnConnectFeedback(GraphEvent& event);
     void OnConnect(GraphEvent& event);
 
@@ -618,6 +619,7 @@ BEGIN_EVENT_TABLE(MyFrame, wxFrame)
 
     EVT_GRAPH_EDGE_ADD(MyFrame::OnAddEdge)
     EVT_GRAPH_EDGE_DELETE(MyFrame::OnDeleteEdge)
+    EVT_GRAPH_BATCH_DELETE(MyFrame::OnDeleteBatch)
 
     EVT_GRAPH_CONNECT_FEEDBACK(MyFrame::OnConnectFeedback)
     EVT_GRAPH_CONNECT(MyFrame::OnConnect)
@@ -1019,6 +1021,12 @@ void MyFrame::OnDeleteEdge(GraphEvent&)
     wxLogDebug(_T("OnDeleteEdge"));
 }
 
+void MyFrame::OnDeleteBatch(GraphEvent& event)
+{
+    wxLogDebug(_T("OnDeleteBatch: %lu nodes"),
+               static_cast<unsigned long>(event.GetSources().size()));
+}
+
 // This event fires during node dragging each time the cursor hovers over
 // a potential target node, and allows the application to decide whether
 // dropping here would create a link.
@@ -1029,28 +1037,30 @@ void MyFrame::OnDeleteEdge(GraphEvent&)
 // disallows all connections (it's equivalent to clearing the list).
 //
 // In this example Import nodes are not allowed to connect to Import nodes,
-// and Export nodes are not allowed to connect to Export nodes.
+// and Export nodes are not allowed to connect to Export nodes. No connection
+// is allowed to make the pipeline loop back on itself either.
 //
 //
 void MyFrame::OnConnectFeedback(GraphEvent& event)
 {
     wxLogDebug(_T("OnConnectFeedback"));
 
+    GraphNode *target = event.GetTarget();
     ImportNode *imp = event.GetTarget<ImportNode>();
     ExportNode *exp = imp ? NULL : event.GetTarget<ExportNode>();
 
-    if (imp || exp) {
-        GraphEvent::NodeList& sources = event.GetSources();
-        GraphEvent::NodeList::iterator i = sources.begin(), j;
-
-        // Remove from sources list to disallow only some connections
-        while (i != sources.end()) {
-            j = i++;
-            if (imp && dynamic_cast<ImportNode*>(*j))
-                sources.erase(j);
-            if (exp && dynamic_cast<ExportNode*>(*j))
-                sources.erase(j);
-        }
+    GraphEvent::NodeList& sources = event.GetSources();
+    GraphEvent::NodeList::iterator i = sources.begin(), j;
+
+    // Remove from sources list to disallow only some connections
+    while (i != sources.end()) {
+        j = i++;
+        if (imp && dynamic_cast<ImportNode*>(*j))
+            sources.erase(j);
+        else if (exp && dynamic_cast<ExportNode*>(*j))
+            sources.erase(j);
+        else if (m_graph->WouldCreateCycle(**j, *target))
+            sources.erase(j);
     }
 }
 
@@ -1361,9 +1371,7 @@ void MyFrame::OnOpen(wxCommandEvent&)
     if (!PickFile(wxFD_OPEN))
         return;
 
-    wxFFileInputStream stream(m_filename);
-    if (stream.IsOk())
-        m_graph->Deserialise(stream);
+    m_graph->Deserialise(m_filename);
 }
 
 void MyFrame::OnSave(wxCommandEvent& event)
@@ -1420,28 +1428,18 @@ void MyFrame::OnSaveImage(wxCommandEvent&)
     if (w < 0 || h < 0 || b < 0 || w + h + b == 0)
         return;
 
-    wxBitmap bmp(w + 2 * b, h + 2 * b, 32);
-    {
-        wxMemoryDC dc(bmp);
+    // render the graph a tile at a time directly into the image, this
+    // avoids needing a full size bitmap as well as the image
+    wxImage image(w + 2 * b, h + 2 * b, false);
+    image.Clear(0xff);
 
-        // Draw doesn't clear the background
-        dc.SetBackground(*wxWHITE_BRUSH);
-        dc.Clear();
+    GraphTiles tiles(m_graph, rc, wxSize(w, h));
 
-        // this is needed to position the graph's bounding box in the bitmap
-        dc.SetLogicalOrigin(rc.x, rc.y);
-
-        // this is optional, it offsets the image 'b' pixels to leave a border
-        dc.SetDeviceOrigin(b, b);
-
-        // this is optional too, it scales the image to the size w x h pixels
-        if (!rc.IsEmpty())
-            dc.SetUserScale(double(w) / rc.GetWidth(),
-                            double(h) / rc.GetHeight());
-
-        m_graph->Draw(&dc);
-    }
-    bmp.SaveFile(filename, types[index]);
+    // 'b' pixels offset leave a white border around the graph
+    if (tiles.Render(image, wxPoint(b, b)))
+        image.SaveFile(filename, types[index]);
+    else
+        wxLogError(_T("Failed to render the image."));
 }
 
 // Print the graph
@@ -20,9 +20,33 @@
 #endif
 
 #include <wx/base64.h>
+#include <wx/file.h>
 #include <wx/mstream.h>
+#include <wx/thread.h>
+#include <wx/wfstream.h>
+#include <wx/zstream.h>
+
+#if defined(__WINDOWS__)
+#include <wx/msw/wrapwin.h>
+#elif defined(__UNIX__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <initializer_list>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "archive.h"
+#include "graphstats.h"
 #include "iterrange.h"
 
 /**
@@ -46,6 +70,7 @@ namespace {
 const wxChar* const TAGARCHIVE    = _T("archive");
 const wxChar* const TAGID         = _T("id");
 const wxChar* const TAGSORT       = _T("sort");
+const wxChar* const TAGSORTED     = _T("sorted");
 
 const wxString      TAGFONT       = _T("wxFont");
 
@@ -68,6 +93,12 @@ wxString FontId(const wxString& desc)
     return TAGFONT + _T(" ") + desc;
 }
 
+/// Decoder for the Archive::Value referring to UTF-8 text.
+wxString DecodeUtf8(const char *data, size_t len)
+{
+    return wxString::FromUTF8(data, len);
+}
+
 // ----------------------------------------------------------------------------
 // XML parser
 // ----------------------------------------------------------------------------
@@ -79,6 +110,13 @@ constexpr size_t bufsize = 8192;
 
 /**
  * XML parser used by Archive::Load().
+ *
+ * The items are added to the archive as they are parsed and passed to the
+ * optional consumer as soon as they are complete. The element names, which
+ * are the same for most items, are converted to wxString only once.
+ *
+ * When the whole document is in memory, the attribute values which don't
+ * need unescaping refer to it instead of being converted immediately.
  */
 class Parser
 {
@@ -87,9 +125,22 @@ public:
      * Initialize a parser associated with the given archive.
      *
      * @a archive must be non-@c NULL and will be used by the parser to add
-     * elements read from XML to it via Archive::Put().
+     * elements read from XML to it via Archive::Put(). @a sorted is set if
+     * the root element says that the items are in sort key order. If
+     * @a consumer is non-@c NULL, it is given each item once it's complete.
+     * @a base is the start of the document if it's all in memory and
+     * remains valid for as long as the archive, or @c NULL.
+     */
+    Parser(XML_Parser parser,
+           Archive *archive,
+           bool *sorted,
+           Archive::Consumer *consumer,
+           const char *base = NULL);
+
+    /**
+     * Called for the XML declaration.
      */
-    Parser(Archive *archive);
+    void XmlDecl(const XML_Char *encoding);
 
     /**
      * Called when an opening tag for an element is encountered.
@@ -120,7 +171,23 @@ protected:
 #endif
     //@}
 
+    /**
+     * Return the interned wxString for the given XML name.
+     */
+    const wxString& Intern(const XML_Char *name);
+
+    /**
+     * Make the value of the attribute ending at the current position.
+     */
+    Archive::Value MakeValue();
+
 private:
+    /// Raw XML text.
+    typedef std::basic_string<XML_Char> XmlString;
+
+    /// Map of the XML names already converted to wxString.
+    typedef std::unordered_map<XmlString, wxString> NameMap;
+
     /**
      * Current depth in XML hierarchy.
      *
@@ -128,16 +195,60 @@ private:
      */
     size_t m_depth;
 
+    XML_Parser m_parser;        ///< The expat parser.
     Archive *m_archive;         ///< The associated archive.
+    bool *m_sorted;             ///< Set if the items are sorted.
+    Archive::Consumer *m_consumer; ///< Receives the items, may be @c NULL.
     Archive::Item *m_item;      ///< Current item, may be @c NULL.
-    wxString m_value;           ///< Contents of the current item.
+    XmlString m_value;          ///< Contents of the current attribute.
+    XmlString m_key;            ///< Reused buffer for looking up names.
+    NameMap m_names;            ///< Interned names.
+    const char *m_base;         ///< The document in memory or NULL.
+    XML_Index m_start;          ///< Offset of the current attribute value.
 };
 
-Parser::Parser(Archive *archive)
+Parser::Parser(XML_Parser parser,
+               Archive *archive,
+               bool *sorted,
+               Archive::Consumer *consumer,
+               const char *base)
   : m_depth(0),
+    m_parser(parser),
     m_archive(archive),
-    m_item(NULL)
+    m_sorted(sorted),
+    m_consumer(consumer),
+    m_item(NULL),
+    m_base(base),
+    m_start(0)
+{
+}
+
+void Parser::XmlDecl(const XML_Char *encoding)
+{
+    // The values can only refer to the document if it's in UTF-8.
+    if (encoding && FromXml(encoding).CmpNoCase(_T("utf-8")) != 0)
+        m_base = NULL;
+}
+
+Archive::Value Parser::MakeValue()
 {
+    if (m_base) {
+        XML_Index end = XML_GetCurrentByteIndex(m_parser);
+
+        if (end > m_start) {
+            const char *data = m_base + m_start;
+            size_t len = size_t(end - m_start);
+
+            // Entities, CDATA sections and line ends are translated by the
+            // parser, so only plain text can be used directly.
+            if (std::find_if(data, data + len, [](char ch)
+                    { return ch == '&' || ch == '<' || ch == '\r'; })
+                        == data + len)
+                return Archive::Value(data, len, DecodeUtf8);
+        }
+    }
+
+    return Archive::Value(FromXml(m_value.data(), m_value.length()));
 }
 
 #ifdef XML_UNICODE
@@ -152,6 +263,17 @@ wxString Parser::FromXml(const char *str, size_t len)
 }
 #endif
 
+const wxString& Parser::Intern(const XML_Char *name)
+{
+    m_key.assign(name);
+
+    NameMap::iterator it = m_names.find(m_key);
+    if (it == m_names.end())
+        it = m_names.insert(make_pair(m_key, FromXml(name))).first;
+
+    return it->second;
+}
+
 void Parser::StartElement(const XML_Char *name, const XML_Char **atts)
 {
     m_depth++;
@@ -160,15 +282,23 @@ void Parser::StartElement(const XML_Char *name, const XML_Char **atts)
         if (FromXml(name) != TAGARCHIVE) {
             wxLogError(_("Error loading: unknown root element"));
         }
+
+        while (*atts) {
+            const wxString& atname = Intern(*atts++);
+            wxString atvalue = FromXml(*atts++);
+
+            if (atname == TAGSORTED)
+                *m_sorted = atvalue == _T("1");
+        }
     }
     else if (m_depth == 2) {
         wxASSERT(m_item == NULL);
-        wxString classname = FromXml(name);
+        const wxString& classname = Intern(name);
         wxString id;
         wxString sortkey;
 
         while (*atts) {
-            wxString atname = FromXml(*atts++);
+            const wxString& atname = Intern(*atts++);
             wxString atvalue = FromXml(*atts++);
 
             if (atname == TAGID)
@@ -190,16 +320,22 @@ void Parser::StartElement(const XML_Char *name, const XML_Char **atts)
             }
         }
     }
+    else if (m_depth == 3 && m_base) {
+        m_start = XML_GetCurrentByteIndex(m_parser) +
+                  XML_GetCurrentByteCount(m_parser);
+    }
 }
 
 void Parser::EndElement(const XML_Char *name)
 {
     if (m_depth == 2) {
+        if (m_item && m_consumer && !m_consumer->OnItem(*m_item))
+            XML_StopParser(m_parser, XML_FALSE);
         m_item = NULL;
     }
     else if (m_depth == 3) {
-        wxString pname = FromXml(name);
-        if (m_item && !m_item->Put(pname, m_value)) {
+        const wxString& pname = Intern(name);
+        if (m_item && !m_item->Put(pname, MakeValue())) {
             wxLogError(_("Error loading <%s %s='%s'> ignoring duplicate <%s>"),
                        m_item->GetClass().c_str(), TAGID,
                        m_item->GetId().c_str(), pname.c_str());
@@ -213,7 +349,7 @@ void Parser::EndElement(const XML_Char *name)
 void Parser::CharData(const XML_Char *s, int len)
 {
     if (m_depth >= 3)
-        m_value += FromXml(s, len);
+        m_value.append(s, len);
 }
 
 extern "C" {
@@ -239,8 +375,45 @@ char_data(void *userData, const XML_Char *s, int len)
     static_cast<Parser*>(userData)->CharData(s, len);
 }
 
+/// Expat callback for the XML declaration.
+void //XMLCALL
+xml_decl(void *userData,
+         const XML_Char *, const XML_Char *encoding, int)
+{
+    static_cast<Parser*>(userData)->XmlDecl(encoding);
+}
+
 } // extern "C"
 
+/// Install the callbacks calling the given handler.
+void SetupParser(XML_Parser parser, Parser *handler)
+{
+    XML_SetUserData(parser, handler);
+    XML_SetElementHandler(parser, start_element, end_element);
+    XML_SetCharacterDataHandler(parser, char_data);
+    XML_SetXmlDeclHandler(parser, xml_decl);
+}
+
+/// Log the error if parsing failed and free the parser.
+bool FinishParser(XML_Parser parser, XML_Status status)
+{
+    if (status == XML_STATUS_ERROR) {
+        XML_Error code = XML_GetErrorCode(parser);
+
+        // XML_ERROR_ABORTED means that the consumer has stopped us, it's
+        // responsible for giving the reason for it.
+        if (code != XML_ERROR_ABORTED) {
+            wxLogError(_("Error loading: %s at line %lu"),
+                       wxString::FromAscii(XML_ErrorString(code)).c_str(),
+                       static_cast<unsigned long>(
+                           XML_GetCurrentLineNumber(parser)));
+        }
+    }
+
+    XML_ParserFree(parser);
+    return status == XML_STATUS_OK;
+}
+
 #endif // NO_EXPAT
 
 // ----------------------------------------------------------------------------
@@ -251,7 +424,11 @@ char_data(void *userData, const XML_Char *s, int len)
  * Helper class for outputting XML.
  *
  * This class is used by Archive::Save() to serialize the archive contents in
- * XML format.
+ * XML format. Everything is converted to UTF-8 straight into a buffer which
+ * is only written to the stream when it's full, so saving a big archive
+ * makes a few large writes rather than one per tag, and needs no temporary
+ * strings. Most values need no escaping, so they are copied as they are and
+ * only escaped if the copy turns out to contain a special character.
  */
 class Generator
 {
@@ -262,6 +439,12 @@ public:
      * Items passed to the Generator will be sent to @a out.
      */
     Generator(wxOutputStream& out);
+    ~Generator() { Flush(); }
+
+    Generator(const Generator&) = delete;
+    Generator(Generator&&) = delete;
+    Generator& operator=(const Generator&) = delete;
+    Generator& operator=(Generator&&) = delete;
 
     /**
      * Directly write the given text to the associated stream.
@@ -279,19 +462,26 @@ public:
      * &lt;foo/&gt; instead of @c &lt;foo&gt;&lt;/foo&gt;) so calling this
      * method is preferable.
      */
-    void Pair(const wxString& name_and_attrs, const wxString& value);
+    void Pair(const wxString& name, const wxString& value);
 
     /**
      * Output the opening tag.
+     *
+     * The tag is left open so that attributes can be added with Attribute(),
+     * it is closed by the next call adding contents.
      */
-    void Start(const wxString& name_and_attrs);
+    void Start(const wxString& name);
 
     /**
-     * Output the closing tag.
+     * Add an attribute to the tag just started.
      *
-     * @param name Name of the closing tag, may be empty in which case nothing
-     * is actually output (this is used by Pair() in case the value is empty
-     * and the tag was already closed).
+     * Any special characters in the value @a str (but not in its @a name)
+     * are escaped.
+     */
+    void Attribute(const wxString& name, const wxString& str);
+
+    /**
+     * Output the closing tag.
      */
     void End(const wxString& name);
 
@@ -303,171 +493,1321 @@ public:
      */
     void CharData(const wxString& str);
 
-protected:
+    /// Write the buffered data to the stream.
+    void Flush();
+
+private:
+    /// Append the string converted to UTF-8 to the buffer.
+    void Append(const wxString& str);
+
+    /// Close the tag being started, if any.
+    void CloseTag();
+
+    /// Start a new line indented for the current depth.
+    void NewLine();
+
     /**
-     * Convert a narrow or wide character buffer to wxString.
+     * Escape the special characters of the buffer after @a pos.
+     *
+     * @a attr selects escaping for an attribute value rather than for
+     * character data.
      */
-    //@{
-    wxString FromXml(const char *str, size_t len = wxString::npos);
-    wxString FromXml(const wchar_t *str, size_t len = wxString::npos);
-    //@}
+    void Escape(size_t pos, bool attr);
+
+    /// Flush the buffer if it's full.
+    void Check() { if (m_buf.size() >= xmlbufsize) Flush(); }
+
+    /// The size the buffer is allowed to reach before it's written.
+    static constexpr size_t xmlbufsize = 64 * 1024;
 
-private:
     size_t m_depth;             ///< Current depth in XML hierarchy.
     bool m_leaf;                ///< True while we're writing an element.
+    bool m_open;                ///< True while a start tag is open.
     wxOutputStream& m_stream;   ///< The associated stream.
+    std::string m_buf;          ///< Data not written to the stream yet.
+    std::string m_escaped;      ///< Reused by Escape().
 };
 
 Generator::Generator(wxOutputStream& stream)
   : m_depth(0),
     m_leaf(false),
+    m_open(false),
     m_stream(stream)
 {
+    m_buf.reserve(xmlbufsize + bufsize);
 }
 
 void Generator::Write(const char *utf, size_t len)
 {
     if (len == wxString::npos)
         len = strlen(utf);
-    m_stream.Write(utf, len);
+    m_buf.append(utf, len);
+    Check();
+}
+
+void Generator::Write(const wxString& str)
+{
+    Append(str);
+    Check();
+}
+
+void Generator::Append(const wxString& str)
+{
+#if wxUSE_UNICODE_UTF8
+    m_buf.append(str.wx_str(), str.utf8_length());
+#else
+    // a UTF-16 or UTF-32 unit never takes more than 4 bytes in UTF-8
+    constexpr size_t MAX_UTF8_LEN = 4;
+
+    const size_t len = str.length();
+    if (len == 0)
+        return;
+
+    const size_t pos = m_buf.size();
+    m_buf.resize(pos + len * MAX_UTF8_LEN);
+
+    size_t n = wxConvUTF8.FromWChar(&m_buf[pos], len * MAX_UTF8_LEN,
+                                    str.wc_str(), len);
+    if (n == wxCONV_FAILED)
+        n = 0;
+
+    m_buf.resize(pos + n);
+#endif
+}
+
+void Generator::CloseTag()
+{
+    if (m_open) {
+        m_buf += '>';
+        m_open = false;
+    }
+}
+
+void Generator::NewLine()
+{
+    m_buf += '\n';
+    m_buf.append(m_depth * 2, ' ');
+}
+
+void Generator::Escape(size_t pos, bool attr)
+{
+    // the special characters are ASCII, so they can't be part of a multibyte
+    // UTF-8 sequence and the bytes can be scanned directly
+    const char *specials = attr ? "<&\"" : "<&>";
+    size_t found = m_buf.find_first_of(specials, pos);
+    if (found == std::string::npos)
+        return;
+
+    m_escaped.assign(m_buf, pos, found - pos);
+
+    // count the ']' just before, for the "]]>" check below
+    int square = 0;
+    for (size_t i = found; i > pos && m_buf[i - 1] == ']'; i--)
+        square++;
+
+    for (size_t i = found; i < m_buf.size(); i++) {
+        char ch = m_buf[i];
+        switch (ch) {
+            case '&':
+                m_escaped += "&amp;";
+                break;
+            case '<':
+                m_escaped += "&lt;";
+                break;
+            case '"':
+                m_escaped += attr ? "&quot;" : "\"";
+                break;
+            case '>':
+                // only "]]>" must be escaped in character data
+                if (!attr && square >= 2)
+                    m_escaped += "&gt;";
+                else
+                    m_escaped += ch;
+                break;
+            default:
+                m_escaped += ch;
+        }
+        square = ch == ']' ? square + 1 : 0;
+    }
+
+    m_buf.replace(pos, std::string::npos, m_escaped);
+}
+
+void Generator::Pair(const wxString& name, const wxString& value)
+{
+    Start(name);
+
+    if (value.empty()) {
+        m_buf += "/>";
+        m_open = false;
+        m_depth--;
+        m_leaf = false;
+        Check();
+    }
+    else {
+        CharData(value);
+        End(name);
+    }
 }
 
-void Generator::Write(const wxString& str)
-{
-    const wxCharBuffer cbuf(str.utf8_str());
-    Write(cbuf, cbuf.length());
-}
+void Generator::Start(const wxString& name)
+{
+    CloseTag();
+    m_leaf = true;
+
+    NewLine();
+    m_buf += '<';
+    Append(name);
+    m_open = true;
+
+    m_depth++;
+}
+
+void Generator::Attribute(const wxString& name, const wxString& str)
+{
+    wxASSERT(m_open);
+
+    m_buf += ' ';
+    Append(name);
+    m_buf += "=\"";
+
+    const size_t pos = m_buf.size();
+    Append(str);
+    Escape(pos, true);
+
+    m_buf += '"';
+}
+
+void Generator::End(const wxString& name)
+{
+    CloseTag();
+    m_depth--;
+
+    if (!m_leaf)
+        NewLine();
+    m_buf += "</";
+    Append(name);
+    m_buf += '>';
+
+    m_leaf = false;
+    Check();
+}
+
+void Generator::CharData(const wxString& str)
+{
+    CloseTag();
+
+    const size_t pos = m_buf.size();
+    Append(str);
+    Escape(pos, false);
+
+    Check();
+}
+
+void Generator::Flush()
+{
+    if (!m_buf.empty()) {
+        m_stream.Write(m_buf.data(), m_buf.size());
+        m_buf.clear();
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Binary format
+// ----------------------------------------------------------------------------
+
+/*
+ * The binary format consists of:
+ *
+ *  - The signature BINMAGIC followed by the format version.
+ *  - Flags, BINSORTED if the items are in sort key order.
+ *  - The string table: the number of strings followed by each string as its
+ *    UTF-8 length and bytes. It holds the class names, ids, sort keys and
+ *    attribute names, which are then referred to by their index.
+ *  - The number of items followed by each item: its class, id and sort key,
+ *    the number of its attributes and each attribute name and value.
+ *
+ * All the numbers are stored as varints, 7 bits per byte starting from the
+ * least significant ones, with the high bit set in all bytes but the last.
+ * Signed numbers are zigzag encoded first so that small negative numbers
+ * remain short.
+ *
+ * The values are preceded by one of the Value tags below. The integer and
+ * base64 forms hold the typed Archive::Value objects stored by the Insert()
+ * overloads, and are loaded back as typed values, so that they are never
+ * converted to text unless their strings are used.
+ */
+
+/// Signature of the binary archives, can't be the start of an XML file.
+const char BINMAGIC[] = "\x89GEA";
+const size_t BINMAGICLEN = 4;
+
+/// The first bytes of the gzip format, for the compressed archives.
+const char GZIPMAGIC[] = "\x1f\x8b";
+
+/// Current version of the binary format.
+const unsigned BINVERSION = 1;
+
+/// Flag set when the items are stored in sort key order.
+const unsigned BINSORTED = 1;
+
+/// Tags of the attribute values.
+enum Value
+{
+    Value_String,   ///< UTF-8 string.
+    Value_Ref,      ///< Index of a string in the string table.
+    Value_Ints,     ///< Comma separated list of integers.
+    Value_Base64    ///< Raw bytes that are stored as base64.
+};
+
+/// Format a list of integers as the string of a Type_Ints value.
+wxString FormatInts(const std::vector<wxInt64>& values)
+{
+    wxString str;
+
+    for (size_t i = 0; i < values.size(); i++) {
+        if (i)
+            str += _T(',');
+        str << values[i];
+    }
+
+    return str;
+}
+
+/// Zigzag encode a signed number, so small negative ones stay short.
+inline wxUint64 ZigZag(wxInt64 n)
+{
+    return (wxUint64(n) << 1) ^ wxUint64(n >> 63);
+}
+
+/// Append an unsigned number to @a buf as a varint.
+void AppendVarint(std::string& buf, wxUint64 n)
+{
+    char bytes[10];
+    size_t len = 0;
+
+    while (n >= 0x80) {
+        bytes[len++] = char(n | 0x80);
+        n >>= 7;
+    }
+    bytes[len++] = char(n);
+
+    buf.append(bytes, len);
+}
+
+/**
+ * Buffered writer of the binary format primitives.
+ */
+class BinaryWriter
+{
+public:
+    BinaryWriter(wxOutputStream& stream) : m_stream(stream) { }
+    ~BinaryWriter() { Flush(); }
+
+    /// Write raw bytes.
+    void Write(const void *data, size_t len);
+
+    /// Write an unsigned number.
+    void Varint(wxUint64 n);
+
+    /// Write a string as its length and UTF-8 bytes.
+    void String(const wxString& str);
+
+    /// Write the buffered data to the stream.
+    void Flush();
+
+private:
+    wxOutputStream& m_stream;   ///< The associated stream.
+    std::string m_buf;          ///< Data not written to the stream yet.
+};
+
+void BinaryWriter::Write(const void *data, size_t len)
+{
+    m_buf.append(static_cast<const char*>(data), len);
+    if (m_buf.size() >= bufsize)
+        Flush();
+}
+
+void BinaryWriter::Varint(wxUint64 n)
+{
+    AppendVarint(m_buf, n);
+    if (m_buf.size() >= bufsize)
+        Flush();
+}
+
+void BinaryWriter::String(const wxString& str)
+{
+    const wxCharBuffer utf(str.utf8_str());
+    Varint(utf.length());
+    Write(utf.data(), utf.length());
+}
+
+void BinaryWriter::Flush()
+{
+    if (!m_buf.empty()) {
+        m_stream.Write(m_buf.data(), m_buf.size());
+        m_buf.clear();
+    }
+}
+
+/**
+ * Buffered reader of the binary format primitives.
+ *
+ * Reads either from a stream or directly from data in memory, in which case
+ * View() can be used to refer to the data instead of copying it.
+ *
+ * All methods return false if the end of the data is reached before the
+ * value could be read. The lengths read from the data are not trusted, the
+ * memory for a string is only allocated as its bytes are actually read, so
+ * a corrupt length fails at the end of the data.
+ */
+class BinaryReader
+{
+public:
+    BinaryReader(wxInputStream& stream)
+      : m_stream(&stream), m_buf(bufsize), m_data(NULL), m_pos(0), m_len(0)
+    { }
+
+    BinaryReader(const char *data, size_t len)
+      : m_stream(NULL), m_data(data), m_pos(0), m_len(len)
+    { }
+
+    /// Read raw bytes.
+    bool Read(void *data, size_t len);
+
+    /// Read @a len raw bytes, appending them to @a str.
+    bool Append(std::string& str, size_t len);
+
+    /// Read an unsigned number.
+    bool Varint(wxUint64& n);
+
+    /// Read an unsigned number that must fit into size_t.
+    bool Size(size_t& n);
+
+    /// Read a signed number.
+    bool Signed(wxInt64& n);
+
+    /// Read a string written by BinaryWriter::String().
+    bool String(wxString& str);
+
+    /// True if reading from memory and View() can be used.
+    bool IsInMemory() const { return m_stream == NULL; }
+
+    /// Current position, only for the data in memory.
+    const char *GetPos() const { return m_data + m_pos; }
+
+    /// Return a pointer to the next @a len bytes and skip them.
+    bool View(size_t len, const char **data);
+
+private:
+    /// Refill the buffer, returns false at end of stream.
+    bool Fill();
+
+    wxInputStream *m_stream;    ///< The associated stream or NULL.
+    std::vector<char> m_buf;    ///< Data read from the stream.
+    const char *m_data;         ///< The data being read.
+    size_t m_pos;               ///< Offset of the next byte in m_data.
+    size_t m_len;               ///< Number of valid bytes in m_data.
+    std::string m_str;          ///< Reused by String().
+};
+
+bool BinaryReader::Fill()
+{
+    if (!m_stream)
+        return false;
+
+    m_data = &m_buf[0];
+    m_pos = 0;
+    m_len = m_stream->Read(&m_buf[0], m_buf.size()).LastRead();
+    return m_len != 0;
+}
+
+bool BinaryReader::Read(void *data, size_t len)
+{
+    char *p = static_cast<char*>(data);
+
+    while (len) {
+        if (m_pos == m_len && !Fill())
+            return false;
+
+        size_t n = std::min(len, m_len - m_pos);
+        memcpy(p, m_data + m_pos, n);
+        m_pos += n;
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool BinaryReader::Append(std::string& str, size_t len)
+{
+    // Don't reserve len, it's only known to be valid once the data is read.
+    while (len) {
+        if (m_pos == m_len && !Fill())
+            return false;
+
+        size_t n = std::min(len, m_len - m_pos);
+        str.append(m_data + m_pos, n);
+        m_pos += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+bool BinaryReader::View(size_t len, const char **data)
+{
+    wxASSERT(IsInMemory());
+
+    if (len > m_len - m_pos)
+        return false;
+
+    *data = m_data + m_pos;
+    m_pos += len;
+    return true;
+}
+
+bool BinaryReader::Varint(wxUint64& n)
+{
+    n = 0;
+
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (m_pos == m_len && !Fill())
+            return false;
+
+        unsigned char b = m_data[m_pos++];
+        n |= wxUint64(b & 0x7f) << shift;
+
+        if ((b & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+bool BinaryReader::Size(size_t& n)
+{
+    wxUint64 v;
+    if (!Varint(v) || v > wxUint64(size_t(-1)))
+        return false;
+    n = size_t(v);
+    return true;
+}
+
+bool BinaryReader::Signed(wxInt64& n)
+{
+    wxUint64 v;
+    if (!Varint(v))
+        return false;
+    n = wxInt64(v >> 1) ^ -wxInt64(v & 1);
+    return true;
+}
+
+bool BinaryReader::String(wxString& str)
+{
+    size_t len;
+    if (!Size(len))
+        return false;
+
+    m_str.clear();
+    if (!Append(m_str, len))
+        return false;
+
+    str = wxString::FromUTF8(m_str.data(), len);
+    return true;
+}
+
+/// Result of reading a part of a binary archive.
+enum ReadStatus
+{
+    Read_Ok,        ///< Success.
+    Read_Eof,       ///< Unexpected end of stream.
+    Read_Corrupt    ///< Invalid data.
+};
+
+/// Read an index into the string table.
+ReadStatus ReadRef(BinaryReader& in,
+                   const std::vector<wxString>& strings,
+                   size_t& ref)
+{
+    if (!in.Size(ref))
+        return Read_Eof;
+    return ref < strings.size() ? Read_Ok : Read_Corrupt;
+}
+
+/// Decode the integers of a Type_Ints value.
+bool DecodeInts(const char *data, size_t len, std::vector<wxInt64>& ints)
+{
+    BinaryReader in(data, len);
+    size_t count;
+
+    ints.clear();
+    if (!in.Size(count))
+        return false;
+
+    for (size_t i = 0; i < count; i++) {
+        wxInt64 n;
+        if (!in.Signed(n))
+            return false;
+        ints.push_back(n);
+    }
+
+    return true;
+}
+
+/**
+ * Read a value written with one of the Value tags.
+ *
+ * When reading from memory, the value refers to the data and is only
+ * converted when it's used. The integers and bytes are read as typed values.
+ */
+ReadStatus ReadValue(BinaryReader& in,
+                     const std::vector<wxString>& strings,
+                     Archive::Value& value)
+{
+    size_t tag;
+    if (!in.Size(tag))
+        return Read_Eof;
+
+    switch (tag) {
+        case Value_String:
+        {
+            if (in.IsInMemory()) {
+                size_t len;
+                const char *data;
+                if (!in.Size(len) || !in.View(len, &data))
+                    return Read_Eof;
+                value = Archive::Value(data, len, DecodeUtf8);
+                return Read_Ok;
+            }
+
+            wxString str;
+            if (!in.String(str))
+                return Read_Eof;
+            value = Archive::Value(str);
+            return Read_Ok;
+        }
+
+        case Value_Ref:
+        {
+            size_t ref;
+            ReadStatus status = ReadRef(in, strings, ref);
+            if (status == Read_Ok)
+                value = Archive::Value(strings[ref]);
+            return status;
+        }
+
+        case Value_Ints:
+        {
+            const char *start = in.GetPos();
+            size_t count;
+            if (!in.Size(count))
+                return Read_Eof;
+
+            std::vector<wxInt64> ints;
+            for (size_t i = 0; i < count; i++) {
+                wxInt64 n;
+                if (!in.Signed(n))
+                    return Read_Eof;
+                if (!in.IsInMemory())
+                    ints.push_back(n);
+            }
+
+            if (in.IsInMemory())
+                value = Archive::Value(Archive::Value::Type_Ints,
+                                       start, in.GetPos() - start);
+            else
+                value = Archive::Value(ints);
+            return Read_Ok;
+        }
+
+        case Value_Base64:
+        {
+            size_t len;
+            if (!in.Size(len))
+                return Read_Eof;
+
+            if (in.IsInMemory()) {
+                const char *data;
+                if (!in.View(len, &data))
+                    return Read_Eof;
+                value = Archive::Value(Archive::Value::Type_Bytes, data, len);
+                return Read_Ok;
+            }
+
+            std::string bytes;
+            if (!in.Append(bytes, len))
+                return Read_Eof;
+
+            value = Archive::Value(bytes.data(), len);
+            return Read_Ok;
+        }
+    }
+
+    return Read_Corrupt;
+}
+
+/**
+ * Parse a binary archive.
+ *
+ * Used by Archive::Load(), adds the items to @a archive and sets @a sorted
+ * if they are in sort key order.
+ */
+bool ParseBinary(BinaryReader& in,
+                 Archive& archive,
+                 bool *sorted,
+                 Archive::Consumer *consumer)
+{
+    char magic[BINMAGICLEN];
+    size_t version, flags;
+
+    if (!in.Read(magic, BINMAGICLEN) ||
+            memcmp(magic, BINMAGIC, BINMAGICLEN) != 0 ||
+            !in.Size(version) ||
+            !in.Size(flags)) {
+        wxLogError(_("Error loading: unknown file format"));
+        return false;
+    }
+
+    if (version > BINVERSION) {
+        wxLogError(_("Error loading: unsupported format version %lu"),
+                   static_cast<unsigned long>(version));
+        return false;
+    }
+
+    *sorted = (flags & BINSORTED) != 0;
+
+    std::vector<wxString> strings;
+    ReadStatus status = Read_Ok;
+    size_t count;
+
+    if (!in.Size(count))
+        status = Read_Eof;
+
+    for (size_t i = 0; status == Read_Ok && i < count; i++) {
+        wxString str;
+        if (in.String(str))
+            strings.push_back(str);
+        else
+            status = Read_Eof;
+    }
+
+    if (status == Read_Ok && !in.Size(count))
+        status = Read_Eof;
+
+    for (size_t i = 0; status == Read_Ok && i < count; i++) {
+        size_t classname, id, sortkey, attribs;
+
+        if ((status = ReadRef(in, strings, classname)) != Read_Ok ||
+                (status = ReadRef(in, strings, id)) != Read_Ok ||
+                (status = ReadRef(in, strings, sortkey)) != Read_Ok)
+            break;
+
+        if (!in.Size(attribs)) {
+            status = Read_Eof;
+            break;
+        }
+
+        Archive::Item *item = archive.Put(strings[classname],
+                                          strings[id],
+                                          strings[sortkey]);
+
+        if (!item) {
+            wxLogError(_("Error loading <%s %s='%s'> id is not unique"),
+                       strings[classname].c_str(), TAGID,
+                       strings[id].c_str());
+        }
+
+        for (size_t j = 0; status == Read_Ok && j < attribs; j++) {
+            size_t pname;
+            Archive::Value value((wxString()));
+
+            if ((status = ReadRef(in, strings, pname)) != Read_Ok ||
+                    (status = ReadValue(in, strings, value)) != Read_Ok)
+                break;
+
+            if (item && !item->Put(strings[pname], value)) {
+                wxLogError(_("Error loading <%s %s='%s'> ignoring duplicate <%s>"),
+                           item->GetClass().c_str(), TAGID,
+                           item->GetId().c_str(), strings[pname].c_str());
+            }
+        }
+
+        if (status == Read_Ok && item && consumer && !consumer->OnItem(*item))
+            return false;
+    }
+
+    switch (status) {
+        case Read_Ok:
+            return true;
+
+        case Read_Eof:
+            wxLogError(_("Error loading: unexpected end of file"));
+            break;
+
+        case Read_Corrupt:
+            wxLogError(_("Error loading: the file is corrupt"));
+            break;
+    }
+
+    return false;
+}
+
+} // namespace
+
+// ----------------------------------------------------------------------------
+// Archive::Value
+// ----------------------------------------------------------------------------
+
+Archive::Value::Value(const std::vector<wxInt64>& ints)
+  : m_type(Type_Ints), m_converted(false), m_decode(NULL)
+{
+    std::shared_ptr<std::string> own = std::make_shared<std::string>();
+
+    AppendVarint(*own, ints.size());
+    for (wxInt64 n : ints)
+        AppendVarint(*own, ZigZag(n));
+
+    m_data = own->data();
+    m_len = own->size();
+    m_own = own;
+}
+
+Archive::Value::Value(const void *data, size_t len)
+  : m_type(Type_Bytes),
+    m_converted(false),
+    m_decode(NULL),
+    m_own(std::make_shared<std::string>(static_cast<const char*>(data), len))
+{
+    m_data = m_own->data();
+    m_len = m_own->size();
+}
+
+bool Archive::Value::GetInts(std::vector<wxInt64>& ints) const
+{
+    if (m_type != Type_Ints) {
+        ints.clear();
+        return false;
+    }
+
+    return DecodeInts(m_data, m_len, ints);
+}
+
+const wxString& Archive::Value::Convert() const
+{
+    switch (m_type) {
+        case Type_String:
+            m_str = m_decode(m_data, m_len);
+            break;
+
+        case Type_Ints:
+        {
+            std::vector<wxInt64> ints;
+            GetInts(ints);
+            m_str = FormatInts(ints);
+            break;
+        }
+
+        case Type_Bytes:
+            m_str = wxBase64Encode(m_data, m_len);
+            break;
+    }
+
+    m_converted = true;
+    return m_str;
+}
+
+// ----------------------------------------------------------------------------
+// Archive::Mapping
+// ----------------------------------------------------------------------------
+
+/**
+ * A read-only file mapped into memory.
+ *
+ * If the file can't be mapped, e.g. because it's empty or the file system
+ * doesn't support it, its contents are read into memory instead.
+ */
+class Archive::Mapping
+{
+public:
+    Mapping();
+    Mapping(const Mapping&) = delete;
+    Mapping(Mapping&&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+    Mapping& operator=(Mapping&&) = delete;
+    ~Mapping();
+
+    /// Map the file, returns false if it couldn't be read at all.
+    bool Open(const wxString& path);
+
+    /// The contents of the file.
+    const char *GetData() const { return m_data; }
+    size_t GetLength() const { return m_len; }
+
+private:
+    /// Read the file into m_buf if it can't be mapped.
+    bool Read(const wxString& path);
+
+    const char *m_data;     ///< The file contents.
+    size_t m_len;           ///< Length of m_data.
+    bool m_mapped;          ///< True if m_data is mapped.
+#ifdef __WINDOWS__
+    HANDLE m_map;           ///< The file mapping object.
+#endif
+    wxMemoryBuffer m_buf;   ///< The file contents if it wasn't mapped.
+};
+
+Archive::Mapping::Mapping()
+  : m_data(""),
+    m_len(0),
+    m_mapped(false)
+#ifdef __WINDOWS__
+    , m_map(NULL)
+#endif
+{
+}
+
+Archive::Mapping::~Mapping()
+{
+    if (m_mapped) {
+#if defined(__WINDOWS__)
+        ::UnmapViewOfFile(m_data);
+        ::CloseHandle(m_map);
+#elif defined(__UNIX__)
+        munmap(const_cast<char*>(m_data), m_len);
+#endif
+    }
+}
+
+bool Archive::Mapping::Open(const wxString& path)
+{
+#if defined(__WINDOWS__)
+    HANDLE file = ::CreateFile(path.t_str(), GENERIC_READ, FILE_SHARE_READ,
+                               NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                               NULL);
+
+    if (file != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER size;
+
+        if (::GetFileSizeEx(file, &size) && size.QuadPart > 0 &&
+                wxUint64(size.QuadPart) <= wxUint64(size_t(-1))) {
+            m_map = ::CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+            if (m_map) {
+                void *view = ::MapViewOfFile(m_map, FILE_MAP_READ, 0, 0, 0);
+
+                if (view) {
+                    m_data = static_cast<const char*>(view);
+                    m_len = size_t(size.QuadPart);
+                    m_mapped = true;
+                }
+                else {
+                    ::CloseHandle(m_map);
+                    m_map = NULL;
+                }
+            }
+        }
+
+        // The mapping keeps its own reference to the file.
+        ::CloseHandle(file);
+    }
+#elif defined(__UNIX__)
+    int fd = open(path.fn_str(), O_RDONLY);
+
+    if (fd != -1) {
+        struct stat st;
+
+        if (fstat(fd, &st) == 0 && st.st_size > 0 &&
+                wxUint64(st.st_size) <= wxUint64(size_t(-1))) {
+            size_t len = size_t(st.st_size);
+            void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (p != MAP_FAILED) {
+                madvise(p, len, MADV_SEQUENTIAL);
+                m_data = static_cast<const char*>(p);
+                m_len = len;
+                m_mapped = true;
+            }
+        }
+
+        close(fd);
+    }
+#endif
+
+    return m_mapped || Read(path);
+}
+
+bool Archive::Mapping::Read(const wxString& path)
+{
+    wxFile file;
+    if (!file.Open(path))
+        return false;
+
+    wxFileOffset len = file.Length();
+    if (len == wxInvalidOffset)
+        return false;
+
+    if (len > 0) {
+        void *buf = m_buf.GetWriteBuf(size_t(len));
+        if (!buf || file.Read(buf, size_t(len)) != ssize_t(len))
+            return false;
+        m_buf.UngetWriteBuf(size_t(len));
+
+        m_data = static_cast<const char*>(m_buf.GetData());
+        m_len = size_t(len);
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// Image decoding
+// ----------------------------------------------------------------------------
+
+namespace {
+
+/// Decode the image stored in an item by PutImage().
+wxImage DecodeImage(const Archive::Item& item)
+{
+    const Archive::Value *value = item.GetValue(TAGBASE64);
+    if (!value)
+        return wxImage();
+
+    // Loaded from XML the data is still base64.
+    const char *data;
+    size_t len;
+    wxMemoryBuffer buf;
+
+    if (!value->GetBytes(&data, &len)) {
+        buf = wxBase64Decode(value->GetString());
+        data = static_cast<const char*>(buf.GetData());
+        len = buf.GetDataLen();
+    }
+
+    wxImage img;
+    wxMemoryInputStream stream(data, len);
+    img.LoadFile(stream);
+    return img;
+}
+
+/**
+ * Decode the images of @a items into @a images, in the calling thread.
+ *
+ * Each call takes the next image to do from the shared counter @a next until
+ * there are none left, so any number of threads can share the work. Each
+ * item is only read by the thread that took it and each image is only
+ * written by it, so they need no locking.
+ */
+void DecodeShare(const std::vector<Archive::Item*>& items,
+                 std::vector<wxImage>& images,
+                 std::atomic<size_t>& next)
+{
+    for (size_t i = next++; i < items.size(); i = next++)
+        images[i] = DecodeImage(*items[i]);
+}
+
+/// A worker thread for Archive::DecodeImages().
+class ImageDecoder : public wxThread
+{
+public:
+    ImageDecoder(const std::vector<Archive::Item*>& items,
+                 std::vector<wxImage>& images,
+                 std::atomic<size_t>& next)
+      : wxThread(wxTHREAD_JOINABLE),
+        m_items(items),
+        m_images(images),
+        m_next(next)
+    { }
+
+    ImageDecoder(const ImageDecoder&) = delete;
+    ImageDecoder(ImageDecoder&&) = delete;
+    ImageDecoder& operator=(const ImageDecoder&) = delete;
+    ImageDecoder& operator=(ImageDecoder&&) = delete;
+
+    ~ImageDecoder() override = default;
+
+private:
+    ExitCode Entry() override
+    {
+        DecodeShare(m_items, m_images, m_next);
+        return 0;
+    }
+
+    const std::vector<Archive::Item*>& m_items;
+    std::vector<wxImage>& m_images;
+    std::atomic<size_t>& m_next;
+};
+
+} // namespace
+
+// ----------------------------------------------------------------------------
+// Archive
+// ----------------------------------------------------------------------------
+
+using std::make_pair;
+
+Archive::Archive()
+  : m_lastClass(NULL),
+    m_mapping(NULL),
+    m_indexed(false),
+    m_storing(true),
+    m_sorted(false),
+    m_format(Format_Xml)
+{
+}
+
+Archive::~Archive()
+{
+    Clear();
+}
+
+void Archive::Clear()
+{
+    for (Item *item : m_list)
+        delete item;
+
+    m_list.clear();
+    m_items.clear();
+    m_objects.clear();
+    m_sort.clear();
+    m_pending.clear();
+    m_indexed = false;
+    m_names.clear();
+    m_classes.clear();
+    m_lastClass = NULL;
+
+    // The values of the items may have referred to it.
+    delete m_mapping;
+    m_mapping = NULL;
+}
+
+bool Archive::Load(wxInputStream& stream, Consumer *consumer)
+{
+    GRAPH_STATS_TIMER(archiveLoad);
+    m_storing = false;
+    m_sorted = false;
+    m_format = Format_Xml;
+    Clear();
+
+    return LoadAny(stream, consumer);
+}
+
+bool Archive::LoadAny(wxInputStream& stream, Consumer *consumer)
+{
+    const char first = stream.Peek();
+    if (stream.LastRead() != 1)
+        return LoadXml(stream, consumer);
+
+    if (first == GZIPMAGIC[0]) {
+#if wxUSE_ZLIB
+        wxZlibInputStream unzip(stream, wxZLIB_GZIP);
+        return LoadAny(unzip, consumer);
+#else
+        wxLogError(_("Compressed archives are not supported."));
+        return false;
+#endif
+    }
+
+    if (first == BINMAGIC[0]) {
+        m_format = Format_Binary;
+        return LoadBinary(stream, consumer);
+    }
+
+    return LoadXml(stream, consumer);
+}
+
+bool Archive::Load(const wxString& path, Consumer *consumer)
+{
+    GRAPH_STATS_TIMER(archiveLoad);
+    m_storing = false;
+    m_sorted = false;
+    m_format = Format_Xml;
+    Clear();
+
+    m_mapping = new Mapping;
+    if (!m_mapping->Open(path))
+        return false;
+
+    const char *data = m_mapping->GetData();
+    size_t len = m_mapping->GetLength();
 
-void Generator::Pair(const wxString& name_and_attrs, const wxString& value)
-{
-    if (value.empty()) {
-        Start(name_and_attrs + _T("/"));
-        End(wxEmptyString);
+    // a compressed file can only be parsed as it's uncompressed
+    if (len != 0 && data[0] == GZIPMAGIC[0]) {
+        wxMemoryInputStream stream(data, len);
+        return LoadAny(stream, consumer);
     }
-    else {
-        Start(name_and_attrs);
-        CharData(value);
-        End(name_and_attrs.BeforeFirst(_T(' ')));
+
+    if (len != 0 && data[0] == BINMAGIC[0]) {
+        m_format = Format_Binary;
+        return LoadBinary(data, len, consumer);
     }
+
+    return LoadXml(data, len, consumer);
 }
 
-void Generator::Start(const wxString& name_and_attrs)
+bool Archive::Save(wxOutputStream& stream, Format format) const
 {
-    m_leaf = true;
-
-    wxString buf;
-    buf << _T("\n") << wxString(_T(' '), m_depth * 2)
-        << _T("<") << name_and_attrs << _T(">");
-    Write(buf);
+    GRAPH_STATS_TIMER(archiveSave);
+    if (format == Format_Binary)
+        return SaveBinary(stream);
 
-    m_depth++;
+    return SaveXml(stream);
 }
 
-void Generator::End(const wxString& name)
+bool Archive::Save(const wxString& path, Format format, bool compress) const
 {
-    m_depth--;
+    wxFileOutputStream file(path);
+    if (!file.IsOk())
+        return false;
 
-    if (!name.empty()) {
-        wxString buf;
-        if (!m_leaf)
-            buf << _T("\n") << wxString(_T(' '), m_depth * 2);
-        buf << _T("</") + name + _T(">");
-        Write(buf);
+    if (compress) {
+#if wxUSE_ZLIB
+        wxZlibOutputStream zip(file, wxZ_DEFAULT_COMPRESSION, wxZLIB_GZIP);
+        return Save(zip, format) && zip.Close() && file.Close();
+#else
+        wxLogError(_("Compressed archives are not supported."));
+        return false;
+#endif
     }
 
-    m_leaf = false;
+    return Save(file, format) && file.Close();
 }
 
-void Generator::CharData(const wxString& str)
+void Archive::DecodeImages(unsigned threads)
 {
-    wxString::const_iterator it = str.begin();
-    wxString buf;
-    int square = 0;
+    GRAPH_STATS_TIMER(archiveDecode);
 
-    while (it != str.end()) {
-        wxChar ch = *it++;
-        switch (ch) {
-            case _T('&'):
-                buf += _T("&amp;");
-                break;
-            case _T('<'):
-                buf += _T("&lt;");
-                break;
-            case _T('>'):
-                if (square >= 2)
-                    buf += _T("&gt;");
-                else
-                    buf += ch;
-                break;
-            default:
-                buf += ch;
-        }
-        square = ch == _T(']') ? square + 1 : 0;
+    std::vector<Item*> items;
+    for (Item *item : m_list)
+        if (item->GetClass() == TAGIMAGE && !item->GetInstance())
+            items.push_back(item);
 
-        if (buf.length() >= bufsize) {
-            Write(buf);
-            buf.clear();
-        }
+    if (items.empty())
+        return;
+
+    if (threads == 0)
+        threads = unsigned(std::max(wxThread::GetCPUCount(), 1));
+    threads = unsigned(std::min(size_t(threads), items.size()));
+
+    std::vector<wxImage> images(items.size());
+    std::atomic<size_t> next(0);
+
+    // this thread decodes too, so start one less worker
+    std::vector<std::unique_ptr<ImageDecoder> > workers;
+    for (unsigned i = 1; i < threads; i++) {
+        std::unique_ptr<ImageDecoder> worker(
+            new ImageDecoder(items, images, next));
+        if (worker->Run() != wxTHREAD_NO_ERROR)
+            break;
+        workers.push_back(std::move(worker));
     }
 
-    if (!buf.empty())
-        Write(buf);
+    DecodeShare(items, images, next);
+
+    for (auto& worker : workers)
+        worker->Wait();
+
+    for (size_t i = 0; i < items.size(); i++)
+        if (images[i].IsOk())
+            items[i]->SetInstance(new wxImage(images[i]), true);
 }
 
-/**
- * Return XML representation of an attribute with the given name and value.
- *
- * Any special characters in the attribute value @a str (bot not in its @a
- * name) are escaped.
- */
-wxString Attribute(const wxString& name, const wxString& str)
+bool Archive::LoadBinary(wxInputStream& stream, Consumer *consumer)
 {
-    wxString::const_iterator it = str.begin();
-    wxString attr;
+    BinaryReader in(stream);
+    return ParseBinary(in, *this, &m_sorted, consumer);
+}
 
-    attr += _T(" ");
-    attr += name;
-    attr += _T("=\"");
+bool Archive::LoadBinary(const char *data, size_t len, Consumer *consumer)
+{
+    BinaryReader in(data, len);
+    return ParseBinary(in, *this, &m_sorted, consumer);
+}
 
-    while (it != str.end()) {
-        wxChar ch = *it++;
-        switch (ch) {
-            case _T('<'): attr += _T("&lt;"); break;
-            case _T('&'): attr += _T("&amp;"); break;
-            case _T('"'): attr += _T("&quot;"); break;
-            default:      attr += ch;
+bool Archive::SaveBinary(wxOutputStream& stream) const
+{
+    // The ids come first in the string table, so that the index of an id is
+    // the same as the index of its item. The class names and sort keys are
+    // few, as are the attribute names which are already interned.
+    std::vector<const wxString*> strings;
+    std::map<wxString, size_t> names;
+    std::unordered_map<const wxString*, size_t> keys;
+
+    for (const Item *item : m_list)
+        strings.push_back(&item->GetId());
+
+    for (const Item *item : m_list) {
+        const wxString *str[] = { &item->GetClass(), &item->GetSort() };
+
+        for (const wxString *s : str) {
+            if (names.insert(make_pair(*s, strings.size())).second)
+                strings.push_back(s);
+        }
+
+        for (const auto& j : MakeRange(item->GetAttribs())) {
+            const wxString *name = &j.first.GetName();
+            if (keys.insert(make_pair(name, strings.size())).second)
+                strings.push_back(name);
         }
     }
 
-    attr += _T("\"");
-    return attr;
-}
+    BinaryWriter out(stream);
 
-} // namespace
+    out.Write(BINMAGIC, BINMAGICLEN);
+    out.Varint(BINVERSION);
+    out.Varint(BINSORTED);
 
-// ----------------------------------------------------------------------------
-// Archive
-// ----------------------------------------------------------------------------
+    out.Varint(strings.size());
+    for (const wxString *str : strings)
+        out.String(*str);
 
-using std::make_pair;
+    out.Varint(m_list.size());
 
-Archive::Archive()
-  : m_storing(true)
-{
-}
+    for (const auto& i : MakeRange(GetItems())) {
+        const Item *item = i.second;
 
-Archive::~Archive()
-{
-    Clear();
-}
+        out.Varint(names[item->GetClass()]);
+        out.Varint(item->GetIndex());
+        out.Varint(names[item->GetSort()]);
+        out.Varint(item->m_attribs.size());
 
-void Archive::Clear()
-{
-    for (ItemMap::iterator it = m_items.begin(); it != m_items.end(); ++it)
-        delete it->second;
+        for (const auto& j : MakeRange(item->GetAttribs())) {
+            const Value& value = j.second;
+            out.Varint(keys[&j.first.GetName()]);
+
+            // The typed values are written as they are held, for Type_Ints
+            // that's already the encoding of the binary format.
+            switch (value.GetType()) {
+                case Value::Type_Ints:
+                    out.Varint(Value_Ints);
+                    out.Write(value.m_data, value.m_len);
+                    continue;
+
+                case Value::Type_Bytes:
+                    out.Varint(Value_Base64);
+                    out.Varint(value.m_len);
+                    out.Write(value.m_data, value.m_len);
+                    continue;
+
+                case Value::Type_String:
+                    break;
+            }
 
-    m_items.clear();
-    m_sort.clear();
+            ItemMap::const_iterator ref = m_items.find(value.GetString());
+            if (ref != m_items.end()) {
+                out.Varint(Value_Ref);
+                out.Varint(ref->second->GetIndex());
+                continue;
+            }
+
+            out.Varint(Value_String);
+            out.String(value.GetString());
+        }
+    }
+
+    out.Flush();
+    return stream.IsOk();
 }
 
 #ifdef NO_EXPAT
@@ -478,11 +1818,8 @@ wxString FromXml(const wxString& str)  { return str; }
 
 } // namespace
 
-bool Archive::Load(wxInputStream& stream)
+bool Archive::LoadXml(wxInputStream& stream, Consumer *consumer)
 {
-    m_storing = false;
-    Clear();
-
     wxXmlDocument doc;
 
     if (!doc.Load(stream))
@@ -495,6 +1832,8 @@ bool Archive::Load(wxInputStream& stream)
         return false;
     }
 
+    m_sorted = root->GetAttribute(TAGSORTED) == _T("1");
+
     wxXmlNode *node = root->GetChildren();
 
     while (node) {
@@ -520,6 +1859,9 @@ bool Archive::Load(wxInputStream& stream)
 
                     attrnode = attrnode->GetNext();
                 }
+
+                if (consumer && !consumer->OnItem(*item))
+                    return false;
             }
             else {
                 wxLogError(_("Error loading <%s %s='%s'> id is not unique"),
@@ -536,64 +1878,96 @@ bool Archive::Load(wxInputStream& stream)
     return true;
 }
 
+bool Archive::LoadXml(const char *data, size_t len, Consumer *consumer)
+{
+    wxMemoryInputStream stream(data, len);
+    return LoadXml(stream, consumer);
+}
+
 #else // NO_EXPAT
 
-bool Archive::Load(wxInputStream& stream)
+bool Archive::LoadXml(wxInputStream& stream, Consumer *consumer)
 {
-    m_storing = false;
-    Clear();
+    XML_Parser parser = XML_ParserCreate(NULL);
+    Parser handler(parser, this, &m_sorted, consumer);
+    SetupParser(parser, &handler);
+
+    // Read directly into the parser's own buffer to avoid copying the data.
+    XML_Status status = XML_STATUS_OK;
+    bool done = false;
+
+    while (status == XML_STATUS_OK && !done) {
+        void *buf = XML_GetBuffer(parser, static_cast<int>(bufsize));
+        if (!buf) {
+            status = XML_STATUS_ERROR;
+            break;
+        }
+
+        size_t len = stream.Read(buf, bufsize).LastRead();
+        done = len < bufsize;
+        status = XML_ParseBuffer(parser, static_cast<int>(len), done);
+    }
+
+    return FinishParser(parser, status);
+}
+
+bool Archive::LoadXml(const char *data, size_t len, Consumer *consumer)
+{
+    // The values can't refer to the document if it's in UTF-16, which
+    // would start with a byte order mark.
+    bool utf16 = len >= 2 &&
+                 ((data[0] == '\xfe' && data[1] == '\xff') ||
+                  (data[0] == '\xff' && data[1] == '\xfe'));
 
-    Parser handler(this);
     XML_Parser parser = XML_ParserCreate(NULL);
-    XML_SetUserData(parser, &handler);
-    XML_SetElementHandler(parser, start_element, end_element);
-    XML_SetCharacterDataHandler(parser, char_data);
+    Parser handler(parser, this, &m_sorted, consumer, utf16 ? NULL : data);
+    SetupParser(parser, &handler);
 
-    wxCharBuffer buf(bufsize);
+    // Parse the document in place, in pieces as expat takes an int length.
+    const size_t maxchunk = 1 << 30;
     XML_Status status = XML_STATUS_OK;
+    size_t pos = 0;
 
-    size_t len;
-    while (status == XML_STATUS_OK &&
-            (len = stream.Read(buf.data(), bufsize).LastRead()) != 0)
-        status = XML_Parse(parser, buf, static_cast<int>(len), len < bufsize);
+    do {
+        size_t n = std::min(len - pos, maxchunk);
+        status = XML_Parse(parser, data + pos, static_cast<int>(n),
+                           pos + n == len);
+        pos += n;
+    } while (status == XML_STATUS_OK && pos < len);
 
-    XML_ParserFree(parser);
-    return status == XML_STATUS_OK;
+    return FinishParser(parser, status);
 }
 
 #endif // NO_EXPAT
 
-bool Archive::Save(wxOutputStream& stream) const
+bool Archive::SaveXml(wxOutputStream& stream) const
 {
     Generator out(stream);
     out.Write("<?xml version=\"1.0\" encoding=\"utf-8\"?>");
     out.Start(TAGARCHIVE);
+    out.Attribute(TAGSORTED, _T("1"));
 
-    ItemMap::const_iterator i;
-
-    for (i = m_items.begin(); i != m_items.end(); ++i) {
-        wxString id = i->first;
-        const Item *item = i->second;
-        wxString classname = item->GetClass();
-        wxString sortkey = item->GetSort();
+    // Write the items in sort key order, so that they can be processed as
+    // they are read by Load(), see IsSorted().
+    for (const auto& i : MakeRange(GetItems())) {
+        const Item *item = i.second;
+        const wxString& classname = item->GetClass();
+        const wxString& sortkey = item->GetSort();
 
-        wxString attrs = Attribute(TAGID, id);
+        out.Start(classname);
+        out.Attribute(TAGID, item->GetId());
         if (!sortkey.empty())
-            attrs += Attribute(TAGSORT, sortkey);
-        out.Start(classname + attrs);
+            out.Attribute(TAGSORT, sortkey);
 
-        for (const auto& j : MakeRange(item->GetAttribs())) {
-            wxString pname = j.first;
-            wxString value = j.second;
-
-            out.Pair(pname, value);
-        }
+        for (const auto& j : MakeRange(item->GetAttribs()))
+            out.Pair(j.first, j.second);
 
         out.End(classname);
     }
 
     out.End(TAGARCHIVE);
     out.Write("\n");
+    out.Flush();
 
     return stream.IsOk();
 }
@@ -602,17 +1976,43 @@ Archive::Item *Archive::Put(const wxString& name,
                             const wxString& id,
                             const wxString& sort)
 {
+    std::pair<ItemMap::iterator, bool> added =
+        m_items.insert(make_pair(id, static_cast<Item*>(NULL)));
+
+    if (!added.second)
+        return NULL;
+
     Item *item = new Item(*this, name, id, sort);
-    bool added = m_items.insert(make_pair(id, item)).second;
+    item->m_index = m_list.size();
+    m_list.push_back(item);
+    added.first->second = item;
+
+    SortAdd(item);
+
+    return item;
+}
 
-    if (added) {
-        if (m_sort.size() != 0)
-            SortAdd(item);
-        return item;
+Archive::Item *Archive::PutObject(const wxString& name,
+                                  const void *obj,
+                                  const wxString& sort)
+{
+    std::pair<ObjectMap::iterator, bool> added =
+        m_objects.insert(make_pair(obj, static_cast<Item*>(NULL)));
+
+    if (!added.second)
+        return NULL;
+
+    Item *item = Put(name, MakeId(obj), sort);
+
+    if (item) {
+        item->m_object = obj;
+        added.first->second = item;
+    }
+    else {
+        m_objects.erase(added.first);
     }
 
-    delete item;
-    return NULL;
+    return item;
 }
 
 bool Archive::Remove(const wxString& id)
@@ -622,8 +2022,18 @@ bool Archive::Remove(const wxString& id)
     if (it == m_items.end())
         return false;
 
-    SortRemove(it->second);
-    delete it->second;
+    Item *item = it->second;
+
+    SortRemove(item);
+    if (item->m_object)
+        m_objects.erase(item->m_object);
+
+    // Keep the remaining items in order, removing items is rare.
+    m_list.erase(m_list.begin() + item->m_index);
+    for (size_t i = item->m_index; i < m_list.size(); i++)
+        m_list[i]->m_index = i;
+
+    delete item;
     m_items.erase(it);
     return true;
 }
@@ -645,37 +2055,123 @@ wxObject *Archive::GetInstance(const wxString& id) const {
     return item ? item->GetInstance() : NULL;
 }
 
+Archive::Item *Archive::FindObject(const void *obj) const
+{
+    ObjectMap::const_iterator it = m_objects.find(obj);
+    return it != m_objects.end() ? it->second : NULL;
+}
+
+Archive::Key Archive::Intern(const wxString& name)
+{
+    return Key(&*m_names.insert(name).first);
+}
+
+Archive::ClassMap::value_type *Archive::InternClass(const wxString& name)
+{
+    if (!m_lastClass || m_lastClass->first != name)
+        m_lastClass = &*m_classes.emplace(name, ClassMap::mapped_type()).first;
+
+    return m_lastClass;
+}
+
+bool Archive::FindKey(const wxString& name, Key *key) const
+{
+    NameSet::const_iterator it = m_names.find(name);
+
+    if (it == m_names.end())
+        return false;
+
+    *key = Key(&*it);
+    return true;
+}
+
 wxString Archive::MakeId(const void *p)
 {
-    return wxString::Format(_T("%p"), p);
+    // This is called for every stored object, so format the address in hex
+    // directly instead of using the much slower wxString::Format("%p").
+    static const wxChar digits[] = _T("0123456789abcdef");
+    wxChar buf[2 + 2 * sizeof(wxUIntPtr)];
+    wxChar *end = buf + WXSIZEOF(buf);
+    wxChar *begin = end;
+    wxUIntPtr n = wxPtrToUInt(p);
+
+    do {
+        *--begin = digits[n & 0xf];
+        n >>= 4;
+    } while (n);
+
+    *--begin = _T('x');
+    *--begin = _T('0');
+
+    return wxString(begin, end - begin);
+}
+
+bool Archive::SortLess(const SortIndex::value_type& a,
+                       const SortIndex::value_type& b)
+{
+    int cmp = a.first.GetName().compare(b.first.GetName());
+    return cmp < 0 || (cmp == 0 && a.second->m_index < b.second->m_index);
 }
 
 void Archive::Sort() const
 {
-    if (m_sort.size() == 0) {
-        ItemMap::const_iterator it;
-        for (it = m_items.begin(); it != m_items.end(); ++it)
-            SortAdd(it->second);
+    if (!m_indexed) {
+        m_sort.clear();
+        m_sort.reserve(m_list.size());
+
+        for (Item *item : m_list)
+            m_sort.push_back(make_pair(Key(&item->m_sort), item));
+
+        std::sort(m_sort.begin(), m_sort.end(), SortLess);
+        m_indexed = true;
+    }
+    else if (!m_pending.empty()) {
+        // Drop the old entries of the items whose keys were changed, then
+        // merge all the pending items in one go.
+        m_sort.erase(std::remove_if(m_sort.begin(), m_sort.end(),
+                                    [](const SortIndex::value_type& e)
+                                        { return e.second->m_pending; }),
+                     m_sort.end());
+
+        size_t count = m_sort.size();
+
+        for (Item *item : m_pending) {
+            m_sort.push_back(make_pair(Key(&item->m_sort), item));
+            item->m_pending = false;
+        }
+
+        std::sort(m_sort.begin() + count, m_sort.end(), SortLess);
+        std::inplace_merge(m_sort.begin(), m_sort.begin() + count,
+                           m_sort.end(), SortLess);
     }
 
-    wxASSERT(m_sort.size() == m_items.size());
+    m_pending.clear();
+
+    wxASSERT(m_sort.size() == m_list.size());
 }
 
 void Archive::SortAdd(Item *item) const
 {
-    m_sort.insert(make_pair(item->GetSort(), item));
+    if (m_indexed && !item->m_pending) {
+        item->m_pending = true;
+        m_pending.push_back(item);
+    }
 }
 
 void Archive::SortRemove(Item *item) const
 {
-    wxString key = item->GetSort();
+    if (!m_indexed)
+        return;
 
-    for (const auto& it : MakeRange(m_sort.equal_range(key))) {
-        if (it.second == item) {
-            m_sort.erase(it.first);
-            break;
-        }
-    }
+    Sort();
+
+    SortIndex::iterator it = std::lower_bound(m_sort.begin(), m_sort.end(),
+                                              make_pair(Key(&item->m_sort),
+                                                        item),
+                                              SortLess);
+
+    wxASSERT(it != m_sort.end() && it->second == item);
+    m_sort.erase(it);
 }
 
 void Archive::SortItem(Item& item, const wxString& key)
@@ -683,14 +2179,8 @@ void Archive::SortItem(Item& item, const wxString& key)
     if (&item.m_archive != this)
         return;
 
-    if (m_sort.size() != 0) {
-        SortRemove(&item);
-        item.m_sort = key;
-        SortAdd(&item);
-    }
-    else {
-        item.m_sort = key;
-    }
+    item.m_sort = key;
+    SortAdd(&item);
 }
 
 Archive::iterator_pair Archive::DoGetItems(const wxString& prefix) const
@@ -704,7 +2194,13 @@ Archive::iterator_pair Archive::DoGetItems(const wxString& prefix) const
     wxString::reference ch = *last.rbegin();
     ch = wxChar(ch) + 1;
 
-    return make_pair(m_sort.lower_bound(prefix), m_sort.lower_bound(last));
+    auto less = [](const SortIndex::value_type& e, const wxString& key)
+        { return e.first.GetName() < key; };
+
+    return make_pair(std::lower_bound(m_sort.begin(), m_sort.end(),
+                                      prefix, less),
+                     std::lower_bound(m_sort.begin(), m_sort.end(),
+                                      last, less));
 }
 
 Archive::iterator_pair Archive::GetItems(const wxString& prefix)
@@ -726,18 +2222,51 @@ Archive::Item::Item(Archive& archive,
                     const wxString& id,
                     const wxString& sort)
   : m_archive(archive),
-    m_class(name),
+    m_class(archive.InternClass(name)),
     m_id(id),
     m_sort(sort),
+    m_index(0),
+    m_object(NULL),
+    m_pending(false),
     m_instance(NULL),
     m_owns(false)
 {
 }
 
+void Archive::Item::SetClass(const wxString& name)
+{
+    m_class = m_archive.InternClass(name);
+}
+
+Archive::Item::const_iterator Archive::Item::Find(const wxString& name) const
+{
+    Key key(NULL);
+
+    if (m_archive.FindKey(name, &key)) {
+        for (const_iterator it = m_attribs.begin(); it != m_attribs.end(); ++it)
+            if (it->first == key)
+                return it;
+    }
+
+    return m_attribs.end();
+}
+
 /** @cond */
 bool Archive::Item::Put(const wxString& name, const wxString& value)
 {
-    return m_attribs.insert(make_pair(name, value)).second;
+    return Put(name, Value(value));
+}
+
+bool Archive::Item::Put(const wxString& name, const Value& value)
+{
+    Key key = m_archive.Intern(name);
+
+    for (const auto& it : m_attribs)
+        if (it.first == key)
+            return false;
+
+    m_attribs.push_back(make_pair(key, value));
+    return true;
 }
 
 bool Archive::Item::Put(const wxString& name, const wxChar *value)
@@ -747,10 +2276,10 @@ bool Archive::Item::Put(const wxString& name, const wxChar *value)
 
 bool Archive::Item::Get(const wxString& name, wxString& value) const
 {
-    const_iterator it = m_attribs.find(name);
+    const_iterator it = Find(name);
     if (it == m_attribs.end())
         return false;
-    value = it->second;
+    value = it->second.GetString();
     return true;
 }
 
@@ -762,12 +2291,22 @@ wxString Archive::Item::Get(const wxString& name) const
 
 bool Archive::Item::Has(const wxString& name) const
 {
-    return m_attribs.find(name) != m_attribs.end();
+    return Find(name) != m_attribs.end();
+}
+
+const Archive::Value *Archive::Item::GetValue(const wxString& name) const
+{
+    const_iterator it = Find(name);
+    return it != m_attribs.end() ? &it->second : NULL;
 }
 
 bool Archive::Item::Remove(const wxString& name)
 {
-    return m_attribs.erase(name) > 0;
+    const_iterator it = Find(name);
+    if (it == m_attribs.end())
+        return false;
+    m_attribs.erase(m_attribs.begin() + (it - m_attribs.begin()));
+    return true;
 }
 
 void Archive::Item::SetInstance(wxObject *instance, bool owns)
@@ -796,90 +2335,178 @@ Archive::Item::const_iterator_pair Archive::Item::GetAttribs() const
 namespace {
 
 /**
- * Store a pair of integer values in the archive.
+ * Store a list of integer values in the archive.
  *
- * Values are stored comma-separated.
+ * The value is kept as integers by the binary format, and its string, used
+ * by the XML format, is the values comma-separated.
  *
- * Use GetPair() to extract them back.
+ * Use GetInts() to extract them back.
+ */
+bool PutInts(Archive::Item& arc,
+             const wxString& name,
+             std::initializer_list<wxInt64> ints)
+{
+    return arc.Put(name, Archive::Value(std::vector<wxInt64>(ints)));
+}
+
+/**
+ * Extract @a count integer values stored by PutInts().
  *
- * The template parameter T must be a struct type with x and y members.
+ * The string of a value that isn't typed, e.g. loaded from XML, is parsed
+ * instead and must hold exactly @a count comma separated integers.
  */
-template <class T>
-bool PutPair(Archive::Item& arc, const wxString& name, const T& value)
+bool GetInts(const Archive::Item& arc,
+             const wxString& name,
+             int *values,
+             size_t count)
 {
-    return arc.Put(name, wxString() << value.x << _T(",") << value.y);
+    const Archive::Value *value = arc.GetValue(name);
+    if (!value)
+        return false;
+
+    std::vector<wxInt64> ints;
+
+    if (value->GetInts(ints)) {
+        if (ints.size() != count)
+            return false;
+
+        for (size_t i = 0; i < count; i++) {
+            if (ints[i] < INT_MIN || ints[i] > INT_MAX)
+                return false;
+            values[i] = int(ints[i]);
+        }
+
+        return true;
+    }
+
+    const wxChar *p = c_str(value->GetString());
+
+    for (size_t i = 0; i < count; i++) {
+        if (i && *p++ != _T(','))
+            return false;
+
+        wxChar *end;
+        long n = wxStrtol(p, &end, 10);
+        if (end == p || n < INT_MIN || n > INT_MAX)
+            return false;
+
+        values[i] = int(n);
+        p = end;
+    }
+
+    // Fail on trailing garbage, e.g. "12abc".
+    return *p == 0;
 }
 
 /**
- * Extract a pair of integer values stored by PutPair().
+ * Extract an integer stored by PutInts(), or as text by the generic
+ * Extract().
  */
 template <class T>
-bool GetPair(const Archive::Item& arc, const wxString& name, T& value)
+bool GetInteger(const Archive::Item& arc, const wxString& name, T& value)
 {
-    wxString str;
-    if (!arc.Get(name, str))
-        return false;
+    const Archive::Value *stored = arc.GetValue(name);
+    std::vector<wxInt64> ints;
+
+    if (!stored || !stored->GetInts(ints))
+        return Extract<T>(arc, name, value);
 
-    int x, y;
-    if (wxSscanf(str.c_str(), _T("%d,%d"), &x, &y) != 2)
+    if (ints.size() != 1 ||
+            ints[0] < wxInt64(std::numeric_limits<T>::min()) ||
+            ints[0] > wxInt64(std::numeric_limits<T>::max()))
         return false;
 
-    value.x = x;
-    value.y = y;
+    value = T(ints[0]);
     return true;
 }
 
 } // namespace
 
+/// Store an integer in the archive.
+bool Insert(Archive::Item& arc, const wxString& name, int value)
+{
+    return PutInts(arc, name, { value });
+}
+
+/// Extract an integer from the archive.
+bool Extract(const Archive::Item& arc, const wxString& name, int& value)
+{
+    return GetInteger(arc, name, value);
+}
+
+/// Store an unsigned integer in the archive.
+bool Insert(Archive::Item& arc, const wxString& name, unsigned value)
+{
+    return PutInts(arc, name, { value });
+}
+
+/// Extract an unsigned integer from the archive.
+bool Extract(const Archive::Item& arc, const wxString& name, unsigned& value)
+{
+    return GetInteger(arc, name, value);
+}
+
+/// Store a long integer in the archive.
+bool Insert(Archive::Item& arc, const wxString& name, long value)
+{
+    return PutInts(arc, name, { value });
+}
+
+/// Extract a long integer from the archive.
+bool Extract(const Archive::Item& arc, const wxString& name, long& value)
+{
+    return GetInteger(arc, name, value);
+}
+
 /// Store a point in the archive.
 bool Insert(Archive::Item& arc, const wxString& name, const wxPoint& value)
 {
-    return PutPair(arc, name, value);
+    return PutInts(arc, name, { value.x, value.y });
 }
 
 /// Extract a point from the archive.
 bool Extract(const Archive::Item& arc, const wxString& name, wxPoint& value)
 {
-    return GetPair(arc, name, value);
+    int v[2];
+    if (!GetInts(arc, name, v, 2))
+        return false;
+
+    value = wxPoint(v[0], v[1]);
+    return true;
 }
 
 /// Store a size in the archive.
 bool Insert(Archive::Item& arc, const wxString& name, const wxSize& value)
 {
-    return PutPair(arc, name, value);
+    return PutInts(arc, name, { value.x, value.y });
 }
 
 /// Extract a size from the archive.
 bool Extract(const Archive::Item& arc, const wxString& name, wxSize& value)
 {
-    return GetPair(arc, name, value);
+    int v[2];
+    if (!GetInts(arc, name, v, 2))
+        return false;
+
+    value = wxSize(v[0], v[1]);
+    return true;
 }
 
 /// Store a rectangle in the archive.
 bool Insert(Archive::Item& arc, const wxString& name, const wxRect& value)
 {
-    wxString str;
-
-    str << value.x << _T(",")
-        << value.y << _T(",")
-        << value.width << _T(",")
-        << value.height;
-
-    return arc.Put(name, str);
+    return PutInts(arc, name,
+                   { value.x, value.y, value.width, value.height });
 }
 
 /// Extract a rectangle from the archive.
 bool Extract(const Archive::Item& arc, const wxString& name, wxRect& value)
 {
-    wxString str;
-    if (!arc.Get(name, str))
-        return false;
-
-    int x, y, w, h;
-    if (wxSscanf(str.c_str(), _T("%d,%d,%d,%d"), &x, &y, &w, &h) != 4)
+    int v[4];
+    if (!GetInts(arc, name, v, 4))
         return false;
 
-    value = wxRect(x, y, w, h);
+    value = wxRect(v[0], v[1], v[2], v[3]);
     return true;
 }
 
@@ -968,31 +2595,20 @@ namespace {
 /// Store an image in the archive.
 void PutImage(Archive::Item *item, const wxImage& img, wxBitmapType type)
 {
-    wxString value;
-
-    {
-        wxMemoryOutputStream stream;
-        img.SaveFile(stream, type);
-
-        const size_t len = size_t(stream.GetLength());
-        wxCharBuffer buf(len);
+    wxMemoryOutputStream stream;
+    img.SaveFile(stream, type);
 
-        stream.CopyTo(buf.data(), len);
-
-        value = wxBase64Encode(buf, len);
-    }
+    const size_t len = size_t(stream.GetLength());
+    const void *data = stream.GetOutputStreamBuffer()->GetBufferStart();
 
-    item->Put(TAGBASE64, value);
+    item->Put(TAGBASE64, Archive::Value(data, len));
 }
 
-/// Extract an image from the archive.
+/// Extract an image from the archive, unless DecodeImages() already did.
 wxImage GetImage(Archive::Item *item)
 {
-    wxMemoryBuffer buf = wxBase64Decode(item->Get(TAGBASE64));
-    wxImage img;
-    wxMemoryInputStream stream(buf, buf.GetDataLen());
-    img.LoadFile(stream);
-    return img;
+    wxImage *decoded = item->GetInstance<wxImage>();
+    return decoded ? *decoded : DecodeImage(*item);
 }
 
 } // namespace
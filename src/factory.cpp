@@ -23,10 +23,13 @@ namespace impl {
 /// Factories registry allowing fast access by string key.
 using ClassMap = std::unordered_map<wxString, FactoryBase *>;
 
-/// Registry indexing factories by their type name from type info.
-ClassMap& GetIndexByType()
+/// Factories registry allowing fast access by type.
+using TypeMap = std::unordered_map<std::type_index, FactoryBase *>;
+
+/// Registry indexing factories by the type of the objects they create.
+TypeMap& GetIndexByType()
 {
-    static ClassMap s_typeidx;
+    static TypeMap s_typeidx;
     return s_typeidx;
 }
 
@@ -62,8 +65,7 @@ FactoryBase *FactoryBase::Get(const std::type_info& type)
     auto& typeidx = GetIndexByType();
 
     if (!typeidx.empty()) {
-        wxString key = wxString::FromAscii(type.name());
-        ClassMap::const_iterator it = typeidx.find(key);
+        TypeMap::const_iterator it = typeidx.find(std::type_index(type));
 
         if (it != typeidx.end())
             return it->second;
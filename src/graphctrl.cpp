@@ -43,13 +43,28 @@
  */
 
 #include "graphctrl.h"
+#include "graphoverview.h"
 #include "tipwin.h"
+#include <wx/clipbrd.h>
+#include <wx/dcgraph.h>
+#include <wx/file.h>
+#include <wx/geometry.h>
 #include <wx/math.h>
+#include <wx/mstream.h>
 #include <wx/richtooltip.h>
+#include <wx/thread.h>
+#include <wx/tokenzr.h>
 #include <wx/tooltip.h>
 #include <wx/ogl/ogl.h>
-#include <bitset>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #ifndef NO_GRAPHVIZ
 
@@ -101,6 +116,14 @@ DEFINE_EVENT_TYPE(Evt_Graph_Edge_Delete)
 DEFINE_EVENT_TYPE(Evt_Graph_Connect_Feedback)
 DEFINE_EVENT_TYPE(Evt_Graph_Connect)
 
+DEFINE_EVENT_TYPE(Evt_Graph_Layout_Progress)
+DEFINE_EVENT_TYPE(Evt_Graph_Layout_Done)
+DEFINE_EVENT_TYPE(Evt_Graph_Layout_Cancel)
+
+DEFINE_EVENT_TYPE(Evt_Graph_Changed)
+DEFINE_EVENT_TYPE(Evt_Graph_Batch_Add)
+DEFINE_EVENT_TYPE(Evt_Graph_Batch_Delete)
+
 // GraphCtrl Events
 
 DEFINE_EVENT_TYPE(Evt_Graph_Node_Click)
@@ -177,16 +200,6 @@ public:
     }
 };
 
-/**
- * Return a unique node name.
- *
- * This name is not user-readable and is only used inside dot files.
- */
-wxString NodeName(const GraphNode& node)
-{
-    return wxString::Format(_T("n%p"), &node);
-}
-
 /**
  * Helper function returning the canvas if the shape has it or @c NULL.
  */
@@ -204,39 +217,45 @@ char *unconst(const char *str)
     return const_cast<char*>(str);
 }
 
+/**
+ * Estimate the memory used by the nodes and buckets of an unordered container.
+ */
+template <class C>
+size_t HashedMemoryUsage(const C& c)
+{
+    return c.size() * (sizeof(typename C::value_type) + 2 * sizeof(void*)) +
+           c.bucket_count() * sizeof(void*);
+}
+
+/**
+ * Return the nodes found by one of the const internal indices for the public
+ * API, as the graph gives access to its nodes.
+ */
+vector<GraphNode*> ToNodes(const vector<const GraphNode*>& nodes)
+{
+    vector<GraphNode*> result;
+    result.reserve(nodes.size());
+    for (const auto node : nodes)
+        result.push_back(const_cast<GraphNode*>(node));
+    return result;
+}
+
 /**
  * Create a polygon shape from the given 2D array of points.
  */
 wxPolygonShape *CreatePolygon(int num_points, const int points[][2])
 {
-    wxList *list = new wxList;
+    wxOGLPoints vertices;
+    vertices.reserve(num_points);
 
     for (int i = 0; i < num_points; i++)
-        list->Append(reinterpret_cast<wxObject*>
-                     (new wxRealPoint(points[i][0], points[i][1])));
+        vertices.push_back(wxRealPoint(points[i][0], points[i][1]));
 
     wxPolygonShape *shape = new wxPolygonShape;
-    shape->Create(list);
+    shape->Create(vertices);
     return shape;
 }
 
-/**
- * Return the value between the given limits.
- *
- * Return the original @a value if it is already between @a limit1 and @a
- * limit2 or the lower/upper limit if the value is too low/high.
- *
- * Notice that the limits can be specified in any order.
- */
-int between(int value, int limit1, int limit2)
-{
-    int lo = min(limit1, limit2);
-    int hi = max(limit1, limit2);
-    value = max(value, lo);
-    value = min(value, hi);
-    return value;
-}
-
 /**
  * Add a line connecting the two given nodes.
  */
@@ -294,7 +313,11 @@ wxSize GetScreenDPI()
         // compared to the standard resolution one. Hence we have to scale by
         // the content resolution factor -- which we currently suppose to be
         // the same for all windows (which is, of course, not true in general).
-        dpi /= wxTheApp->GetTopWindow()->GetContentScaleFactor();
+        // A process without windows, e.g. one using only headless graphs,
+        // doesn't have any scale factor.
+        wxWindow *top = wxTheApp ? wxTheApp->GetTopWindow() : NULL;
+        if (top)
+            dpi /= top->GetContentScaleFactor();
     }
 
     return dpi;
@@ -325,6 +348,30 @@ Initialisor::~Initialisor()
 
 } // namespace impl
 
+// ----------------------------------------------------------------------------
+// Statistics
+// ----------------------------------------------------------------------------
+
+#ifdef GRAPH_STATS
+
+namespace impl {
+
+GraphStats& GetStatsData()
+{
+    static GraphStats stats;
+    return stats;
+}
+
+wxCriticalSection& GetStatsLock()
+{
+    static wxCriticalSection cs;
+    return cs;
+}
+
+} // namespace impl
+
+#endif // GRAPH_STATS
+
 // ----------------------------------------------------------------------------
 // GraphEvent
 // ----------------------------------------------------------------------------
@@ -337,7 +384,8 @@ GraphEvent::GraphEvent(wxEventType commandType, int winid)
     m_target(NULL),
     m_edge(NULL),
     m_sources(NULL),
-    m_zoom(0)
+    m_zoom(0),
+    m_progress(0)
 {
 }
 
@@ -362,6 +410,8 @@ public:
                  const wxSize& size = wxDefaultSize,
                  long style = wxBORDER | wxRETAINED,
                  const wxString& name = DefaultName);
+    /// Headless ctor, the window isn't created.
+    explicit GraphCanvas(const GraphMetrics *metrics);
     ~GraphCanvas() override;
 
     GraphCanvas(const GraphCanvas&) = delete;
@@ -390,7 +440,8 @@ public:
     /**
      * Called when left mouse button is clicked.
      *
-     * Deselects all items and generates a Evt_Graph_Click event.
+     * Deselects all items and generates a Evt_Graph_Click event. In a view,
+     * the node clicked, if any, is selected instead.
      */
     void OnLeftClick(double x, double y, int keys) override;
 
@@ -422,6 +473,17 @@ public:
      * Finalizes a panning or rubber-banding operation.
      */
     void OnEndDragLeft(double x, double y, int keys) override;
+
+    /**
+     * Find the shape at the given position.
+     *
+     * Always returns NULL in a view, as the shapes draw their dragging
+     * feedback on the main canvas. So the mouse can only select, pan and
+     * zoom in a view, see OnLeftClick().
+     */
+    wxShape *FindShape(double x, double y, int *attachment,
+                       wxClassInfo *info = NULL,
+                       wxShape *notImage = NULL) override;
     //@}
 
     /**
@@ -441,6 +503,30 @@ public:
      */
     Graph *GetGraph() const { return m_graph; }
 
+    /**
+     * Return the metrics of the graph if the canvas is headless.
+     *
+     * NULL for a canvas with a window.
+     */
+    const GraphMetrics *GetMetrics() const { return m_metrics; }
+
+    /**
+     * True if the canvas is an additional view of a graph whose shapes
+     * belong to the canvas of another GraphCtrl.
+     */
+    bool IsView() const;
+
+    /**
+     * Refresh the area given in graph coordinates.
+     */
+    void RefreshGraphRect(const wxRect& rcGraph);
+
+    /**
+     * Override to do nothing if the canvas is headless.
+     */
+    void Refresh(bool eraseBackground = true,
+                 const wxRect *rect = NULL) override;
+
     /**
      * Override event processing to send mouse events to the parent.
      */
@@ -465,6 +551,14 @@ public:
      */
     void OnScroll(wxScrollWinEvent& event);
 
+    /**
+     * Paint event handler.
+     *
+     * Draws the graph through a wxGraphicsContext if SetRenderer() was
+     * called, or defers to the base class otherwise.
+     */
+    void OnPaint(wxPaintEvent& event);
+
     /**
      * Size event handler.
      *
@@ -501,6 +595,13 @@ public:
      */
     void OnCaptureLost(wxMouseCaptureLostEvent& event);
 
+    /**
+     * Progressive zoom timer event handler.
+     *
+     * Calls EndProgressiveZoom() once the zoom gesture has settled.
+     */
+    void OnZoomTimer(wxTimerEvent& event);
+
     //@}
 
     /**
@@ -537,8 +638,8 @@ public:
     /**
      * Override to not do any scrollbar adjustments.
      *
-     * The scrollbars will be set from CheckBounds() called from
-     * GraphCtrl::OnIdle() instead.
+     * The scrollbars will be set from CheckBounds() called from the idle
+     * work of GraphCtrl instead.
      */
     void AdjustScrollbars() override { }
     //@}
@@ -546,9 +647,10 @@ public:
     /**
      * Schedule a scrollbar update during the idle time.
      *
-     * CheckBounds() will be called from GraphCtrl::OnIdle().
+     * CheckBounds() will be called once the pending events are processed if
+     * the canvas belongs to a GraphCtrl.
      */
-    void SetCheckBounds() { m_checkBounds = true; }
+    void SetCheckBounds();
 
     /**
      * Check whether the scrollbars should be updated.
@@ -671,7 +773,35 @@ public:
      */
     void SetFits() { m_fitsX = m_fitsY = true; }
 
+#if wxUSE_GRAPHICS_CONTEXT
+    /**
+     * Set the renderer used for painting the graph, or NULL to paint it
+     * using the classic wxPaintDC.
+     */
+    void SetRenderer(wxGraphicsRenderer *renderer);
+#endif
+
+    /**
+     * Start or continue a progressive zoom gesture.
+     *
+     * The first call renders the visible part of the graph into a bitmap,
+     * which is then painted stretched to the current zoom instead of the
+     * graph until the calls stop for a short time. See
+     * GraphCtrl::SetProgressiveZoom().
+     */
+    void StartProgressiveZoom();
+
+    /**
+     * Discard the zoom bitmap and repaint the graph at full quality.
+     */
+    void EndProgressiveZoom();
+
 private:
+    /**
+     * Paint the zoom bitmap stretched to the current scale and scrolling.
+     */
+    void PaintZoomFrame(wxDC& dc);
+
     /**
      * Return the given or dummy parent.
      *
@@ -682,6 +812,7 @@ private:
     static wxWindow *EnsureParent(wxWindow *parent);
 
     Graph *m_graph;             ///< The associated graph.
+    const GraphMetrics *m_metrics; ///< The graph's metrics if headless.
     bool m_isPanning;           ///< Is panning operation in progress?
     bool m_checkBounds;         ///< Do we need to adjust scrollbars?
     wxPoint m_ptDrag;           ///< Point where dragging was started.
@@ -693,6 +824,18 @@ private:
     bool m_fitsX;               ///< Do we need a horizontal scrollbar?
     bool m_fitsY;               ///< Do we need a vertical scrollbar?
 
+#if wxUSE_GRAPHICS_CONTEXT
+    wxGraphicsRenderer *m_renderer; ///< Renderer used for painting or NULL.
+#endif
+
+    /// Progressive zoom data, see StartProgressiveZoom().
+    //@{
+    wxBitmap m_zoomFrame;       ///< Visible area when the gesture started.
+    wxPoint m_zoomOrigin;       ///< Graph point at the bitmap's origin.
+    double m_zoomScale;         ///< The scale the bitmap was drawn at.
+    wxTimer m_zoomTimer;        ///< Ends the gesture when it expires.
+    //@}
+
     DECLARE_EVENT_TABLE()
     DECLARE_DYNAMIC_CLASS(GraphCanvas)
 };
@@ -702,6 +845,7 @@ const wxChar GraphCanvas::DefaultName[] = _T("graph_canvas");
 IMPLEMENT_DYNAMIC_CLASS(GraphCanvas, wxShapeCanvas)
 
 BEGIN_EVENT_TABLE(GraphCanvas, wxShapeCanvas)
+    EVT_PAINT(GraphCanvas::OnPaint)
     EVT_SCROLLWIN(GraphCanvas::OnScroll)
     EVT_SIZE(GraphCanvas::OnSize)
     EVT_LEFT_DOWN(GraphCanvas::OnLeftButton)
@@ -710,6 +854,7 @@ BEGIN_EVENT_TABLE(GraphCanvas, wxShapeCanvas)
     EVT_RIGHT_UP(GraphCanvas::OnRightButton)
     EVT_SET_FOCUS(GraphCanvas::OnSetFocus)
     EVT_MOUSE_CAPTURE_LOST(GraphCanvas::OnCaptureLost)
+    EVT_TIMER(wxID_ANY, GraphCanvas::OnZoomTimer)
 END_EVENT_TABLE()
 
 GraphCanvas::GraphCanvas(
@@ -721,6 +866,7 @@ GraphCanvas::GraphCanvas(
         const wxString& name)
   : wxShapeCanvas(EnsureParent(parent), id, pos, size, style, name),
     m_graph(NULL),
+    m_metrics(NULL),
     m_isPanning(false),
     m_checkBounds(false),
     m_border(0, 0),
@@ -728,11 +874,35 @@ GraphCanvas::GraphCanvas(
     m_margin(GetScreenDPI() / 4),
     m_fitsX(true),
     m_fitsY(true)
+#if wxUSE_GRAPHICS_CONTEXT
+    , m_renderer(NULL)
+#endif
+    , m_zoomScale(1.0)
+    , m_zoomTimer(this)
 {
     SetScrollRate(1, 1);
     SetFont(DefaultFont());
 }
 
+GraphCanvas::GraphCanvas(const GraphMetrics *metrics)
+  : m_graph(NULL),
+    m_metrics(metrics),
+    m_isPanning(false),
+    m_checkBounds(false),
+    m_border(0, 0),
+    m_borderType(GraphCtrl::Percentage_Border),
+    m_margin(metrics->GetDPI() / 4),
+    m_fitsX(true),
+    m_fitsY(true)
+#if wxUSE_GRAPHICS_CONTEXT
+    , m_renderer(NULL)
+#endif
+    , m_zoomScale(1.0)
+    , m_zoomTimer(this)
+{
+    SetFont(metrics->GetFont());
+}
+
 GraphCanvas::~GraphCanvas()
 {
     wxFrame *dummy = wxDynamicCast(GetParent(), wxFrame);
@@ -757,6 +927,122 @@ bool GraphCanvas::ReleaseIfCaptured()
     return true;
 }
 
+void GraphCanvas::OnPaint(wxPaintEvent& event)
+{
+    if (m_zoomFrame.IsOk()) {
+        wxPaintDC dc(this);
+        PaintZoomFrame(dc);
+        return;
+    }
+
+#if wxUSE_GRAPHICS_CONTEXT
+    if (m_renderer && m_graph) {
+        wxPaintDC pdc(this);
+        wxGCDC dc(m_renderer->CreateContext(pdc));
+        PrepareDC(dc);
+
+        // Graph::Draw() rather than the diagram is used as the update region
+        // can't be retrieved from the wxGCDC by GraphDiagram::Redraw().
+        wxRect box = GetUpdateRegion().GetBox();
+        if (box.IsEmpty())
+            box = wxRect(GetClientSize());
+
+        wxRect rc;
+        rc.x = dc.DeviceToLogicalX(box.x);
+        rc.y = dc.DeviceToLogicalY(box.y);
+        rc.width = dc.DeviceToLogicalX(box.x + box.width) - rc.x + 1;
+        rc.height = dc.DeviceToLogicalY(box.y + box.height) - rc.y + 1;
+
+        m_graph->Draw(&dc, rc);
+        return;
+    }
+#endif // wxUSE_GRAPHICS_CONTEXT
+
+    wxShapeCanvas::OnPaint(event);
+}
+
+#if wxUSE_GRAPHICS_CONTEXT
+void GraphCanvas::SetRenderer(wxGraphicsRenderer *renderer)
+{
+    m_renderer = renderer;
+    EndProgressiveZoom();
+    Refresh();
+}
+#endif
+
+void GraphCanvas::StartProgressiveZoom()
+{
+    constexpr int ZOOM_SETTLE_MS = 200;
+
+    const wxSize size = GetClientSize();
+
+    if (!m_zoomFrame.IsOk() && m_graph && size.x > 0 && size.y > 0) {
+        m_zoomFrame = wxBitmap(size);
+
+        wxMemoryDC mdc(m_zoomFrame);
+        mdc.SetBackground(wxBrush(GetBackgroundColour()));
+        mdc.Clear();
+        PrepareDC(mdc);
+
+        wxRect rc;
+        rc.x = mdc.DeviceToLogicalX(0);
+        rc.y = mdc.DeviceToLogicalY(0);
+        rc.width = mdc.DeviceToLogicalX(size.x) - rc.x + 1;
+        rc.height = mdc.DeviceToLogicalY(size.y) - rc.y + 1;
+
+        m_zoomOrigin = rc.GetTopLeft();
+        m_zoomScale = GetScaleX();
+
+#if wxUSE_GRAPHICS_CONTEXT
+        if (m_renderer) {
+            wxGCDC dc(m_renderer->CreateContext(mdc));
+            PrepareDC(dc);
+            m_graph->Draw(&dc, rc);
+        }
+        else
+#endif // wxUSE_GRAPHICS_CONTEXT
+        {
+            m_graph->Draw(&mdc, rc);
+        }
+    }
+
+    m_zoomTimer.StartOnce(ZOOM_SETTLE_MS);
+}
+
+void GraphCanvas::EndProgressiveZoom()
+{
+    m_zoomTimer.Stop();
+
+    if (m_zoomFrame.IsOk()) {
+        m_zoomFrame = wxBitmap();
+        Refresh();
+    }
+}
+
+void GraphCanvas::OnZoomTimer(wxTimerEvent&)
+{
+    EndProgressiveZoom();
+}
+
+void GraphCanvas::PaintZoomFrame(wxDC& dc)
+{
+    wxInfoDC info(this);
+    PrepareDC(info);
+
+    const double ratio = GetScaleX() / m_zoomScale;
+    const int width = m_zoomFrame.GetWidth();
+    const int height = m_zoomFrame.GetHeight();
+
+    dc.SetBackground(wxBrush(GetBackgroundColour()));
+    dc.Clear();
+
+    wxMemoryDC mdc(m_zoomFrame);
+    dc.StretchBlit(info.LogicalToDeviceX(m_zoomOrigin.x),
+                   info.LogicalToDeviceY(m_zoomOrigin.y),
+                   wxRound(width * ratio), wxRound(height * ratio),
+                   &mdc, 0, 0, width, height);
+}
+
 void GraphCanvas::OnSetFocus(wxFocusEvent&)
 {
     GetParent()->SetFocus();
@@ -797,6 +1083,12 @@ void GraphCanvas::OnRightButton(wxMouseEvent& event)
     event.Skip();
 }
 
+void GraphCanvas::Refresh(bool eraseBackground, const wxRect *rect)
+{
+    if (!m_metrics)
+        wxShapeCanvas::Refresh(eraseBackground, rect);
+}
+
 wxWindow *GraphCanvas::EnsureParent(wxWindow *parent)
 {
     if (!parent) {
@@ -817,12 +1109,39 @@ bool GraphCanvas::SendEvent(wxEventType cmd, double x, double y)
     return event.IsAllowed();
 }
 
-void GraphCanvas::OnLeftClick(double x, double y, int)
+void GraphCanvas::OnLeftClick(double x, double y, int keys)
 {
-    GetGraph()->UnselectAll();
+    Graph *graph = GetGraph();
+
+    if (IsView()) {
+        GraphNode *node = graph->HitTest(wxPoint(int(x), int(y)));
+        if (node) {
+            if ((keys & KEY_CTRL) == 0)
+                graph->UnselectAll();
+            node->Select();
+            return;
+        }
+    }
+
+    graph->UnselectAll();
     SendEvent(Evt_Graph_Click, x, y);
 }
 
+wxShape *GraphCanvas::FindShape(double x, double y, int *attachment,
+                                wxClassInfo *info, wxShape *notImage)
+{
+    if (IsView())
+        return NULL;
+
+    return wxShapeCanvas::FindShape(x, y, attachment, info, notImage);
+}
+
+bool GraphCanvas::IsView() const
+{
+    wxDiagram *diagram = GetDiagram();
+    return diagram && diagram->GetCanvas() != this;
+}
+
 void GraphCanvas::OnRightClick(double x, double y, int)
 {
     SendEvent(Evt_Graph_Menu, x, y);
@@ -910,25 +1229,7 @@ void GraphCanvas::OnEndDragLeft(double x, double y, int key)
             rc.height = m_ptDrag.y - int(y);
         }
 
-        Graph *graph = GetGraph();
-        Graph::iterator i, j, end;
-        tie(i, end) = graph->GetElements();
-
-        while (i != end)
-        {
-            // Increment i before calling Select, since Select invalidates
-            // iterators to that element.
-            j = i++;
-
-            if (!j->IsSelected()) {
-                if (rc.Intersects(j->GetBounds().Inflate(1)))
-                    j->Select();
-            }
-            else {
-                if ((key & KEY_CTRL) == 0 && !rc.Intersects(j->GetBounds()))
-                    j->Unselect();
-            }
-        }
+        GetGraph()->SelectRect(rc, (key & KEY_CTRL) != 0);
     }
 }
 
@@ -1023,15 +1324,26 @@ void GraphCanvas::OnScroll(wxScrollWinEvent& event)
     ScrollGraph(orient, type, pos);
 }
 
+void GraphCanvas::SetCheckBounds()
+{
+    m_checkBounds = true;
+
+    GraphCtrl *ctrl = wxDynamicCast(GetParent(), GraphCtrl);
+    if (ctrl)
+        ctrl->ScheduleIdleWork(GraphCtrl::Idle_Bounds);
+}
+
 bool GraphCanvas::CheckBounds()
 {
+    GRAPH_STATS_TIMER(checkBounds);
     wxInfoDC dc(this);
     PrepareDC(dc);
 
     wxSize cs = GetFullClientSize();
     wxSize fullclient = cs;
 
-    wxRect b = m_graph->GetBounds();
+    const wxRect bounds = m_graph->GetBounds();
+    wxRect b = bounds;
 
     if (!b.IsEmpty()) {
         if (m_borderType == GraphCtrl::Graph_Border)
@@ -1049,7 +1361,7 @@ bool GraphCanvas::CheckBounds()
         else if (m_borderType == GraphCtrl::Ctrl_Border)
             b.Inflate(m_border);
 
-        wxRect inner = m_graph->GetBounds();
+        wxRect inner = bounds;
         inner.Inflate(m_margin);
         inner.x = dc.LogicalToDeviceX(inner.x);
         inner.y = dc.LogicalToDeviceY(inner.y);
@@ -1148,6 +1460,11 @@ wxSize GraphCanvas::GetFullClientSize() const
 void GraphCanvas::OnSize(wxSizeEvent& event)
 {
     SetCheckBounds();
+
+    GraphCtrl *ctrl = wxDynamicCast(GetParent(), GraphCtrl);
+    if (ctrl)
+        ctrl->RefreshOverviewViews();
+
     event.Skip();
 }
 
@@ -1190,7 +1507,7 @@ wxPoint GraphCanvas::GetScrollPosition()
     wxPoint pt;
 
     pt.x = dc.DeviceToLogicalX(cs.x / 2);
-    pt.y = dc.DeviceToLogicalX(cs.y / 2);
+    pt.y = dc.DeviceToLogicalY(cs.y / 2);
 
     return pt;
 }
@@ -1205,6 +1522,11 @@ wxPoint GraphCanvas::ScrollByOffset(int x, int y, bool draw)
 
     SetCheckBounds();
 
+    // zooming also ends here, after changing the scale
+    GraphCtrl *ctrl = wxDynamicCast(GetParent(), GraphCtrl);
+    if (ctrl)
+        ctrl->RefreshOverviewViews();
+
     return wxPoint(x, y);
 }
 
@@ -1317,84 +1639,332 @@ wxRect GraphCanvas::GetClientScreenRect() const
 } // namespace impl
 
 // ----------------------------------------------------------------------------
-// Handler to give shapes a transparent background
+// MeasureDC
 // ----------------------------------------------------------------------------
 
 namespace {
 
 /**
- * Generic event handler for the shape objects.
- *
- * This class is used as the event handler by GraphDiagram to allow changing
- * the behaviour of any existing shape without having to override its virtual
- * methods.
+ * A DC for measuring the shapes of a canvas.
  *
- * It's both a base class inherited from by ControlPointHandler,
- * GraphNodeHandler and GraphEdgeHandler and a concrete class used directly
- * for the other graph elements.
+ * This is a wxInfoDC prepared for the canvas's scrolling and zoom, unless
+ * the canvas is headless, in which case the DC comes from the graph's
+ * GraphMetrics and no window is needed.
  */
-class GraphHandler: public wxShapeEvtHandler
+class MeasureDC
 {
 public:
-    /// Ctor taking an existing shape.
-    GraphHandler(wxShapeEvtHandler *prev);
+    explicit MeasureDC(wxShapeCanvas *canvas);
 
-    /// Overridden base class virtual method.
-    //@{
-    void OnErase(wxReadOnlyDC& dc) override;
-    void OnMoveLink(wxReadOnlyDC& dc, bool moveControlPoints) override;
-    //@}
+    MeasureDC(const MeasureDC&) = delete;
+    MeasureDC(MeasureDC&&) = delete;
+    MeasureDC& operator=(const MeasureDC&) = delete;
+    MeasureDC& operator=(MeasureDC&&) = delete;
 
-protected:
-    /// Return the rectangle to refresh in OnErase().
-    virtual wxRect GetEraseRect() const;
+    operator wxReadOnlyDC&() { return *m_dc; }
+    wxReadOnlyDC *operator->() { return m_dc.get(); }
+
+private:
+    std::unique_ptr<wxReadOnlyDC> m_dc;
 };
 
-GraphHandler::GraphHandler(wxShapeEvtHandler *prev)
-  : wxShapeEvtHandler(prev, prev->GetShape())
+MeasureDC::MeasureDC(wxShapeCanvas *canvas)
 {
+    const GraphMetrics *metrics =
+        wxStaticCast(canvas, GraphCanvas)->GetMetrics();
+
+    if (metrics) {
+        m_dc.reset(metrics->CreateDC());
+    }
+    else {
+        wxInfoDC *dc = new wxInfoDC(canvas);
+        canvas->PrepareDC(*dc);
+        m_dc.reset(dc);
+    }
 }
 
-void GraphHandler::OnErase(wxReadOnlyDC& dc)
-{
-    wxShape *shape = GetShape();
+} // namespace
 
-    if (GetShape()->IsShown() && dc.IsKindOf(CLASSINFO(wxWindowDC)))
-    {
-        wxRect rcGraph = GetEraseRect();
-        wxRect rc;
+namespace impl {
 
-        rc.x = dc.LogicalToDeviceX(rcGraph.x);
-        rc.y = dc.LogicalToDeviceY(rcGraph.y);
-        rc.width = dc.LogicalToDeviceX(rcGraph.x + rcGraph.width) - rc.x + 1;
-        rc.height = dc.LogicalToDeviceY(rcGraph.y + rcGraph.height) - rc.y + 1;
+void GraphCanvas::RefreshGraphRect(const wxRect& rcGraph)
+{
+    MeasureDC dc(this);
 
-        wxWindow *canvas = shape->GetCanvas();
-        canvas->RefreshRect(rc);
-    }
+    wxRect rc;
+    rc.x = dc->LogicalToDeviceX(rcGraph.x);
+    rc.y = dc->LogicalToDeviceY(rcGraph.y);
+    rc.width = dc->LogicalToDeviceX(rcGraph.GetRight() + 1) - rc.x + 1;
+    rc.height = dc->LogicalToDeviceY(rcGraph.GetBottom() + 1) - rc.y + 1;
+
+    RefreshRect(rc);
 }
 
-wxRect GraphHandler::GetEraseRect() const
+} // namespace impl
+
+// ----------------------------------------------------------------------------
+// Handler to give shapes a transparent background
+// ----------------------------------------------------------------------------
+
+namespace {
+
+/**
+ * Size class pool for the shape event handlers of a diagram.
+ *
+ * There is a handler for every shape, including the control points, so
+ * allocating them from a few large chunks saves a heap allocation per shape
+ * and lets the diagram free them all together when it is cleared.
+ *
+ * Each block starts with a header pointing back to its pool, so that the
+ * handlers can be deleted as usual. The blocks too large for the pool and
+ * the handlers allocated without a pool have a NULL pool in their header.
+ */
+class HandlerPool
 {
-    wxShape *shape = GetShape();
-    wxPen *pen = shape->GetPen();
-    int penWidth = pen ? pen->GetWidth() : 0;
+public:
+    HandlerPool() : m_live(0) { }
+    ~HandlerPool();
 
-    double sizeX, sizeY;
-    shape->GetBoundingBoxMax(&sizeX, &sizeY);
-    sizeX += 2 * penWidth;
-    sizeY += 2 * penWidth;
+    HandlerPool(const HandlerPool&) = delete;
+    HandlerPool(HandlerPool&&) = delete;
+    HandlerPool& operator=(const HandlerPool&) = delete;
+    HandlerPool& operator=(HandlerPool&&) = delete;
 
-    int x1 = int(floor(shape->GetX() - sizeX / 2));
-    int y1 = int(floor(shape->GetY() - sizeY / 2));
-    int x2 = int(ceil(shape->GetX() + sizeX / 2));
-    int y2 = int(ceil(shape->GetY() + sizeY / 2));
+    /// Allocate a block from the given pool, or the heap if it is NULL.
+    static void *Allocate(HandlerPool *pool, size_t size);
+    /// Return a block to the pool it came from.
+    static void Free(void *p);
 
-    return wxRect(x1, y1, x2 - x1, y2 - y1);
-}
+    /// Free all the chunks if none of their blocks are in use.
+    void Release();
 
-void GraphHandler::OnMoveLink(wxReadOnlyDC& dc, bool moveControlPoints)
-{
+    /// The bytes reserved by the chunks.
+    size_t GetReserved() const;
+
+private:
+    union Header
+    {
+        struct
+        {
+            HandlerPool *pool;
+            unsigned sizeClass;
+        } info;
+        std::max_align_t align;
+    };
+
+    /// A free block, linked through its own storage.
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    static constexpr size_t GRANULE = sizeof(Header);
+    static constexpr size_t SIZE_CLASSES = 16;
+    static constexpr size_t CHUNK_BLOCKS = 256;
+
+    static size_t BlockSize(size_t sizeClass)
+    {
+        return (sizeClass + 1) * GRANULE;
+    }
+
+    FreeBlock *m_free[SIZE_CLASSES] = { };  ///< Free lists per size class.
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    std::vector<size_t> m_chunkSizes;       ///< Size class of each chunk.
+    size_t m_live;                          ///< Blocks in use.
+};
+
+HandlerPool::~HandlerPool()
+{
+    // if any handler is still alive, leak the chunks rather than freeing the
+    // memory from under it
+    wxASSERT_MSG(m_live == 0, _T("shape handlers outlive their diagram"));
+    if (m_live)
+        for (auto& chunk : m_chunks)
+            chunk.release();
+}
+
+void *HandlerPool::Allocate(HandlerPool *pool, size_t size)
+{
+    const size_t sizeClass = (size + sizeof(Header) - 1) / GRANULE;
+    Header *header;
+
+    if (!pool || sizeClass >= SIZE_CLASSES) {
+        header = static_cast<Header*>(::operator new(size + sizeof(Header)));
+        header->info.pool = NULL;
+        return header + 1;
+    }
+
+    FreeBlock *&head = pool->m_free[sizeClass];
+
+    if (!head) {
+        const size_t blockSize = BlockSize(sizeClass);
+        char *chunk = new char[blockSize * CHUNK_BLOCKS];
+        pool->m_chunks.emplace_back(chunk);
+        pool->m_chunkSizes.push_back(sizeClass);
+
+        for (size_t i = CHUNK_BLOCKS; i-- > 0; ) {
+            FreeBlock *block = new (chunk + i * blockSize) FreeBlock;
+            block->next = head;
+            head = block;
+        }
+    }
+
+    FreeBlock *block = head;
+    head = block->next;
+    pool->m_live++;
+
+    header = reinterpret_cast<Header*>(block);
+    header->info.pool = pool;
+    header->info.sizeClass = sizeClass;
+    return header + 1;
+}
+
+void HandlerPool::Free(void *p)
+{
+    if (!p)
+        return;
+
+    Header *header = static_cast<Header*>(p) - 1;
+    HandlerPool *pool = header->info.pool;
+
+    if (!pool) {
+        ::operator delete(header);
+        return;
+    }
+
+    FreeBlock *block = reinterpret_cast<FreeBlock*>(header);
+    FreeBlock *&head = pool->m_free[header->info.sizeClass];
+    block->next = head;
+    head = block;
+    pool->m_live--;
+}
+
+void HandlerPool::Release()
+{
+    if (m_live)
+        return;
+
+    m_chunks.clear();
+    m_chunkSizes.clear();
+    for (auto& head : m_free)
+        head = NULL;
+}
+
+size_t HandlerPool::GetReserved() const
+{
+    size_t bytes = 0;
+    for (size_t sizeClass : m_chunkSizes)
+        bytes += BlockSize(sizeClass) * CHUNK_BLOCKS;
+    return bytes;
+}
+
+/**
+ * Generic event handler for the shape objects.
+ *
+ * This class is used as the event handler by GraphDiagram to allow changing
+ * the behaviour of any existing shape without having to override its virtual
+ * methods.
+ *
+ * It's both a base class inherited from by ControlPointHandler,
+ * GraphNodeHandler and GraphEdgeHandler and a concrete class used directly
+ * for the other graph elements.
+ */
+class GraphHandler: public wxShapeEvtHandler
+{
+public:
+    /// Ctor taking an existing shape.
+    GraphHandler(wxShapeEvtHandler *prev);
+
+    /// The handlers are allocated from the HandlerPool of their diagram.
+    //@{
+    static void *operator new(size_t size, HandlerPool& pool)
+    {
+        return HandlerPool::Allocate(&pool, size);
+    }
+    static void *operator new(size_t size)
+    {
+        return HandlerPool::Allocate(NULL, size);
+    }
+    static void operator delete(void *p, HandlerPool&)
+    {
+        HandlerPool::Free(p);
+    }
+    static void operator delete(void *p)
+    {
+        HandlerPool::Free(p);
+    }
+    //@}
+
+    /// Overridden base class virtual method.
+    //@{
+    void OnErase(wxReadOnlyDC& dc) override;
+    void OnMoveLink(wxReadOnlyDC& dc, bool moveControlPoints) override;
+    //@}
+
+    /// Return the rectangle covered by the shape, used for culling.
+    wxRect GetDrawRect() const { return GetEraseRect(); }
+
+protected:
+    /// Return the rectangle to refresh in OnErase().
+    virtual wxRect GetEraseRect() const;
+};
+
+GraphHandler::GraphHandler(wxShapeEvtHandler *prev)
+  : wxShapeEvtHandler(prev, prev->GetShape())
+{
+}
+
+void GraphHandler::OnErase(wxReadOnlyDC& dc)
+{
+    wxShape *shape = GetShape();
+
+    if (GetShape()->IsShown() && dc.IsKindOf(CLASSINFO(wxWindowDC)))
+    {
+        wxRect rcGraph = GetEraseRect();
+        wxWindow *canvas = shape->GetCanvas();
+
+        // during an update just remember the area, it's repainted at the end
+        Graph *graph = wxStaticCast(canvas, GraphCanvas)->GetGraph();
+        if (graph && graph->IsUpdating()) {
+            graph->Invalidate(rcGraph);
+            return;
+        }
+
+        wxRect rc;
+
+        rc.x = dc.LogicalToDeviceX(rcGraph.x);
+        rc.y = dc.LogicalToDeviceY(rcGraph.y);
+        rc.width = dc.LogicalToDeviceX(rcGraph.x + rcGraph.width) - rc.x + 1;
+        rc.height = dc.LogicalToDeviceY(rcGraph.y + rcGraph.height) - rc.y + 1;
+
+        canvas->RefreshRect(rc);
+
+        if (graph)
+            graph->RefreshViews(rcGraph);
+    }
+}
+
+wxRect GraphHandler::GetEraseRect() const
+{
+    wxShape *shape = GetShape();
+    wxPen *pen = shape->GetPen();
+    int penWidth = pen ? pen->GetWidth() : 0;
+
+    double sizeX, sizeY;
+    shape->GetBoundingBoxMax(&sizeX, &sizeY);
+    sizeX += 2 * penWidth;
+    sizeY += 2 * penWidth;
+
+    int x1 = int(floor(shape->GetX() - sizeX / 2));
+    int y1 = int(floor(shape->GetY() - sizeY / 2));
+    int x2 = int(ceil(shape->GetX() + sizeX / 2));
+    int y2 = int(ceil(shape->GetY() + sizeY / 2));
+
+    return wxRect(x1, y1, x2 - x1, y2 - y1);
+}
+
+void GraphHandler::OnMoveLink(wxReadOnlyDC& dc, bool moveControlPoints)
+{
     wxShape *shape = GetShape();
     shape->Show(false);
     wxShapeEvtHandler::OnMoveLink(dc, moveControlPoints);
@@ -1444,7 +2014,7 @@ public:
     void OnLeftDoubleClick(double x, double y, int keys, int attachment) override;
     void OnRightClick(double x, double y, int keys, int attachment) override;
 
-    void OnDraw(wxDC& dc) override { GetElement(GetShape())->OnDraw(dc); }
+    void OnDraw(wxDC& dc) override;
     void OnDrawContents(wxDC&) override { }
     //@}
 
@@ -1489,6 +2059,22 @@ void GraphElementHandler::OnRightClick(double x, double y, int keys, int)
     HandleRClick(Evt_Graph_Edge_Menu, x, y, keys);
 }
 
+void GraphElementHandler::OnDraw(wxDC& dc)
+{
+    GraphElement *element = GetElement(GetShape());
+
+    switch (element->GetDetailLevel(dc)) {
+        case GraphElement::Detail_Hidden:
+            break;
+        case GraphElement::Detail_Low:
+            element->OnDrawLowDetail(dc);
+            break;
+        case GraphElement::Detail_Full:
+            element->OnDraw(dc);
+            break;
+    }
+}
+
 void GraphElementHandler::HandleClick(wxEventType cmd,
                                       double x, double y,
                                       int keys)
@@ -1708,38 +2294,19 @@ void GraphNodeHandler::OnDrag(int mode, bool draw, double x, double y)
     Graph *graph = canvas->GetGraph();
 
     if (draw && (mode & Drag_Connect) != 0) {
-        int new_attachment;
-        wxShape *sh =
-            canvas->FindFirstSensitiveShape(x, y, &new_attachment, OP_ALL);
-        GraphNode *target;
+        // Use the graph spatial index rather than FindFirstSensitiveShape()
+        // which checks all the shapes of the diagram.
+        GraphNode *target = graph->HitTest(wxPoint(int(x), int(y)));
 
-        if (sh != NULL && sh != shape)
-            target = wxDynamicCast(GetElement(sh), GraphNode);
-        else
+        if (target == GetNode())
             target = NULL;
 
         if (target && target != m_target) {
             m_sources.clear();
 
             for (auto& node : MakeRange(graph->GetSelectionNodes())) {
-                if (&node != target) {
-                    bool found = false;
-
-                    for (const auto& edge : MakeRange(node.GetEdges())) {
-                        for (const auto& node2 : MakeRange(edge.GetNodes())) {
-                            if (&node2 == target) {
-                                found = true;
-                                break;
-                            }
-                        }
-
-                        if (found)
-                            break;
-                    }
-
-                    if (!found)
-                        m_sources.push_back(&node);
-                }
+                if (&node != target && !graph->AreConnected(node, *target))
+                    m_sources.push_back(&node);
             }
 
             if (!m_sources.empty()) {
@@ -1840,6 +2407,9 @@ void GraphNodeHandler::OnEndDrag(int mode, double x, double y)
         wxPoint ptOffset = wxPoint(int(x), int(y)) + m_offset -
                            GetNode()->GetPosition();
 
+        // route the edges between the moved nodes once, not once per end
+        GraphUpdateLocker noUpdates(*graph);
+
         for (auto& node : MakeRange(graph->GetSelectionNodes()))
             node.SetPosition(node.GetPosition() + ptOffset);
     }
@@ -1848,8 +2418,20 @@ void GraphNodeHandler::OnEndDrag(int mode, double x, double y)
 void GraphNodeHandler::OnDraw(wxDC& dc)
 {
     GraphNode *node = GetNode();
+
+    switch (node->GetDetailLevel(dc)) {
+        case GraphElement::Detail_Hidden:
+            return;
+        case GraphElement::Detail_Low:
+            node->OnDrawLowDetail(dc);
+            return;
+        case GraphElement::Detail_Full:
+            break;
+    }
+
     dc.SetFont(node->GetFont());
-    node->OnDraw(dc);
+    if (!node->DrawCached(dc, GetDrawRect()))
+        node->OnDraw(dc);
 }
 
 void GraphNodeHandler::OnSizingDragLeft(wxControlPoint* pt, bool draw,
@@ -1865,11 +2447,20 @@ void GraphNodeHandler::OnSizingEndDragLeft(wxControlPoint* pt,
 {
     GraphNode *node = GetNode();
     wxShape *shape = GetShape();
+
+    // the base class resizes and moves the shape itself, so SetSize() below
+    // finds nothing to record and the old geometry must be kept for undo
+    const wxPoint pos = node->GetPosition();
+    const wxSize size = node->GetSize();
+
     node->Refresh();
     shape->Show(false);
     GraphElementHandler::OnSizingEndDragLeft(pt, x, y, keys, attachment);
     shape->Show(true);
+
+    GraphUpdateLocker noUpdates(*node->GetGraph());
     node->SetSize(node->GetSize());
+    node->RecordResize(pos, size);
 }
 
 /**
@@ -1881,12 +2472,36 @@ public:
     /// Ctor taking an existing shape.
     GraphEdgeHandler(wxShapeEvtHandler *prev);
 
+    /**
+     * Overridden to reroute the line only when its nodes have moved or
+     * resized, or its control points were changed by something else.
+     *
+     * During a Graph update this just asks the diagram to reroute the line
+     * at the end of the update, so that a line whose both nodes move is
+     * routed only once, see GraphDiagram::DeferLink().
+     */
+    void OnMoveLink(wxReadOnlyDC& dc, bool moveControlPoints) override;
+
 protected:
     /// Overridden base class virtual method.
     //@{
     wxRect GetEraseRect() const override;
     inline wxLineShape *GetShape() const;
     //@}
+
+private:
+    /// True if the line is still routed for the current node bounds.
+    bool IsRouted() const;
+
+    /// The bounds of the node at one end of the line, empty if none.
+    static wxRect GetEndBounds(wxShape *shape);
+
+    /// The node bounds and control points after the line was last routed.
+    //@{
+    wxRect m_rcFrom;
+    wxRect m_rcTo;
+    wxOGLPoints m_points;
+    //@}
 };
 
 GraphEdgeHandler::GraphEdgeHandler(wxShapeEvtHandler *prev)
@@ -1970,29 +2585,200 @@ bool GraphNodeShape::GetPerimeterPoint(double x1, double y1,
 
 namespace impl {
 
+/**
+ * A list of shapes in Z-order with a handle for each of them.
+ *
+ * This wraps a wxList, which is still used for iterating over the shapes, and
+ * keeps a map from each object in it to its list node, so that finding,
+ * removing or moving an object to either end of the list doesn't need to
+ * search the list for it.
+ *
+ * All modifications of the list must be done through this class for the
+ * handles to remain valid.
+ */
+class ZOrderList
+{
+public:
+    typedef wxList::compatibility_iterator Node;
+
+    explicit ZOrderList(wxList& list) : m_list(list) { }
+
+    ZOrderList(const ZOrderList&) = delete;
+    ZOrderList& operator=(const ZOrderList&) = delete;
+    ZOrderList(ZOrderList&&) = delete;
+    ZOrderList& operator=(ZOrderList&&) = delete;
+
+    /// The wrapped list.
+    wxList& GetList() { return m_list; }
+
+    /// Return the node of the object, or a null node if it's not in the list.
+    Node Find(const wxObject *obj) const;
+
+    /// True if the object is in the list.
+    bool Contains(const wxObject *obj) const
+        { return m_nodes.count(obj) != 0; }
+
+    /// Add the object at the end, the top of the Z-order.
+    void Append(wxObject *obj) { m_nodes[obj] = m_list.Append(obj); }
+
+    /// Add the object at the beginning, the bottom of the Z-order.
+    void Prepend(wxObject *obj) { m_nodes[obj] = m_list.Insert(obj); }
+
+    /// Add the object before the given node.
+    void Insert(const Node& before, wxObject *obj);
+
+    /// Remove the object, returning false if it wasn't in the list.
+    bool Remove(const wxObject *obj);
+
+    /**
+     * Move the object to the end or the beginning of the list.
+     *
+     * Returns false and does nothing if the object isn't in the list.
+     */
+    //@{
+    bool MoveToBack(wxObject *obj);
+    bool MoveToFront(wxObject *obj);
+    //@}
+
+    /// Remove all the objects.
+    void Clear();
+
+private:
+    wxList& m_list;
+    std::unordered_map<const wxObject*, Node> m_nodes;
+};
+
+ZOrderList::Node ZOrderList::Find(const wxObject *obj) const
+{
+    const auto it = m_nodes.find(obj);
+    return it != m_nodes.end() ? it->second : Node();
+}
+
+void ZOrderList::Insert(const Node& before, wxObject *obj)
+{
+    m_nodes[obj] = m_list.Insert(before, obj);
+}
+
+bool ZOrderList::Remove(const wxObject *obj)
+{
+    const auto it = m_nodes.find(obj);
+    if (it == m_nodes.end())
+        return false;
+
+    m_list.Erase(it->second);
+    m_nodes.erase(it);
+    return true;
+}
+
+bool ZOrderList::MoveToBack(wxObject *obj)
+{
+    const auto it = m_nodes.find(obj);
+    if (it == m_nodes.end())
+        return false;
+
+    if (it->second->GetNext()) {
+        m_list.Erase(it->second);
+        it->second = m_list.Append(obj);
+    }
+    return true;
+}
+
+bool ZOrderList::MoveToFront(wxObject *obj)
+{
+    const auto it = m_nodes.find(obj);
+    if (it == m_nodes.end())
+        return false;
+
+    if (it->second->GetPrevious()) {
+        m_list.Erase(it->second);
+        it->second = m_list.Insert(obj);
+    }
+    return true;
+}
+
+void ZOrderList::Clear()
+{
+    m_list.Clear();
+    m_nodes.clear();
+}
+
 /**
  * Diagram represents a collection of shapes.
  *
  * This class override wxDiagram virtual methods to ensure that each shape
  * belonging to the diagram has a custom event handler associated with it.
+ *
+ * It also maintains separate lists of the node and edge shapes, in the same
+ * order as in the main shapes list, and of the selected shapes, allowing to
+ * iterate over and count them without going through all the shapes. All of
+ * these lists, including the main one, are wrapped in ZOrderLists, so that
+ * changing the Z-order or the selection of a shape doesn't search them.
  */
 class GraphDiagram : public wxDiagram
 {
 public:
+    GraphDiagram()
+      : m_skipped(0),
+        m_shapes(*m_shapeList),
+        m_nodes(m_nodeList),
+        m_edges(m_edgeList),
+        m_selection(m_selectionList),
+        m_selectedNodes(0)
+    { }
+
     /**
      * Override to set up a correct handler for @a shape.
      *
-     * Calls SetEventHandler() and the base class method.
+     * Calls SetEventHandler() and adds the shape like the base class method,
+     * but without searching the shape list.
      */
     void AddShape(wxShape *shape, wxShape *addAfter = NULL) override;
 
     /**
      * Override to set up a correct handler for @a shape.
      *
-     * Calls SetEventHandler() and the base class method.
+     * Calls SetEventHandler() and adds the shape like the base class method.
      */
     void InsertShape(wxShape *shape) override;
 
+    /// Override to keep the node, edge and selection lists up to date.
+    //@{
+    void RemoveShape(wxShape *shape) override;
+    void RemoveAllShapes() override;
+    //@}
+
+    /// Move the shape to the end of the Z-order, i.e. on top of the others.
+    void RaiseShape(wxShape *shape);
+
+    /// Move the shape to the beginning of the Z-order.
+    void LowerShape(wxShape *shape);
+
+    /// Select or unselect the shape, updating the selection list.
+    void SelectShape(wxShape *shape, bool select);
+
+    /// Lists of the node, edge and selected shapes.
+    //@{
+    wxList *GetNodeList() { return &m_nodeList; }
+    wxList *GetEdgeList() { return &m_edgeList; }
+    wxList *GetSelectionList() { return &m_selectionList; }
+    //@}
+
+    /// The shape below the given one in the Z-order, or NULL if none.
+    wxShape *GetPreviousShape(wxShape *shape) const;
+
+    /**
+     * Remember the line to be rerouted by RouteLinks() instead of now.
+     *
+     * A line is only remembered once however many times it's deferred.
+     */
+    void DeferLink(wxLineShape *line);
+
+    /// Reroute the lines given to DeferLink() since the last call.
+    void RouteLinks();
+
+    /// Number of the selected nodes.
+    size_t GetSelectedNodeCount() const { return m_selectedNodes; }
+
     /**
      * Associate an appropriate custom event handler with the shape.
      *
@@ -2005,56 +2791,509 @@ public:
     /**
      * Override Redraw since the default method displays a busy cursor which
      * flashes on and off during panning.
+     *
+     * Only the shapes intersecting the area being drawn are drawn, see
+     * GetRedrawRect().
      */
     void Redraw(wxDC& dc) override;
-};
 
-// The custom behaviour of the wxShapes is achieved using wxShapeEvtHandler
-// objects rather than by overriding wxShape methods. This allows any old
-// wxShape to be used.
-//
-void GraphDiagram::SetEventHandler(wxShape *shape)
-{
-    wxShapeEvtHandler *handler;
-    void *data = shape->GetClientData();
+    /// The number of shapes not drawn by the last Redraw() call.
+    size_t GetSkippedCount() const { return m_skipped; }
+
+    /// The pool the shape event handlers are allocated from.
+    //@{
+    HandlerPool& GetHandlerPool() { return m_handlerPool; }
+    const HandlerPool& GetHandlerPool() const { return m_handlerPool; }
+    //@}
+
+private:
+    /**
+     * Return the area that needs to be drawn in graph coordinates.
+     *
+     * This is the clipping rectangle passed to Graph::Draw() if any, or the
+     * update region when painting the canvas, or the visible part of the
+     * canvas for the other canvas DCs. An empty rectangle is returned if
+     * everything needs to be drawn.
+     */
+    wxRect GetRedrawRect(wxDC& dc) const;
+
+    /// Return the list of the shapes of the same kind as the given one.
+    ZOrderList *GetKindList(wxShape *shape);
+
+    /// The number of shapes skipped by the last Redraw().
+    size_t m_skipped;
+
+    wxList m_nodeList;          ///< Shapes of GraphNodes in Z-order.
+    wxList m_edgeList;          ///< Shapes of GraphEdges in Z-order.
+    wxList m_selectionList;     ///< Selected shapes in selection order.
+
+    /// Handles into wxDiagram::m_shapeList and the lists above.
+    //@{
+    ZOrderList m_shapes;
+    ZOrderList m_nodes;
+    ZOrderList m_edges;
+    ZOrderList m_selection;
+    //@}
+
+    size_t m_selectedNodes;     ///< The number of nodes in m_selection.
+
+    /**
+     * The lines given to DeferLink() in order and as a set. Removing a line
+     * only takes it out of the set, so that it's fast when many are deleted
+     * at once.
+     */
+    //@{
+    std::vector<wxShape*> m_pendingLinks;
+    std::unordered_set<wxShape*> m_pendingSet;
+    //@}
+
+    HandlerPool m_handlerPool;  ///< See GetHandlerPool().
+};
+
+// The custom behaviour of the wxShapes is achieved using wxShapeEvtHandler
+// objects rather than by overriding wxShape methods. This allows any old
+// wxShape to be used.
+//
+void GraphDiagram::SetEventHandler(wxShape *shape)
+{
+    wxShapeEvtHandler *handler;
+    void *data = shape->GetClientData();
 
     if (shape->GetClassInfo() == CLASSINFO(wxControlPoint))
-        handler = new ControlPointHandler(shape);
+        handler = new (m_handlerPool) ControlPointHandler(shape);
     else if (wxDynamicCast(data, GraphNode))
-        handler = new GraphNodeHandler(shape);
+        handler = new (m_handlerPool) GraphNodeHandler(shape);
     else if (wxDynamicCast(data, GraphElement))
-        handler = new GraphEdgeHandler(shape);
+        handler = new (m_handlerPool) GraphEdgeHandler(shape);
     else
-        handler = new GraphHandler(shape);
+        handler = new (m_handlerPool) GraphHandler(shape);
 
     shape->SetEventHandler(handler);
 }
 
+ZOrderList *GraphDiagram::GetKindList(wxShape *shape)
+{
+    void *data = shape->GetClientData();
+
+    if (wxDynamicCast(data, GraphNode))
+        return &m_nodes;
+    if (wxDynamicCast(data, GraphEdge))
+        return &m_edges;
+
+    return NULL;
+}
+
+wxShape *GraphDiagram::GetPreviousShape(wxShape *shape) const
+{
+    const auto node = m_shapes.Find(shape);
+    const auto prev = node ? node->GetPrevious() : ZOrderList::Node();
+    return prev ? static_cast<wxShape*>(prev->GetData()) : NULL;
+}
+
 void GraphDiagram::AddShape(wxShape *shape, wxShape *addAfter)
 {
     SetEventHandler(shape);
-    wxDiagram::AddShape(shape, addAfter);
+
+    if (m_shapes.Contains(shape))
+        return;
+
+    const auto after = addAfter ? m_shapes.Find(addAfter) : ZOrderList::Node();
+
+    if (after && after->GetNext())
+        m_shapes.Insert(after->GetNext(), shape);
+    else
+        m_shapes.Append(shape);
+
+    shape->SetCanvas(GetCanvas());
+
+    ZOrderList *list = GetKindList(shape);
+    if (!list)
+        return;
+
+    if (!after) {
+        list->Append(shape);
+        return;
+    }
+
+    // Insert the shape after the closest preceding shape of the same kind to
+    // keep the same relative order as in the main list.
+    wxShape *prev = NULL;
+
+    for (auto node = m_shapes.Find(shape)->GetPrevious();
+         node && !prev;
+         node = node->GetPrevious()) {
+        wxShape *other = static_cast<wxShape*>(node->GetData());
+        if (GetKindList(other) == list)
+            prev = other;
+    }
+
+    if (!prev) {
+        list->Prepend(shape);
+    } else {
+        const auto node = list->Find(prev)->GetNext();
+        if (node)
+            list->Insert(node, shape);
+        else
+            list->Append(shape);
+    }
 }
 
 void GraphDiagram::InsertShape(wxShape *shape)
 {
     SetEventHandler(shape);
-    wxDiagram::InsertShape(shape);
+
+    m_shapes.Prepend(shape);
+    shape->SetCanvas(GetCanvas());
+
+    ZOrderList *list = GetKindList(shape);
+    if (list)
+        list->Prepend(shape);
+}
+
+// Notice that this is called from wxShape dtor, called from GraphElement dtor,
+// so we can't use the client data type here.
+void GraphDiagram::RemoveShape(wxShape *shape)
+{
+    m_shapes.Remove(shape);
+
+    bool isNode = m_nodes.Remove(shape);
+    if (!isNode)
+        m_edges.Remove(shape);
+
+    if (m_selection.Remove(shape) && isNode)
+        m_selectedNodes--;
+
+    // left in m_pendingLinks, RouteLinks() skips it as it's not in the set
+    m_pendingSet.erase(shape);
+}
+
+void GraphDiagram::RemoveAllShapes()
+{
+    m_shapes.Clear();
+    m_nodes.Clear();
+    m_edges.Clear();
+    m_selection.Clear();
+    m_selectedNodes = 0;
+    m_pendingLinks.clear();
+    m_pendingSet.clear();
+}
+
+void GraphDiagram::DeferLink(wxLineShape *line)
+{
+    if (m_pendingSet.insert(line).second)
+        m_pendingLinks.push_back(line);
+}
+
+void GraphDiagram::RouteLinks()
+{
+    wxShapeCanvas *canvas = GetCanvas();
+
+    if (m_pendingLinks.empty() || !canvas)
+        return;
+
+    std::vector<wxShape*> links;
+    links.swap(m_pendingLinks);
+    std::unordered_set<wxShape*> pending;
+    pending.swap(m_pendingSet);
+
+    MeasureDC dc(canvas);
+
+    // erasing also skips a deleted line whose address was reused and which
+    // was then deferred again, leaving it twice in the list
+    for (wxShape *line : links)
+        if (pending.erase(line))
+            line->GetEventHandler()->OnMoveLink(dc);
+}
+
+void GraphDiagram::RaiseShape(wxShape *shape)
+{
+    if (m_shapes.MoveToBack(shape)) {
+        ZOrderList *list = GetKindList(shape);
+        if (list)
+            list->MoveToBack(shape);
+    }
+}
+
+void GraphDiagram::LowerShape(wxShape *shape)
+{
+    if (m_shapes.MoveToFront(shape)) {
+        ZOrderList *list = GetKindList(shape);
+        if (list)
+            list->MoveToFront(shape);
+    }
+}
+
+void GraphDiagram::SelectShape(wxShape *shape, bool select)
+{
+    if (shape->Selected() == select)
+        return;
+
+    shape->Select(select);
+
+    const bool isNode = m_nodes.Contains(shape);
+
+    if (select) {
+        m_selection.Append(shape);
+        if (isNode)
+            m_selectedNodes++;
+    }
+    else if (m_selection.Remove(shape) && isNode) {
+        m_selectedNodes--;
+    }
+}
+
+wxRect GraphDiagram::GetRedrawRect(wxDC& dc) const
+{
+    // the DC can be for a view rather than for our canvas
+    GraphCanvas *canvas = wxDynamicCast(dc.GetWindow(), GraphCanvas);
+    if (!canvas || canvas->GetDiagram() != this)
+        canvas = wxStaticCast(GetCanvas(), GraphCanvas);
+    wxRect rc;
+
+    if (canvas && canvas->GetGraph())
+        rc = canvas->GetGraph()->GetDrawRect();
+
+    if (rc.IsEmpty() && canvas && dc.GetWindow() == canvas) {
+        wxRect box;
+
+        if (dc.IsKindOf(CLASSINFO(wxPaintDC)))
+            box = canvas->GetUpdateRegion().GetBox();
+        if (box.IsEmpty())
+            box = wxRect(canvas->GetClientSize());
+
+        rc.x = dc.DeviceToLogicalX(box.x);
+        rc.y = dc.DeviceToLogicalY(box.y);
+        rc.width = dc.DeviceToLogicalX(box.x + box.width) - rc.x + 1;
+        rc.height = dc.DeviceToLogicalY(box.y + box.height) - rc.y + 1;
+    }
+
+    return rc;
+}
+
+#if wxUSE_GRAPHICS_CONTEXT
+
+/**
+ * Strokes the lines of the edges drawn one after the other with a single
+ * wxGraphicsPath per pen, when the graph is painted through a wxGCDC.
+ *
+ * Only the edges of the GraphEdge class itself, with one of its predefined
+ * styles and a wxLineShape, are batched, as the derived classes and the
+ * other shapes can draw themselves differently. Their arrowheads are drawn
+ * after all the lines of the batch.
+ */
+class EdgeBatch
+{
+public:
+    explicit EdgeBatch(wxGCDC& dc) : m_dc(dc) { }
+
+    EdgeBatch(const EdgeBatch&) = delete;
+    EdgeBatch(EdgeBatch&&) = delete;
+    EdgeBatch& operator=(const EdgeBatch&) = delete;
+    EdgeBatch& operator=(EdgeBatch&&) = delete;
+
+    /// Add the line of an edge to the batch, or return false if it can't be.
+    bool Add(wxLineShape *line);
+
+    /// Stroke the lines added since the last call and draw their arrowheads.
+    void Flush();
+
+private:
+    /// The path of the lines drawn with one pen.
+    struct Stroke
+    {
+        wxPen pen;
+        wxGraphicsPath path;
+    };
+
+    wxGCDC& m_dc;
+    std::vector<Stroke> m_strokes;
+    std::vector<wxLineShape*> m_arrows; ///< The lines with arrowheads.
+};
+
+bool EdgeBatch::Add(wxLineShape *line)
+{
+    const wxOGLPoints& points = line->GetLineControlPoints();
+
+    if (typeid(*line) != typeid(wxLineShape) || line->IsSpline() ||
+            line->Selected() || points.size() < 2)
+        return false;
+
+    GraphEdge *edge = GetEdge(line);
+
+    if (!edge || typeid(*edge) != typeid(GraphEdge) ||
+            edge->GetStyle() == GraphEdge::Style_Custom)
+        return false;
+
+    const GraphElement::DetailLevel level = edge->GetDetailLevel(m_dc);
+
+    if (level == GraphElement::Detail_Hidden)
+        return true;
+
+    const wxPen pen = edge->GetPen();
+    auto it = find_if(m_strokes.begin(), m_strokes.end(),
+                      [&pen](const Stroke& s) { return s.pen == pen; });
+
+    if (it == m_strokes.end()) {
+        Stroke stroke = { pen, m_dc.GetGraphicsContext()->CreatePath() };
+        it = m_strokes.insert(m_strokes.end(), stroke);
+    }
+
+    // rounded as by wxLineShape::OnDraw() so the lines are the same
+    it->path.MoveToPoint(WXROUND(points[0].x), WXROUND(points[0].y));
+    for (size_t i = 1; i < points.size(); i++)
+        it->path.AddLineToPoint(WXROUND(points[i].x), WXROUND(points[i].y));
+
+    if (level == GraphElement::Detail_Full && !line->GetArrows().empty())
+        m_arrows.push_back(line);
+
+    return true;
+}
+
+void EdgeBatch::Flush()
+{
+    wxGraphicsContext *gc = m_dc.GetGraphicsContext();
+
+    for (const auto& stroke : m_strokes) {
+        gc->SetPen(stroke.pen);
+        gc->StrokePath(stroke.path);
+    }
+    m_strokes.clear();
+
+    // as in GraphElement::OnDraw(), the shape only has a pen while drawn
+    for (const auto line : m_arrows) {
+        GraphEdge *edge = GetEdge(line);
+        wxPen pen(edge->GetPen());
+        wxBrush brush(edge->GetBrush());
+
+        line->SetPen(&pen);
+        line->SetBrush(&brush);
+        line->DrawArrows(m_dc);
+        line->SetPen(NULL);
+        line->SetBrush(NULL);
+    }
+    m_arrows.clear();
 }
 
+#endif // wxUSE_GRAPHICS_CONTEXT
+
 void GraphDiagram::Redraw(wxDC& dc)
 {
+    GRAPH_STATS_TIMER(redraw);
+    m_skipped = 0;
+
     if (m_shapeList) {
+        const wxRect rc = GetRedrawRect(dc);
+#ifdef GRAPH_STATS
+        unsigned long drawn = 0;
+#endif
+#if wxUSE_GRAPHICS_CONTEXT
+        wxGCDC *gcdc = wxDynamicCast(&dc, wxGCDC);
+        unique_ptr<EdgeBatch> batch(gcdc ? new EdgeBatch(*gcdc) : NULL);
+#endif
+
         for (auto& obj : *m_shapeList) {
             wxShape *object = static_cast<wxShape*>(obj);
-            if (!object->GetParent())
-                object->Draw(dc);
+            if (object->GetParent())
+                continue;
+
+            if (!rc.IsEmpty()) {
+                GraphHandler *handler =
+                    dynamic_cast<GraphHandler*>(object->GetEventHandler());
+
+                if (handler && !rc.Intersects(handler->GetDrawRect())) {
+                    m_skipped++;
+                    continue;
+                }
+            }
+
+#if wxUSE_GRAPHICS_CONTEXT
+            if (batch) {
+                wxLineShape *line = wxDynamicCast(object, wxLineShape);
+
+                if (line && batch->Add(line)) {
+#ifdef GRAPH_STATS
+                    drawn++;
+#endif
+                    continue;
+                }
+
+                // the shapes above the batched lines are drawn after them
+                batch->Flush();
+            }
+#endif
+
+            object->Draw(dc);
+#ifdef GRAPH_STATS
+            drawn++;
+#endif
         }
+
+#if wxUSE_GRAPHICS_CONTEXT
+        if (batch)
+            batch->Flush();
+#endif
+
+        GRAPH_STATS_ADD_ALL(GRAPH_STATS_COUNT(shapesDrawn, drawn),
+                            GRAPH_STATS_COUNT(shapesCulled, m_skipped));
     }
 }
 
 } // namespace impl
 
+namespace {
+
+/// Return the diagram containing the shape or @c NULL.
+GraphDiagram *GetDiagram(wxShape *shape)
+{
+    wxShapeCanvas *canvas = GetCanvas(shape);
+    return canvas ? static_cast<GraphDiagram*>(canvas->GetDiagram()) : NULL;
+}
+
+// ----------------------------------------------------------------------------
+// GraphEdgeHandler link routing
+// ----------------------------------------------------------------------------
+
+void GraphEdgeHandler::OnMoveLink(wxReadOnlyDC& dc, bool moveControlPoints)
+{
+    wxLineShape *line = GetShape();
+    GraphCanvas *canvas = wxStaticCast(line->GetCanvas(), GraphCanvas);
+    Graph *graph = canvas ? canvas->GetGraph() : NULL;
+
+    if (graph && graph->IsUpdating()) {
+        GetDiagram(line)->DeferLink(line);
+        return;
+    }
+
+    if (IsRouted())
+        return;
+
+    GraphElementHandler::OnMoveLink(dc, moveControlPoints);
+
+    m_rcFrom = GetEndBounds(line->GetFrom());
+    m_rcTo = GetEndBounds(line->GetTo());
+    m_points = line->GetLineControlPoints();
+}
+
+bool GraphEdgeHandler::IsRouted() const
+{
+    wxLineShape *line = GetShape();
+    wxShape *from = line->GetFrom();
+    wxShape *to = line->GetTo();
+
+    return from && to &&
+           m_rcFrom == GetEndBounds(from) &&
+           m_rcTo == GetEndBounds(to) &&
+           m_points == line->GetLineControlPoints();
+}
+
+wxRect GraphEdgeHandler::GetEndBounds(wxShape *shape)
+{
+    GraphNode *node = shape ? GetNode(shape) : NULL;
+    return node ? node->GetBounds() : wxRect();
+}
+
+} // namespace
+
 namespace impl {
 
 /**
@@ -2098,1047 +3337,4963 @@ protected:
 GraphIteratorBase::GraphIteratorBase() = default;
 
 GraphIteratorBase::GraphIteratorBase(const GraphIteratorBase& it)
-  : m_impl(it.m_impl ? it.m_impl->clone() : NULL)
 {
+    Assign(it);
 }
 
 GraphIteratorBase::GraphIteratorBase(GraphIteratorBase&& it) noexcept = default;
 
 GraphIteratorBase::GraphIteratorBase(GraphIteratorImpl *impl)
-    : m_impl(impl)
+    : m_kind(impl ? Kind_Impl : Kind_None),
+      m_impl(impl)
 {
 }
 
-GraphIteratorBase::~GraphIteratorBase() = default;
-
-GraphElement& GraphIteratorBase::operator*() const
+GraphIteratorBase::GraphIteratorBase(const wxList::iterator& begin,
+                                     const wxList::iterator& end,
+                                     wxClassInfo *classinfo,
+                                     int which,
+                                     const GraphNode *node)
+    : m_kind(Kind_List),
+      m_it(begin),
+      m_end(end),
+      m_node(node),
+      m_classinfo(classinfo == CLASSINFO(GraphElement) ? NULL : classinfo),
+      m_which(which)
 {
-    return *m_impl->get();
+    while (m_it != m_end && !Accept())
+        ++m_it;
 }
 
-GraphIteratorBase& GraphIteratorBase::operator=(const GraphIteratorBase& it)
+GraphIteratorBase::GraphIteratorBase(GraphLineShape *line,
+                                     wxClassInfo *classinfo,
+                                     bool end)
+    : m_kind(Kind_Pair),
+      m_line(line),
+      m_classinfo(classinfo == CLASSINFO(GraphElement) ? NULL : classinfo)
 {
-    if (&it != this) {
-        m_impl.reset(it.m_impl ? it.m_impl->clone() : NULL);
+    if (end) {
+        m_pos = 3;
+    } else {
+        m_pos = 0;
+        ++*this;
     }
-    return *this;
 }
 
-GraphIteratorBase&
-GraphIteratorBase::operator=(GraphIteratorBase&& it) noexcept = default;
+GraphIteratorBase::~GraphIteratorBase() = default;
 
-GraphIteratorBase& GraphIteratorBase::operator++()
+void GraphIteratorBase::Assign(const GraphIteratorBase& it)
 {
-    m_impl->inc();
-    return *this;
+    m_kind = it.m_kind;
+    m_it = it.m_it;
+    m_end = it.m_end;
+    m_node = it.m_node;
+    m_line = it.m_line;
+    m_pos = it.m_pos;
+    m_classinfo = it.m_classinfo;
+    m_which = it.m_which;
+    m_impl.reset(it.m_impl ? it.m_impl->clone() : NULL);
 }
 
-GraphIteratorBase& GraphIteratorBase::operator--()
+// Note that this function intentionally avoids using GetElement() helper and
+// checked casts because it's called for every element being iterated over and
+// the shapes in the diagram list are always associated with GraphElements.
+GraphElement *GraphIteratorBase::Get() const
 {
-    m_impl->dec();
-    return *this;
-}
+    wxShape *shape;
 
-bool GraphIteratorBase::operator ==(const GraphIteratorBase& it) const
-{
-    return (m_impl == NULL && it.m_impl == NULL) ||
-           (m_impl != NULL && it.m_impl != NULL && m_impl->eq(*it.m_impl));
-}
+    switch (m_kind) {
+        case Kind_List:
+            shape = static_cast<wxShape*>(*m_it);
+            break;
 
-} // namespace impl
+        case Kind_Pair:
+            shape = m_pos == 1 ? m_line->GetFrom() : m_line->GetTo();
+            break;
 
-namespace {
+        case Kind_Impl:
+            return m_impl->get();
 
-/**
- * A concrete iterator over lists of graph elements.
- *
- * This class implements the base graph iterator API defined by
- * GraphIteratorImpl for iteration over graph elements. It supports iterating
- * over ranges of items (and not all of them) and filtering the kind of items
- * it returns to the items of the given type and, optionally, to just the
- * incoming or outgoing edges.
- */
-class ListIterImpl : public GraphIteratorImpl
-{
-public:
-    /**
-     * Constructor specifying the range to iterate over and filters to apply.
-     *
-     * @param begin The beginning of the range to iterate over.
-     * @param end The end of the range to iterate over.
-     * @param classinfo Type of elements to restrict iteration to, if @c NULL
-     * iterate over elements of any type.
-     * @param which One of IteratorFilter enum elements. By default we iterate
-     * over all elements.
-     * @param node Only used if @a which is InEdges or OutEdges and specifies
-     * the node whose incoming or outgoing edges we want to iterate over.
-     */
-    ListIterImpl(const wxList::iterator& begin,
-                 const wxList::iterator& end,
-                 wxClassInfo *classinfo,
-                 int which = All,
-                 const GraphNode *node = NULL)
-      : m_it(begin),
-        m_end(end),
-        m_classinfo(classinfo == CLASSINFO(GraphElement) ? NULL : classinfo),
-        m_which(which),
-        m_node(node)
-    {
-        while (m_it != m_end && !filter())
-            ++m_it;
+        case Kind_None:
+        default:
+            return NULL;
     }
 
-    /**
-     * Return true if the current element should be accepted.
-     *
-     * If false is returned, the iterator ignores the current element.
-     */
-    bool filter()
-    {
-        GraphElement *element = get();
+    return shape ? static_cast<GraphElement*>(shape->GetClientData()) : NULL;
+}
 
-        if (!element)
-            return false;
+bool GraphIteratorBase::Accept() const
+{
+    GraphElement *element = Get();
 
-        if (m_which == Selected && !element->IsSelected())
-            return false;
+    if (!element)
+        return false;
 
-        if (m_classinfo && !element->IsKindOf(m_classinfo))
-            return false;
+    if (m_which == Selected && !element->IsSelected())
+        return false;
 
-        if (m_node && (m_which == InEdges || m_which == OutEdges))
-        {
-            GraphEdge *edge = wxDynamicCast(element, GraphEdge);
-            if (!edge)
-                return false;
-            if (m_which == InEdges)
-                return edge->GetTo() == m_node;
-            else
-                return edge->GetFrom() == m_node;
-        }
+    // Check for the exact type first as this is the most common case and is
+    // faster than IsKindOf() walking the class hierarchy.
+    if (m_classinfo &&
+            element->GetClassInfo() != m_classinfo &&
+                !element->IsKindOf(m_classinfo))
+        return false;
 
-        return true;
+    if (m_node && (m_which == InEdges || m_which == OutEdges))
+    {
+        // The list of the lines of the node shape only contains lines.
+        wxLineShape *line = static_cast<wxLineShape*>(*m_it);
+        wxShape *shape = m_node->GetShape();
+
+        if (m_which == InEdges)
+            return line->GetTo() == shape;
+        else
+            return line->GetFrom() == shape;
     }
 
-    /**
-     * Advance the iterator skipping over unacceptable elements.
-     */
-    void inc() override
-    {
-        do {
-            ++m_it;
-        }
-        while (m_it != m_end && !filter());
-    }
+    return true;
+}
 
-    /**
-     * Advance the iterator backwards skipping over unacceptable elements.
-     */
-    void dec() override
-    {
-        do {
-            --m_it;
-        }
-        while (!filter());
-    }
+GraphElement& GraphIteratorBase::operator*() const
+{
+    return *Get();
+}
 
-    /**
-     * Compare two iterators.
-     *
-     * The comparison doesn't take filter settings into account.
-     */
-    bool eq(const GraphIteratorImpl& other) const override
-    {
-        return typeid(other) == typeid(ListIterImpl) &&
-               m_it == static_cast<const ListIterImpl&>(other).m_it;
+GraphIteratorBase& GraphIteratorBase::operator=(const GraphIteratorBase& it)
+{
+    if (&it != this)
+        Assign(it);
+    return *this;
+}
+
+GraphIteratorBase&
+GraphIteratorBase::operator=(GraphIteratorBase&& it) noexcept = default;
+
+GraphIteratorBase& GraphIteratorBase::operator++()
+{
+    switch (m_kind) {
+        case Kind_List:
+            do {
+                ++m_it;
+            }
+            while (m_it != m_end && !Accept());
+            break;
+
+        case Kind_Pair:
+            do {
+                m_pos++;
+            }
+            while (m_pos < 3 && !Accept());
+            break;
+
+        case Kind_Impl:
+            m_impl->inc();
+            break;
+
+        case Kind_None:
+            wxFAIL_MSG(_T("Incrementing invalid iterator"));
+            break;
     }
 
-    /// Dereference the iterator.
-    GraphElement *get() const override
-    {
-        return GetElement(wxStaticCast(*m_it, wxShape));
+    return *this;
+}
+
+GraphIteratorBase& GraphIteratorBase::operator--()
+{
+    switch (m_kind) {
+        case Kind_List:
+            do {
+                --m_it;
+            }
+            while (!Accept());
+            break;
+
+        case Kind_Pair:
+            do {
+                m_pos--;
+            }
+            while (m_pos > 0 && !Accept());
+            break;
+
+        case Kind_Impl:
+            m_impl->dec();
+            break;
+
+        case Kind_None:
+            wxFAIL_MSG(_T("Decrementing invalid iterator"));
+            break;
     }
 
-    /// Create a copy of this iterator polymorphically.
-    ListIterImpl *clone() const override
-    {
-        return new ListIterImpl(*this);
+    return *this;
+}
+
+// The comparison doesn't take filter settings (i.e. type of the elements to
+// accept) into account.
+bool GraphIteratorBase::operator ==(const GraphIteratorBase& it) const
+{
+    if (m_kind != it.m_kind)
+        return false;
+
+    switch (m_kind) {
+        case Kind_List:
+            return m_it == it.m_it;
+
+        case Kind_Pair:
+            return m_line == it.m_line && m_pos == it.m_pos;
+
+        case Kind_Impl:
+            return m_impl->eq(*it.m_impl);
+
+        case Kind_None:
+            break;
     }
 
-private:
-    wxList::iterator m_it;      ///< The current iterator position.
-    wxList::iterator m_end;     ///< One past the last valid position.
-    wxClassInfo *m_classinfo;   ///< Type of accepted elements.
-    int m_which;                ///< Kind of elements to include.
-    const GraphNode *m_node;    ///< Node for InEdges/OutEdges filter.
-};
+    return true;
+}
+
+} // namespace impl
+
+// ----------------------------------------------------------------------------
+// SpatialIndex
+// ----------------------------------------------------------------------------
+
+namespace impl {
 
 /**
- * Iterator over edge end points.
+ * Uniform grid index of the node bounds used for hit testing.
+ *
+ * Each node is registered in all the grid cells its bounds overlap, so that
+ * finding the nodes under a point only needs to look at a single cell instead
+ * of walking the whole diagram.
  *
- * This class iterates over the nodes connected to the given edge.
+ * The index also remembers the Z-order of the nodes: a node added later or
+ * brought to the front by Raise() is above all the nodes already indexed,
+ * which corresponds to the order of the shapes in the diagram shape list.
  */
-class PairIterImpl : public GraphIteratorImpl
+class SpatialIndex
 {
 public:
-    /**
-     * Create an iterator over nodes connected by the given line.
-     *
-     * @param line The line whose terminal nodes we want to iterate over.
-     * @param classinfo The type of the nodes to return or @c NULL if any.
-     * @param end If true, position the iterator to the end initially so that
-     * it's one past the target node. Otherwise it's positioned at the
-     * beginning, i.e. at the source node.
-     */
-    PairIterImpl(wxLineShape *line, wxClassInfo *classinfo, bool end)
-      : m_line(line),
-        m_classinfo(classinfo == CLASSINFO(GraphElement) ? NULL : classinfo)
-    {
-        if (end) {
-            m_pos = 3;
-        } else {
-            m_pos = 0;
-            inc();
-        }
-    }
+    SpatialIndex() : m_zorder(0) { }
+
+    SpatialIndex(const SpatialIndex&) = delete;
+    SpatialIndex(SpatialIndex&&) = delete;
+    SpatialIndex& operator=(const SpatialIndex&) = delete;
+    SpatialIndex& operator=(SpatialIndex&&) = delete;
+
+    /// Add a node on top of all the existing ones.
+    void Insert(const GraphNode *node, const wxRect& bounds);
 
     /**
-     * Return true if the current element should be accepted.
+     * Update the bounds of a node, does nothing if it's not indexed.
      *
-     * If false is returned, the iterator ignores the current element.
+     * Returns the previous bounds of the node or an empty rectangle if it
+     * wasn't indexed.
      */
-    bool filter()
-    {
-        GraphElement *element = get();
-        return element && (!m_classinfo || element->IsKindOf(m_classinfo));
-    }
+    wxRect Update(const GraphNode *node, const wxRect& bounds);
 
-    /**
-     * Advance the iterator skipping over unacceptable elements.
-     */
-    void inc() final
-    {
-        do {
-            m_pos++;
-        }
-        while (m_pos < 3 && !filter());
-    }
+    /// Bring a node above all the others, does nothing if it's not indexed.
+    void Raise(const GraphNode *node);
 
-    /**
-     * Advance the iterator backwards skipping over unacceptable elements.
-     */
-    void dec() final
-    {
-        do {
-            m_pos--;
-        }
-        while (m_pos > 0 && !filter());
-    }
+    /// Remove a node from the index, returning its bounds.
+    wxRect Remove(const GraphNode *node);
 
-    /**
-     * Compare two iterators.
-     *
-     * The comparison doesn't take filter settings (i.e. type of the elements
-     * to accept) into account.
-     */
-    bool eq(const GraphIteratorImpl& other) const final
-    {
-        if (typeid(other) != typeid(PairIterImpl))
-            return false;
-        const PairIterImpl& oth = static_cast<const PairIterImpl&>(other);
-        return oth.m_line == m_line && oth.m_pos == m_pos;
-    }
+    /// Remove all the nodes.
+    void Clear();
 
-    /// Dereference the iterator.
-    GraphElement *get() const final
-    {
-        return GetElement(m_pos == 1 ? m_line->GetFrom() : m_line->GetTo());
-    }
+    /// Prepare for adding the given number of nodes.
+    void Reserve(size_t count) { m_entries.reserve(m_entries.size() + count); }
 
-    /// Create a copy of this iterator polymorphically.
-    PairIterImpl *clone() const final
+    /// Return the union of the bounds of all the nodes.
+    wxRect GetBounds() const;
+
+    /// Return the topmost node containing the given point or @c NULL.
+    const GraphNode *HitTest(const wxPoint& pt) const;
+
+    /// Return any node other than @a ignore intersecting the rectangle.
+    const GraphNode *FindOverlap(const wxRect& rect,
+                                 const GraphNode *ignore = NULL) const;
+
+    /// Return all the nodes intersecting the rectangle in Z-order.
+    std::vector<const GraphNode*> Query(const wxRect& rect) const;
+
+    /// Estimate the memory used by the index in bytes.
+    size_t GetMemoryUsage() const
     {
-        return new PairIterImpl(*this);
+        size_t bytes = HashedMemoryUsage(m_entries) +
+                       HashedMemoryUsage(m_cells);
+        for (const auto& cell : m_cells)
+            bytes += cell.second.capacity() * sizeof(Cell::value_type);
+        return bytes;
     }
 
 private:
-    wxLineShape *m_line;        ///< The connecting edge.
-    wxClassInfo *m_classinfo;   ///< The type of nodes to accept or @c NULL.
+    /// The size of the grid cells in pixels.
+    static constexpr int CELL_SIZE = 256;
 
-    /**
-     * Current position of the iterator.
-     *
-     * This is 0 for the position just before the beginning, 1 for the source
-     * node, 2 for the target one and 3 for the position right after end.
-     */
-    int m_pos;
-};
+    /// The information stored for every indexed node.
+    struct Entry
+    {
+        wxRect bounds;                  ///< The node bounds.
+        unsigned long zorder;           ///< Higher values are on top.
+    };
 
-} // namespace
+    /// Key identifying a grid cell combining its column and row.
+    typedef unsigned long long CellKey;
 
-// ----------------------------------------------------------------------------
-// Graph
-// ----------------------------------------------------------------------------
+    /// Nodes overlapping a single cell.
+    typedef std::vector<const GraphNode*> Cell;
 
-IMPLEMENT_DYNAMIC_CLASS(Graph, wxEvtHandler)
+    /// Return the column or row of the cell containing the coordinate.
+    static int CellOf(int coord)
+    {
+        return coord >= 0 ? coord / CELL_SIZE : -((-coord - 1) / CELL_SIZE) - 1;
+    }
 
-namespace {
+    /// Return the key of the cell at the given column and row.
+    static CellKey MakeKey(int col, int row)
+    {
+        return (CellKey(unsigned(col)) << 32) | unsigned(row);
+    }
 
-/**
- * Name of the corresponding object in the archive.
- */
-//@{
-const wxChar* const TAGGRAPH  = _T("graph");
-const wxChar* const TAGFONT   = _T("font");
-const wxChar* const TAGSNAP   = _T("snap");
-const wxChar* const TAGGRID   = _T("grid");
-const wxChar* const TAGBOUNDS = _T("bounds");
-//@}
+    /// Register or unregister the node in all cells overlapped by bounds.
+    //@{
+    void Link(const GraphNode *node, const wxRect& bounds);
+    void Unlink(const GraphNode *node, const wxRect& bounds);
+    //@}
 
-/**
- * Extrinsic information associated with a serialized GraphNode.
- *
- * This object is used to store the global graph font (if different from
- * default) and offset when serializing the graph in an archive and to restore
- * it when deserialising.
- */
-class GraphInfo : public wxObject
-{
-public:
-    GraphInfo()
-    { }
+    std::unordered_map<const GraphNode*, Entry> m_entries;
+    std::unordered_map<CellKey, Cell> m_cells;
 
-    /// Create object storing the given font and offset.
-    GraphInfo(const wxFont& font, const wxPoint& offset)
-      : m_font(font), m_offset(offset)
-    { }
+    /// The Z-order value of the last node added or raised.
+    unsigned long m_zorder;
+};
 
-    /// Return the font stored by this object.
-    wxFont  GetFont()   const { return m_font; }
+void SpatialIndex::Link(const GraphNode *node, const wxRect& bounds)
+{
+    if (bounds.IsEmpty())
+        return;
 
-    /// Return the offset stored by this object.
-    wxPoint GetOffset() const { return m_offset; }
+    for (int col = CellOf(bounds.x); col <= CellOf(bounds.GetRight()); col++)
+        for (int row = CellOf(bounds.y); row <= CellOf(bounds.GetBottom()); row++)
+            m_cells[MakeKey(col, row)].push_back(node);
+}
 
-private:
-    wxFont m_font;          ///< Font specified in the ctor.
-    wxPoint m_offset;       ///< Offset specified in the ctor.
-};
+void SpatialIndex::Unlink(const GraphNode *node, const wxRect& bounds)
+{
+    if (bounds.IsEmpty())
+        return;
 
-} // namespace
+    for (int col = CellOf(bounds.x); col <= CellOf(bounds.GetRight()); col++) {
+        for (int row = CellOf(bounds.y); row <= CellOf(bounds.GetBottom()); row++) {
+            auto it = m_cells.find(MakeKey(col, row));
+            if (it == m_cells.end())
+                continue;
+
+            Cell& cell = it->second;
+            auto pos = std::find(cell.begin(), cell.end(), node);
+            if (pos != cell.end()) {
+                *pos = cell.back();
+                cell.pop_back();
+            }
 
-Graph::Graph(wxEvtHandler *handler)
-  : m_diagram(new GraphDiagram),
-    m_nodeHit(NULL),
-    m_handler(handler),
-    m_dpi(GetScreenDPI())
+            if (cell.empty())
+                m_cells.erase(it);
+        }
+    }
+}
+
+void SpatialIndex::Insert(const GraphNode *node, const wxRect& bounds)
 {
-    Graph::New();
+    Remove(node);
+
+    Entry& entry = m_entries[node];
+    entry.bounds = bounds;
+    entry.zorder = ++m_zorder;
+    Link(node, bounds);
 }
 
-Graph::~Graph()
+wxRect SpatialIndex::Update(const GraphNode *node, const wxRect& bounds)
 {
-    Graph::New();
-    GraphCtrl *ctrl = GetCtrl();
+    auto it = m_entries.find(node);
+    if (it == m_entries.end())
+        return wxRect();
 
-    if (ctrl) {
-        m_diagram->SetCanvas(NULL);
-        ctrl->SetGraph(NULL);
-    }
-    else {
-        delete m_diagram->GetCanvas();
+    wxRect old = it->second.bounds;
+
+    if (old != bounds) {
+        Unlink(node, old);
+        it->second.bounds = bounds;
+        Link(node, bounds);
     }
 
-    delete m_diagram;
+    return old;
 }
 
-void Graph::New()
+void SpatialIndex::Raise(const GraphNode *node)
 {
-    iterator it, end;
-    for (tie(it, end) = GetElements(); it != end; )
-        delete &*it++;
+    auto it = m_entries.find(node);
 
-    m_diagram->DeleteAllShapes();
+    if (it != m_entries.end())
+        it->second.zorder = ++m_zorder;
+}
 
-    wxShapeCanvas *canvas = m_diagram->GetCanvas();
-    if (canvas) {
-        canvas->SetFont(DefaultFont());
-        wxStaticCast(canvas, GraphCanvas)->ScrollTo(wxPoint(0, 0), false);
-    }
+wxRect SpatialIndex::Remove(const GraphNode *node)
+{
+    auto it = m_entries.find(node);
+    if (it == m_entries.end())
+        return wxRect();
 
-    constexpr int GRID_SPACING_FACTOR = 18;
-    SetGridSpacing(m_dpi.y / GRID_SPACING_FACTOR);
+    wxRect old = it->second.bounds;
+    Unlink(node, old);
+    m_entries.erase(it);
 
-    RefreshBounds();
+    return old;
 }
 
-void Graph::SetEventHandler(wxEvtHandler *handler)
+void SpatialIndex::Clear()
 {
-    m_handler = handler;
+    m_entries.clear();
+    m_cells.clear();
+    m_zorder = 0;
 }
 
-wxEvtHandler *Graph::GetEventHandler() const
+wxRect SpatialIndex::GetBounds() const
 {
-    return m_handler;
+    wxRect rc;
+
+    for (const auto& entry : m_entries)
+        rc.Union(entry.second.bounds);
+
+    return rc;
 }
 
-void Graph::SendEvent(wxEvent& event)
+const GraphNode *SpatialIndex::HitTest(const wxPoint& pt) const
 {
-    if (m_handler) {
-        event.SetEventObject(this);
-        m_handler->ProcessEvent(event);
+    auto it = m_cells.find(MakeKey(CellOf(pt.x), CellOf(pt.y)));
+    if (it == m_cells.end()) {
+        GRAPH_STATS_ADD(hitTests, 1);
+        return NULL;
     }
-}
 
-wxRect Graph::GetBounds() const
-{
-    if (m_rcBounds.IsEmpty()) {
-        for (const auto& node : MakeRange(GetNodes()))
-            m_rcBounds.Union(node.GetBounds());
+    const GraphNode *hit = NULL;
+    unsigned long zorder = 0;
+
+    for (const auto node : it->second) {
+        const Entry& entry = m_entries.find(node)->second;
+
+        if (entry.zorder > zorder && entry.bounds.Contains(pt)) {
+            hit = node;
+            zorder = entry.zorder;
+        }
     }
 
-    return m_rcBounds;
-}
+    // this is called for every mouse move, so take the lock only once
+    GRAPH_STATS_ADD_ALL(
+        GRAPH_STATS_COUNT(hitTests, 1),
+        GRAPH_STATS_COUNT(hitTestCandidates, it->second.size()),
+        GRAPH_STATS_COUNT(hitTestHits, hit ? 1 : 0));
 
-void Graph::RefreshBounds()
-{
-    GraphCanvas *canvas = GetCanvas();
-    if (canvas)
-        canvas->SetCheckBounds();
-    m_rcBounds = wxRect();
-    m_rcHit = wxRect();
-    m_nodeHit = NULL;
+    return hit;
 }
 
-void Graph::SetCanvas(GraphCanvas *canvas)
+vector<const GraphNode*> SpatialIndex::Query(const wxRect& rect) const
 {
-    GraphCtrl *oldctrl = GetCtrl();
-    wxShapeCanvas *oldcanvas = m_diagram->GetCanvas();
+    vector<pair<unsigned long, const GraphNode*>> found;
 
-    if (canvas == oldcanvas || (!canvas && !oldctrl))
-        return;
+    if (!rect.IsEmpty()) {
+        const int col1 = CellOf(rect.x), row1 = CellOf(rect.y);
 
-    m_diagram->SetCanvas(canvas);
-    canvas = GetCanvas();
+        for (int col = col1; col <= CellOf(rect.GetRight()); col++) {
+            for (int row = row1; row <= CellOf(rect.GetBottom()); row++) {
+                auto it = m_cells.find(MakeKey(col, row));
+                if (it == m_cells.end())
+                    continue;
 
-    canvas->SetGraph(this);
+                for (const auto node : it->second) {
+                    const Entry& entry = m_entries.find(node)->second;
 
-    if (oldcanvas)
-        canvas->SetFont(oldcanvas->GetFont());
+                    // a node is in all the cells it overlaps, only report it
+                    // from the first one also overlapping the rectangle
+                    if (col == max(col1, CellOf(entry.bounds.x)) &&
+                            row == max(row1, CellOf(entry.bounds.y)) &&
+                            entry.bounds.Intersects(rect))
+                        found.push_back(make_pair(entry.zorder, node));
+                }
+            }
+        }
+    }
 
-    for(auto& obj : *m_diagram->GetShapeList())
-        wxStaticCast(obj, wxShape)->SetCanvas(canvas);
+    sort(found.begin(), found.end());
 
-    if (!oldctrl)
-        delete oldcanvas;
+    vector<const GraphNode*> nodes;
+    nodes.reserve(found.size());
+    for (const auto& f : found)
+        nodes.push_back(f.second);
+
+    return nodes;
 }
 
-GraphCanvas *Graph::GetCanvas() const
+const GraphNode *SpatialIndex::FindOverlap(const wxRect& rect,
+                                           const GraphNode *ignore) const
 {
-    wxShapeCanvas *canvas = m_diagram->GetCanvas();
+    if (rect.IsEmpty())
+        return NULL;
 
-    if (!canvas) {
-        GraphCanvas *gcanvas = new GraphCanvas;
-        gcanvas->SetGraph(const_cast<Graph*>(this));
+    for (int col = CellOf(rect.x); col <= CellOf(rect.GetRight()); col++) {
+        for (int row = CellOf(rect.y); row <= CellOf(rect.GetBottom()); row++) {
+            auto it = m_cells.find(MakeKey(col, row));
+            if (it == m_cells.end())
+                continue;
+
+            for (const auto node : it->second) {
+                if (node != ignore &&
+                        m_entries.find(node)->second.bounds.Intersects(rect))
+                    return node;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// AdjacencyIndex
+// ----------------------------------------------------------------------------
+
+/**
+ * Number of the edges going from one node to another for every such pair.
+ *
+ * This allows Graph::AreConnected() to answer without walking the edges of
+ * either node. The edges are counted, rather than the pairs just being
+ * flagged, as the same nodes can be connected by several edges.
+ */
+class AdjacencyIndex
+{
+public:
+    AdjacencyIndex() { }
+
+    AdjacencyIndex(const AdjacencyIndex&) = delete;
+    AdjacencyIndex(AdjacencyIndex&&) = delete;
+    AdjacencyIndex& operator=(const AdjacencyIndex&) = delete;
+    AdjacencyIndex& operator=(AdjacencyIndex&&) = delete;
+
+    /// Add or remove @a delta edges going from @a from to @a to.
+    void Update(const GraphNode *from, const GraphNode *to, int delta);
+
+    /// True if at least one edge goes from @a from to @a to.
+    bool Contains(const GraphNode *from, const GraphNode *to) const
+    {
+        return m_counts.count(Key(from, to)) != 0;
+    }
+
+    /// Remove all the edges.
+    void Clear() { m_counts.clear(); }
+
+    /// Estimate the memory used by the index in bytes.
+    size_t GetMemoryUsage() const { return HashedMemoryUsage(m_counts); }
+
+private:
+    /// The starting and ending nodes of the edges.
+    typedef std::pair<const GraphNode*, const GraphNode*> Key;
+
+    /// Hash function for Key.
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            std::hash<const GraphNode*> hash;
+            return hash(key.first) ^ (hash(key.second) << 1);
+        }
+    };
+
+    std::unordered_map<Key, size_t, KeyHash> m_counts;
+};
+
+void AdjacencyIndex::Update(const GraphNode *from,
+                            const GraphNode *to,
+                            int delta)
+{
+    if (delta > 0) {
+        m_counts[Key(from, to)] += delta;
+        return;
+    }
+
+    auto it = m_counts.find(Key(from, to));
+    wxCHECK_RET(it != m_counts.end() && it->second >= size_t(-delta),
+                _T("removing an edge missing from the adjacency index"));
+
+    it->second -= size_t(-delta);
+    if (it->second == 0)
+        m_counts.erase(it);
+}
+
+// ----------------------------------------------------------------------------
+// GraphAnalysis
+// ----------------------------------------------------------------------------
+
+/**
+ * Topological order of the nodes, kept up to date as the edges change.
+ *
+ * Every node has an order number, and while the graph has no cycle each edge
+ * goes from a lower number to a higher one. Connecting two nodes already in
+ * this order costs nothing, otherwise only the nodes with numbers between
+ * those of the two ends are searched and renumbered, using the algorithm of
+ * Pearce and Kelly. This search also finds out whether the edge closes a
+ * cycle, after which the order is left as it is until an edge is removed,
+ * and is then recomputed for the whole graph the next time it's needed.
+ *
+ * The order bounds the reachability searches too: a node can only reach the
+ * nodes after it, so most queries are answered without visiting any node.
+ *
+ * The nodes refer to each other directly rather than by GraphNode, so that
+ * the searches don't need any lookups, and are marked as visited with a
+ * counter incremented for each search, so that nothing is allocated either.
+ */
+class GraphAnalysis
+{
+public:
+    GraphAnalysis() : m_state(Acyclic), m_next(0), m_mark(0) { }
+
+    GraphAnalysis(const GraphAnalysis&) = delete;
+    GraphAnalysis(GraphAnalysis&&) = delete;
+    GraphAnalysis& operator=(const GraphAnalysis&) = delete;
+    GraphAnalysis& operator=(GraphAnalysis&&) = delete;
+
+    /// Add a new node, after all the others in the order.
+    void Insert(const GraphNode *node) { Get(node); }
+    /// Remove a node, its edges should have been disconnected already.
+    void Remove(const GraphNode *node);
+
+    /// The first edge going from @a from to @a to was connected.
+    void Connect(const GraphNode *from, const GraphNode *to);
+    /// The last edge going from @a from to @a to was disconnected.
+    void Disconnect(const GraphNode *from, const GraphNode *to);
+
+    /// Remove all the nodes.
+    void Clear();
+
+    /// True unless the graph has a cycle.
+    bool IsAcyclic() { return Validate(); }
+
+    /// True if a directed path goes from @a from to @a to.
+    bool IsReachable(const GraphNode *from, const GraphNode *to);
+
+    /**
+     * The nodes reachable from @a node, following the edges forwards if
+     * @a downstream is true or backwards otherwise.
+     *
+     * They are in topological order unless the graph has a cycle.
+     */
+    std::vector<const GraphNode*> GetReachable(const GraphNode *node,
+                                               bool downstream);
+
+    /// All the nodes in topological order, none if the graph has a cycle.
+    std::vector<const GraphNode*> GetOrder();
+
+    /// Estimate the memory used in bytes.
+    size_t GetMemoryUsage() const;
+
+private:
+    /// A node with its successors and predecessors.
+    struct Vertex
+    {
+        const GraphNode *node;
+        size_t order;                   ///< Position in the order.
+        size_t mark;                    ///< Number of the last search.
+        std::vector<Vertex*> succ;
+        std::vector<Vertex*> pred;
+    };
+
+    /// Whether m_order is a topological order.
+    enum State
+    {
+        Acyclic,        ///< It is, the graph has no cycle.
+        Cyclic,         ///< It isn't, the graph has a cycle.
+        Unknown         ///< A cycle may have been removed.
+    };
+
+    /// Return the vertex of @a node, adding it if needed.
+    Vertex& Get(const GraphNode *node);
+
+    /// Return the vertex of @a node or @c NULL.
+    Vertex *Find(const GraphNode *node);
+
+    /**
+     * Collect in @a found the vertices reachable from @a start, following
+     * the successors if @a forward is true and the predecessors otherwise,
+     * and only through vertices whose order is from @a lower to @a upper
+     * inclusive. Returns false if @a stop is reached, ending the search.
+     */
+    bool Search(Vertex& start,
+                bool forward,
+                size_t lower,
+                size_t upper,
+                const Vertex *stop,
+                std::vector<Vertex*> *found);
+
+    /**
+     * Renumber the vertices between @a to and @a from, so that the new edge
+     * from @a from to @a to follows the order. Returns false if the edge
+     * closes a cycle, in which case nothing is changed.
+     */
+    bool Reorder(Vertex& from, Vertex& to);
+
+    /**
+     * Recompute the order if the state is Unknown. Returns true if the graph
+     * has no cycle.
+     */
+    bool Validate();
+
+    std::unordered_map<const GraphNode*, Vertex> m_vertices;
+    State m_state;
+    size_t m_next;                      ///< Order of the next node added.
+    size_t m_mark;                      ///< Number of the current search.
+    std::vector<Vertex*> m_stack;       ///< Reused by Search().
+};
+
+GraphAnalysis::Vertex& GraphAnalysis::Get(const GraphNode *node)
+{
+    // the elements of an unordered_map are never moved, so the vertices can
+    // point to each other
+    auto result = m_vertices.emplace(node, Vertex());
+    Vertex& vertex = result.first->second;
+
+    if (result.second) {
+        vertex.node = node;
+        vertex.order = m_next++;
+        vertex.mark = 0;
+    }
+
+    return vertex;
+}
+
+GraphAnalysis::Vertex *GraphAnalysis::Find(const GraphNode *node)
+{
+    auto it = m_vertices.find(node);
+    return it != m_vertices.end() ? &it->second : NULL;
+}
+
+void GraphAnalysis::Remove(const GraphNode *node)
+{
+    auto it = m_vertices.find(node);
+    if (it == m_vertices.end())
+        return;
+
+    // removing a node leaves a gap in the order, which doesn't matter
+    Vertex& vertex = it->second;
+    wxASSERT_MSG(vertex.succ.empty() && vertex.pred.empty(),
+                 _T("removing a node which is still connected"));
+
+    while (!vertex.succ.empty())
+        Disconnect(node, vertex.succ.back()->node);
+    while (!vertex.pred.empty())
+        Disconnect(vertex.pred.back()->node, node);
+
+    m_vertices.erase(it);
+}
+
+void GraphAnalysis::Connect(const GraphNode *from, const GraphNode *to)
+{
+    Vertex& vfrom = Get(from);
+    Vertex& vto = Get(to);
+
+    if (m_state == Unknown)
+        Validate();
+    if (m_state == Acyclic && !Reorder(vfrom, vto))
+        m_state = Cyclic;
+
+    vfrom.succ.push_back(&vto);
+    vto.pred.push_back(&vfrom);
+}
+
+void GraphAnalysis::Disconnect(const GraphNode *from, const GraphNode *to)
+{
+    Vertex *vfrom = Find(from);
+    Vertex *vto = Find(to);
+    wxCHECK_RET(vfrom && vto, _T("disconnecting an unknown node"));
+
+    auto& succ = vfrom->succ;
+    succ.erase(std::find(succ.begin(), succ.end(), vto));
+    auto& pred = vto->pred;
+    pred.erase(std::find(pred.begin(), pred.end(), vfrom));
+
+    // removing an edge can't add a cycle, but it can remove the last one
+    if (m_state == Cyclic)
+        m_state = Unknown;
+}
+
+void GraphAnalysis::Clear()
+{
+    m_vertices.clear();
+    m_state = Acyclic;
+    m_next = 0;
+    m_stack.clear();
+}
+
+bool GraphAnalysis::Search(Vertex& start,
+                           bool forward,
+                           size_t lower,
+                           size_t upper,
+                           const Vertex *stop,
+                           std::vector<Vertex*> *found)
+{
+    m_mark++;
+    m_stack.clear();
+    m_stack.push_back(&start);
+    start.mark = m_mark;
+
+    while (!m_stack.empty()) {
+        Vertex *vertex = m_stack.back();
+        m_stack.pop_back();
+        if (found)
+            found->push_back(vertex);
+
+        for (auto next : forward ? vertex->succ : vertex->pred) {
+            if (next == stop)
+                return false;
+            if (next->mark != m_mark &&
+                    next->order >= lower && next->order <= upper) {
+                next->mark = m_mark;
+                m_stack.push_back(next);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool GraphAnalysis::Reorder(Vertex& from, Vertex& to)
+{
+    if (&from == &to)
+        return false;
+    if (from.order < to.order)
+        return true;
+
+    // the nodes after 'to' which must move after 'from' too, stopping if a
+    // path leads back to 'from', then those before 'from' to move before 'to'
+    std::vector<Vertex*> forward, backward;
+    if (!Search(to, true, to.order, from.order, &from, &forward))
+        return false;
+    Search(from, false, to.order + 1, from.order, NULL, &backward);
+
+    auto byOrder = [](const Vertex *a, const Vertex *b)
+    {
+        return a->order < b->order;
+    };
+    std::sort(forward.begin(), forward.end(), byOrder);
+    std::sort(backward.begin(), backward.end(), byOrder);
+
+    // reuse the numbers of both sets, giving the lowest to the backward set
+    // while keeping the relative order within each set
+    std::vector<size_t> orders;
+    orders.reserve(forward.size() + backward.size());
+    for (auto vertex : backward)
+        orders.push_back(vertex->order);
+    for (auto vertex : forward)
+        orders.push_back(vertex->order);
+    std::sort(orders.begin(), orders.end());
+
+    size_t i = 0;
+    for (auto vertex : backward)
+        vertex->order = orders[i++];
+    for (auto vertex : forward)
+        vertex->order = orders[i++];
+
+    return true;
+}
+
+bool GraphAnalysis::Validate()
+{
+    if (m_state != Unknown)
+        return m_state == Acyclic;
+
+    // Kahn's algorithm, with the counts of the predecessors not yet numbered
+    // kept in the marks, as no search can happen meanwhile
+    m_stack.clear();
+    for (auto& i : m_vertices) {
+        Vertex& vertex = i.second;
+        vertex.mark = vertex.pred.size();
+        if (vertex.mark == 0)
+            m_stack.push_back(&vertex);
+    }
+
+    size_t order = 0;
+    while (!m_stack.empty()) {
+        Vertex *vertex = m_stack.back();
+        m_stack.pop_back();
+        vertex->order = order++;
+
+        for (auto succ : vertex->succ)
+            if (--succ->mark == 0)
+                m_stack.push_back(succ);
+    }
+
+    for (auto& i : m_vertices)
+        i.second.mark = 0;
+    m_mark = 0;
+
+    if (order < m_vertices.size()) {
+        // the nodes in cycles weren't numbered, but it doesn't matter as
+        // the order isn't used until the graph is acyclic again
+        m_state = Cyclic;
+        return false;
+    }
+
+    m_next = order;
+    m_state = Acyclic;
+    return true;
+}
+
+bool GraphAnalysis::IsReachable(const GraphNode *from, const GraphNode *to)
+{
+    Vertex *vfrom = Find(from);
+    Vertex *vto = Find(to);
+    if (!vfrom || !vto)
+        return false;
+    if (vfrom == vto)
+        return true;
+
+    if (!Validate())
+        return !Search(*vfrom, true, 0, size_t(-1), vto, NULL);
+
+    // only the nodes between the two in the order can be on a path
+    if (vfrom->order > vto->order)
+        return false;
+    return !Search(*vfrom, true, vfrom->order, vto->order, vto, NULL);
+}
+
+std::vector<const GraphNode*>
+GraphAnalysis::GetReachable(const GraphNode *node, bool downstream)
+{
+    std::vector<const GraphNode*> nodes;
+    Vertex *vertex = Find(node);
+    if (!vertex)
+        return nodes;
+
+    bool acyclic = Validate();
+
+    std::vector<Vertex*> found;
+    Search(*vertex, downstream, 0, size_t(-1), NULL, &found);
+
+    // the first one found is the starting node itself
+    found.erase(found.begin());
+    if (acyclic) {
+        std::sort(found.begin(), found.end(),
+                  [](const Vertex *a, const Vertex *b)
+                  {
+                      return a->order < b->order;
+                  });
+    }
+
+    nodes.reserve(found.size());
+    for (auto v : found)
+        nodes.push_back(v->node);
+
+    return nodes;
+}
+
+std::vector<const GraphNode*> GraphAnalysis::GetOrder()
+{
+    std::vector<const GraphNode*> nodes;
+    if (!Validate())
+        return nodes;
+
+    std::vector<const Vertex*> vertices;
+    vertices.reserve(m_vertices.size());
+    for (const auto& i : m_vertices)
+        vertices.push_back(&i.second);
+
+    std::sort(vertices.begin(), vertices.end(),
+              [](const Vertex *a, const Vertex *b)
+              {
+                  return a->order < b->order;
+              });
+
+    nodes.reserve(vertices.size());
+    for (auto v : vertices)
+        nodes.push_back(v->node);
+
+    return nodes;
+}
+
+size_t GraphAnalysis::GetMemoryUsage() const
+{
+    size_t bytes = HashedMemoryUsage(m_vertices) +
+                   m_stack.capacity() * sizeof(Vertex*);
+    for (const auto& i : m_vertices)
+        bytes += (i.second.succ.capacity() + i.second.pred.capacity()) *
+                 sizeof(Vertex*);
+    return bytes;
+}
+
+} // namespace impl
+
+// ----------------------------------------------------------------------------
+// Layout
+// ----------------------------------------------------------------------------
+
+namespace {
+
+/**
+ * Trace mask used for dumping the input of the layout engine.
+ *
+ * Enable it with wxLog::AddTraceMask() to have the graph passed to the layout
+ * engine logged in dot format.
+ */
+const wxChar* const TRACE_LAYOUT = _T("graphlayout");
+
+/**
+ * A snapshot of the part of a graph to be laid out.
+ *
+ * This is plain data not referring to the graph elements, so it can be used
+ * by the layout engine in a worker thread while the graph is modified.
+ *
+ * Nodes are referred to by their index in the @c nodes vector, both by the
+ * edges and the ranks, and the layout results are returned in the same
+ * order, so no lookup by name is needed to map them back to the graph.
+ */
+struct LayoutInput
+{
+    /// A node to lay out, its size is in inches.
+    struct Node
+    {
+        double width;
+        double height;
+    };
+
+    /// An edge between the nodes with the given indices.
+    typedef pair<size_t, size_t> Edge;
+
+    LayoutInput()
+      : ranksep(DEFAULT_VERT_SPACING_IN_INCHES),
+        nodesep(DEFAULT_HORZ_SPACING_IN_INCHES),
+        fixed(NONE)
+    { }
+
+    /**
+     * Return the name used for the node with the given index.
+     *
+     * This name is not user-readable and is only used inside dot files.
+     */
+    static wxString NodeName(size_t i)
+    {
+        return wxString::Format(_T("n%lu"), static_cast<unsigned long>(i));
+    }
+
+    /// Return the graph in dot format.
+    wxString ToDot() const;
+
+    static constexpr size_t NONE = size_t(-1);
+
+    double ranksep;             ///< The vertical separation in inches.
+    double nodesep;             ///< The horizontal separation in inches.
+    vector<Node> nodes;         ///< Nodes in screen order.
+    vector<Edge> edges;         ///< Edges in screen order.
+    vector< vector<size_t> > ranks; ///< Groups of nodes having the same rank.
+    size_t fixed;               ///< Index of the node which doesn't move.
+};
+
+wxString LayoutInput::ToDot() const
+{
+    wxString dot;
+
+    dot << _T("digraph Project {\n");
+    dot << _T("\tnodesep=") << wxString::FromCDouble(nodesep) << _T("\n");
+    dot << _T("\tranksep=") << wxString::FromCDouble(ranksep) << _T("\n");
+    dot << _T("\tnode [label=\"\", shape=box, fixedsize=true];\n");
+
+    for (size_t i = 0; i < nodes.size(); i++)
+        dot << _T("\t") << NodeName(i)
+            << _T(" [width=\"") << wxString::FromCDouble(nodes[i].width)
+            << _T("\", height=\"") << wxString::FromCDouble(nodes[i].height)
+            << _T("\"]\n");
+
+    for (const auto& rank : ranks) {
+        dot << _T("\tsubgraph {\n\t\trank = same;\n");
+        for (size_t i : rank)
+            dot << _T("\t\t") << NodeName(i) << _T(";\n");
+        dot << _T("\t}\n");
+    }
+
+    for (const auto& edge : edges)
+        dot << _T("\t") << NodeName(edge.first)
+            << _T(" -> ") << NodeName(edge.second)
+            << _T(";\n");
+
+    dot << _T("}\n");
+
+    return dot;
+}
+
+} // namespace
+
+namespace impl {
+
+/**
+ * @brief The layouts computed before, found by the hash of their input.
+ *
+ * The layout engine always places the nodes of the same LayoutInput in the
+ * same way, so a connected component which hasn't changed since it was
+ * last laid out doesn't need to be passed to it again. The positions are
+ * stored in the graph item of the archive by Graph::Serialise(), so this
+ * still works after the file is reopened.
+ *
+ * A cache isn't modified once it's shared with a LayoutJob, Merge() returns
+ * a new one instead, so the jobs can read it from their worker threads.
+ */
+class LayoutCache
+{
+public:
+    typedef vector<wxRealPoint> Positions;
+    typedef unordered_map<wxUint64, Positions> Map;
+
+    LayoutCache() = default;
+
+    LayoutCache(const LayoutCache&) = delete;
+    LayoutCache(LayoutCache&&) = delete;
+    LayoutCache& operator=(const LayoutCache&) = delete;
+    LayoutCache& operator=(LayoutCache&&) = delete;
+
+    ~LayoutCache() = default;
+
+    /**
+     * Return a hash of everything in the input affecting the layout.
+     *
+     * The sizes and separations are rounded to twips so that the hash is
+     * the same on every platform and from one run to the next.
+     */
+    static wxUint64 Hash(const LayoutInput& input);
+
+    /// The positions cached for the hash, or @c NULL if there are none.
+    const Positions *Find(wxUint64 hash) const;
+
+    /**
+     * Return a cache of the @a recent layouts, followed by the layouts of
+     * @a cache, if any, from the most to the least recently used until
+     * there are @c MAX_LAYOUTS in all.
+     *
+     * The layouts restored by FromString() count as less recently used than
+     * any layout used since.
+     */
+    static shared_ptr<const LayoutCache>
+    Merge(const shared_ptr<const LayoutCache>& cache, const Map& recent);
+
+    /// Save the cache as a string, the positions are in twips.
+    wxString ToString() const;
+
+    /// Restore a cache saved by ToString(), NULL if it's invalid.
+    static shared_ptr<const LayoutCache> FromString(const wxString& str);
+
+private:
+    static constexpr size_t MAX_LAYOUTS = 4096;
+
+    Map m_layouts;
+    vector<wxUint64> m_order;   ///< The hashes, most recently used first.
+};
+
+wxUint64 LayoutCache::Hash(const LayoutInput& input)
+{
+    // 64 bit FNV-1a of the values, fed in byte by byte so that it doesn't
+    // depend on the endianness
+    constexpr wxUint64 FNV_OFFSET = 14695981039346656037ULL;
+    constexpr wxUint64 FNV_PRIME = 1099511628211ULL;
+    constexpr int BYTE_BITS = 8;
+    constexpr int BYTES = 8;
+
+    wxUint64 hash = FNV_OFFSET;
+
+    auto add = [&hash](wxUint64 n) {
+        for (int i = 0; i < BYTES; i++) {
+            hash ^= (n >> (i * BYTE_BITS)) & 0xff;
+            hash *= FNV_PRIME;
+        }
+    };
+
+    auto addInches = [&add](double inches) {
+        add(wxUint64(wxInt64(wxRound(inches * Twips::Inch))));
+    };
+
+    addInches(input.ranksep);
+    addInches(input.nodesep);
+
+    add(input.nodes.size());
+    for (const auto& node : input.nodes) {
+        addInches(node.width);
+        addInches(node.height);
+    }
+
+    add(input.edges.size());
+    for (const auto& edge : input.edges) {
+        add(edge.first);
+        add(edge.second);
+    }
+
+    add(input.ranks.size());
+    for (const auto& rank : input.ranks) {
+        add(rank.size());
+        for (size_t i : rank)
+            add(i);
+    }
+
+    return hash;
+}
+
+const LayoutCache::Positions *LayoutCache::Find(wxUint64 hash) const
+{
+    auto it = m_layouts.find(hash);
+    return it != m_layouts.end() ? &it->second : NULL;
+}
+
+shared_ptr<const LayoutCache>
+LayoutCache::Merge(const shared_ptr<const LayoutCache>& cache,
+                   const Map& recent)
+{
+    shared_ptr<LayoutCache> merged = make_shared<LayoutCache>();
+    merged->m_layouts = recent;
+
+    for (const auto& layout : recent)
+        merged->m_order.push_back(layout.first);
+
+    if (cache) {
+        for (wxUint64 hash : cache->m_order) {
+            if (merged->m_layouts.size() >= MAX_LAYOUTS)
+                break;
+            const auto it = cache->m_layouts.find(hash);
+            if (merged->m_layouts.insert(*it).second)
+                merged->m_order.push_back(hash);
+        }
+    }
+
+    return merged;
+}
+
+wxString LayoutCache::ToString() const
+{
+    // sort by hash so that saving the same graph twice gives the same file
+    map<wxUint64, const Positions*> sorted;
+    for (const auto& layout : m_layouts)
+        sorted[layout.first] = &layout.second;
+
+    const double scale = Twips::Inch / Points::Inch;
+    wxString str;
+
+    for (const auto& layout : sorted) {
+        if (!str.empty())
+            str << _T(";");
+
+        str << wxString::Format(_T("%") wxLongLongFmtSpec _T("x="),
+                                wxULongLong_t(layout.first));
+
+        const Positions& positions = *layout.second;
+        for (size_t i = 0; i < positions.size(); i++) {
+            if (i)
+                str << _T(",");
+            str << wxRound(positions[i].x * scale) << _T(",")
+                << wxRound(positions[i].y * scale);
+        }
+    }
+
+    return str;
+}
+
+shared_ptr<const LayoutCache> LayoutCache::FromString(const wxString& str)
+{
+    shared_ptr<LayoutCache> cache = make_shared<LayoutCache>();
+    const double scale = Points::Inch / Twips::Inch;
+    constexpr int HEX = 16;
+
+    wxStringTokenizer layouts(str, _T(";"), wxTOKEN_STRTOK);
+
+    while (layouts.HasMoreTokens()) {
+        wxString layout = layouts.GetNextToken();
+        wxULongLong_t hash;
+
+        if (!layout.BeforeFirst(_T('=')).ToULongLong(&hash, HEX))
+            return NULL;
+
+        const auto inserted = cache->m_layouts.emplace(wxUint64(hash),
+                                                       Positions());
+        if (inserted.second)
+            cache->m_order.push_back(hash);
+
+        Positions& positions = inserted.first->second;
+        wxStringTokenizer coords(layout.AfterFirst(_T('=')), _T(","));
+
+        while (coords.HasMoreTokens()) {
+            long x, y;
+            if (!coords.GetNextToken().ToLong(&x) ||
+                    !coords.HasMoreTokens() ||
+                    !coords.GetNextToken().ToLong(&y))
+                return NULL;
+            positions.push_back(wxRealPoint(x * scale, y * scale));
+        }
+    }
+
+    return cache;
+}
+
+} // namespace impl
+
+namespace {
+
+/**
+ * Receives the layout engine progress notifications.
+ */
+class LayoutProgress
+{
+public:
+    /**
+     * Called with the percentage of the work done.
+     *
+     * Returns @c false if the layout should be abandoned.
+     */
+    virtual bool Update(int percent) = 0;
+
+protected:
+    LayoutProgress() = default;
+    ~LayoutProgress() = default;
+
+    LayoutProgress(const LayoutProgress&) = delete;
+    LayoutProgress(LayoutProgress&&) = delete;
+    LayoutProgress& operator=(const LayoutProgress&) = delete;
+    LayoutProgress& operator=(LayoutProgress&&) = delete;
+};
+
+#ifndef NO_GRAPHVIZ
+
+/**
+ * Return the mutex which must be locked while using Graphviz.
+ *
+ * Graphviz uses global state internally and so can't be used from more than
+ * one thread at a time.
+ */
+wxMutex& GetGraphVizMutex()
+{
+    static wxMutex theMutex;
+    return theMutex;
+}
+
+/**
+ * Return the Graphviz context, creating it on first use.
+ *
+ * Must be called with the Graphviz mutex locked.
+ */
+GVC_t *GetGraphVizContext()
+{
+    class GraphVizContext
+    {
+    public:
+        GraphVizContext()
+            : context(gvContext())
+        {
+        }
+        ~GraphVizContext() {
+            // wait until a layout running in a worker thread, if any,
+            // finishes using the context
+            wxMutexLocker lock(GetGraphVizMutex());
+            gvFreeContext(context);
+        }
+        GVC_t* get() {
+            return context;
+        }
+
+        GraphVizContext(const GraphVizContext&) = delete;
+        GraphVizContext(GraphVizContext&&) = delete;
+        GraphVizContext& operator=(const GraphVizContext&) = delete;
+        GraphVizContext& operator=(GraphVizContext&&) = delete;
+
+    private:
+        GVC_t* const context;
+    };
+
+#ifdef SUPPRESS_GRAPHVIZ_MEMLEAKS
+    // memory allocated during GraphVizContext creation is never freed so
+    // VC++ debug CRT reports it as leaked which is not really true as this
+    // is a one-time only allocation and, anyhow, we can do nothing about
+    // it, so just suppress the CRT reports about it
+    class NoLeakCheck
+    {
+    public:
+        NoLeakCheck() : flags(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG)) {
+            _CrtSetDbgFlag(flags & ~_CRTDBG_ALLOC_MEM_DF);
+        }
+        ~NoLeakCheck() {
+            _CrtSetDbgFlag(flags);
+        }
+    private:
+        int flags;
+    };
+
+    NoLeakCheck noCheck;
+#endif // SUPPRESS_GRAPHVIZ_MEMLEAKS
+
+    static GraphVizContext theContext;
+    return theContext.get();
+}
+
+/**
+ * Create the Graphviz graph for the given input.
+ *
+ * The Graphviz node corresponding to each input node is returned in
+ * @a agnodes, in the same order.
+ *
+ * With cgraph the graph is built directly using its API, the old libgraph
+ * has no equivalent so there the dot text is parsed instead.
+ */
+Agraph_t *CreateAgraph(const LayoutInput& input, vector<Agnode_t*>& agnodes)
+{
+    agnodes.clear();
+    agnodes.reserve(input.nodes.size());
+
+#ifdef WITH_CGRAPH
+    Agraph_t *graph = agopen(unconst("Project"), Agdirected, NULL);
+    wxCHECK(graph, NULL);
+
+    agattr(graph, AGRAPH, unconst("nodesep"),
+           unconst(wxString::FromCDouble(input.nodesep).mb_str()));
+    agattr(graph, AGRAPH, unconst("ranksep"),
+           unconst(wxString::FromCDouble(input.ranksep).mb_str()));
+
+    agattr(graph, AGNODE, unconst("label"), unconst(""));
+    agattr(graph, AGNODE, unconst("shape"), unconst("box"));
+    agattr(graph, AGNODE, unconst("fixedsize"), unconst("true"));
+    Agsym_t *width = agattr(graph, AGNODE, unconst("width"), unconst("0.75"));
+    Agsym_t *height = agattr(graph, AGNODE, unconst("height"), unconst("0.5"));
+
+    for (size_t i = 0; i < input.nodes.size(); i++) {
+        const LayoutInput::Node& node = input.nodes[i];
+        Agnode_t *n = agnode(graph,
+                             unconst(LayoutInput::NodeName(i).mb_str()), 1);
+        agxset(n, width,
+               unconst(wxString::FromCDouble(node.width).mb_str()));
+        agxset(n, height,
+               unconst(wxString::FromCDouble(node.height).mb_str()));
+        agnodes.push_back(n);
+    }
+
+    for (size_t i = 0; i < input.ranks.size(); i++) {
+        wxString name = wxString::Format(_T("rank%lu"),
+                                         static_cast<unsigned long>(i));
+        Agraph_t *subg = agsubg(graph, unconst(name.mb_str()), 1);
+        agsafeset(subg, unconst("rank"), unconst("same"), unconst(""));
+
+        for (size_t j : input.ranks[i])
+            agsubnode(subg, agnodes[j], 1);
+    }
+
+    for (const auto& edge : input.edges)
+        agedge(graph, agnodes[edge.first], agnodes[edge.second], NULL, 1);
+#else // old Graphviz (< 2.30) without cgraph
+    Agraph_t *graph = agmemread(unconst(input.ToDot().mb_str()));
+    wxCHECK(graph, NULL);
+
+    for (size_t i = 0; i < input.nodes.size(); i++)
+        agnodes.push_back(agfindnode(graph,
+                          unconst(LayoutInput::NodeName(i).mb_str())));
+#endif // WITH_CGRAPH/old Graphviz
+
+    return graph;
+}
+
+#endif // NO_GRAPHVIZ
+
+/**
+ * Run the layout engine on the given input.
+ *
+ * On success, @a positions is filled with the positions of the nodes in
+ * points, in the same order as @c input.nodes. The positions are relative
+ * to an arbitrary origin.
+ *
+ * This function may be called from any thread. If @a progress is given, it
+ * is notified between the steps of the layout and can abandon it, in which
+ * case @c false is returned without logging any errors.
+ */
+bool RunLayout(const LayoutInput& input,
+               vector<wxRealPoint>& positions,
+               LayoutProgress *progress = NULL)
+{
+#if wxUSE_LOG_TRACE
+    // only generate the dot text if it's going to be logged
+    if (wxLog::IsAllowedTraceMask(TRACE_LAYOUT))
+        wxLogTrace(TRACE_LAYOUT, _T("%s"), input.ToDot());
+#endif
+
+#ifdef NO_GRAPHVIZ
+    wxUnusedVar(positions);
+    wxUnusedVar(progress);
+    wxLogError(_("No layout engine available"));
+    return false;
+#else // using graphviz
+    constexpr int PROGRESS_CREATED = 10;
+    constexpr int PROGRESS_LAID_OUT = 90;
+    constexpr int PROGRESS_DONE = 100;
+
+    if (progress && !progress->Update(0))
+        return false;
+
+    wxMutexLocker lock(GetGraphVizMutex());
+    GVC_t *context = GetGraphVizContext();
+
+    vector<Agnode_t*> agnodes;
+    Agraph_t *graph;
+    {
+        GRAPH_STATS_TIMER(layoutGraph);
+        graph = CreateAgraph(input, agnodes);
+    }
+    if (!graph)
+        return false;
+
+    if (progress && !progress->Update(PROGRESS_CREATED)) {
+        agclose(graph);
+        return false;
+    }
+
+    // do the layout
+    bool ok;
+    {
+        GRAPH_STATS_TIMER(layoutEngine);
+        ok = gvLayout(context, graph, (char*)"dot") == 0;
+    }
+
+    if (ok)
+    {
+        const double dpi = Points::Inch;
+
+        positions.clear();
+        positions.reserve(agnodes.size());
+
+        for (Agnode_t *n : agnodes) {
+            wxRealPoint pt;
+            if (n) {
+                pointf pos = ND_coord(n);
+                pt.x = PS2INCH(pos.x) * dpi;
+                pt.y = - PS2INCH(pos.y) * dpi;
+            }
+            positions.push_back(pt);
+        }
+
+        gvFreeLayout(context, graph);
+
+        ok = !progress || progress->Update(PROGRESS_LAID_OUT);
+    }
+    else {
+        wxLogError(_(
+"An error occurred laying out the graph with dot.\
+ Please check the installation of the graphviz library and\
+ its configuration file 'PREFIX/lib/graphviz/config'"
+                    ));
+    }
+
+    agclose(graph);
+
+    if (ok && progress)
+        ok = progress->Update(PROGRESS_DONE);
+
+    return ok;
+#endif // NO_GRAPHVIZ/using graphviz
+}
+
+/**
+ * Forwards the progress of a part of the work to another LayoutProgress.
+ *
+ * The percentages reported to this object are mapped to the range from
+ * @a from to @a to of the target.
+ */
+class PartialProgress : public LayoutProgress
+{
+public:
+    PartialProgress(LayoutProgress *target, int from, int to)
+      : m_target(target), m_from(from), m_to(to)
+    { }
+
+    bool Update(int percent) override
+    {
+        constexpr int PERCENT = 100;
+        return !m_target ||
+               m_target->Update(m_from + (m_to - m_from) * percent / PERCENT);
+    }
+
+private:
+    LayoutProgress *const m_target;
+    const int m_from;
+    const int m_to;
+};
+
+/**
+ * Run the layout engine on the given input unless its layout is cached.
+ *
+ * The parameters and the return value are the same as for RunLayout(). The
+ * layout is looked up in @a cache, if given, and the layout used, whether
+ * found there or computed, is added to @a used.
+ */
+bool RunCachedLayout(const LayoutInput& input,
+                     vector<wxRealPoint>& positions,
+                     LayoutProgress *progress,
+                     const LayoutCache *cache,
+                     LayoutCache::Map& used)
+{
+    const wxUint64 hash = LayoutCache::Hash(input);
+    const LayoutCache::Positions *cached = cache ? cache->Find(hash) : NULL;
+
+    if (cached && cached->size() == input.nodes.size()) {
+        GRAPH_STATS_ADD(layoutCached, 1);
+        positions = *cached;
+
+        constexpr int PERCENT = 100;
+        if (progress && !progress->Update(PERCENT))
+            return false;
+    }
+    else if (!RunLayout(input, positions, progress)) {
+        return false;
+    }
+
+    used[hash] = positions;
+    return true;
+}
+
+/**
+ * Split the input into its connected components.
+ *
+ * Nodes having the same rank are kept in the same component, as the layout
+ * engine must align them. The components and the nodes in each of them are
+ * in the same order as the input nodes.
+ */
+vector<LayoutInput> FindComponents(const LayoutInput& input,
+                                   vector< vector<size_t> >& components)
+{
+    // union-find with path halving
+    vector<size_t> parent(input.nodes.size());
+    for (size_t i = 0; i < parent.size(); i++)
+        parent[i] = i;
+
+    auto find = [&parent](size_t i) {
+        while (parent[i] != i)
+            i = parent[i] = parent[parent[i]];
+        return i;
+    };
+
+    auto unite = [&parent, &find](size_t i, size_t j) {
+        i = find(i);
+        j = find(j);
+        // keep the smallest index as root to preserve the order
+        if (i < j)
+            parent[j] = i;
+        else if (j < i)
+            parent[i] = j;
+    };
+
+    for (const auto& edge : input.edges)
+        unite(edge.first, edge.second);
+
+    for (const auto& rank : input.ranks)
+        for (size_t i = 1; i < rank.size(); i++)
+            unite(rank[0], rank[i]);
+
+    // the component of each node and its index in it
+    vector<size_t> which(parent.size());
+    vector<size_t> local(parent.size());
+
+    components.clear();
+    vector<LayoutInput> inputs;
+
+    for (size_t i = 0; i < parent.size(); i++) {
+        size_t root = find(i);
+        if (root == i) {
+            which[i] = inputs.size();
+            components.push_back(vector<size_t>());
+            inputs.push_back(LayoutInput());
+            inputs.back().ranksep = input.ranksep;
+            inputs.back().nodesep = input.nodesep;
+        }
+        else {
+            which[i] = which[root];
+        }
+
+        local[i] = components[which[i]].size();
+        components[which[i]].push_back(i);
+        inputs[which[i]].nodes.push_back(input.nodes[i]);
+    }
+
+    // all the edges and ranks of a node are in the node's component
+    for (const auto& edge : input.edges)
+        inputs[which[edge.first]].edges.push_back(
+            make_pair(local[edge.first], local[edge.second]));
+
+    for (const auto& rank : input.ranks) {
+        vector<size_t> sub;
+        sub.reserve(rank.size());
+        for (size_t i : rank)
+            sub.push_back(local[i]);
+        inputs[which[rank.front()]].ranks.push_back(std::move(sub));
+    }
+
+    return inputs;
+}
+
+/**
+ * Lay out each connected component of the graph separately and pack them.
+ *
+ * The layout engine cost grows faster than linearly with the graph size, so
+ * laying out many small graphs is much cheaper than one big one. The laid
+ * out components are then packed in rows ("shelves") kept in the input
+ * order so that they don't move around too much, separated by @c nodesep
+ * horizontally and @c ranksep vertically.
+ *
+ * Only the components whose layout isn't in @a cache are passed to the
+ * layout engine. The parameters and the return value are the same as for
+ * RunCachedLayout().
+ */
+bool RunComponentLayout(const LayoutInput& input,
+                        vector<wxRealPoint>& positions,
+                        LayoutProgress *progress,
+                        const LayoutCache *cache,
+                        LayoutCache::Map& used)
+{
+    vector< vector<size_t> > components;
+    vector<LayoutInput> inputs = FindComponents(input, components);
+
+    if (inputs.size() < 2)
+        return RunCachedLayout(input, positions, progress, cache, used);
+
+    const double dpi = Points::Inch;
+    constexpr int PERCENT = 100;
+
+    positions.assign(input.nodes.size(), wxRealPoint());
+
+    // the bounds of each component after its layout, in points
+    vector<wxRect2DDouble> bounds;
+    bounds.reserve(inputs.size());
+
+    double area = 0;
+    double maxWidth = 0;
+
+    for (size_t c = 0; c < inputs.size(); c++) {
+        const LayoutInput& sub = inputs[c];
+
+        PartialProgress partial(progress,
+                                int(c * PERCENT / inputs.size()),
+                                int((c + 1) * PERCENT / inputs.size()));
+        vector<wxRealPoint> subPositions;
+        if (!RunCachedLayout(sub, subPositions, &partial, cache, used))
+            return false;
+
+        wxRect2DDouble rc;
+        for (size_t i = 0; i < sub.nodes.size(); i++) {
+            const LayoutInput::Node& node = sub.nodes[i];
+            wxRect2DDouble rcNode(subPositions[i].x - node.width * dpi / 2,
+                                  subPositions[i].y - node.height * dpi / 2,
+                                  node.width * dpi,
+                                  node.height * dpi);
+            if (i == 0)
+                rc = rcNode;
+            else
+                rc.Union(rcNode);
+
+            positions[components[c][i]] = subPositions[i];
+        }
+
+        bounds.push_back(rc);
+        area += rc.m_width * rc.m_height;
+        maxWidth = max(maxWidth, rc.m_width);
+    }
+
+    // Pack the components in shelves about as wide as the whole is high,
+    // but no narrower than the widest component.
+    const double hgap = input.nodesep * dpi;
+    const double vgap = input.ranksep * dpi;
+    const double shelfWidth = max(maxWidth, sqrt(area));
+
+    double x = 0, y = 0, shelfHeight = 0;
+
+    for (size_t c = 0; c < inputs.size(); c++) {
+        const wxRect2DDouble& rc = bounds[c];
+
+        if (x > 0 && x + rc.m_width > shelfWidth) {
+            x = 0;
+            y += shelfHeight + vgap;
+            shelfHeight = 0;
+        }
+
+        const double dx = x - rc.m_x;
+        const double dy = y - rc.m_y;
+
+        for (size_t i : components[c]) {
+            positions[i].x += dx;
+            positions[i].y += dy;
+        }
+
+        x += rc.m_width + hgap;
+        shelfHeight = max(shelfHeight, rc.m_height);
+    }
+
+    return true;
+}
+
+/// Identifiers of the events sent by the layout worker threads.
+enum
+{
+    ID_LAYOUT_PROGRESS = 1,
+    ID_LAYOUT_DONE
+};
+
+} // namespace
+
+namespace impl {
+
+/**
+ * @brief A layout of a part of a graph.
+ *
+ * The layout is done in three steps: Collect() snapshots the graph into a
+ * LayoutInput, Run() computes the positions, which can be done in a worker
+ * thread, and Apply() moves the nodes. The first and the last steps must be
+ * done in the main thread.
+ *
+ * When used asynchronously, the job is shared between the Graph and the
+ * worker thread and sends wxThreadEvents to the graph when the progress
+ * changes and when it's done, unless Detach() has been called.
+ */
+class LayoutJob : private LayoutProgress
+{
+public:
+    /**
+     * Create a job sending the progress events with the given id to the
+     * graph, if it's non-NULL.
+     */
+    LayoutJob(Graph *graph = NULL, unsigned long id = 0)
+      : m_fixed(LayoutInput::NONE),
+        m_graph(graph), m_id(id), m_cancelled(false), m_split(false),
+        m_ok(false)
+    { }
+
+    LayoutJob(const LayoutJob&) = delete;
+    LayoutJob(LayoutJob&&) = delete;
+    LayoutJob& operator=(const LayoutJob&) = delete;
+    LayoutJob& operator=(LayoutJob&&) = delete;
+
+    ~LayoutJob() = default;
+
+    /// The id passed in the events sent by this job.
+    unsigned long GetId() const { return m_id; }
+
+    /// Snapshot the nodes in the range and the edges connecting them.
+    void Collect(const Graph::node_iterator_pair& range,
+                 const GraphNode *fixed,
+                 double ranksep,
+                 double nodesep);
+
+    /// Lay out the connected components separately, see RunComponentLayout().
+    void SetSplitComponents(bool split) { m_split = split; }
+
+    /// Reuse the layouts found in the cache instead of computing them.
+    void SetCache(const shared_ptr<const LayoutCache>& cache)
+    {
+        m_cache = cache;
+    }
+
+    /// The layouts used by Run(), to add to the cache.
+    const LayoutCache::Map& GetLayouts() const { return m_layouts; }
+
+    /// Compute the layout, may be called from any thread.
+    bool Run();
+
+    /// True if Run() was successful.
+    bool IsOk() const { return m_ok; }
+
+    /// The nodes laid out, @c NULL for the ones deleted since Collect().
+    const vector<GraphNode*>& GetNodes() const { return m_nodes; }
+
+    /**
+     * Move the nodes to their new positions.
+     *
+     * They are shifted to keep the fixed node where it is now, unless it was
+     * deleted, in which case they are moved to the computed positions as is.
+     */
+    void Apply();
+
+    /// Forget about the given node, and whether it's fixed, as it's being
+    /// deleted.
+    void Forget(const GraphNode *node);
+
+    /// Stop sending events to the graph and abandon the layout.
+    void Detach();
+
+private:
+    bool Update(int percent) override;
+
+    /// Send an event with the given id to the graph, if still attached.
+    void Post(int id, int percent = 0);
+
+    LayoutInput m_input;                    ///< Only read by Run().
+    vector<wxRealPoint> m_positions;        ///< Only written by Run().
+    shared_ptr<const LayoutCache> m_cache;  ///< Only read by Run().
+    LayoutCache::Map m_layouts;             ///< Only written by Run().
+
+    vector<GraphNode*> m_nodes;             ///< Nodes, parallel to m_input.
+    unordered_map<const GraphNode*, size_t> m_indices; ///< Index of nodes.
+    size_t m_fixed;                         ///< Index of the fixed node.
+
+    wxCriticalSection m_cs;                 ///< Protects m_graph.
+    Graph *m_graph;                         ///< Graph to send events to.
+    const unsigned long m_id;               ///< Id of the events.
+    std::atomic<bool> m_cancelled;          ///< Set by Detach().
+    bool m_split;                           ///< Split in components.
+    bool m_ok;                              ///< Result of Run().
+};
+
+void LayoutJob::Collect(const Graph::node_iterator_pair& range,
+                        const GraphNode *fixed,
+                        double ranksep,
+                        double nodesep)
+{
+    GRAPH_STATS_TIMER(layoutCollect);
+
+    // Collect all the nodes in the range and the edges that connect them.
+    // To find the edges, first put all the nodes into a set, then iterate
+    // over all the edges of the nodes, looking for the edges which connect
+    // nodes in the set.
+    m_input.ranksep = ranksep;
+    m_input.nodesep = nodesep;
+
+    const double dpi = Points::Inch;
+    bool findFixed = fixed == NULL;
+    bool externalConnection = false;
+
+    typedef multiset<GraphNode*, ElementCompare> NodeSet;
+    typedef multiset<const GraphEdge*, ElementCompare> EdgeSet;
+    typedef map< wxString, vector<size_t> > RankMap;
+    NodeSet nodeset;
+    EdgeSet edgeset;
+    RankMap rankmap;
+
+    // First put the nodes into a set. The ElementCompare functor puts them
+    // into the order they appear on the screen, which avoids the nodes
+    // being randomly reordered on screen.
+    for (auto& node : MakeRange(range))
+        nodeset.insert(&node);
+
+    m_input.nodes.reserve(nodeset.size());
+    m_nodes.reserve(nodeset.size());
+    m_indices.reserve(nodeset.size());
+
+    for (GraphNode* node : nodeset) {
+        wxSize size = node->GetSize<Points>();
+        LayoutInput::Node n = { size.x / dpi, size.y / dpi };
+
+        m_indices[node] = m_nodes.size();
+        m_nodes.push_back(node);
+        m_input.nodes.push_back(n);
+    }
+
+    nodeset.clear();
+
+    // Now iterate over all the edges of all the nodes
+    for (size_t i = 0; i < m_nodes.size(); i++) {
+        const GraphNode *node = m_nodes[i];
+        bool extCon = false;
+
+        for (const auto& edge : MakeRange(node->GetEdges())) {
+            const GraphNode *n1 = edge.GetFrom(), *n2 = edge.GetTo();
+
+            // looking for edges which connect nodes in the set
+            if (m_indices.count(n1 != node ? n1 : n2)) {
+                // each edge will be found twice, but only add it once
+                if (n1 == node)
+                    edgeset.insert(&edge);
+            }
+            else {
+                extCon = true;
+            }
+        }
+
+        // If the range is a subset of the whole graph, and one of the nodes
+        // has an edge to another node outside the range, then hold that
+        // node fixed when doing the layout. Otherwise just fix the top-left-
+        // most node.
+        if (findFixed &&
+            (!fixed || (!externalConnection && extCon) ||
+             (externalConnection == extCon &&
+              node->GetPosition() < fixed->GetPosition())))
+        {
+            fixed = node;
+            externalConnection = extCon;
+        }
+
+        if (!node->GetRank().empty())
+            rankmap[node->GetRank()].push_back(i);
+    }
+
+    m_input.ranks.reserve(rankmap.size());
+    for (auto& rank : rankmap)
+        m_input.ranks.push_back(std::move(rank.second));
+
+    rankmap.clear();
+
+    // Now add the edges. These are also sorted by ElementCompare into the
+    // order they appear on the screen, to avoid the nodes being reordered
+    // too much.
+    m_input.edges.reserve(edgeset.size());
+    for (const GraphEdge* edge : edgeset)
+        m_input.edges.push_back(make_pair(m_indices[edge->GetFrom()],
+                                          m_indices[edge->GetTo()]));
+
+    edgeset.clear();
+
+    if (fixed) {
+        auto it = m_indices.find(fixed);
+        if (it != m_indices.end())
+            m_input.fixed = it->second;
+    }
+
+    // m_input is read by Run() in the worker thread, so Forget() can't
+    // reset its copy of the index
+    m_fixed = m_input.fixed;
+}
+
+bool LayoutJob::Run()
+{
+    m_layouts.clear();
+    m_ok = m_split ? RunComponentLayout(m_input, m_positions, this,
+                                        m_cache.get(), m_layouts)
+                   : RunCachedLayout(m_input, m_positions, this,
+                                     m_cache.get(), m_layouts);
+
+    if (!m_cancelled)
+        Post(ID_LAYOUT_DONE);
+
+    return m_ok;
+}
+
+void LayoutJob::Apply()
+{
+    wxCHECK_RET(m_ok, _T("no layout to apply"));
+    GRAPH_STATS_TIMER(layoutApply);
+
+    double offsetX = 0;
+    double offsetY = 0;
+
+    // keep the fixed node where it is now, even if it was moved while the
+    // layout was being computed
+    if (m_fixed != LayoutInput::NONE) {
+        wxPoint pt = m_nodes[m_fixed]->GetPosition<Points>();
+        offsetX = pt.x - m_positions[m_fixed].x;
+        offsetY = pt.y - m_positions[m_fixed].y;
+    }
+
+    for (size_t i = 0; i < m_nodes.size(); i++) {
+        if (m_nodes[i]) {
+            int x = int(offsetX + m_positions[i].x);
+            int y = int(offsetY + m_positions[i].y);
+            m_nodes[i]->SetPosition<Points>(wxPoint(x, y));
+        }
+    }
+}
+
+void LayoutJob::Forget(const GraphNode *node)
+{
+    auto it = m_indices.find(node);
+    if (it != m_indices.end()) {
+        if (it->second == m_fixed)
+            m_fixed = LayoutInput::NONE;
+        m_nodes[it->second] = NULL;
+        m_indices.erase(it);
+    }
+}
+
+void LayoutJob::Detach()
+{
+    m_cancelled = true;
+
+    wxCriticalSectionLocker lock(m_cs);
+    m_graph = NULL;
+}
+
+bool LayoutJob::Update(int percent)
+{
+    if (m_cancelled)
+        return false;
+
+    Post(ID_LAYOUT_PROGRESS, percent);
+    return true;
+}
+
+void LayoutJob::Post(int id, int percent)
+{
+    wxCriticalSectionLocker lock(m_cs);
+
+    if (m_graph) {
+        wxThreadEvent *event = new wxThreadEvent(wxEVT_THREAD, id);
+        event->SetInt(percent);
+        event->SetExtraLong(long(m_id));
+        wxQueueEvent(m_graph, event);
+    }
+}
+
+} // namespace impl
+
+namespace {
+
+/**
+ * The worker thread running a LayoutJob.
+ */
+class LayoutThread : public wxThread
+{
+public:
+    explicit LayoutThread(const shared_ptr<LayoutJob>& job)
+      : wxThread(wxTHREAD_DETACHED), m_job(job)
+    { }
+
+protected:
+    ExitCode Entry() override
+    {
+        m_job->Run();
+        return 0;
+    }
+
+private:
+    /// Shared with the graph which may abandon the job before it's done.
+    const shared_ptr<LayoutJob> m_job;
+};
+
+} // namespace
+
+namespace impl {
+
+/**
+ * @brief The nodes placed by the last layouts.
+ *
+ * This is used by the incremental layout mode: as long as the graph only
+ * had a few nodes added since it was last laid out, the new nodes are placed
+ * next to their already laid out neighbours without touching the rest of
+ * the graph, which is much faster than running the layout engine again.
+ *
+ * Adding an edge between two already laid out nodes can change the ranks of
+ * the whole graph though, so it makes the history stale until the next full
+ * layout. Deleting nodes or edges leaves the other nodes where they are.
+ */
+class LayoutHistory
+{
+public:
+    LayoutHistory() : m_enabled(false), m_stale(false) { }
+
+    LayoutHistory(const LayoutHistory&) = delete;
+    LayoutHistory(LayoutHistory&&) = delete;
+    LayoutHistory& operator=(const LayoutHistory&) = delete;
+    LayoutHistory& operator=(LayoutHistory&&) = delete;
+
+    /// Enable or disable incremental layout.
+    //@{
+    void Enable(bool enable)    { m_enabled = enable; }
+    bool IsEnabled() const      { return m_enabled; }
+    //@}
+
+    /**
+     * Remember the nodes laid out by a layout engine.
+     *
+     * If all the nodes of the graph, whose number is @a count, were laid
+     * out, the history is not stale any more. @a nodes has NULL entries
+     * for the nodes deleted while they were being laid out.
+     */
+    void Record(const vector<GraphNode*>& nodes, size_t count);
+
+    /// Called when a node is added to the graph.
+    void NodeAdded(GraphNode *node);
+
+    /// Called when an edge is added to the graph.
+    void EdgeAdded(const GraphNode *from, const GraphNode *to);
+
+    /// Called when a node is deleted from the graph.
+    void Forget(const GraphNode *node);
+
+    /// Called when many nodes are deleted from the graph at once.
+    void Forget(const unordered_set<const GraphNode*>& nodes);
+
+    /// Forget all the layouts.
+    void Clear();
+
+    /// True if the pending nodes can be placed without a full layout.
+    bool CanPlace() const;
+
+    /**
+     * Place the nodes added since the last layout.
+     *
+     * The nodes are put one rank below their laid out parents, or above
+     * their children if they have no parents, and then moved to the right
+     * until they don't overlap any other node.
+     */
+    void Place(const SpatialIndex& index,
+               const wxSize& dpi,
+               double ranksep,
+               double nodesep);
+
+private:
+    /// The maximal number of nodes which can always be placed.
+    static constexpr size_t MIN_PLACED = 16;
+
+    /// Otherwise, up to 1/MAX_PLACED_RATIO of laid out nodes can be placed.
+    static constexpr size_t MAX_PLACED_RATIO = 10;
+
+    /// True if the node was laid out.
+    bool IsLaidOut(const GraphNode *node) const
+    {
+        return m_laidOut.count(node) != 0;
+    }
+
+    /// Remember the node as laid out.
+    void SetLaidOut(const GraphNode *node);
+
+    /// Return a laid out node having the given rank, or @c NULL.
+    const GraphNode *FindPeer(const wxString& rank);
+
+    /// Place one node if it has laid out neighbours, return false if not.
+    bool PlaceNode(GraphNode *node,
+                   const SpatialIndex& index,
+                   int rankgap,
+                   int nodegap);
+
+    unordered_set<const GraphNode*> m_laidOut; ///< Nodes with a position.
+    unordered_map<wxString, vector<const GraphNode*>,
+                  wxStringHash, wxStringEqual> m_ranks; ///< Nodes by rank.
+    vector<GraphNode*> m_pending;           ///< Nodes added since then.
+    bool m_enabled;                         ///< Incremental layout is on.
+    bool m_stale;                           ///< A full layout is needed.
+};
+
+void LayoutHistory::Record(const vector<GraphNode*>& nodes, size_t count)
+{
+    // the slots of the nodes deleted during the layout are NULL
+    const size_t laidOut = count_if(nodes.begin(), nodes.end(),
+                                    [](const GraphNode *node) {
+                                        return node != NULL;
+                                    });
+
+    if (laidOut == count) {
+        m_laidOut.clear();
+        m_ranks.clear();
+        m_stale = false;
+    }
+
+    for (GraphNode *node : nodes)
+        if (node)
+            SetLaidOut(node);
+
+    m_pending.erase(remove_if(m_pending.begin(), m_pending.end(),
+                              [this](const GraphNode *node) {
+                                  return IsLaidOut(node);
+                              }),
+                    m_pending.end());
+}
+
+void LayoutHistory::NodeAdded(GraphNode *node)
+{
+    // there is nothing to be incremental to before the first layout
+    if (!m_laidOut.empty())
+        m_pending.push_back(node);
+}
+
+void LayoutHistory::EdgeAdded(const GraphNode *from, const GraphNode *to)
+{
+    if (IsLaidOut(from) && IsLaidOut(to))
+        m_stale = true;
+}
+
+void LayoutHistory::Forget(const GraphNode *node)
+{
+    m_laidOut.erase(node);
+    m_pending.erase(remove(m_pending.begin(), m_pending.end(), node),
+                    m_pending.end());
+}
+
+void LayoutHistory::Forget(const unordered_set<const GraphNode*>& nodes)
+{
+    for (const auto node : nodes)
+        m_laidOut.erase(node);
+
+    m_pending.erase(remove_if(m_pending.begin(), m_pending.end(),
+                              [&nodes](const GraphNode *node) {
+                                  return nodes.count(node) != 0;
+                              }),
+                    m_pending.end());
+}
+
+void LayoutHistory::Clear()
+{
+    m_laidOut.clear();
+    m_ranks.clear();
+    m_pending.clear();
+    m_stale = false;
+}
+
+bool LayoutHistory::CanPlace() const
+{
+    return m_enabled && !m_stale && !m_laidOut.empty() &&
+           m_pending.size() <= max(MIN_PLACED,
+                                   m_laidOut.size() / MAX_PLACED_RATIO);
+}
+
+void LayoutHistory::Place(const SpatialIndex& index,
+                          const wxSize& dpi,
+                          double ranksep,
+                          double nodesep)
+{
+    const int rankgap = int(ranksep * dpi.y);
+    const int nodegap = int(nodesep * dpi.x);
+
+    // Place the nodes connected to the already laid out ones first, and
+    // repeat as long as this makes more nodes placeable, so that chains of
+    // new nodes are placed too.
+    vector<GraphNode*> pending;
+    pending.swap(m_pending);
+
+    size_t count;
+    do {
+        count = pending.size();
+
+        for (auto it = pending.begin(); it != pending.end(); ) {
+            if (PlaceNode(*it, index, rankgap, nodegap)) {
+                SetLaidOut(*it);
+                it = pending.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    while (!pending.empty() && pending.size() != count);
+
+    // The nodes not connected to anything laid out stay where they were
+    // put, don't try to place them again.
+    for (GraphNode *node : pending)
+        SetLaidOut(node);
+}
+
+void LayoutHistory::SetLaidOut(const GraphNode *node)
+{
+    if (!m_laidOut.insert(node).second)
+        return;
+
+    const wxString rank = node->GetRank();
+    if (!rank.empty())
+        m_ranks[rank].push_back(node);
+}
+
+const GraphNode *LayoutHistory::FindPeer(const wxString& rank)
+{
+    auto it = m_ranks.find(rank);
+    if (it == m_ranks.end())
+        return NULL;
+
+    // Forget() doesn't update the ranks, so drop the nodes deleted since,
+    // which mustn't be dereferenced and so are checked first, and those
+    // whose rank changed.
+    vector<const GraphNode*>& nodes = it->second;
+
+    while (!nodes.empty()) {
+        const GraphNode *peer = nodes.back();
+        if (IsLaidOut(peer) && peer->GetRank() == rank)
+            return peer;
+        nodes.pop_back();
+    }
+
+    m_ranks.erase(it);
+    return NULL;
+}
+
+bool LayoutHistory::PlaceNode(GraphNode *node,
+                              const SpatialIndex& index,
+                              int rankgap,
+                              int nodegap)
+{
+    wxRect parents, children;
+    int sumX = 0, count = 0;
+
+    for (const auto& edge : MakeRange(node->GetEdges())) {
+        const GraphNode *from = edge.GetFrom();
+        const GraphNode *other = from != node ? from : edge.GetTo();
+
+        if (other == node || !IsLaidOut(other))
+            continue;
+
+        wxRect rc = other->GetBounds();
+        (other == from ? parents : children).Union(rc);
+        sumX += rc.x + rc.width / 2;
+        count++;
+    }
+
+    if (!count)
+        return false;
+
+    wxSize size = node->GetSize();
+    wxRect rc(wxPoint(sumX / count - size.x / 2, 0), size);
+
+    // align with the nodes of the same rank, if any
+    const wxString rank = node->GetRank();
+    const GraphNode *peer = rank.empty() ? NULL : FindPeer(rank);
+
+    if (peer)
+        rc.y = peer->GetPosition().y - size.y / 2;
+    else if (!parents.IsEmpty())
+        rc.y = parents.GetBottom() + 1 + rankgap;
+    else
+        rc.y = children.y - rankgap - size.y;
+
+    // move right until there is enough space around the node
+    wxRect rcGap = rc;
+    rcGap.Inflate(nodegap, 0);
+
+    while (const GraphNode *other = index.FindOverlap(rcGap, node))
+        rcGap.x = other->GetBounds().GetRight() + 1;
+
+    rc.x = rcGap.x + nodegap;
+    node->SetPosition(wxPoint(rc.x + size.x / 2, rc.y + size.y / 2));
+
+    return true;
+}
+
+} // namespace impl
+
+// ----------------------------------------------------------------------------
+// UndoJournal
+// ----------------------------------------------------------------------------
+
+namespace impl {
+
+size_t GetUndoBytes(const wxFont& font)
+{
+    // the font data isn't accessible, estimate it as a fixed size for the
+    // native font and the length of the face name
+    constexpr size_t FONT_DATA_BYTES = 256;
+
+    size_t bytes = sizeof(font);
+    if (font.IsOk())
+        bytes += FONT_DATA_BYTES + GetUndoBytes(font.GetFaceName());
+    return bytes;
+}
+
+/**
+ * The operations done on a graph, kept for Graph::Undo() and Graph::Redo().
+ *
+ * The changes recorded between the outermost Graph::BeginUpdate() and
+ * EndUpdate(), or by a single call outside of an update, form one operation
+ * undone and redone at once. The moves and resizes are stored as the old and
+ * new rectangles only, merging repeated moves of the same node, the setters
+ * as a pair of closures and the elements added and deleted in their binary
+ * serialised form so that they can be created again.
+ *
+ * The elements are referred to by ids rather than by pointers, as undoing a
+ * deletion or redoing an addition creates a new object for the same element.
+ */
+class UndoJournal
+{
+public:
+    explicit UndoJournal(Graph& graph);
+
+    UndoJournal(const UndoJournal&) = delete;
+    UndoJournal(UndoJournal&&) = delete;
+    UndoJournal& operator=(const UndoJournal&) = delete;
+    UndoJournal& operator=(UndoJournal&&) = delete;
+
+    /// Called by the outermost Graph::BeginUpdate() and EndUpdate().
+    //@{
+    void Begin();
+    void End();
+    //@}
+
+    /// Record the changes made to the graph.
+    //@{
+    void Added(GraphElement& element);
+    void Deleting(GraphElement& element);
+    void Moved(GraphNode& node, const wxPoint& old);
+    void Resized(GraphNode& node, const wxSize& old);
+    void Changed(GraphElement& element,
+                 const UndoAction& undo,
+                 const UndoAction& redo,
+                 size_t bytes);
+    //@}
+
+    bool CanUndo() const { return !m_undo.empty(); }
+    bool CanRedo() const { return !m_redo.empty(); }
+    void Undo();
+    void Redo();
+
+    /// Forget all the operations and the element ids.
+    void Clear();
+
+    void SetLimit(size_t bytes);
+    size_t GetLimit() const { return m_limit; }
+
+    /// The bytes used by the operations that can be undone and redone.
+    size_t GetMemoryUsage() const { return m_bytes; }
+
+    /// Stop recording the changes, e.g. while loading the graph.
+    //@{
+    void Suspend() { m_suspended++; }
+    void Resume() { m_suspended--; }
+    //@}
+
+private:
+    /// Identifies an element, see the class description.
+    typedef unsigned long Id;
+
+    enum Kind { Kind_Add, Kind_Delete, Kind_Move, Kind_Size, Kind_Change };
+
+    /**
+     * A single change.
+     *
+     * The positions of the moves and the sizes of the resizes are in the
+     * corresponding parts of the rectangles, the others use index instead,
+     * into Operation::snapshots or Operation::actions.
+     */
+    struct Change
+    {
+        Kind kind;
+        Id id;
+        wxRect old;
+        wxRect now;
+        size_t index;
+    };
+
+    /**
+     * A serialised element.
+     *
+     * For an edge the ids of its nodes are also kept with the ids they have
+     * in the archive, to connect it to the current nodes when it's restored.
+     */
+    struct Snapshot
+    {
+        Snapshot() : from(0), to(0) { }
+
+        std::string data;
+        wxString key;
+        Id from, to;
+        wxString fromKey, toKey;
+    };
+
+    /**
+     * An operation undone and redone at once.
+     *
+     * The values captured by the actions aren't visible in them, so their
+     * sizes are added up in captured.
+     */
+    struct Operation
+    {
+        Operation() : captured(0), bytes(0) { }
+
+        std::vector<Change> changes;
+        std::vector<Snapshot> snapshots;
+        std::vector<std::pair<UndoAction, UndoAction>> actions;
+        size_t captured;
+        size_t bytes;
+    };
+
+    /// True if the changes should be recorded now.
+    bool IsRecording() const
+    {
+        return m_limit && !m_suspended && !m_replaying;
+    }
+
+    /// Add a change to the current operation, ending it outside an update.
+    void Add(const Change& change);
+
+    /// Return the id of the element, giving it one if necessary.
+    Id GetId(const GraphElement *element);
+
+    /// Return the element with the given id or NULL if it's deleted.
+    GraphElement *Find(Id id) const;
+
+    /// Serialise the element or create it again from the snapshot.
+    //@{
+    bool Save(GraphElement& element, Snapshot& snapshot);
+    GraphElement *Restore(const Snapshot& snapshot, Id id);
+    //@}
+
+    /// Delete the element, and the edges of a node, without any events.
+    void Remove(GraphElement& element);
+
+    /// Forget the element's id once the element is deleted.
+    void Unbind(const GraphElement& element);
+
+    /// Undo or redo the operation.
+    void Replay(Operation& op, bool undo);
+
+    /// The approximate memory used by the operation.
+    static size_t GetBytes(const Operation& op);
+
+    /// Forget the oldest operations until below the limit.
+    void Trim();
+
+    Graph& m_graph;
+
+    std::deque<Operation> m_undo;       ///< Oldest first.
+    std::vector<Operation> m_redo;      ///< Most recently undone last.
+
+    Operation m_current;                ///< The operation being recorded.
+    int m_depth;                        ///< Nesting of Begin().
+
+    /// Indices into m_current.changes of its moves and resizes.
+    //@{
+    std::unordered_map<Id, size_t> m_moved;
+    std::unordered_map<Id, size_t> m_sized;
+    //@}
+
+    /// The elements added by m_current, their other changes aren't needed.
+    std::unordered_set<Id> m_added;
+
+    /**
+     * The ids of the elements in the graph and the elements by id.
+     *
+     * Only the elements currently in the graph have entries, so these don't
+     * grow with the number of elements deleted during the session.
+     */
+    //@{
+    std::unordered_map<const GraphElement*, Id> m_ids;
+    std::unordered_map<Id, GraphElement*> m_elements;
+    Id m_lastId;
+    //@}
+
+    size_t m_bytes;                     ///< Total of Operation::bytes.
+    size_t m_limit;                     ///< See Graph::SetUndoLimit().
+    int m_suspended;                    ///< Nesting of Suspend().
+    bool m_replaying;                   ///< True inside Replay().
+};
+
+UndoJournal::UndoJournal(Graph& graph)
+  : m_graph(graph),
+    m_depth(0),
+    m_lastId(0),
+    m_bytes(0),
+    m_limit(Graph::DEFAULT_UNDO_LIMIT),
+    m_suspended(0),
+    m_replaying(false)
+{
+}
+
+void UndoJournal::Begin()
+{
+    m_depth++;
+}
+
+void UndoJournal::End()
+{
+    wxCHECK_RET(m_depth > 0, _T("UndoJournal::End() without Begin()"));
+
+    if (--m_depth > 0)
+        return;
+
+    m_moved.clear();
+    m_sized.clear();
+    m_added.clear();
+
+    if (m_current.changes.empty())
+        return;
+
+    m_current.bytes = GetBytes(m_current);
+    m_bytes += m_current.bytes;
+
+    for (const auto& op : m_redo)
+        m_bytes -= op.bytes;
+    m_redo.clear();
+
+    m_undo.push_back(std::move(m_current));
+    m_current = Operation();
+
+    Trim();
+}
+
+void UndoJournal::Add(const Change& change)
+{
+    m_current.changes.push_back(change);
+
+    if (!m_depth) {
+        Begin();
+        End();
+    }
+}
+
+void UndoJournal::Added(GraphElement& element)
+{
+    if (!IsRecording())
+        return;
+
+    Change change = { Kind_Add, GetId(&element), wxRect(), wxRect(), 0 };
+
+    // the snapshot is only taken when the addition is undone
+    change.index = m_current.snapshots.size();
+    m_current.snapshots.push_back(Snapshot());
+    m_added.insert(change.id);
+
+    Add(change);
+}
+
+void UndoJournal::Deleting(GraphElement& element)
+{
+    if (IsRecording()) {
+        Id id = GetId(&element);
+
+        // an element added by the same operation just disappears from it,
+        // undoing the addition is done when deleting it
+        if (!m_added.count(id)) {
+            Snapshot snapshot;
+            if (Save(element, snapshot)) {
+                Change change = { Kind_Delete, id, wxRect(), wxRect(),
+                                  m_current.snapshots.size() };
+                m_current.snapshots.push_back(std::move(snapshot));
+                Add(change);
+            }
+        }
+    }
+
+    Unbind(element);
+}
+
+void UndoJournal::Moved(GraphNode& node, const wxPoint& old)
+{
+    if (!IsRecording())
+        return;
+
+    Id id = GetId(&node);
+    if (m_added.count(id))
+        return;
+
+    wxPoint now = node.GetPosition();
+    auto it = m_moved.find(id);
+
+    if (it != m_moved.end()) {
+        m_current.changes[it->second].now.SetPosition(now);
+    }
+    else if (now != old) {
+        m_moved[id] = m_current.changes.size();
+        Change change = { Kind_Move, id, wxRect(old, wxSize()),
+                          wxRect(now, wxSize()), 0 };
+        Add(change);
+    }
+}
+
+void UndoJournal::Resized(GraphNode& node, const wxSize& old)
+{
+    if (!IsRecording())
+        return;
+
+    Id id = GetId(&node);
+    if (m_added.count(id))
+        return;
+
+    wxSize now = node.GetSize();
+    auto it = m_sized.find(id);
+
+    if (it != m_sized.end()) {
+        m_current.changes[it->second].now.SetSize(now);
+    }
+    else if (now != old) {
+        m_sized[id] = m_current.changes.size();
+        Change change = { Kind_Size, id, wxRect(wxPoint(), old),
+                          wxRect(wxPoint(), now), 0 };
+        Add(change);
+    }
+}
+
+void UndoJournal::Changed(GraphElement& element,
+                          const UndoAction& undo,
+                          const UndoAction& redo,
+                          size_t bytes)
+{
+    if (!IsRecording())
+        return;
+
+    Id id = GetId(&element);
+    if (m_added.count(id))
+        return;
+
+    Change change = { Kind_Change, id, wxRect(), wxRect(),
+                      m_current.actions.size() };
+    m_current.actions.push_back(make_pair(undo, redo));
+    m_current.captured += bytes;
+    Add(change);
+}
+
+void UndoJournal::Undo()
+{
+    wxCHECK_RET(CanUndo(), _T("nothing to undo"));
+    wxCHECK_RET(!m_depth, _T("can't undo during an update"));
+
+    Operation op = std::move(m_undo.back());
+    m_undo.pop_back();
+    m_bytes -= op.bytes;
+
+    Replay(op, true);
+
+    op.bytes = GetBytes(op);
+    m_bytes += op.bytes;
+    m_redo.push_back(std::move(op));
+}
+
+void UndoJournal::Redo()
+{
+    wxCHECK_RET(CanRedo(), _T("nothing to redo"));
+    wxCHECK_RET(!m_depth, _T("can't redo during an update"));
+
+    Operation op = std::move(m_redo.back());
+    m_redo.pop_back();
+
+    Replay(op, false);
+
+    m_undo.push_back(std::move(op));
+}
+
+void UndoJournal::Clear()
+{
+    m_undo.clear();
+    m_redo.clear();
+    m_current = Operation();
+    m_moved.clear();
+    m_sized.clear();
+    m_added.clear();
+    m_ids.clear();
+    m_elements.clear();
+    m_bytes = 0;
+}
+
+void UndoJournal::SetLimit(size_t bytes)
+{
+    m_limit = bytes;
+
+    if (!m_limit)
+        Clear();
+    else
+        Trim();
+}
+
+UndoJournal::Id UndoJournal::GetId(const GraphElement *element)
+{
+    auto it = m_ids.find(element);
+    if (it != m_ids.end())
+        return it->second;
+
+    Id id = ++m_lastId;
+    m_ids[element] = id;
+    m_elements[id] = const_cast<GraphElement*>(element);
+
+    return id;
+}
+
+GraphElement *UndoJournal::Find(Id id) const
+{
+    auto it = m_elements.find(id);
+    return it != m_elements.end() ? it->second : NULL;
+}
+
+void UndoJournal::Unbind(const GraphElement& element)
+{
+    auto it = m_ids.find(&element);
+
+    // the records still referring to the id find nothing for it, exactly
+    // as for a NULL entry, so don't keep one for each element ever deleted
+    if (it != m_ids.end()) {
+        m_elements.erase(it->second);
+        m_ids.erase(it);
+    }
+}
+
+bool UndoJournal::Save(GraphElement& element, Snapshot& snapshot)
+{
+    Factory<GraphElement> factory(&element);
+    if (!factory)
+        return false;
+
+    Archive archive;
+    Archive::Item *item = archive.PutObject(factory.GetName(), &element);
+
+    if (!item || !element.Serialise(*item))
+        return false;
+
+    snapshot.key = item->GetId();
+
+    GraphEdge *edge = wxDynamicCast(&element, GraphEdge);
+    if (edge) {
+        snapshot.from = GetId(edge->GetFrom());
+        snapshot.to = GetId(edge->GetTo());
+        snapshot.fromKey = Archive::MakeId(edge->GetFrom());
+        snapshot.toKey = Archive::MakeId(edge->GetTo());
+    }
+
+    wxMemoryOutputStream out;
+    if (!archive.Save(out, Archive::Format_Binary))
+        return false;
+
+    snapshot.data.resize(size_t(out.GetLength()));
+    out.CopyTo(&snapshot.data[0], snapshot.data.size());
+
+    return true;
+}
+
+GraphElement *UndoJournal::Restore(const Snapshot& snapshot, Id id)
+{
+    Archive archive;
+    wxMemoryInputStream in(snapshot.data.data(), snapshot.data.size());
+
+    if (snapshot.data.empty() || !archive.Load(in))
+        return NULL;
+
+    // an edge refers to its nodes by the ids they had in the archive
+    if (snapshot.from) {
+        GraphElement *from = Find(snapshot.from);
+        GraphElement *to = Find(snapshot.to);
+        if (!from || !to)
+            return NULL;
+
+        archive.Put(_T("node"), snapshot.fromKey)->SetInstance(from);
+        Archive::Item *item = archive.Put(_T("node"), snapshot.toKey);
+        if (item)
+            item->SetInstance(to);
+    }
+
+    Archive::Item *item = archive.Get(snapshot.key);
+    GraphElement *element = item ? m_graph.DeserialiseElement(*item) : NULL;
+
+    if (element) {
+        m_ids[element] = id;
+        m_elements[id] = element;
+    }
+
+    return element;
+}
+
+void UndoJournal::Remove(GraphElement& element)
+{
+    GraphNode *node = wxDynamicCast(&element, GraphNode);
+
+    if (node) {
+        vector<GraphEdge*> edges;
+        for (auto& edge : MakeRange(node->GetEdges()))
+            edges.push_back(&edge);
+        for (auto edge : edges)
+            Remove(*edge);
+    }
+    else {
+        GraphEdge *edge = wxStaticCast(&element, GraphEdge);
+        edge->UpdateEdgeCounts(-1);
+        edge->GetShape()->Unlink();
+    }
+
+    Unbind(element);
+    m_graph.DoDelete(&element);
+}
+
+void UndoJournal::Replay(Operation& op, bool undo)
+{
+    m_replaying = true;
+
+    {
+        GraphUpdateLocker noUpdates(m_graph);
+
+        GraphCanvas *canvas = m_graph.GetCanvas();
+        MeasureDC dc(canvas);
+
+        const size_t count = op.changes.size();
+
+        for (size_t i = 0; i < count; i++) {
+            const Change& change = op.changes[undo ? count - 1 - i : i];
+            GraphElement *element = Find(change.id);
+            GraphNode *node = wxDynamicCast(element, GraphNode);
+            bool add = change.kind == Kind_Add;
+
+            switch (change.kind) {
+                case Kind_Add:
+                case Kind_Delete:
+                    if (add == undo) {
+                        if (!element)
+                            break;
+                        if (add)
+                            Save(*element, op.snapshots[change.index]);
+                        Remove(*element);
+                    }
+                    else if (!element) {
+                        Restore(op.snapshots[change.index], change.id);
+                    }
+                    break;
+
+                case Kind_Move:
+                    if (node) {
+                        const wxRect& rc = undo ? change.old : change.now;
+                        node->DoSetPosition(dc, rc.GetPosition());
+                    }
+                    break;
+
+                case Kind_Size:
+                    if (node) {
+                        const wxRect& rc = undo ? change.old : change.now;
+                        node->DoSetSize(dc, rc.GetSize());
+                        node->OnLayout(dc);
+                    }
+                    break;
+
+                case Kind_Change:
+                    if (element) {
+                        const auto& actions = op.actions[change.index];
+                        (undo ? actions.first : actions.second)(*element);
+                    }
+                    break;
+            }
+        }
+    }
+
+    m_replaying = false;
+}
+
+size_t UndoJournal::GetBytes(const Operation& op)
+{
+    size_t bytes = sizeof(Operation) +
+                   op.changes.size() * sizeof(Change) +
+                   op.actions.size() * sizeof(op.actions[0]) +
+                   op.captured;
+
+    for (const auto& snapshot : op.snapshots)
+        bytes += sizeof(Snapshot) + snapshot.data.size();
+
+    return bytes;
+}
+
+void UndoJournal::Trim()
+{
+    while (m_bytes > m_limit && !m_undo.empty()) {
+        m_bytes -= m_undo.front().bytes;
+        m_undo.pop_front();
+    }
+}
+
+} // namespace impl
+
+// ----------------------------------------------------------------------------
+// GraphMetrics
+// ----------------------------------------------------------------------------
+
+GraphMetrics::GraphMetrics(const wxSize& dpi)
+  : m_dpi(dpi)
+{
+}
+
+GraphMetrics::~GraphMetrics()
+{
+}
+
+wxFont GraphMetrics::GetFont() const
+{
+    return DefaultFont();
+}
+
+wxReadOnlyDC *GraphMetrics::CreateDC() const
+{
+    wxMemoryDC *dc = new wxMemoryDC;
+    wxBitmap bitmap(1, 1);
+    dc->SelectObject(bitmap);
+
+    // the memory DC measures the fonts at its own resolution, scale it so
+    // that its logical units are pixels at ours
+    const wxSize ppi = dc->GetPPI();
+    const wxSize dpi = GetDPI();
+    if (ppi.x > 0 && ppi.y > 0)
+        dc->SetUserScale(double(ppi.x) / dpi.x, double(ppi.y) / dpi.y);
+
+    dc->SetFont(GetFont());
+    return dc;
+}
+
+// ----------------------------------------------------------------------------
+// Graph
+// ----------------------------------------------------------------------------
+
+IMPLEMENT_DYNAMIC_CLASS(Graph, wxEvtHandler)
+
+BEGIN_EVENT_TABLE(Graph, wxEvtHandler)
+    EVT_THREAD(wxID_ANY, Graph::OnLayoutThread)
+END_EVENT_TABLE()
+
+namespace {
+
+/**
+ * Name of the corresponding object in the archive.
+ */
+//@{
+const wxChar* const TAGGRAPH  = _T("graph");
+const wxChar* const TAGFONT   = _T("font");
+const wxChar* const TAGSNAP   = _T("snap");
+const wxChar* const TAGGRID   = _T("grid");
+const wxChar* const TAGBOUNDS = _T("bounds");
+const wxChar* const TAGLAYOUT = _T("layout");
+//@}
+
+/**
+ * Extrinsic information associated with a serialized GraphNode.
+ *
+ * This object is used to store the global graph font (if different from
+ * default) and offset when serializing the graph in an archive and to restore
+ * it when deserialising.
+ */
+class GraphInfo : public wxObject
+{
+public:
+    GraphInfo()
+    { }
+
+    /// Create object storing the given font and offset.
+    GraphInfo(const wxFont& font, const wxPoint& offset)
+      : m_font(font), m_offset(offset)
+    { }
+
+    /// Return the font stored by this object.
+    wxFont  GetFont()   const { return m_font; }
+
+    /// Return the offset stored by this object.
+    wxPoint GetOffset() const { return m_offset; }
+
+private:
+    wxFont m_font;          ///< Font specified in the ctor.
+    wxPoint m_offset;       ///< Offset specified in the ctor.
+};
+
+/**
+ * The factory resolved from an archive class name, kept as the class data
+ * of the archive by Graph::DeserialiseElement().
+ */
+class FactoryClassData : public wxClientData
+{
+public:
+    explicit FactoryClassData(impl::FactoryBase *factory)
+      : m_factory(factory)
+    { }
+
+    /// Return the factory, which is owned by the registry.
+    impl::FactoryBase *GetFactory() const { return m_factory; }
+
+private:
+    impl::FactoryBase *m_factory;
+};
+
+} // namespace
+
+namespace impl
+{
+
+/**
+ * Creates the graph elements while an archive is being loaded.
+ *
+ * Used by Graph::Deserialise() and Graph::DeserialiseInto(). The elements are
+ * only created as they are read if the archive is sorted, as otherwise the
+ * nodes an edge refers to may not have been read yet. Anything not created
+ * while loading is created by Finish() in the usual sort key order.
+ */
+class GraphLoader : public Archive::Consumer
+{
+public:
+    /**
+     * Initialize the loader for the given graph and archive.
+     *
+     * If @a replace is true, the graph is cleared and the settings stored
+     * in the archive are applied to it, otherwise the elements are imported
+     * centred on @a pt. The graph is only cleared once the graph item has
+     * been read, or by Finish(), so it's left untouched if the stream turns
+     * out not to contain a graph archive at all.
+     */
+    GraphLoader(Graph& graph,
+                Archive& archive,
+                bool replace,
+                const wxPoint& pt = wxPoint())
+      : m_graph(graph),
+        m_archive(archive),
+        m_replace(replace),
+        m_pt(pt),
+        m_haveInfo(false),
+        m_streaming(true),
+        m_started(false)
+    { }
+
+    bool OnItem(Archive::Item& item) override;
+
+    /// Create the elements which were not created during loading.
+    void Finish();
+
+    /// True if the graph was cleared to be replaced by the archive.
+    bool IsStarted() const { return m_started; }
+
+private:
+    /// Clear the graph, if replacing it, the first time it's called.
+    void Start();
+
+    /// Handle the item storing the graph settings.
+    void GraphItem(Archive::Item& item);
+
+    Graph& m_graph;
+    Archive& m_archive;
+    bool m_replace;
+    wxPoint m_pt;
+
+    /// True once the graph item was handled.
+    bool m_haveInfo;
+
+    /// False if the elements must wait for Finish().
+    bool m_streaming;
+
+    /// True once Start() cleared the graph.
+    bool m_started;
+
+    /// The items already used to create elements.
+    std::unordered_set<const Archive::Item*> m_done;
+};
+
+void GraphLoader::Start()
+{
+    if (m_replace && !m_started) {
+        m_graph.New();
+        m_started = true;
+    }
+}
+
+void GraphLoader::GraphItem(Archive::Item& item)
+{
+    Start();
+
+    if (m_replace)
+        m_graph.RestoreSettings(item);
+    m_graph.PrepareImport(item, m_pt);
+    m_haveInfo = true;
+}
+
+bool GraphLoader::OnItem(Archive::Item& item)
+{
+    if (item.GetId() == TAGGRAPH) {
+        GraphItem(item);
+    }
+    else if (m_streaming && item.GetSort().StartsWith(SORT_ELEMENT)) {
+        // The elements need the graph item, which Serialise() sorts first,
+        // so if it's not there the file didn't come from us: wait for the
+        // rest of it.
+        if (m_archive.IsSorted() && m_haveInfo) {
+            m_graph.DeserialiseElement(item);
+            m_done.insert(&item);
+        }
+        else {
+            m_streaming = false;
+        }
+    }
+
+    return true;
+}
+
+void GraphLoader::Finish()
+{
+    Start();
+
+    Archive::Item *item = m_archive.Get(TAGGRAPH);
+    if (item && !m_haveInfo)
+        GraphItem(*item);
+
+    // decode the images of the elements still to create in parallel
+    m_archive.DecodeImages();
+
+    for (const auto& elem : MakeRange(m_archive.GetItems(SORT_ELEMENT))) {
+        Archive::Item *arc = elem.second;
+
+        if (m_done.find(arc) == m_done.end())
+            m_graph.DeserialiseElement(*arc);
+    }
+}
+
+} // namespace impl
+
+Graph::Graph(wxEvtHandler *handler, GraphMetrics *metrics)
+  : m_diagram(new GraphDiagram),
+    m_index(new SpatialIndex),
+    m_adjacency(new AdjacencyIndex),
+    m_analysis(new GraphAnalysis),
+    m_updateCount(0),
+    m_checkBounds(false),
+    m_changed(false),
+    m_history(new LayoutHistory),
+    m_journal(new UndoJournal(*this)),
+    m_componentLayout(false),
+    m_nodeBitmapCache(false),
+    m_handler(handler),
+    m_metrics(metrics),
+    m_dpi(metrics ? metrics->GetDPI() : GetScreenDPI())
+{
+    Graph::New();
+}
+
+Graph::~Graph()
+{
+    // don't use CancelLayout() as no events should be sent from here
+    if (m_layoutJob) {
+        m_layoutJob->Detach();
+        m_layoutJob.reset();
+    }
+
+    // the other controls showing the graph must forget it too
+    while (!m_views.empty())
+        wxStaticCast(m_views.back()->GetParent(), GraphCtrl)->SetGraph(NULL);
+
+    Graph::New();
+    GraphCtrl *ctrl = GetCtrl();
+
+    if (ctrl) {
+        m_diagram->SetCanvas(NULL);
+        ctrl->SetGraph(NULL);
+    }
+    else {
+        delete m_diagram->GetCanvas();
+    }
+
+    delete m_diagram;
+    delete m_index;
+    delete m_adjacency;
+    delete m_analysis;
+    delete m_history;
+    delete m_journal;
+    delete m_metrics;
+}
+
+void Graph::New()
+{
+    CancelLayout();
+
+    iterator it, end;
+    for (tie(it, end) = GetElements(); it != end; )
+        delete &*it++;
+
+    m_diagram->DeleteAllShapes();
+    m_diagram->GetHandlerPool().Release();
+    m_index->Clear();
+    m_adjacency->Clear();
+    m_analysis->Clear();
+    m_history->Clear();
+    m_journal->Clear();
+    m_layoutCache.reset();
+
+    wxShapeCanvas *canvas = m_diagram->GetCanvas();
+    if (canvas) {
+        GraphCanvas *gcanvas = wxStaticCast(canvas, GraphCanvas);
+        gcanvas->SetFont(m_metrics ? m_metrics->GetFont() : DefaultFont());
+        if (!gcanvas->GetMetrics())
+            gcanvas->ScrollTo(wxPoint(0, 0), false);
+    }
+
+    constexpr int GRID_SPACING_FACTOR = 18;
+    SetGridSpacing(m_dpi.y / GRID_SPACING_FACTOR);
+
+    RefreshBounds();
+}
+
+void Graph::SetEventHandler(wxEvtHandler *handler)
+{
+    m_handler = handler;
+}
+
+wxEvtHandler *Graph::GetEventHandler() const
+{
+    return m_handler;
+}
+
+void Graph::SendEvent(wxEvent& event)
+{
+    if (m_handler) {
+        event.SetEventObject(this);
+        m_handler->ProcessEvent(event);
+    }
+}
+
+wxRect Graph::GetBounds() const
+{
+    if (m_rcBounds.IsEmpty())
+        m_rcBounds = m_index->GetBounds();
+
+    return m_rcBounds;
+}
+
+size_t Graph::GetMemoryUsage() const
+{
+    size_t bytes = sizeof(*this) + sizeof(*m_diagram);
+
+    for (const auto& element : MakeRange(GetElements())) {
+        bytes += element.GetClassInfo()->GetSize();
+
+        // the shape is in the diagram's list and in the list of its kind
+        const wxShape *shape = element.GetShape();
+        if (shape)
+            bytes += shape->GetClassInfo()->GetSize() + 2 * sizeof(wxNode);
+    }
+
+    bytes += m_diagram->GetHandlerPool().GetReserved();
+    bytes += m_index->GetMemoryUsage();
+    bytes += m_adjacency->GetMemoryUsage();
+    bytes += m_analysis->GetMemoryUsage();
+    bytes += m_journal->GetMemoryUsage();
+
+    return bytes;
+}
+
+void Graph::RefreshBounds()
+{
+    m_rcBounds = wxRect();
+    BoundsChanged();
+}
+
+void Graph::BoundsChanged()
+{
+    if (IsUpdating()) {
+        m_checkBounds = true;
+        m_changed = true;
+    }
+    else {
+        GraphCanvas *canvas = GetCanvas();
+        if (canvas)
+            canvas->SetCheckBounds();
+        CheckViewBounds();
+    }
+}
+
+void Graph::UpdateBounds(const wxRect& old, const wxRect& rc)
+{
+    if (old == rc)
+        return;
+
+    const wxRect& b = m_rcBounds;
+
+    // The bounds can only shrink if the node was on one of their edges and
+    // has moved away from it, only recompute them from scratch in this case.
+    if (!b.IsEmpty()) {
+        bool shrinks = !old.IsEmpty() &&
+            (rc.IsEmpty() ||
+             (old.x <= b.x && rc.x > b.x) ||
+             (old.y <= b.y && rc.y > b.y) ||
+             (old.GetRight() >= b.GetRight() && rc.GetRight() < b.GetRight()) ||
+             (old.GetBottom() >= b.GetBottom() && rc.GetBottom() < b.GetBottom()));
+
+        if (shrinks)
+            m_rcBounds = wxRect();
+        else
+            m_rcBounds.Union(rc);
+    }
+
+    BoundsChanged();
+}
+
+void Graph::BeginUpdate()
+{
+    if (m_updateCount++ == 0)
+        m_journal->Begin();
+}
+
+void Graph::EndUpdate()
+{
+    wxCHECK_RET(m_updateCount > 0, _T("EndUpdate() without BeginUpdate()"));
+
+    if (--m_updateCount > 0)
+        return;
+
+    // the lines whose nodes moved during the update are routed only now
+    m_diagram->RouteLinks();
+    m_journal->End();
+
+    GraphCanvas *canvas = GetCanvas();
+
+    if (!m_rcDirty.IsEmpty()) {
+        canvas->RefreshGraphRect(m_rcDirty);
+        RefreshViews(m_rcDirty);
+        m_rcDirty = wxRect();
+    }
+
+    if (m_checkBounds) {
+        canvas->SetCheckBounds();
+        CheckViewBounds();
+        m_checkBounds = false;
+    }
+
+    if (m_changed) {
+        m_changed = false;
+        GraphEvent event(Evt_Graph_Changed);
+        SendEvent(event);
+    }
+}
+
+void Graph::Invalidate(const wxRect& rc)
+{
+    m_rcDirty.Union(rc);
+    m_changed = true;
+}
+
+void Graph::UpdateIndex(const GraphNode& node)
+{
+    wxRect rc = node.GetBounds();
+    UpdateBounds(m_index->Update(&node, rc), rc);
+}
+
+void Graph::InsertIndex(const GraphNode& node)
+{
+    wxRect rc = node.GetBounds();
+    m_index->Insert(&node, rc);
+    m_analysis->Insert(&node);
+    UpdateBounds(wxRect(), rc);
+}
+
+void Graph::UpdateAdjacency(const GraphNode& from,
+                            const GraphNode& to,
+                            int delta)
+{
+    // only the first edge between the nodes and the removal of the last one
+    // change the paths
+    bool connected = m_adjacency->Contains(&from, &to);
+    m_adjacency->Update(&from, &to, delta);
+
+    if (m_adjacency->Contains(&from, &to) != connected) {
+        if (connected)
+            m_analysis->Disconnect(&from, &to);
+        else
+            m_analysis->Connect(&from, &to);
+    }
+}
+
+void Graph::RaiseIndex(const GraphNode& node)
+{
+    m_index->Raise(&node);
+}
+
+void Graph::SetCanvas(GraphCanvas *canvas)
+{
+    GraphCtrl *oldctrl = GetCtrl();
+    wxShapeCanvas *oldcanvas = m_diagram->GetCanvas();
+
+    if (canvas == oldcanvas || (!canvas && !oldctrl))
+        return;
+
+    // when the main control goes, one of the views takes its place
+    if (!canvas && !m_views.empty()) {
+        canvas = m_views.front();
+        m_views.erase(m_views.begin());
+    }
+
+    m_diagram->SetCanvas(canvas);
+    canvas = GetCanvas();
+
+    canvas->SetGraph(this);
+
+    if (oldcanvas)
+        canvas->SetFont(oldcanvas->GetFont());
+
+    for(auto& obj : *m_diagram->GetShapeList())
+        wxStaticCast(obj, wxShape)->SetCanvas(canvas);
+
+    if (!oldctrl)
+        delete oldcanvas;
+}
+
+GraphCanvas *Graph::GetCanvas() const
+{
+    wxShapeCanvas *canvas = m_diagram->GetCanvas();
+
+    if (!canvas) {
+        GraphCanvas *gcanvas = m_metrics ? new GraphCanvas(m_metrics)
+                                         : new GraphCanvas;
+        gcanvas->SetGraph(const_cast<Graph*>(this));
         m_diagram->SetCanvas(gcanvas);
         gcanvas->SetDiagram(m_diagram);
         return gcanvas;
     }
     else {
-        return wxStaticCast(canvas, GraphCanvas);
+        return wxStaticCast(canvas, GraphCanvas);
+    }
+}
+
+GraphCtrl *Graph::GetCtrl() const
+{
+    wxShapeCanvas *canvas = m_diagram->GetCanvas();
+    return canvas ? wxDynamicCast(canvas->GetParent(), GraphCtrl) : NULL;
+}
+
+GraphCtrl *Graph::GetCtrl(const wxDC& dc) const
+{
+    GraphCanvas *canvas = wxDynamicCast(dc.GetWindow(), GraphCanvas);
+
+    if (canvas && canvas->GetGraph() == this)
+        return wxDynamicCast(canvas->GetParent(), GraphCtrl);
+
+    return GetCtrl();
+}
+
+void Graph::AddView(GraphCanvas *canvas)
+{
+    m_views.push_back(canvas);
+    canvas->SetCheckBounds();
+}
+
+void Graph::RemoveView(GraphCanvas *canvas)
+{
+    m_views.erase(remove(m_views.begin(), m_views.end(), canvas),
+                  m_views.end());
+}
+
+void Graph::RefreshViews(const wxRect& rcGraph)
+{
+    GraphCtrl *ctrl = GetCtrl();
+    if (ctrl)
+        ctrl->RefreshOverviews(rcGraph);
+
+    for (GraphCanvas *view : m_views) {
+        view->RefreshGraphRect(rcGraph);
+        wxStaticCast(view->GetParent(), GraphCtrl)->RefreshOverviews(rcGraph);
+    }
+}
+
+void Graph::CheckViewBounds()
+{
+    GraphCtrl *ctrl = GetCtrl();
+    if (ctrl)
+        ctrl->CheckOverviewBounds();
+
+    for (GraphCanvas *view : m_views) {
+        view->SetCheckBounds();
+        wxStaticCast(view->GetParent(), GraphCtrl)->CheckOverviewBounds();
+    }
+}
+
+wxList *Graph::GetShapeList() const
+{
+    return m_diagram->GetShapeList();
+}
+
+wxList *Graph::GetShapeList(wxClassInfo *classinfo, int which) const
+{
+    if (which == impl::Selected)
+        return m_diagram->GetSelectionList();
+    if (classinfo->IsKindOf(CLASSINFO(GraphNode)))
+        return m_diagram->GetNodeList();
+    if (classinfo->IsKindOf(CLASSINFO(GraphEdge)))
+        return m_diagram->GetEdgeList();
+
+    return m_diagram->GetShapeList();
+}
+
+void Graph::SetFont(const wxFont& font)
+{
+    GetCanvas()->SetFont(font);
+}
+
+wxFont Graph::GetFont() const
+{
+    return GetCanvas()->GetFont();
+}
+
+GraphNode *Graph::Add(GraphNode *node,
+                      wxPoint pt,
+                      wxSize size)
+{
+    GraphEvent event(Evt_Graph_Node_Add);
+    event.SetNode(node);
+    event.SetPosition(pt);
+    SendEvent(event);
+
+    if (event.IsAllowed())
+        return DoAdd(node, pt, size);
+
+    delete node;
+    return NULL;
+}
+
+GraphNode *Graph::DoAdd(GraphNode *node,
+                        wxPoint pt,
+                        wxSize size)
+{
+    wxASSERT(node != NULL);
+    wxShape *shape = node->EnsureShape();
+    wxASSERT_MSG(!shape->GetCanvas(), _T("Node already inserted into graph"));
+
+    m_diagram->AddShape(shape);
+    InsertIndex(*node);
+    m_history->NodeAdded(node);
+
+    // the snapshot recorded for undo includes the position and size
+    m_journal->Suspend();
+    node->SetPosition(pt);
+    node->SetSize(size);
+    m_journal->Resume();
+    m_journal->Added(*node);
+
+    return node;
+}
+
+GraphEdge *Graph::Add(GraphNode& from, GraphNode& to, GraphEdge *edge)
+{
+    GraphEvent event(Evt_Graph_Edge_Add);
+    event.SetNode(&from);
+    event.SetTarget(&to);
+    event.SetEdge(edge);
+    SendEvent(event);
+    edge = event.GetEdge();
+    GraphNode *src = event.GetNode();
+    GraphNode *dest = event.GetTarget();
+    wxASSERT(src != NULL && dest != NULL);
+
+    if (event.IsAllowed())
+        return DoAdd(*src, *dest, edge);
+
+    delete edge;
+    return NULL;
+}
+
+GraphEdge *Graph::DoAdd(GraphNode& from, GraphNode& to, GraphEdge *edge)
+{
+    if (!edge)
+        edge = new GraphEdge;
+
+    wxLineShape *line = edge->EnsureShape();
+    wxASSERT_MSG(!line->GetCanvas(), _T("Edge already inserted into graph"));
+
+    m_diagram->InsertShape(line);
+    if (ShowLine(line, &from, &to)) {
+        edge->UpdateEdgeCounts(1);
+        m_history->EdgeAdded(&from, &to);
+        m_journal->Added(*edge);
+    }
+    edge->Refresh();
+
+    return edge;
+}
+
+bool Graph::AddBatch(const vector<GraphNode*>& nodes,
+                     const vector<EdgeSpec>& edges,
+                     bool layout)
+{
+    GraphEvent::NodeList sources(nodes.begin(), nodes.end());
+
+    GraphEvent event(Evt_Graph_Batch_Add);
+    event.SetSources(sources);
+    SendEvent(event);
+
+    if (!event.IsAllowed()) {
+        for (const auto node : nodes)
+            delete node;
+        for (const auto& spec : edges)
+            delete spec.edge;
+        return false;
+    }
+
+    // only the nodes from the original list remaining in the event are added
+    unordered_set<const GraphNode*> accepted(sources.begin(), sources.end());
+    unordered_set<const GraphNode*> refused;
+
+    GraphUpdateLocker noUpdates(*this);
+    m_index->Reserve(nodes.size());
+
+    for (const auto node : nodes) {
+        if (accepted.count(node))
+            DoAdd(node, wxPoint(), wxSize());
+        else
+            refused.insert(node);
+    }
+
+    for (const auto& spec : edges) {
+        if (refused.count(spec.from) || refused.count(spec.to))
+            delete spec.edge;
+        else
+            DoAdd(*spec.from, *spec.to, spec.edge);
+    }
+
+    // only deleted now, as the edges above are looked up by their address
+    for (const auto node : refused)
+        delete node;
+
+    if (layout && !accepted.empty())
+        LayoutAll();
+
+    return true;
+}
+
+// This function is recursive, but this is fine.
+//
+// NOLINTNEXTLINE(misc-no-recursion)
+void Graph::Delete(GraphElement *element)
+{
+    // deleting a node and its edges is undone as a single operation
+    GraphUpdateLocker noUpdates(*this);
+    GraphNode *node = wxDynamicCast(element, GraphNode);
+
+    if (node) {
+        GraphEvent event(Evt_Graph_Node_Delete);
+        event.SetNode(node);
+        SendEvent(event);
+
+        if (event.IsAllowed()) {
+            GraphNode::iterator it, end;
+
+            for (tie(it, end) = node->GetEdges(); it != end; ++it)
+                Delete(&*it);
+
+            if (node->GetEdges().first == end) {
+                m_journal->Deleting(*node);
+                DoDelete(node);
+            }
+        }
+    }
+    else {
+        GraphEdge *edge = wxStaticCast(element, GraphEdge);
+
+        GraphEvent event(Evt_Graph_Edge_Delete);
+        event.SetEdge(edge);
+        SendEvent(event);
+
+        if (event.IsAllowed()) {
+            m_journal->Deleting(*edge);
+            edge->UpdateEdgeCounts(-1);
+            edge->GetShape()->Unlink();
+            DoDelete(edge);
+        }
+    }
+}
+
+void Graph::DoDelete(GraphElement *element)
+{
+    wxShape *shape = element->GetShape();
+    if (shape->GetCanvas()) {
+        element->Refresh();
+        m_diagram->SelectShape(shape, false);
+    }
+    m_diagram->RemoveShape(shape);
+
+    GraphNode *node = wxDynamicCast(element, GraphNode);
+    if (node) {
+        UpdateBounds(m_index->Remove(node), wxRect());
+        m_analysis->Remove(node);
+        m_history->Forget(node);
+        if (m_layoutJob)
+            m_layoutJob->Forget(node);
+    }
+
+    delete element;
+}
+
+void Graph::Delete(const iterator_pair& range)
+{
+    GraphUpdateLocker noUpdates(*this);
+
+    iterator i, endi;
+    tie(i, endi) = range;
+
+    while (i != endi)
+    {
+        GraphElement *element = &*i;
+        ++i;
+        GraphNode *node = wxDynamicCast(element, GraphNode);
+
+        if (node) {
+            GraphEvent event(Evt_Graph_Node_Delete);
+            event.SetNode(node);
+            SendEvent(event);
+
+            if (event.IsAllowed()) {
+                GraphNode::iterator j, endj;
+                tie(j, endj) = node->GetEdges();
+
+                while (j != endj)
+                {
+                    GraphEdge *edge = &*j;
+                    ++j;
+                    if (i != endi && edge == &*i)
+                        ++i;
+                    Delete(edge);
+                }
+
+                if (node->GetEdges().first == endj) {
+                    m_journal->Deleting(*node);
+                    DoDelete(node);
+                }
+            }
+        }
+        else {
+            Delete(wxStaticCast(element, GraphEdge));
+        }
+    }
+}
+
+bool Graph::DeleteBatch(const iterator_pair& range)
+{
+    vector<GraphNode*> nodes;
+    vector<GraphEdge*> edges;
+
+    for (auto& element : MakeRange(range)) {
+        GraphNode *node = wxDynamicCast(&element, GraphNode);
+        if (node)
+            nodes.push_back(node);
+        else
+            edges.push_back(wxStaticCast(&element, GraphEdge));
+    }
+
+    GraphEvent::NodeList sources(nodes.begin(), nodes.end());
+
+    GraphEvent event(Evt_Graph_Batch_Delete);
+    event.SetSources(sources);
+    SendEvent(event);
+
+    if (!event.IsAllowed())
+        return false;
+
+    // only the nodes from the original list remaining in the event are
+    // deleted, together with all of their edges
+    unordered_set<const GraphNode*> original(nodes.begin(), nodes.end());
+    unordered_set<const GraphNode*> deleted;
+    nodes.clear();
+
+    for (const auto node : sources) {
+        if (original.count(node) && deleted.insert(node).second)
+            nodes.push_back(node);
+    }
+
+    unordered_set<const GraphEdge*> seen(edges.begin(), edges.end());
+
+    for (const auto node : nodes) {
+        for (auto& edge : MakeRange(node->GetEdges())) {
+            if (seen.insert(&edge).second)
+                edges.push_back(&edge);
+        }
+    }
+
+    if (nodes.empty() && edges.empty())
+        return true;
+
+    GraphUpdateLocker noUpdates(*this);
+
+    GraphCanvas *canvas = GetCanvas();
+    MeasureDC dc(canvas);
+
+    // the edges go first as unlinking them needs their nodes
+    for (const auto edge : edges) {
+        m_journal->Deleting(*edge);
+        wxLineShape *line = edge->GetShape();
+        line->Erase(dc);
+        m_diagram->SelectShape(line, false);
+        edge->UpdateEdgeCounts(-1);
+        line->Unlink();
+        m_diagram->RemoveShape(line);
+    }
+
+    for (const auto node : nodes) {
+        m_journal->Deleting(*node);
+        wxShape *shape = node->GetShape();
+        shape->Erase(dc);
+        m_diagram->SelectShape(shape, false);
+        m_diagram->RemoveShape(shape);
+        m_index->Remove(node);
+        m_analysis->Remove(node);
+        if (m_layoutJob)
+            m_layoutJob->Forget(node);
+    }
+
+    m_history->Forget(deleted);
+
+    for (const auto edge : edges)
+        delete edge;
+    for (const auto node : nodes)
+        delete node;
+
+    RefreshBounds();
+
+    return true;
+}
+
+void Graph::Undo()
+{
+    m_journal->Undo();
+}
+
+void Graph::Redo()
+{
+    m_journal->Redo();
+}
+
+bool Graph::CanUndo() const
+{
+    return m_journal->CanUndo();
+}
+
+bool Graph::CanRedo() const
+{
+    return m_journal->CanRedo();
+}
+
+void Graph::SetUndoLimit(size_t bytes)
+{
+    m_journal->SetLimit(bytes);
+}
+
+size_t Graph::GetUndoLimit() const
+{
+    return m_journal->GetLimit();
+}
+
+void Graph::ClearUndo()
+{
+    m_journal->Clear();
+}
+
+void Graph::RecordChange(GraphElement& element,
+                         const UndoAction& undo,
+                         const UndoAction& redo,
+                         size_t bytes)
+{
+    m_journal->Changed(element, undo, redo, bytes);
+}
+
+const GraphNode *Graph::HitTest(const wxPoint& pt) const
+{
+    return m_index->HitTest(pt);
+}
+
+GraphNode *Graph::HitTest(const wxPoint& pt)
+{
+    const Graph *graph = this;
+    return const_cast<GraphNode*>(graph->HitTest(pt));
+}
+
+bool Graph::AreConnected(const GraphNode& from,
+                         const GraphNode& to,
+                         bool directed) const
+{
+    return m_adjacency->Contains(&from, &to) ||
+           (!directed && m_adjacency->Contains(&to, &from));
+}
+
+bool Graph::IsAcyclic() const
+{
+    return m_analysis->IsAcyclic();
+}
+
+bool Graph::IsReachable(const GraphNode& from, const GraphNode& to) const
+{
+    return m_analysis->IsReachable(&from, &to);
+}
+
+bool Graph::WouldCreateCycle(const GraphNode& from,
+                             const GraphNode& to) const
+{
+    return &from == &to || m_analysis->IsReachable(&to, &from);
+}
+
+vector<GraphNode*> Graph::GetUpstream(const GraphNode& node) const
+{
+    return ToNodes(m_analysis->GetReachable(&node, false));
+}
+
+vector<GraphNode*> Graph::GetDownstream(const GraphNode& node) const
+{
+    return ToNodes(m_analysis->GetReachable(&node, true));
+}
+
+vector<GraphNode*> Graph::GetTopologicalOrder() const
+{
+    return ToNodes(m_analysis->GetOrder());
+}
+
+size_t Graph::GetNodeCount() const
+{
+    return m_diagram->GetNodeList()->GetCount();
+}
+
+size_t Graph::GetElementCount() const
+{
+    return m_diagram->GetNodeList()->GetCount() +
+           m_diagram->GetEdgeList()->GetCount();
+}
+
+size_t Graph::GetSelectionCount() const
+{
+    return m_diagram->GetSelectionList()->GetCount();
+}
+
+size_t Graph::GetSelectionNodeCount() const
+{
+    return m_diagram->GetSelectedNodeCount();
+}
+
+bool Graph::LayoutAll(const GraphNode *fixed, double ranksep, double nodesep)
+{
+    if (m_history->CanPlace()) {
+        GraphUpdateLocker noUpdates(*this);
+        m_history->Place(*m_index, m_dpi, ranksep, nodesep);
+        return true;
+    }
+
+    return Layout(GetNodes(), fixed, ranksep, nodesep);
+}
+
+void Graph::SetIncrementalLayout(bool incremental)
+{
+    m_history->Enable(incremental);
+}
+
+bool Graph::IsIncrementalLayout() const
+{
+    return m_history->IsEnabled();
+}
+
+void Graph::SetComponentLayout(bool separate)
+{
+    m_componentLayout = separate;
+}
+
+bool Graph::IsComponentLayout() const
+{
+    return m_componentLayout;
+}
+
+bool Graph::Layout(const node_iterator_pair& range,
+                   const GraphNode *fixed,
+                   double ranksep,
+                   double nodesep)
+{
+    LayoutJob job;
+    job.SetSplitComponents(m_componentLayout);
+    job.SetCache(m_layoutCache);
+    job.Collect(range, fixed, ranksep, nodesep);
+
+    if (!job.Run())
+        return false;
+
+    GraphUpdateLocker noUpdates(*this);
+    job.Apply();
+    m_history->Record(job.GetNodes(), GetNodeCount());
+    m_layoutCache = LayoutCache::Merge(m_layoutCache, job.GetLayouts());
+
+    return true;
+}
+
+bool Graph::LayoutAllAsync(const GraphNode *fixed,
+                           double ranksep,
+                           double nodesep)
+{
+    return LayoutAsync(GetNodes(), fixed, ranksep, nodesep);
+}
+
+bool Graph::LayoutAsync(const node_iterator_pair& range,
+                        const GraphNode *fixed,
+                        double ranksep,
+                        double nodesep)
+{
+    CancelLayout();
+
+    static unsigned long lastId;
+    shared_ptr<LayoutJob> job = make_shared<LayoutJob>(this, ++lastId);
+    job->SetSplitComponents(m_componentLayout);
+    job->SetCache(m_layoutCache);
+    job->Collect(range, fixed, ranksep, nodesep);
+
+    LayoutThread *thread = new LayoutThread(job);
+    if (thread->Run() != wxTHREAD_NO_ERROR) {
+        delete thread;
+        wxLogError(_("Failed to start the layout thread."));
+        return false;
+    }
+
+    m_layoutJob = job;
+    return true;
+}
+
+void Graph::CancelLayout()
+{
+    if (m_layoutJob) {
+        m_layoutJob->Detach();
+        m_layoutJob.reset();
+
+        GraphEvent event(Evt_Graph_Layout_Cancel);
+        SendEvent(event);
+    }
+}
+
+bool Graph::IsLayoutRunning() const
+{
+    return m_layoutJob != NULL;
+}
+
+void Graph::OnLayoutThread(wxThreadEvent& event)
+{
+    // ignore the events from the jobs which were cancelled
+    if (!m_layoutJob || event.GetExtraLong() != long(m_layoutJob->GetId()))
+        return;
+
+    if (event.GetId() == ID_LAYOUT_PROGRESS) {
+        GraphEvent progress(Evt_Graph_Layout_Progress);
+        progress.SetProgress(event.GetInt());
+        SendEvent(progress);
+
+        if (!progress.IsAllowed())
+            CancelLayout();
+    }
+    else {
+        shared_ptr<LayoutJob> job;
+        job.swap(m_layoutJob);
+
+        if (job->IsOk()) {
+            {
+                GraphUpdateLocker noUpdates(*this);
+                job->Apply();
+                m_history->Record(job->GetNodes(), GetNodeCount());
+                m_layoutCache = LayoutCache::Merge(m_layoutCache,
+                                                   job->GetLayouts());
+            }
+
+            GraphEvent done(Evt_Graph_Layout_Done);
+            SendEvent(done);
+        }
+        else {
+            GraphEvent cancel(Evt_Graph_Layout_Cancel);
+            SendEvent(cancel);
+        }
     }
 }
 
-GraphCtrl *Graph::GetCtrl() const
+void Graph::Select(const iterator_pair& range)
 {
-    wxShapeCanvas *canvas = m_diagram->GetCanvas();
-    return canvas ? wxDynamicCast(canvas->GetParent(), GraphCtrl) : NULL;
+    vector<GraphElement*> elements;
+    for (auto& element : MakeRange(range))
+        elements.push_back(&element);
+
+    SelectElements(elements, true);
 }
 
-wxList *Graph::GetShapeList() const
+void Graph::Unselect(const iterator_pair& range)
 {
-    return m_diagram->GetShapeList();
+    vector<GraphElement*> elements;
+    for (auto& element : MakeRange(range))
+        elements.push_back(&element);
+
+    SelectElements(elements, false);
 }
 
-void Graph::SetFont(const wxFont& font)
+void Graph::SelectElements(const vector<GraphElement*>& elements, bool select)
 {
-    GetCanvas()->SetFont(font);
+    // each element goes through its own Select() or Unselect(), which the
+    // element classes can override, and the lock repaints them all at once
+    GraphUpdateLocker noUpdates(*this);
+
+    for (const auto element : elements) {
+        if (element->IsSelected() == select)
+            continue;
+        if (select)
+            element->Select();
+        else
+            element->Unselect();
+    }
 }
 
-wxFont Graph::GetFont() const
+void Graph::SelectRect(const wxRect& rc, bool extend)
 {
-    return GetCanvas()->GetFont();
+    vector<GraphElement*> select, unselect;
+
+    if (!extend) {
+        for (auto& element : MakeRange(GetSelection()))
+            if (!rc.Intersects(element.GetBounds()))
+                unselect.push_back(&element);
+    }
+
+    wxRect rcHit = rc;
+    rcHit.Inflate(1);
+
+    // the edges are not indexed, only those of the nodes in the rectangle
+    // are candidates
+    unordered_set<const GraphEdge*> seen;
+
+    for (const auto found : m_index->Query(rcHit)) {
+        GraphNode *node = const_cast<GraphNode*>(found);
+        if (!node->IsSelected())
+            select.push_back(node);
+
+        for (auto& edge : MakeRange(node->GetEdges())) {
+            if (seen.insert(&edge).second && !edge.IsSelected() &&
+                    rc.Intersects(edge.GetBounds().Inflate(1)))
+                select.push_back(&edge);
+        }
+    }
+
+    SelectElements(unselect, false);
+    SelectElements(select, true);
 }
 
-GraphNode *Graph::Add(GraphNode *node,
-                      wxPoint pt,
-                      wxSize size)
+void Graph::SetSnapToGrid(bool snap)
 {
-    GraphEvent event(Evt_Graph_Node_Add);
-    event.SetNode(node);
-    event.SetPosition(pt);
-    SendEvent(event);
-
-    if (event.IsAllowed())
-        return DoAdd(node, pt, size);
+    m_diagram->SetSnapToGrid(snap);
+}
 
-    delete node;
-    return NULL;
+bool Graph::GetSnapToGrid() const
+{
+    return m_diagram->GetSnapToGrid();
 }
 
-GraphNode *Graph::DoAdd(GraphNode *node,
-                        wxPoint pt,
-                        wxSize size)
+void Graph::SetGridSpacing(int spacing)
 {
-    wxASSERT(node != NULL);
-    wxShape *shape = node->EnsureShape();
-    wxASSERT_MSG(!shape->GetCanvas(), _T("Node already inserted into graph"));
+    if (spacing < 1)
+        spacing = 1;
 
-    m_diagram->AddShape(shape);
-    node->SetPosition(pt);
-    node->SetSize(size);
+#ifdef oglHAVE_XY_GRID
+    int xspacing = wxRound(double(spacing) * m_dpi.x / m_dpi.y);
+    if (xspacing < 1)
+        xspacing = 1;
+    m_diagram->SetGridSpacing(xspacing, spacing);
+#else
+    m_diagram->SetGridSpacing(spacing);
+#endif
 
-    return node;
+    wxShapeCanvas *canvas = m_diagram->GetCanvas();
+    if (canvas)
+        canvas->Refresh();
 }
 
-GraphEdge *Graph::Add(GraphNode& from, GraphNode& to, GraphEdge *edge)
+wxSize Graph::GetGridSpacing() const
 {
-    GraphEvent event(Evt_Graph_Edge_Add);
-    event.SetNode(&from);
-    event.SetTarget(&to);
-    event.SetEdge(edge);
-    SendEvent(event);
-    edge = event.GetEdge();
-    GraphNode *src = event.GetNode();
-    GraphNode *dest = event.GetTarget();
-    wxASSERT(src != NULL && dest != NULL);
+    wxSize spacing;
+    double x, y;
 
-    if (event.IsAllowed())
-        return DoAdd(*src, *dest, edge);
+#ifdef oglHAVE_XY_GRID
+    m_diagram->GetGridSpacing(&x, &y);
+#else
+    x = y = m_diagram->GetGridSpacing();
+#endif
 
-    delete edge;
-    return NULL;
+    spacing.x = wxRound(x);
+    spacing.y = wxRound(y);
+
+    return spacing;
 }
 
-GraphEdge *Graph::DoAdd(GraphNode& from, GraphNode& to, GraphEdge *edge)
+bool Graph::CanClear() const
 {
-    if (!edge)
-        edge = new GraphEdge;
+    const_iterator_pair its = GetSelection();
+    return its.first == its.second;
+}
 
-    wxLineShape *line = edge->EnsureShape();
-    wxASSERT_MSG(!line->GetCanvas(), _T("Edge already inserted into graph"));
+namespace {
 
-    m_diagram->InsertShape(line);
-    ShowLine(line, &from, &to);
-    edge->Refresh();
+/// The private clipboard format of the archived graph elements.
+const wxDataFormat& GetGraphDataFormat()
+{
+    static const wxDataFormat format(_T("application/x-tt-solutions-graph"));
+    return format;
+}
 
-    return edge;
+/**
+ * The clipboard format identifying the copy, used to tell whether the
+ * clipboard still holds the last elements copied by this process.
+ */
+const wxDataFormat& GetGraphTokenFormat()
+{
+    static const wxDataFormat format(
+        _T("application/x-tt-solutions-graph-token"));
+    return format;
 }
 
-// This function is recursive, but this is fine.
-//
-// NOLINTNEXTLINE(misc-no-recursion)
-void Graph::Delete(GraphElement *element)
+/// The last elements copied to the clipboard by this process.
+struct GraphClipboard
 {
-    GraphNode *node = wxDynamicCast(element, GraphNode);
+    std::shared_ptr<Archive> archive;
+    std::string token;
+};
 
-    if (node) {
-        GraphEvent event(Evt_Graph_Node_Delete);
-        event.SetNode(node);
-        SendEvent(event);
+GraphClipboard& GetGraphClipboard()
+{
+    static GraphClipboard clipboard;
+    return clipboard;
+}
 
-        if (event.IsAllowed()) {
-            GraphNode::iterator it, end;
+/**
+ * Puts an archive on the clipboard.
+ *
+ * The archive is encoded only when its format is requested, the token
+ * format alone is enough for a paste in the same process.
+ */
+class GraphDataObject : public wxDataObject
+{
+public:
+    GraphDataObject(const std::shared_ptr<Archive>& archive,
+                    const std::string& token)
+      : m_archive(archive), m_token(token)
+    { }
 
-            for (tie(it, end) = node->GetEdges(); it != end; ++it)
-                Delete(&*it);
+    wxDataFormat GetPreferredFormat(Direction = Get) const override
+    {
+        return GetGraphTokenFormat();
+    }
 
-            if (node->GetEdges().first == end) {
-                DoDelete(node);
-                RefreshBounds();
-            }
+    size_t GetFormatCount(Direction dir = Get) const override
+    {
+        return dir == Get ? 2 : 0;
+    }
+
+    void GetAllFormats(wxDataFormat *formats,
+                       Direction dir = Get) const override
+    {
+        if (dir == Get) {
+            formats[0] = GetGraphTokenFormat();
+            formats[1] = GetGraphDataFormat();
         }
     }
-    else {
-        GraphEdge *edge = wxStaticCast(element, GraphEdge);
 
-        GraphEvent event(Evt_Graph_Edge_Delete);
-        event.SetEdge(edge);
-        SendEvent(event);
+    size_t GetDataSize(const wxDataFormat& format) const override
+    {
+        if (format == GetGraphTokenFormat())
+            return m_token.size();
+        if (format == GetGraphDataFormat())
+            return GetData().size();
+        return 0;
+    }
 
-        if (event.IsAllowed()) {
-            edge->GetShape()->Unlink();
-            DoDelete(edge);
+    bool GetDataHere(const wxDataFormat& format, void *buf) const override
+    {
+        const std::string *data = NULL;
+
+        if (format == GetGraphTokenFormat())
+            data = &m_token;
+        else if (format == GetGraphDataFormat())
+            data = &GetData();
+
+        if (!data)
+            return false;
+
+        memcpy(buf, data->data(), data->size());
+        return true;
+    }
+
+    bool SetData(const wxDataFormat&, size_t, const void*) override
+    {
+        return false;
+    }
+
+private:
+    /// The binary encoding of the archive, done on the first call.
+    const std::string& GetData() const
+    {
+        if (m_data.empty()) {
+            wxMemoryOutputStream out;
+            if (m_archive->Save(out, Archive::Format_Binary)) {
+                m_data.resize(size_t(out.GetLength()));
+                out.CopyTo(&m_data[0], m_data.size());
+            }
         }
+        return m_data;
     }
-}
 
-void Graph::DoDelete(GraphElement *element)
+    std::shared_ptr<Archive> m_archive;
+    std::string m_token;
+    mutable std::string m_data;
+};
+
+/**
+ * Return the archive on the clipboard, or NULL if it doesn't hold any graph
+ * elements. The clipboard must be open.
+ */
+std::shared_ptr<Archive> GetClipboardArchive()
 {
-    wxShape *shape = element->GetShape();
-    if (shape->GetCanvas()) {
-        element->Refresh();
-        if (shape->Selected())
-            shape->Select(false);
+    GraphClipboard& clipboard = GetGraphClipboard();
+
+    if (clipboard.archive &&
+        wxTheClipboard->IsSupported(GetGraphTokenFormat()))
+    {
+        wxCustomDataObject token(GetGraphTokenFormat());
+
+        if (wxTheClipboard->GetData(token) &&
+            token.GetSize() == clipboard.token.size() &&
+            memcmp(token.GetData(), clipboard.token.data(),
+                   token.GetSize()) == 0)
+        {
+            return clipboard.archive;
+        }
     }
-    m_diagram->RemoveShape(shape);
-    delete element;
+
+    // the elements were copied by another process, or aren't the last ones
+    // copied by this one any more
+    clipboard.archive.reset();
+
+    wxCustomDataObject data(GetGraphDataFormat());
+
+    if (!wxTheClipboard->IsSupported(GetGraphDataFormat()) ||
+            !wxTheClipboard->GetData(data))
+        return std::shared_ptr<Archive>();
+
+    auto archive = std::make_shared<Archive>();
+    wxMemoryInputStream in(data.GetData(), data.GetSize());
+
+    if (!archive->Load(in))
+        return std::shared_ptr<Archive>();
+
+    return archive;
 }
 
-void Graph::Delete(const iterator_pair& range)
+} // namespace
+
+bool Graph::Cut()
 {
-    iterator i, endi;
-    tie(i, endi) = range;
+    if (!Copy())
+        return false;
 
-    while (i != endi)
-    {
-        GraphElement *element = &*i;
-        ++i;
-        GraphNode *node = wxDynamicCast(element, GraphNode);
+    Clear();
+    return true;
+}
 
-        if (node) {
-            GraphEvent event(Evt_Graph_Node_Delete);
-            event.SetNode(node);
-            SendEvent(event);
+bool Graph::Copy()
+{
+    if (!CanCopy())
+        return false;
 
-            if (event.IsAllowed()) {
-                GraphNode::iterator j, endj;
-                tie(j, endj) = node->GetEdges();
+    auto archive = std::make_shared<Archive>();
+    if (!Serialise(*archive, GetSelection()))
+        return false;
 
-                while (j != endj)
-                {
-                    GraphEdge *edge = &*j;
-                    ++j;
-                    if (i != endi && edge == &*i)
-                        ++i;
-                    Delete(edge);
-                }
+    // the archive is pasted from directly, so make it ready for extracting
+    archive->SetStoring(false);
+    for (const auto& item : MakeRange(archive->GetItems()))
+        item.second->SetInstance(NULL);
 
-                if (node->GetEdges().first == endj) {
-                    DoDelete(node);
-                    RefreshBounds();
-                }
-            }
-        }
-        else {
-            Delete(wxStaticCast(element, GraphEdge));
-        }
+    static unsigned long s_copies;
+    std::string token(wxString::Format(_T("%lu:%lu"),
+                                       wxGetProcessId(),
+                                       ++s_copies).utf8_str());
+
+    wxClipboardLocker clipboardLocker;
+    if (!clipboardLocker ||
+            !wxTheClipboard->SetData(new GraphDataObject(archive, token)))
+    {
+        wxLogError(_("Cannot copy to the clipboard."));
+        return false;
     }
+
+    GraphClipboard& clipboard = GetGraphClipboard();
+    clipboard.archive = archive;
+    clipboard.token = token;
+
+    return true;
 }
 
-const GraphNode *Graph::HitTest(const wxPoint& pt) const
+bool Graph::Paste()
 {
-    wxRect bounds = GetBounds();
-
-    if (!bounds.Contains(pt))
-        return NULL;
+    std::shared_ptr<Archive> archive;
+    {
+        wxClipboardLocker clipboardLocker;
+        if (clipboardLocker)
+            archive = GetClipboardArchive();
+    }
 
-    if (!m_rcHit.Contains(pt)) {
-        const_node_iterator begin, it;
-        tie(begin, it) = GetNodes();
+    if (!archive)
+        return false;
 
-        m_rcHit = bounds;
-        m_nodeHit = NULL;
+    // the archive can be pasted more than once, forget the elements created
+    // the previous time and the offset used for them
+    for (const auto& item : MakeRange(archive->GetItems()))
+        item.second->SetInstance(NULL);
 
-        while (it != begin) {
-            const GraphNode& node = *--it;
-            wxRect nb = node.GetBounds();
+    wxSize size = GetGridSpacing();
+    Archive::Item *item = archive->Get(TAGGRAPH);
+    wxRect rc;
 
-            if (!nb.Contains(pt)) {
-                wxRect rx, ry;
+    if (item && item->Get(TAGBOUNDS, rc))
+        size.IncTo(Twips::To<Pixels>(rc, GetDPI()).GetSize());
 
-                if (nb.x > pt.x) {
-                    rx = m_rcHit;
-                    rx.width = nb.x - m_rcHit.x;
-                }
-                else if (nb.x + nb.width < pt.x) {
-                    rx = m_rcHit;
-                    rx.x = nb.x + nb.width;
-                    rx.width -= rx.x - m_rcHit.x;
-                }
+    GraphUpdateLocker noUpdates(*this);
+    UnselectAll();
 
-                if (nb.y > pt.y) {
-                    ry = m_rcHit;
-                    ry.height = nb.y - m_rcHit.y;
-                }
-                else if (nb.y + nb.height < pt.y) {
-                    ry = m_rcHit;
-                    ry.y = nb.y + nb.height;
-                    ry.height -= ry.y - m_rcHit.y;
-                }
+    if (!DeserialiseInto(*archive, FindSpace(size)))
+        return false;
 
-                rx.Intersect(m_rcHit);
-                ry.Intersect(m_rcHit);
+    vector<GraphElement*> pasted;
 
-                if (rx.width * rx.height >= ry.width * ry.height)
-                    m_rcHit = rx;
-                else
-                    m_rcHit = ry;
-            }
-            else {
-                m_rcHit.Intersect(nb);
-                m_nodeHit = &node;
-                break;
-            }
-        }
+    for (const auto& elem : MakeRange(archive->GetItems(SORT_ELEMENT))) {
+        GraphElement *element = elem.second->GetInstance<GraphElement>();
+        if (element)
+            pasted.push_back(element);
     }
 
-    return m_nodeHit;
+    SelectElements(pasted, true);
+
+    return true;
 }
 
-GraphNode *Graph::HitTest(const wxPoint& pt)
+bool Graph::CanCut() const
 {
-    const Graph *graph = this;
-    return const_cast<GraphNode*>(graph->HitTest(pt));
+    return CanCopy();
 }
 
-GraphIteratorImpl *Graph::IterImpl(
-    const wxList::iterator& begin,
-    const wxList::iterator& end,
-    wxClassInfo *classinfo,
-    int which)
+bool Graph::CanCopy() const
 {
-    return new ListIterImpl(begin, end, classinfo, which);
+    return GetSelectionCount() != 0;
 }
 
-namespace
+bool Graph::CanPaste() const
 {
+    return wxTheClipboard->IsSupported(GetGraphDataFormat());
+}
 
-// Helper for all the GetXXXCount() functions below.
-template<typename T>
-size_t GetCount(T&& range)
+namespace {
+
+/**
+ * Writes the elements of a graph as an SVG document.
+ *
+ * The elements are written directly from their geometry, without going
+ * through a wxDC. The pens, brushes and fonts used by them are collected
+ * first and written once as CSS classes, each element then only refers to
+ * its classes.
+ */
+class SvgWriter
 {
-    size_t count = 0;
-    for (const auto& element : MakeRange(range)) {
-        count++;
+public:
+    SvgWriter(wxOutputStream& out, const wxSize& dpi)
+      : m_out(out), m_dpi(dpi)
+    { }
 
-        wxUnusedVar(element);
-    }
+    SvgWriter(const SvgWriter&) = delete;
+    SvgWriter& operator=(const SvgWriter&) = delete;
+    SvgWriter(SvgWriter&&) = delete;
+    SvgWriter& operator=(SvgWriter&&) = delete;
 
-    return count;
-}
+    /// Collect the styles used by the element, must be called for all of
+    /// them before WriteHeader().
+    void Add(const GraphElement& element);
 
-} // anonymous namespace
+    /// Write the document header, including the style definitions.
+    void WriteHeader(const wxRect& bounds);
+    /// Write one element, in the same order as they were added.
+    void Write(const GraphElement& element);
+    /// Write the document end and flush the output.
+    bool WriteFooter();
 
-size_t Graph::GetNodeCount() const
-{
-    return GetCount(GetNodes());
-}
+private:
+    /// The classes used by an element.
+    struct Item
+    {
+        int shape;      ///< Index of the line and fill class.
+        int text;       ///< Index of the text class or -1.
+        int marker;     ///< Index of the arrowhead marker or -1.
+    };
 
-size_t Graph::GetElementCount() const
-{
-    return GetCount(GetElements());
-}
+    typedef std::unordered_map<wxString, int,
+                               wxStringHash, wxStringEqual> StyleMap;
+
+    /// Return the index of the definition in the map, adding it if needed.
+    static int GetIndex(StyleMap& map, const wxString& def);
+
+    /// Return the colour in the SVG syntax, or "none" if it's transparent.
+    static wxString Colour(const wxColour& colour);
+    /// Escape the XML special characters in the text and drop the
+    /// characters which can't appear in an XML document at all.
+    static wxString Escape(const wxString& text);
+    /// Quote the text as a CSS string.
+    static wxString CssString(const wxString& text);
+    /// Format a coordinate.
+    static wxString Coord(double value)
+        { return wxString::FromCDouble(value, 1); }
+
+    void WriteNode(const GraphNode& node, const Item& item);
+    void WriteEdge(const GraphEdge& edge, const Item& item);
+    void WriteDefs(const StyleMap& map, const wxString& prefix);
+
+    /// Append to the output buffer, writing it out when it grows large.
+    void Out(const wxString& str);
+    void Flush();
+
+    wxOutputStream& m_out;
+    wxSize m_dpi;
+    wxString m_buf;
+
+    StyleMap m_shapes;          ///< Stroke and fill definitions.
+    StyleMap m_texts;           ///< Font and text colour definitions.
+    StyleMap m_markers;         ///< Arrowhead markers.
+    std::vector<Item> m_items;  ///< Classes of the added elements.
+    size_t m_next = 0;          ///< Index of the next item to write.
+};
 
-size_t Graph::GetSelectionCount() const
+int SvgWriter::GetIndex(StyleMap& map, const wxString& def)
 {
-    return GetCount(GetSelection());
-}
+    const auto it = map.find(def);
+    if (it != map.end())
+        return it->second;
 
-size_t Graph::GetSelectionNodeCount() const
-{
-    return GetCount(GetSelectionNodes());
+    const int index = int(map.size());
+    map[def] = index;
+    return index;
 }
 
-bool Graph::LayoutAll(const GraphNode *fixed, double ranksep, double nodesep)
+wxString SvgWriter::Colour(const wxColour& colour)
 {
-    return Layout(GetNodes(), fixed, ranksep, nodesep);
+    if (!colour.IsOk() || colour.Alpha() == wxALPHA_TRANSPARENT)
+        return _T("none");
+    return colour.GetAsString(wxC2S_HTML_SYNTAX);
 }
 
-bool Graph::Layout(const node_iterator_pair& range,
-                   const GraphNode *fixed,
-                   double ranksep,
-                   double nodesep)
+wxString SvgWriter::Escape(const wxString& text)
 {
-    wxString dot;
+    wxString result;
+    result.reserve(text.length());
 
-    // Create a dot file for all the nodes in the range and the edges that
-    // connect that. To find the edges, first put all the nodes into a set,
-    // then iterate over all the edges of the nodes, looking for the edges
-    // which connect nodes in the set.
-    dot << _T("digraph Project {\n");
-    dot << _T("\tnodesep=") << nodesep << _T("\n");
-    dot << _T("\tranksep=") << ranksep << _T("\n");
-    dot << _T("\tnode [label=\"\", shape=box, fixedsize=true];\n");
+    for (const auto ch : text) {
+        const wxUniChar::value_type value = ch.GetValue();
 
-    wxSize dpi = wxSize(int(Points::Inch), int(Points::Inch));
-    bool findFixed = fixed == NULL;
-    bool externalConnection = false;
+        switch (value) {
+            case '&':   result += _T("&amp;");  break;
+            case '<':   result += _T("&lt;");   break;
+            case '>':   result += _T("&gt;");   break;
+            case '"':   result += _T("&quot;"); break;
+            case '\t':
+            case '\n':
+            case '\r':  result += ch;           break;
+            default:
+                // the other control characters and the non-characters
+                // U+FFFE and U+FFFF are not allowed by XML 1.0
+                if (value >= 0x20 && value != 0xFFFE && value != 0xFFFF)
+                    result += ch;
+        }
+    }
 
-    typedef multiset<const GraphNode*, ElementCompare> NodeSet;
-    typedef multiset<const GraphEdge*, ElementCompare> EdgeSet;
-    typedef set< pair<wxString, const GraphNode*> > RankSet;
-    NodeSet nodeset;
-    EdgeSet edgeset;
-    RankSet rankset;
+    return result;
+}
 
-    // First put the nodes into a set. The ElementCompare functor puts them
-    // into the order they appear on the screen, which avoids the nodes
-    // being randomly reordered on screen.
-    for (const auto& node : MakeRange(range))
-        nodeset.insert(&node);
+wxString SvgWriter::CssString(const wxString& text)
+{
+    wxString result = _T("'");
 
-    // Now iterate over all the edges of all the nodes
-    for (const GraphNode* node : nodeset) {
-        bool extCon = false;
+    for (const auto ch : text) {
+        const wxUniChar::value_type value = ch.GetValue();
 
-        for (const auto& edge : MakeRange(node->GetEdges())) {
-            const GraphNode *n1 = edge.GetFrom(), *n2 = edge.GetTo();
+        if (value < 0x20 || value == 0x7F || value == 0xFFFE || value == 0xFFFF)
+            continue;
 
-            // looking for edges which connect nodes in the set
-            if (nodeset.count(n1 != node ? n1 : n2)) {
-                // each edge will be found twice, but only add it once
-                if (n1 == node)
-                    edgeset.insert(&edge);
-            }
-            else {
-                extCon = true;
-            }
-        }
+        // besides the quote and the backslash, escape the closing bracket
+        // as the style sheet is inside a CDATA section ended by "]]>"
+        if (value == '\\' || value == '\'' || value == ']')
+            result << _T("\\") << wxString::Format(_T("%x "), unsigned(value));
+        else
+            result += ch;
+    }
 
-        // If the range is a subset of the whole graph, and one of the nodes
-        // has an edge to another node outside the range, then hold that
-        // node fixed when doing the layout. Otherwise just fix the top-left-
-        // most node.
-        if (findFixed &&
-            (!fixed || (!externalConnection && extCon) ||
-             (externalConnection == extCon &&
-              node->GetPosition() < fixed->GetPosition())))
-        {
-            fixed = node;
-            externalConnection = extCon;
-        }
+    return result + _T("'");
+}
 
-        wxSize size = node->GetSize<Points>();
+void SvgWriter::Add(const GraphElement& element)
+{
+    Item item = { 0, -1, -1 };
+    wxString def;
 
-        // add the node to the dot file
-        dot << _T("\t") << NodeName(*node)
-            << _T(" [width=\"") << double(size.x) / dpi.x
-            << _T("\", height=\"") << double(size.y) / dpi.y
-            << _T("\"]\n");
+    if (const GraphEdge *edge = wxDynamicCast(&element, GraphEdge)) {
+        def << _T("stroke:") << Colour(edge->GetColour())
+            << _T(";stroke-width:") << edge->GetLineWidth()
+            << _T(";fill:none");
 
-        if (!node->GetRank().empty())
-            rankset.insert(make_pair(node->GetRank(), node));
+        wxLineShape *line = edge->GetShape();
+        if (line && !line->GetArrows().empty()) {
+            wxString marker;
+            marker << Colour(edge->GetColour()) << _T(" ")
+                   << edge->GetArrowSize();
+            item.marker = GetIndex(m_markers, marker);
+        }
     }
-
-    nodeset.clear();
-
-    wxString rank;
-    for (RankSet::iterator it = rankset.begin(); it != rankset.end(); ++it)
-    {
-        if (it->first != rank) {
-            if (!rank.empty())
-                dot << _T("\t}\n");
-            rank = it->first;
-            dot << _T("\tsubgraph {\n\t\trank = same;\n");
+    else if (const GraphNode *node = wxDynamicCast(&element, GraphNode)) {
+        def << _T("stroke:") << Colour(node->GetColour())
+            << _T(";stroke-width:1;fill:")
+            << Colour(node->GetBackgroundColour());
+
+        if (!node->GetText().empty()) {
+            const wxFont font = node->GetFont();
+            wxString text;
+
+            text << _T("font-family:") << CssString(font.GetFaceName())
+                 << _T(";font-size:")
+                 << Coord(font.GetFractionalPointSize() * m_dpi.y / 72.0)
+                 << _T("px;fill:") << Colour(node->GetTextColour());
+            if (font.GetWeight() >= wxFONTWEIGHT_BOLD)
+                text << _T(";font-weight:bold");
+            if (font.GetStyle() != wxFONTSTYLE_NORMAL)
+                text << _T(";font-style:italic");
+
+            item.text = GetIndex(m_texts, text);
         }
-        dot << _T("\t\t") << NodeName(*it->second) << _T(";\n");
     }
-    if (!rank.empty())
-        dot << _T("\t}\n");
 
-    rankset.clear();
+    item.shape = GetIndex(m_shapes, def);
+    m_items.push_back(item);
+}
 
-    // Now add the edges. These are also sorted by ElementCompare into the
-    // order they appear on the screen, to avoid the nodes being reordered
-    // too much.
-    for (EdgeSet::iterator it = edgeset.begin(); it != edgeset.end(); ++it)
-        dot << _T("\t") << NodeName(*(*it)->GetFrom())
-            << _T(" -> ") << NodeName(*(*it)->GetTo())
-            << _T(";\n");
+void SvgWriter::WriteDefs(const StyleMap& map, const wxString& prefix)
+{
+    for (const auto& def : map)
+        Out(wxString::Format(_T(".%s%d{%s}\n"), prefix, def.second, def.first));
+}
 
-    dot << _T("}\n");
+void SvgWriter::WriteHeader(const wxRect& bounds)
+{
+    Out(_T("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"));
+    Out(wxString::Format(
+        _T("<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\" ")
+        _T("width=\"%d\" height=\"%d\" viewBox=\"%d %d %d %d\">\n"),
+        bounds.width, bounds.height,
+        bounds.x, bounds.y, bounds.width, bounds.height));
 
-    edgeset.clear();
+    Out(_T("<defs>\n<style type=\"text/css\"><![CDATA[\n"));
+    WriteDefs(m_shapes, _T("s"));
+    WriteDefs(m_texts, _T("t"));
+    Out(_T("text{text-anchor:middle;dominant-baseline:central}\n"));
+    Out(_T("]]></style>\n"));
 
-#ifdef NO_GRAPHVIZ
-    wxLogError(_("No layout engine available"));
-    return false;
-#else // using graphviz
-    Agraph_t *graph;
-    bool ok;
-    GVC_t *context;
+    for (const auto& def : m_markers) {
+        const wxString colour = def.first.BeforeFirst(' ');
+        const wxString size = def.first.AfterFirst(' ');
 
-    {
-        class GraphVizContext
-        {
-        public:
-            GraphVizContext()
-                : context(gvContext())
-            {
-            }
-            ~GraphVizContext() {
-                gvFreeContext(context);
-            }
-            GVC_t* get() {
-                return context;
-            }
+        Out(wxString::Format(
+            _T("<marker id=\"m%d\" viewBox=\"0 0 10 10\" refX=\"10\" ")
+            _T("refY=\"5\" markerUnits=\"userSpaceOnUse\" ")
+            _T("markerWidth=\"%s\" markerHeight=\"%s\" orient=\"auto\">")
+            _T("<path d=\"M0,0L10,5L0,10z\" fill=\"%s\"/></marker>\n"),
+            def.second, size, size, colour));
+    }
 
-            GraphVizContext(const GraphVizContext&) = delete;
-            GraphVizContext(GraphVizContext&&) = delete;
-            GraphVizContext& operator=(const GraphVizContext&) = delete;
-            GraphVizContext& operator=(GraphVizContext&&) = delete;
+    Out(_T("</defs>\n"));
+}
 
-        private:
-            GVC_t* const context;
-        };
+void SvgWriter::Write(const GraphElement& element)
+{
+    wxCHECK_RET(m_next < m_items.size(), _T("element wasn't added"));
+    const Item& item = m_items[m_next++];
 
-#ifdef SUPPRESS_GRAPHVIZ_MEMLEAKS
-        // memory allocated during GraphVizContext creation is never freed so
-        // VC++ debug CRT reports it as leaked which is not really true as this
-        // is a one-time only allocation and, anyhow, we can do nothing about
-        // it, so just suppress the CRT reports about it
-        class NoLeakCheck
-        {
-        public:
-            NoLeakCheck() : flags(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG)) {
-                _CrtSetDbgFlag(flags & ~_CRTDBG_ALLOC_MEM_DF);
-            }
-            ~NoLeakCheck() {
-                _CrtSetDbgFlag(flags);
-            }
-        private:
-            int flags;
-        };
+    if (const GraphEdge *edge = wxDynamicCast(&element, GraphEdge))
+        WriteEdge(*edge, item);
+    else if (const GraphNode *node = wxDynamicCast(&element, GraphNode))
+        WriteNode(*node, item);
+}
 
-        NoLeakCheck noCheck;
-#endif // SUPPRESS_GRAPHVIZ_MEMLEAKS
+void SvgWriter::WriteNode(const GraphNode& node, const Item& item)
+{
+    const wxRect rc = node.GetBounds();
+    const wxString cls = wxString::Format(_T(" class=\"s%d\"/>\n"), item.shape);
+
+    const int cx = rc.x + rc.width / 2;
+    const int cy = rc.y + rc.height / 2;
 
-        static GraphVizContext theContext;
-        context = theContext.get();
+    switch (node.GetStyle()) {
+        case GraphNode::Style_Elipse:
+            Out(wxString::Format(
+                _T("<ellipse cx=\"%d\" cy=\"%d\" rx=\"%d\" ry=\"%d\""),
+                cx, cy, rc.width / 2, rc.height / 2) + cls);
+            break;
 
-        // parse the dot file
-        graph = agmemread(unconst(dot.mb_str()));
-        wxCHECK(graph, false);
+        case GraphNode::Style_Triangle:
+            Out(wxString::Format(
+                _T("<polygon points=\"%d,%d %d,%d %d,%d\""),
+                cx, rc.y, rc.GetRight(), rc.GetBottom(),
+                rc.x, rc.GetBottom()) + cls);
+            break;
 
-        // do the layout
-        ok = gvLayout(context, graph, (char*)"dot") == 0;
+        case GraphNode::Style_Diamond:
+            Out(wxString::Format(
+                _T("<polygon points=\"%d,%d %d,%d %d,%d %d,%d\""),
+                cx, rc.y, rc.GetRight(), cy,
+                cx, rc.GetBottom(), rc.x, cy) + cls);
+            break;
+
+        default:
+            // also used for the custom styles, drawn by OnDraw() overrides
+            Out(wxString::Format(
+                _T("<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\""),
+                rc.x, rc.y, rc.width, rc.height) + cls);
     }
 
-    if (ok)
-    {
-        double offsetX = 0;
-        double offsetY = 0;
+    if (item.text < 0)
+        return;
 
-        if (fixed) {
-            Agnode_t *n = agfindnode(graph, unconst(NodeName(*fixed).mb_str()));
-            if (n) {
-                pointf pos = ND_coord(n);
-                double x = PS2INCH(pos.x) * dpi.x;
-                double y = - PS2INCH(pos.y) * dpi.y;
-                wxPoint pt = fixed->GetPosition<Points>();
-                offsetX = pt.x - x;
-                offsetY = pt.y - y;
-            }
-        }
+    const wxArrayString lines = wxSplit(node.GetText(), '\n', '\0');
+    constexpr double LINE_HEIGHT = 1.2;
 
-        for (Agnode_t *n = agfstnode(graph); n; n = agnxtnode(graph, n))
-        {
-            pointf pos = ND_coord(n);
-            int x = int(offsetX + PS2INCH(pos.x) * dpi.x);
-            int y = int(offsetY - PS2INCH(pos.y) * dpi.y);
-#ifdef WITH_CGRAPH
-            const char* const name = agnameof(n);
-#else // old Graphviz (< 2.30) without cgraph
-            const char* const name = n->name;
-#endif
-            GraphNode *node;
-            if (sscanf(name, "n%p", &node) == 1)
-                node->SetPosition<Points>(wxPoint(x, y));
-        }
+    Out(wxString::Format(_T("<text class=\"t%d\" x=\"%d\" y=\"%d\">"),
+                         item.text, cx, cy));
 
-        gvFreeLayout(context, graph);
-    }
-    else {
-        wxLogError(_(
-"An error occurred laying out the graph with dot.\
- Please check the installation of the graphviz library and\
- its configuration file 'PREFIX/lib/graphviz/config'"
-                    ));
+    for (size_t i = 0; i < lines.size(); i++) {
+        const double dy = i ? LINE_HEIGHT : -LINE_HEIGHT * (lines.size() - 1) / 2;
+        Out(wxString::Format(_T("<tspan x=\"%d\" dy=\"%sem\">%s</tspan>"),
+                             cx, Coord(dy), Escape(lines[i])));
     }
 
-    agclose(graph);
-    return ok;
-#endif // NO_GRAPHVIZ/using graphviz
+    Out(_T("</text>\n"));
 }
 
-void Graph::Select(const iterator_pair& range)
+void SvgWriter::WriteEdge(const GraphEdge& edge, const Item& item)
 {
-    iterator i, j, end;
-    tie(i, end) = range;
+    wxLineShape *line = edge.GetShape();
 
-    while (i != end) {
-        j = i++;
-        j->Select();
-    }
+    if (!line || line->GetLineControlPoints().size() < 2)
+        return;
+
+    Out(wxString::Format(_T("<polyline class=\"s%d\""), item.shape));
+    if (item.marker >= 0)
+        Out(wxString::Format(_T(" marker-end=\"url(#m%d)\""), item.marker));
+    Out(_T(" points=\""));
+
+    for (const auto& pt : line->GetLineControlPoints())
+        Out(Coord(pt.x) + _T(",") + Coord(pt.y) + _T(" "));
+
+    Out(_T("\"/>\n"));
 }
 
-void Graph::Unselect(const iterator_pair& range)
+void SvgWriter::Out(const wxString& str)
 {
-    iterator i, j, end;
-    tie(i, end) = range;
+    constexpr size_t FLUSH_SIZE = 64 * 1024;
 
-    while (i != end) {
-        j = i++;
-        j->Unselect();
-    }
+    m_buf += str;
+    if (m_buf.length() >= FLUSH_SIZE)
+        Flush();
 }
 
-void Graph::SetSnapToGrid(bool snap)
+void SvgWriter::Flush()
 {
-    m_diagram->SetSnapToGrid(snap);
+    const wxScopedCharBuffer utf8 = m_buf.utf8_str();
+    m_out.Write(utf8.data(), utf8.length());
+    m_buf.clear();
 }
 
-bool Graph::GetSnapToGrid() const
+bool SvgWriter::WriteFooter()
 {
-    return m_diagram->GetSnapToGrid();
+    Out(_T("</svg>\n"));
+    Flush();
+    return m_out.IsOk();
 }
 
-void Graph::SetGridSpacing(int spacing)
-{
-    if (spacing < 1)
-        spacing = 1;
+} // namespace
 
-#ifdef oglHAVE_XY_GRID
-    int xspacing = wxRound(double(spacing) * m_dpi.x / m_dpi.y);
-    if (xspacing < 1)
-        xspacing = 1;
-    m_diagram->SetGridSpacing(xspacing, spacing);
-#else
-    m_diagram->SetGridSpacing(spacing);
-#endif
+bool Graph::Export(wxOutputStream& out,
+                   ExportFormat format,
+                   const iterator_pair& range)
+{
+    wxCHECK_MSG(format == Export_SVG, false, _T("unsupported export format"));
 
-    wxShapeCanvas *canvas = m_diagram->GetCanvas();
-    if (canvas)
-        canvas->Refresh();
-}
+    const iterator_pair elements = range == iterator_pair() ? GetElements()
+                                                            : range;
+    SvgWriter writer(out, GetDPI());
+    wxRect bounds;
 
-wxSize Graph::GetGridSpacing() const
-{
-    wxSize spacing;
-    double x, y;
+    for (auto& element : MakeRange(elements)) {
+        writer.Add(element);
+        bounds.Union(element.GetBounds());
+    }
 
-#ifdef oglHAVE_XY_GRID
-    m_diagram->GetGridSpacing(&x, &y);
-#else
-    x = y = m_diagram->GetGridSpacing();
-#endif
+    // leave room for the outlines drawn on the bounds
+    constexpr int EXPORT_MARGIN = 4;
+    bounds.Inflate(EXPORT_MARGIN);
 
-    spacing.x = wxRound(x);
-    spacing.y = wxRound(y);
+    writer.WriteHeader(bounds);
+    for (auto& element : MakeRange(elements))
+        writer.Write(element);
 
-    return spacing;
-}
+    if (!writer.WriteFooter()) {
+        wxLogError(_("Failed to write the graph image"));
+        return false;
+    }
 
-bool Graph::CanClear() const
-{
-    const_iterator_pair its = GetSelection();
-    return its.first == its.second;
+    return true;
 }
 
-bool Graph::Serialise(wxOutputStream& stream, const iterator_pair& range)
+bool Graph::Serialise(wxOutputStream& stream,
+                      const iterator_pair& range,
+                      Archive::Format format)
 {
     Archive archive;
-    return Serialise(archive, range) && archive.Save(stream);
+    return Serialise(archive, range) && archive.Save(stream, format);
 }
 
 bool Graph::Serialise(Archive& archive, const iterator_pair& range)
@@ -3150,14 +8305,13 @@ bool Graph::Serialise(Archive& archive, const iterator_pair& range)
         Factory<GraphElement> factory(elem);
 
         if (factory) {
-            wxString name = factory.GetName();
-            wxString id = Archive::MakeId(&elem);
+            const wxString& name = factory.GetName();
 
-            Archive::Item *arc = archive.Put(name, id);
+            Archive::Item *arc = archive.PutObject(name, &elem);
             wxASSERT(arc);
 
             if (!elem.Serialise(*arc))
-                archive.Remove(id);
+                archive.Remove(arc->GetId());
             else
                 rcBounds += elem.GetBounds();
         }
@@ -3180,6 +8334,10 @@ bool Graph::Serialise(Archive& archive, const iterator_pair& range)
     graph->Put(TAGSNAP, GetSnapToGrid());
     graph->Put(TAGBOUNDS, Twips::From<Pixels>(rcBounds, GetDPI()));
 
+    // the layouts are only worth keeping with the whole graph
+    if (m_layoutCache && range == iterator_pair())
+        graph->Put(TAGLAYOUT, m_layoutCache->ToString());
+
     if (badfactory) {
         wxLogError(_("Internal error, not all elements could be saved"));
     }
@@ -3189,33 +8347,62 @@ bool Graph::Serialise(Archive& archive, const iterator_pair& range)
 
 bool Graph::Deserialise(wxInputStream& stream)
 {
+    // the loader only clears the graph once it has read the graph item
+    GraphUpdateLocker noUpdates(*this);
     Archive archive;
-    return archive.Load(stream) && Deserialise(archive);
+    GraphLoader loader(*this, archive, true);
+    return FinishDeserialise(loader, archive.Load(stream, &loader));
 }
 
-bool Graph::Deserialise(Archive& archive)
+bool Graph::Deserialise(const wxString& path)
 {
-    New();
-    Archive::Item *item = archive.Get(TAGGRAPH);
+    // Don't lose the current graph if the file can't be read at all.
+    if (!wxFile::Access(path, wxFile::read)) {
+        wxLogError(_("Cannot open file '%s'."), path.c_str());
+        return false;
+    }
+
+    GraphUpdateLocker noUpdates(*this);
+    Archive archive;
+    GraphLoader loader(*this, archive, true);
+    return FinishDeserialise(loader, archive.Load(path, &loader));
+}
 
-    if (item) {
-        wxFont font;
-        if (item->Get(TAGFONT, font))
-            SetFont(font);
+bool Graph::FinishDeserialise(GraphLoader& loader, bool ok)
+{
+    if (ok)
+        loader.Finish();
+    else if (loader.IsStarted())
+        New();  // don't leave a part of the graph behind
 
-        int spacing;
-        if (item->Get(TAGGRID, spacing))
-            SetGridSpacing<Twips>(spacing);
+    // nothing was read, the graph and its undo history are unchanged
+    if (!loader.IsStarted())
+        return ok;
 
-        bool snap;
-        if (item->Get(TAGSNAP, snap))
-            SetSnapToGrid(snap);
+    // loading the graph can't be undone, forget the elements it added
+    m_journal->Clear();
 
-        if (item->GetInstance() == NULL)
-            item->SetInstance(new GraphInfo, true);
+    GraphCtrl *ctrl = GetCtrl();
+    if (ctrl) {
+        ctrl->SetZoom(100.0);
+        ctrl->Home();
     }
 
+    return ok;
+}
+
+bool Graph::Deserialise(Archive& archive)
+{
+    New();
+
+    GraphUpdateLocker noUpdates(*this);
+    Archive::Item *item = archive.Get(TAGGRAPH);
+
+    if (item)
+        RestoreSettings(*item);
+
     bool ok = DeserialiseInto(archive, wxPoint());
+    m_journal->Clear();
 
     GraphCtrl *ctrl = GetCtrl();
     if (ctrl) {
@@ -3228,61 +8415,130 @@ bool Graph::Deserialise(Archive& archive)
 
 bool Graph::DeserialiseInto(wxInputStream& stream, const wxPoint& pt)
 {
+    GraphUpdateLocker noUpdates(*this);
     Archive archive;
-    return archive.Load(stream) && DeserialiseInto(archive, pt);
+    GraphLoader loader(*this, archive, false, pt);
+
+    if (!archive.Load(stream, &loader))
+        return false;
+
+    loader.Finish();
+    return true;
+}
+
+bool Graph::DeserialiseInto(Archive& archive, const wxPoint& pt)
+{
+    GraphUpdateLocker noUpdates(*this);
+    Archive::Item *item = archive.Get(TAGGRAPH);
+
+    if (item)
+        PrepareImport(*item, pt);
+
+    // decode the images in parallel first, only the elements and their
+    // shapes need creating here
+    archive.DecodeImages();
+
+    for (const auto& elem : MakeRange(archive.GetItems(SORT_ELEMENT)))
+        DeserialiseElement(*elem.second);
+
+    return true;
+}
+
+void Graph::RestoreSettings(Archive::Item& item)
+{
+    wxFont font;
+    if (item.Get(TAGFONT, font))
+        SetFont(font);
+
+    int spacing;
+    if (item.Get(TAGGRID, spacing))
+        SetGridSpacing<Twips>(spacing);
+
+    bool snap;
+    if (item.Get(TAGSNAP, snap))
+        SetSnapToGrid(snap);
+
+    wxString layouts;
+    if (item.Get(TAGLAYOUT, layouts))
+        m_layoutCache = LayoutCache::FromString(layouts);
+
+    if (item.GetInstance() == NULL)
+        item.SetInstance(new GraphInfo, true);
 }
 
-bool Graph::DeserialiseInto(Archive& archive, const wxPoint& pt)
+void Graph::PrepareImport(Archive::Item& item, const wxPoint& pt)
 {
-    Archive::Item *item = archive.Get(TAGGRAPH);
+    if (item.GetInstance() != NULL)
+        return;
+
     GraphCanvas *canvas = GetCanvas();
+    wxFont font;
 
-    if (item && item->GetInstance() == NULL) {
-        wxFont font;
+    if (item.Get(TAGFONT, font)) {
+        wxString curdesc = canvas->GetFont().GetNativeFontInfoDesc();
+        wxString newdesc = font.GetNativeFontInfoDesc();
 
-        if (item->Get(TAGFONT, font)) {
-            wxString curdesc = canvas->GetFont().GetNativeFontInfoDesc();
-            wxString newdesc = font.GetNativeFontInfoDesc();
+        if (newdesc == curdesc)
+            font = wxFont();
+    }
 
-            if (newdesc == curdesc)
-                font = wxFont();
-        }
+    wxRect rc;
+    wxPoint offset;
 
-        wxRect rc;
-        wxPoint offset;
+    if (item.Get(TAGBOUNDS, rc)) {
+        rc = Twips::To<Pixels>(rc, GetDPI());
+        offset = pt - (rc.GetPosition() + rc.GetSize() / 2);
+    }
 
-        if (item->Get(TAGBOUNDS, rc)) {
-            rc = Twips::To<Pixels>(rc, GetDPI());
-            offset = pt - (rc.GetPosition() + rc.GetSize() / 2);
-        }
+    item.SetInstance(new GraphInfo(font, offset), true);
+}
+
+GraphElement *Graph::DeserialiseElement(Archive::Item& arc)
+{
+    // the factory is resolved once per class and kept with the archive
+    const FactoryClassData *data =
+        dynamic_cast<FactoryClassData*>(arc.GetClassData());
+    impl::FactoryBase *base = data ? data->GetFactory() : NULL;
 
-        item->SetInstance(new GraphInfo(font, offset), true);
+    if (!base) {
+        Factory<GraphElement> named(arc.GetClass());
+        if (!named)
+            return NULL;
+        base = named.GetImpl();
+        arc.SetClassData(new FactoryClassData(base));
     }
 
-    for (const auto& elem : MakeRange(archive.GetItems(SORT_ELEMENT))) {
-        wxString sortkey = elem.first;
-        Archive::Item *arc = elem.second;
+    Factory<GraphElement> factory(base);
 
-        wxString classname = arc->GetClass();
-        Factory<GraphElement> factory(classname);
+    if (!factory)
+        return NULL;
 
-        if (factory) {
-            GraphElement *element = factory.New();
-            wxShape *shape = element->EnsureShape();
+    GraphElement *element = factory.New();
+    wxShape *shape = element->EnsureShape();
 
-            m_diagram->AddShape(shape);
+    m_diagram->AddShape(shape);
 
-            if (element->Serialise(*arc))
-                element->Layout();
-            else
-                Delete(element);
-        }
-    }
+    GraphNode *node = wxDynamicCast(element, GraphNode);
+    if (node)
+        InsertIndex(*node);
 
-    return true;
+    m_journal->Suspend();
+    bool ok = element->Serialise(arc);
+    if (ok)
+        element->Layout();
+    else
+        Delete(element);
+    m_journal->Resume();
+
+    if (!ok)
+        return NULL;
+
+    arc.SetInstance(element);
+    m_journal->Added(*element);
+    return element;
 }
 
-wxPoint Graph::FindSpace(const wxSize& spacing, int columns)
+wxPoint Graph::GetSpaceStart(const wxSize& spacing) const
 {
     wxRect rc;
 
@@ -3294,12 +8550,10 @@ wxPoint Graph::FindSpace(const wxSize& spacing, int columns)
     wxPoint pt(0, rc.IsEmpty() ? 0 : rc.GetBottom());
     pt += spacing / 2;
 
-    return FindSpace(pt, spacing, columns);
+    return pt;
 }
 
-wxPoint Graph::FindSpace(const wxPoint& position,
-                         const wxSize& spacing,
-                         int columns)
+int Graph::GetSpaceColumns(const wxSize& spacing, int columns) const
 {
     if (columns < 1) {
         columns = 4;
@@ -3313,45 +8567,70 @@ wxPoint Graph::FindSpace(const wxPoint& position,
         }
     }
 
-    constexpr int BITSET_SIZE = 8192;
-    bitset<BITSET_SIZE> grid;
-    const int rows = BITSET_SIZE / columns;
+    return columns;
+}
 
-    wxPoint offset = position;
-    offset -= spacing / 2;
-    offset = -offset;
+wxPoint Graph::FindSpace(const wxSize& spacing, int columns)
+{
+    return FindSpace(GetSpaceStart(spacing), spacing, columns);
+}
 
-    for (const auto& node : MakeRange(GetNodes())) {
-        wxRect rc = node.GetBounds();
-        rc.Offset(offset);
-
-        wxPoint pt1 = rc.GetTopLeft();
-        pt1.x /= spacing.x;
-        pt1.y /= spacing.y;
-        pt1.x = between(pt1.x, 0, columns);
-        pt1.y = between(pt1.y, 0, rows);
-
-        wxPoint pt2 = rc.GetBottomRight();
-        pt2.x = (pt2.x + spacing.x - 1) / spacing.x;
-        pt2.y = (pt2.y + spacing.y - 1) / spacing.y;
-        pt2.x = between(pt2.x, 0, columns);
-        pt2.y = between(pt2.y, 0, rows);
-
-        for (int y = pt1.y; y < pt2.y; y++) {
-            for (int x = pt1.x; x < pt2.x; x++) {
-                int i = y * columns + x;
-                wxASSERT(i >= 0 && size_t(i) < grid.size());
-                grid[i] = true;
-            }
-        }
+wxPoint Graph::FindSpace(const wxPoint& position,
+                         const wxSize& spacing,
+                         int columns)
+{
+    return FindSpaces(1, position, spacing, columns).front();
+}
+
+vector<wxPoint> Graph::FindSpaces(size_t count,
+                                  const wxSize& spacing,
+                                  int columns)
+{
+    return FindSpaces(count, GetSpaceStart(spacing), spacing, columns);
+}
+
+vector<wxPoint> Graph::FindSpaces(size_t count,
+                                  const wxPoint& position,
+                                  const wxSize& spacing,
+                                  int columns)
+{
+    columns = GetSpaceColumns(spacing, columns);
+
+    vector<wxPoint> spaces;
+    spaces.reserve(count);
+
+    // The slots are tested against the spatial index, which is kept up to
+    // date as the nodes move, so only the slots actually visited cost
+    // anything and there is no limit on the size of the searched area. The
+    // slots already returned are behind the current one, so there's no need
+    // to mark them as used.
+    for (int i = 0; spaces.size() < count; i++) {
+        wxPoint pt = position + wxSize(spacing.x * (i % columns),
+                                       spacing.y * (i / columns));
+
+        if (!m_index->FindOverlap(wxRect(pt - spacing / 2, spacing)))
+            spaces.push_back(pt);
     }
 
-    for (int i = 0; i < BITSET_SIZE; i++)
-        if (!grid[i])
-            return position + wxSize(spacing.x * (i % columns),
-                                     spacing.y * (i / columns));
+    return spaces;
+}
+
+void Graph::SetNodeBitmapCache(bool cache)
+{
+    if (cache == m_nodeBitmapCache)
+        return;
+
+    m_nodeBitmapCache = cache;
+
+    if (!cache) {
+        for (auto& node : MakeRange(GetNodes()))
+            node.m_bitmap = wxBitmap();
+    }
+}
 
-    return position;
+size_t Graph::GetSkippedShapeCount() const
+{
+    return m_diagram->GetSkippedCount();
 }
 
 void Graph::Draw(wxDC *dc, const wxRect& clip) const
@@ -3372,9 +8651,13 @@ IMPLEMENT_DYNAMIC_CLASS(GraphCtrl, wxControl)
 BEGIN_EVENT_TABLE(GraphCtrl, wxControl)
     EVT_SIZE(GraphCtrl::OnSize)
     EVT_CHAR(GraphCtrl::OnChar)
+    EVT_KEY_DOWN(GraphCtrl::OnKey)
+    EVT_KEY_UP(GraphCtrl::OnKey)
     EVT_TIMER(wxID_ANY, GraphCtrl::OnTipTimer)
     EVT_MOTION(GraphCtrl::OnMouseMove)
     EVT_LEAVE_WINDOW(GraphCtrl::OnMouseLeave)
+    EVT_LEFT_UP(GraphCtrl::OnMouseUp)
+    EVT_RIGHT_UP(GraphCtrl::OnMouseUp)
     EVT_MOUSEWHEEL(GraphCtrl::OnMouseWheel)
     EVT_IDLE(GraphCtrl::OnIdle)
 #ifdef __WXGTK__
@@ -3384,11 +8667,16 @@ BEGIN_EVENT_TABLE(GraphCtrl, wxControl)
 END_EVENT_TABLE()
 
 const wxChar GraphCtrl::DefaultName[] = _T("graphctrl");
+const wxColour GraphCtrl::BitmapMaskColour(254, 1, 253);
 int GraphCtrl::sm_leftDrag = GraphCtrl::Drag_Move;
 int GraphCtrl::sm_rightDrag = GraphCtrl::Drag_Connect;
 
 constexpr int TIP_DELAY_MS = 500;
 
+constexpr int NODE_DETAIL_PIXELS = 16;
+constexpr int EDGE_DETAIL_PIXELS = 3;
+constexpr int EDGE_HIDE_PIXELS = 1;
+
 GraphCtrl::GraphCtrl(
         wxWindow *parent,
         wxWindowID winid,
@@ -3398,6 +8686,9 @@ GraphCtrl::GraphCtrl(
         const wxValidator& validator,
         const wxString& name)
   : wxControl(parent, winid, pos, size, style | wxWANTS_CHARS, validator, name),
+    m_idleWork(0),
+    m_idleScheduled(false),
+    m_cursorShift(-1),
     m_canvas(new GraphCanvas(this, winid, wxPoint(0, 0), size, 0)),
     m_graph(NULL),
     m_tiptimer(this),
@@ -3405,35 +8696,150 @@ GraphCtrl::GraphCtrl(
     m_tipdelay(TIP_DELAY_MS),
     m_tipnode(NULL),
     m_tipwin(NULL),
-    m_tipopen(false)
+    m_tipopen(false),
+    m_nodeDetail(NODE_DETAIL_PIXELS),
+    m_edgeDetail(EDGE_DETAIL_PIXELS),
+    m_edgeHide(EDGE_HIDE_PIXELS),
+    m_renderer(Renderer_DC),
+    m_progressiveZoom(false)
 {
 }
 
 GraphCtrl::~GraphCtrl()
 {
+    while (!m_overviews.empty())
+        m_overviews.back()->SetGraphCtrl(NULL);
+
     GraphCtrl::SetGraph(NULL);
     delete m_canvas;
 }
 
+GraphStats GraphCtrl::GetStats()
+{
+#ifdef GRAPH_STATS
+    wxCriticalSectionLocker lock(impl::GetStatsLock());
+    return impl::GetStatsData();
+#else
+    return GraphStats();
+#endif
+}
+
+void GraphCtrl::ResetStats()
+{
+#ifdef GRAPH_STATS
+    wxCriticalSectionLocker lock(impl::GetStatsLock());
+    impl::GetStatsData() = GraphStats();
+#endif
+}
+
 void GraphCtrl::SetGraph(Graph *graph)
 {
-    if (m_graph)
-        m_graph->SetCanvas(NULL);
+    m_canvas->EndProgressiveZoom();
+
+    if (m_graph) {
+        if (m_canvas->IsView())
+            m_graph->RemoveView(m_canvas);
+        else
+            m_graph->SetCanvas(NULL);
+    }
 
     m_graph = graph;
     m_canvas->SetGraph(graph);
 
     if (graph) {
         m_canvas->SetDiagram(graph->m_diagram);
-        graph->SetCanvas(m_canvas);
+
+        // a graph already shown by another control gets another view
+        if (graph->GetCtrl())
+            graph->AddView(m_canvas);
+        else
+            graph->SetCanvas(m_canvas);
     }
     else {
         m_canvas->SetDiagram(NULL);
     }
 
+    for (GraphOverviewCtrl *overview : m_overviews)
+        overview->GraphChanged();
+
     Refresh();
 }
 
+void GraphCtrl::AddOverview(GraphOverviewCtrl *overview)
+{
+    m_overviews.push_back(overview);
+}
+
+void GraphCtrl::RemoveOverview(GraphOverviewCtrl *overview)
+{
+    m_overviews.erase(remove(m_overviews.begin(), m_overviews.end(), overview),
+                      m_overviews.end());
+}
+
+void GraphCtrl::RefreshOverviews(const wxRect& rcGraph)
+{
+    for (GraphOverviewCtrl *overview : m_overviews)
+        overview->GraphRectChanged(rcGraph);
+}
+
+void GraphCtrl::CheckOverviewBounds()
+{
+    for (GraphOverviewCtrl *overview : m_overviews)
+        overview->GraphBoundsChanged();
+}
+
+void GraphCtrl::RefreshOverviewViews()
+{
+    for (GraphOverviewCtrl *overview : m_overviews)
+        overview->ViewChanged();
+}
+
+bool GraphCtrl::SetRenderer(Renderer renderer)
+{
+    if (renderer == m_renderer)
+        return true;
+
+#if wxUSE_GRAPHICS_CONTEXT
+    wxGraphicsRenderer *gr = NULL;
+
+    if (renderer == Renderer_Graphics) {
+#if defined(__WXMSW__) && wxUSE_GRAPHICS_DIRECT2D
+        gr = wxGraphicsRenderer::GetDirect2DRenderer();
+#elif wxUSE_CAIRO
+        gr = wxGraphicsRenderer::GetCairoRenderer();
+#endif
+        if (!gr)
+            gr = wxGraphicsRenderer::GetDefaultRenderer();
+        if (!gr)
+            return false;
+    }
+
+    m_canvas->SetRenderer(gr);
+    m_renderer = renderer;
+    return true;
+#else // !wxUSE_GRAPHICS_CONTEXT
+    return renderer == Renderer_DC;
+#endif // wxUSE_GRAPHICS_CONTEXT
+}
+
+void GraphCtrl::SetNodeDetailThreshold(int pixels)
+{
+    m_nodeDetail = pixels;
+    m_canvas->Refresh();
+}
+
+void GraphCtrl::SetEdgeDetailThreshold(int pixels)
+{
+    m_edgeDetail = pixels;
+    m_canvas->Refresh();
+}
+
+void GraphCtrl::SetEdgeHideThreshold(int pixels)
+{
+    m_edgeHide = pixels;
+    m_canvas->Refresh();
+}
+
 wxSize GraphCtrl::GetDPI() const
 {
     return GetScreenDPI();
@@ -3481,6 +8887,13 @@ double GraphCtrl::GetZoom() const
     return m_canvas->GetScaleX() * 100.0;
 }
 
+void GraphCtrl::SetProgressiveZoom(bool progressive)
+{
+    m_progressiveZoom = progressive;
+    if (!progressive)
+        m_canvas->EndProgressiveZoom();
+}
+
 wxPoint GraphCtrl::GetScrollPosition() const
 {
     return m_canvas->GetScrollPosition();
@@ -3706,8 +9119,20 @@ void GraphCtrl::CloseTip(const wxPoint& pt)
     }
 }
 
-void GraphCtrl::OnIdle(wxIdleEvent&)
+void GraphCtrl::ScheduleIdleWork(int work)
+{
+    m_idleWork |= work;
+
+    if (!m_idleScheduled) {
+        m_idleScheduled = true;
+        CallAfter(&GraphCtrl::DoIdleWork);
+    }
+}
+
+void GraphCtrl::DoIdleWork()
 {
+    m_idleScheduled = false;
+
 #if defined __WXGTK__
     // Don't do anything until the window is realized: there is no need anyhow,
     // and calling CheckTip() below results in debug warnings from wxGTK saying
@@ -3721,18 +9146,48 @@ void GraphCtrl::OnIdle(wxIdleEvent&)
     if (m_canvas->HasCapture())
         return;
 
-    wxMouseState state = wxGetMouseState();
+    if (m_idleWork & Idle_Bounds) {
+        wxMouseState state = wxGetMouseState();
 
-    if (m_canvas->GetCheckBounds() && !state.LeftIsDown()) {
-        m_canvas->CheckBounds();
-        CheckTip(wxPoint(state.GetX(), state.GetY()));
+        if (!state.LeftIsDown()) {
+            m_idleWork &= ~Idle_Bounds;
+
+            if (m_canvas->GetCheckBounds()) {
+                m_canvas->CheckBounds();
+                m_ptTip = wxPoint(state.GetX(), state.GetY());
+                m_idleWork |= Idle_Tip;
+            }
+        }
     }
 
-    if (state.ShiftDown())
-        // FIXME: want a four-way arrow, add an XPM for it
-        m_canvas->SetCursor(wxCURSOR_SIZING);
-    else
-        m_canvas->SetCursor(wxCURSOR_DEFAULT);
+    if (m_idleWork & Idle_Tip) {
+        m_idleWork &= ~Idle_Tip;
+        CheckTip(m_ptTip);
+    }
+
+    if (m_idleWork & Idle_Cursor) {
+        m_idleWork &= ~Idle_Cursor;
+
+        if (m_cursorShift > 0)
+            // FIXME: want a four-way arrow, add an XPM for it
+            m_canvas->SetCursor(wxCURSOR_SIZING);
+        else
+            m_canvas->SetCursor(wxCURSOR_DEFAULT);
+    }
+}
+
+void GraphCtrl::UpdateCursor(bool shift)
+{
+    if (m_cursorShift != int(shift)) {
+        m_cursorShift = shift;
+        ScheduleIdleWork(Idle_Cursor);
+    }
+}
+
+void GraphCtrl::OnIdle(wxIdleEvent&)
+{
+    if (m_idleWork && !m_idleScheduled)
+        DoIdleWork();
 }
 
 void GraphCtrl::OnSize(wxSizeEvent&)
@@ -3786,6 +9241,8 @@ void GraphCtrl::OnMouseWheel(wxMouseEvent& event)
         constexpr double ZOOM_LINE_FACTOR = 10.0;
 
         double factor = pow(ZOOM_BASE, lines / ZOOM_LINE_FACTOR);
+        if (m_progressiveZoom)
+            m_canvas->StartProgressiveZoom();
         SetZoom(GetZoom() * factor, event.GetPosition());
     }
     else {
@@ -3798,10 +9255,26 @@ void GraphCtrl::OnMouseWheel(wxMouseEvent& event)
 
 void GraphCtrl::OnMouseLeave(wxMouseEvent& event)
 {
+    m_idleWork &= ~Idle_Tip;
     CloseTip(event.GetPosition());
     event.Skip();
 }
 
+void GraphCtrl::OnMouseUp(wxMouseEvent& event)
+{
+    // the cursor may have been changed while dragging
+    m_cursorShift = -1;
+    UpdateCursor(event.ShiftDown());
+    event.Skip();
+}
+
+void GraphCtrl::OnKey(wxKeyEvent& event)
+{
+    if (event.GetKeyCode() == WXK_SHIFT)
+        UpdateCursor(event.GetEventType() == wxEVT_KEY_DOWN);
+    event.Skip();
+}
+
 #ifdef __WXGTK__
 
 void GraphCtrl::OnSetFocus(wxFocusEvent& event)
@@ -3825,7 +9298,9 @@ void GraphCtrl::OnMouseMove(wxMouseEvent& event)
         m_tipnode = NULL;
     }
     else {
-        CheckTip(m_canvas->ClientToScreen(event.GetPosition()));
+        m_ptTip = m_canvas->ClientToScreen(event.GetPosition());
+        ScheduleIdleWork(Idle_Tip);
+        UpdateCursor(event.ShiftDown());
     }
 
     event.Skip();
@@ -3932,12 +9407,10 @@ void GraphElement::SetShape(wxShape *shape)
 
         sel = m_shape->Selected();
         if (sel)
-            m_shape->Select(false);
+            GetDiagram(m_shape)->SelectShape(m_shape, false);
 
         if (shape) {
-            wxList *list = canvas->GetDiagram()->GetShapeList();
-            const auto node = list->Find(m_shape)->GetPrevious();
-            prev = node ? static_cast<wxShape*>(node->GetData()) : NULL;
+            prev = GetDiagram(m_shape)->GetPreviousShape(m_shape);
         }
 
         canvas->RemoveShape(m_shape);
@@ -3959,7 +9432,7 @@ void GraphElement::SetShape(wxShape *shape)
             canvas->AddShape(shape, prev);
 
             if (sel)
-                shape->Select(true);
+                GetDiagram(shape)->SelectShape(shape, true);
         }
 
         UpdateShape();
@@ -3987,15 +9460,15 @@ Graph *GraphElement::GetGraph() const
 
 wxSize GraphElement::GetDPI() const
 {
-    return GetScreenDPI();
+    Graph *graph = GetGraph();
+    return graph ? graph->GetDPI() : GetScreenDPI();
 }
 
 void GraphElement::Refresh()
 {
     wxShapeCanvas *canvas = GetCanvas(m_shape);
     if (canvas) {
-        wxInfoDC dc(canvas);
-        canvas->PrepareDC(dc);
+        MeasureDC dc(canvas);
         m_shape->Erase(dc);
     }
 }
@@ -4017,12 +9490,14 @@ void GraphElement::OnDraw(wxDC& dc)
 
 void GraphElement::SetColour(const wxColour& colour)
 {
+    RecordChange(&GraphElement::SetColour, m_colour, colour);
     m_colour = colour;
     Refresh();
 }
 
 void GraphElement::SetBackgroundColour(const wxColour& colour)
 {
+    RecordChange(&GraphElement::SetBackgroundColour, m_bgcolour, colour);
     m_bgcolour = colour;
     Refresh();
 }
@@ -4034,15 +9509,15 @@ void GraphElement::DoSelect(bool select)
         wxShapeCanvas *canvas = GetCanvas(m_shape);
 
         if (canvas) {
-            wxInfoDC dc(canvas);
-            canvas->PrepareDC(dc);
+            MeasureDC dc(canvas);
+            GraphDiagram *diagram = GetDiagram(m_shape);
             if (select) {
-                m_shape->Select(true);
+                diagram->SelectShape(m_shape, true);
                 m_shape->OnEraseControlPoints(dc);
             }
             else {
                 m_shape->OnEraseControlPoints(dc);
-                m_shape->Select(false);
+                diagram->SelectShape(m_shape, false);
             }
         }
     }
@@ -4159,6 +9634,8 @@ wxLineShape *GraphEdge::EnsureShape()
 
 void GraphEdge::SetStyle(int style)
 {
+    RecordChange(&GraphElement::SetStyle, GetStyle(), style);
+
     wxLineShape *line = new wxLineShape;
 
     line->MakeLineControlPoints(2);
@@ -4171,8 +9648,16 @@ void GraphEdge::SetStyle(int style)
     GraphElement::SetStyle(style);
 }
 
+void GraphEdge::SetLineWidth(int width)
+{
+    RecordChange(&GraphEdge::SetLineWidth, m_linewidth, width);
+    m_linewidth = width;
+    Refresh();
+}
+
 void GraphEdge::SetArrowSize(int size)
 {
+    RecordChange(&GraphEdge::SetArrowSize, m_arrowsize, size);
     m_arrowsize = size;
 
     wxLineShape *shape = GetShape();
@@ -4185,6 +9670,46 @@ void GraphEdge::SetArrowSize(int size)
     }
 }
 
+GraphElement::DetailLevel GraphEdge::GetDetailLevel(const wxDC& dc) const
+{
+    Graph *graph = GetGraph();
+    GraphCtrl *ctrl = graph ? graph->GetCtrl(dc) : NULL;
+
+    if (ctrl) {
+        const wxRect rc = GetBounds();
+        const int length = max(dc.LogicalToDeviceXRel(rc.width),
+                               dc.LogicalToDeviceYRel(rc.height));
+
+        if (length < ctrl->GetEdgeHideThreshold())
+            return Detail_Hidden;
+
+        if (GetStyle() != Style_Line &&
+                dc.LogicalToDeviceXRel(GetArrowSize()) <
+                    ctrl->GetEdgeDetailThreshold())
+            return Detail_Low;
+    }
+
+    return Detail_Full;
+}
+
+void GraphEdge::OnDrawLowDetail(wxDC& dc)
+{
+    wxLineShape *line = GetShape();
+
+    if (!line || line->GetLineControlPoints().size() < 2)
+        return;
+
+    const wxOGLPoints& points = line->GetLineControlPoints();
+    vector<wxPoint> pts;
+    pts.reserve(points.size());
+
+    for (const auto& pt : points)
+        pts.push_back(wxPoint(wxRound(pt.x), wxRound(pt.y)));
+
+    dc.SetPen(GetPen());
+    dc.DrawLines(int(pts.size()), pts.data());
+}
+
 bool GraphEdge::MoveFront()
 {
     wxLineShape *line = GetShape();
@@ -4193,17 +9718,7 @@ bool GraphEdge::MoveFront()
     if (!canvas)
         return false;
 
-    wxDiagram *diagram = canvas->GetDiagram();
-    wxList *list = diagram->GetShapeList();
-    wxList::iterator it = list->end();
-
-    while (it != list->begin()) {
-        if (*--it == line) {
-            list->erase(it);
-            list->push_front(line);
-            break;
-        }
-    }
+    GetDiagram(line)->LowerShape(line);
 
     return true;
 }
@@ -4232,21 +9747,18 @@ bool GraphEdge::Serialise(Archive::Item& arc)
         GraphNode *from = archive.GetInstance<GraphNode>(idFrom);
         GraphNode *to = archive.GetInstance<GraphNode>(idTo);
 
-        if (!ShowLine(GetShape(), from, to) || !MoveFront())
+        if (!ShowLine(GetShape(), from, to))
+            return false;
+
+        UpdateEdgeCounts(1);
+
+        if (!MoveFront())
             return false;
     }
 
     return true;
 }
 
-impl::GraphIteratorImpl *GraphEdge::IterImpl(
-    GraphLineShape *line,
-    wxClassInfo *classinfo,
-    bool end) const
-{
-    return new PairIterImpl(line, classinfo, end);
-}
-
 size_t GraphEdge::GetNodeCount() const
 {
     size_t count = 0;
@@ -4257,6 +9769,21 @@ size_t GraphEdge::GetNodeCount() const
     return count;
 }
 
+void GraphEdge::UpdateEdgeCounts(int delta) const
+{
+    GraphNode *from = GetFrom();
+    GraphNode *to = GetTo();
+
+    if (from)
+        from->m_outEdgeCount += delta;
+    if (to)
+        to->m_inEdgeCount += delta;
+
+    Graph *graph = GetGraph();
+    if (graph && from && to)
+        graph->UpdateAdjacency(*from, *to, delta);
+}
+
 GraphNode *GraphEdge::GetFrom() const
 {
     wxLineShape *line = GetShape();
@@ -4285,7 +9812,23 @@ GraphNode::GraphNode(const wxString& text,
                      int style)
   : GraphElement(colour, bgcolour, style),
     m_textcolour(textcolour),
-    m_text(text)
+    m_text(text),
+    m_inEdgeCount(0),
+    m_outEdgeCount(0),
+    m_bitmapScale(0)
+{
+}
+
+GraphNode::GraphNode(const GraphNode& node)
+  : GraphElement(node),
+    m_textcolour(node.m_textcolour),
+    m_text(node.m_text),
+    m_tooltip(node.m_tooltip),
+    m_rank(node.m_rank),
+    m_font(node.m_font),
+    m_inEdgeCount(0),
+    m_outEdgeCount(0),
+    m_bitmapScale(0)
 {
 }
 
@@ -4302,37 +9845,25 @@ void GraphNode::DoSelect(bool select)
         wxShapeCanvas *canvas = GetCanvas(shape);
 
         if (canvas) {
-            wxInfoDC dc(canvas);
-            canvas->PrepareDC(dc);
+            MeasureDC dc(canvas);
+
+            GraphDiagram *diagram = GetDiagram(shape);
 
             if (select) {
-                shape->Select(true);
+                diagram->SelectShape(shape, true);
                 shape->OnEraseControlPoints(dc);
 
-                wxRect rc, bounds = GetBounds();
-                Graph::node_iterator begin, it;
-
-                tie(begin, it) = GetGraph()->GetNodes();
-
-                while (it != begin && &*--it != this)
-                    rc.Union(it->GetBounds().Intersect(bounds));
-
-                if (!rc.IsEmpty()) {
-                    rc.x = dc.LogicalToDeviceX(rc.x);
-                    rc.y = dc.LogicalToDeviceY(rc.y);
-                    rc.width = dc.LogicalToDeviceXRel(rc.width);
-                    rc.height = dc.LogicalToDeviceYRel(rc.height);
-                    canvas->RefreshRect(rc);
-                }
+                // the node comes to the front, repaint it if it was covered
+                Graph *graph = GetGraph();
+                if (graph->m_index->FindOverlap(GetBounds(), this))
+                    shape->Erase(dc);
 
-                wxDiagram *diagram = canvas->GetDiagram();
-                wxList *list = diagram->GetShapeList();
-                list->remove(shape);
-                list->push_back(shape);
+                diagram->RaiseShape(shape);
+                graph->RaiseIndex(*this);
             }
             else {
                 shape->OnEraseControlPoints(dc);
-                shape->Select(false);
+                diagram->SelectShape(shape, false);
             }
         }
     }
@@ -4365,6 +9896,96 @@ void GraphNode::SetShape(wxShape *shape)
     }
 }
 
+void GraphNode::Refresh()
+{
+    m_bitmap = wxBitmap();
+    GraphElement::Refresh();
+}
+
+GraphElement::DetailLevel GraphNode::GetDetailLevel(const wxDC& dc) const
+{
+    Graph *graph = GetGraph();
+    GraphCtrl *ctrl = graph ? graph->GetCtrl(dc) : NULL;
+
+    if (ctrl) {
+        const wxRect rc = GetBounds();
+        const int threshold = ctrl->GetNodeDetailThreshold();
+
+        if (dc.LogicalToDeviceXRel(rc.width) < threshold ||
+                dc.LogicalToDeviceYRel(rc.height) < threshold)
+            return Detail_Low;
+    }
+
+    return Detail_Full;
+}
+
+void GraphNode::OnDrawLowDetail(wxDC& dc)
+{
+    dc.SetPen(GetPen());
+    dc.SetBrush(GetBrush());
+    dc.DrawRectangle(GetBounds());
+}
+
+bool GraphNode::DrawCached(wxDC& dc, const wxRect& rc)
+{
+    Graph *graph = GetGraph();
+
+    // only cache what is painted on the screen
+    if (!graph || !graph->IsNodeBitmapCache() || rc.IsEmpty() ||
+            !dc.IsKindOf(CLASSINFO(wxPaintDC)))
+        return false;
+
+    // render for the smallest tier not below the zoom, so that the bitmap
+    // is only ever scaled down
+    static const double tiers[] = { 0.25, 0.5, 1.0, 2.0 };
+    constexpr double EPSILON = 1e-6;
+
+    double scaleX, scaleY;
+    dc.GetUserScale(&scaleX, &scaleY);
+    const double scale = max(scaleX, scaleY);
+
+    const double *it = find_if(begin(tiers), end(tiers),
+                               [scale](double t) { return t + EPSILON >= scale; });
+    if (it == end(tiers))
+        return false;
+
+    const double tier = *it;
+    const wxSize size(int(ceil(rc.width * tier)), int(ceil(rc.height * tier)));
+
+    if (!m_bitmap.IsOk() || m_bitmapScale != tier ||
+            m_bitmapSize != rc.GetSize()) {
+        // the parts of the bitmap not drawn by the node are masked out
+        const wxColour& maskColour = GraphCtrl::BitmapMaskColour;
+
+        m_bitmap = wxBitmap(size);
+        m_bitmapScale = tier;
+        m_bitmapSize = rc.GetSize();
+
+        {
+            wxMemoryDC mdc(m_bitmap);
+            mdc.SetBackground(maskColour);
+            mdc.Clear();
+            mdc.SetUserScale(tier, tier);
+            mdc.SetLogicalOrigin(rc.x, rc.y);
+            mdc.SetFont(GetFont());
+
+            // the whole node must be drawn, not just the part being updated
+            wxRect rcDraw = graph->m_rcDraw;
+            graph->m_rcDraw = wxRect();
+            OnDraw(mdc);
+            graph->m_rcDraw = rcDraw;
+        }
+
+        m_bitmap.SetMask(new wxMask(m_bitmap, maskColour));
+    }
+
+    wxMemoryDC mdc(m_bitmap);
+    dc.StretchBlit(rc.x, rc.y, rc.width, rc.height,
+                   &mdc, 0, 0, size.x, size.y, wxCOPY, true);
+
+    return true;
+}
+
 void GraphNode::SetStyle(int style)
 {
     static const int triangle[][2] = {
@@ -4374,6 +9995,8 @@ void GraphNode::SetStyle(int style)
         { 0, -1 }, { 1, 0 }, { 0, 1 }, { -1, 0 }
     };
 
+    RecordChange(&GraphElement::SetStyle, GetStyle(), style);
+
     wxShape *shape;
 
     switch (style) {
@@ -4406,8 +10029,7 @@ void GraphNode::Layout()
     wxShapeCanvas *canvas = GetCanvas(GetShape());
 
     if (canvas) {
-        wxInfoDC dc(canvas);
-        canvas->PrepareDC(dc);
+        MeasureDC dc(canvas);
         OnLayout(dc);
     }
 }
@@ -4419,8 +10041,7 @@ void GraphNode::SetPosition(const wxPoint& pt)
 
     if (canvas) {
         Graph *graph = GetGraph();
-        wxInfoDC dc(canvas);
-        canvas->PrepareDC(dc);
+        MeasureDC dc(canvas);
         double x = pt.x, y = pt.y;
         canvas->Snap(&x, &y);
 
@@ -4430,16 +10051,23 @@ void GraphNode::SetPosition(const wxPoint& pt)
         graph->SendEvent(event);
 
         if (event.IsAllowed()) {
-            wxPoint ptEv = event.GetPosition();
-            shape->Erase(dc);
-            shape->Move(dc, ptEv.x, ptEv.y, false);
-            shape->Erase(dc);
-            OnLayout(dc);
-            graph->RefreshBounds();
+            wxPoint old = GetPosition();
+            DoSetPosition(dc, event.GetPosition());
+            graph->m_journal->Moved(*this, old);
         }
     }
 }
 
+void GraphNode::DoSetPosition(wxReadOnlyDC& dc, const wxPoint& pt)
+{
+    wxShape *shape = GetShape();
+    shape->Erase(dc);
+    shape->Move(dc, pt.x, pt.y, false);
+    shape->Erase(dc);
+    OnLayout(dc);
+    GetGraph()->UpdateIndex(*this);
+}
+
 void GraphNode::DoSetSize(wxReadOnlyDC& dc, const wxSize& size)
 {
     wxShape *shape = GetShape();
@@ -4448,7 +10076,7 @@ void GraphNode::DoSetSize(wxReadOnlyDC& dc, const wxSize& size)
     shape->ResetControlPoints();
     shape->MoveLinks(dc);
     shape->Erase(dc);
-    GetGraph()->RefreshBounds();
+    GetGraph()->UpdateIndex(*this);
 }
 
 void GraphNode::SetSize(const wxSize& size)
@@ -4463,14 +10091,25 @@ void GraphNode::SetSize(const wxSize& size)
         GetGraph()->SendEvent(event);
 
         if (event.IsAllowed()) {
-            wxInfoDC dc(canvas);
-            canvas->PrepareDC(dc);
+            MeasureDC dc(canvas);
+            wxSize old = GetSize();
             DoSetSize(dc, event.GetSize());
             OnLayout(dc);
+            GetGraph()->m_journal->Resized(*this, old);
         }
     }
 }
 
+void GraphNode::RecordResize(const wxPoint& pos, const wxSize& size)
+{
+    Graph *graph = GetGraph();
+
+    if (graph) {
+        graph->m_journal->Moved(*this, pos);
+        graph->m_journal->Resized(*this, size);
+    }
+}
+
 void GraphNode::UpdateShape()
 {
     wxShape *shape = GetShape();
@@ -4487,6 +10126,7 @@ void GraphNode::UpdateShape()
 
 void GraphNode::SetText(const wxString& text)
 {
+    RecordChange(&GraphNode::SetText, m_text, text);
     m_text = text;
 
     wxShape *shape = GetShape();
@@ -4505,6 +10145,7 @@ wxString GraphNode::GetToolTip(const wxPoint&) const
 
 void GraphNode::SetFont(const wxFont& font)
 {
+    RecordChange(&GraphNode::SetFont, m_font, font);
     m_font = font;
 
     wxShape *shape = GetShape();
@@ -4528,6 +10169,7 @@ wxFont GraphNode::GetFont() const
 
 void GraphNode::SetTextColour(const wxColour& colour)
 {
+    RecordChange(&GraphNode::SetTextColour, m_textcolour, colour);
     m_textcolour = colour;
     UpdateShapeTextColour();
     Refresh();
@@ -4553,15 +10195,6 @@ wxList *GraphNode::GetLines() const
     return &GetShape()->GetLines();
 }
 
-impl::GraphIteratorImpl *GraphNode::IterImpl(
-    const wxList::iterator& begin,
-    const wxList::iterator& end,
-    wxClassInfo *classinfo,
-    int which) const
-{
-    return new ListIterImpl(begin, end, classinfo, which, this);
-}
-
 size_t GraphNode::GetEdgeCount() const
 {
     wxList& list = GetShape()->GetLines();
@@ -4570,12 +10203,12 @@ size_t GraphNode::GetEdgeCount() const
 
 size_t GraphNode::GetInEdgeCount() const
 {
-    return GetCount(GetInEdges());
+    return m_inEdgeCount;
 }
 
 size_t GraphNode::GetOutEdgeCount() const
 {
-    return GetCount(GetOutEdges());
+    return m_outEdgeCount;
 }
 
 wxPoint GraphNode::GetPerimeterPoint(const wxPoint& inside,
@@ -0,0 +1,361 @@
+/////////////////////////////////////////////////////////////////////////////
+// Name:        graphoverview.cpp
+// Purpose:     Overview of a graph shown by a GraphCtrl
+// Author:      Mike Wetherell
+// Modified by:
+// Created:     October 2026
+// RCS-ID:      $Id$
+// Copyright:   (c) 2026 TT-Solutions SARL
+// Licence:     wxWindows licence
+/////////////////////////////////////////////////////////////////////////////
+
+#include "graphoverview.h"
+
+#include <wx/dcbuffer.h>
+#include <wx/dcmemory.h>
+
+#include <algorithm>
+#include <cmath>
+
+/**
+ * @file
+ * @brief Implementation of GraphOverviewCtrl.
+ */
+
+using std::min;
+using std::max;
+
+namespace tt_solutions {
+
+namespace {
+
+/// The size of the tiles of the thumbnail drawn again after a change.
+constexpr int TILE_SIZE = 64;
+
+/// The margin around the graph bounds is this fraction of their size.
+constexpr int MARGIN_DIVISOR = 8;
+
+/// The thumbnail is fitted again if the graph becomes this much smaller.
+constexpr int SHRINK_FACTOR = 2;
+
+/// Width of the pen drawing the view rectangle.
+constexpr int VIEW_PEN_WIDTH = 2;
+
+} // namespace
+
+BEGIN_EVENT_TABLE(GraphOverviewCtrl, wxControl)
+    EVT_PAINT(GraphOverviewCtrl::OnPaint)
+    EVT_SIZE(GraphOverviewCtrl::OnSize)
+    EVT_MOUSE_EVENTS(GraphOverviewCtrl::OnMouse)
+    EVT_MOUSE_CAPTURE_LOST(GraphOverviewCtrl::OnCaptureLost)
+END_EVENT_TABLE()
+
+IMPLEMENT_DYNAMIC_CLASS(GraphOverviewCtrl, wxControl)
+
+const wxChar GraphOverviewCtrl::DefaultName[] = _T("graphoverview");
+
+GraphOverviewCtrl::GraphOverviewCtrl(wxWindow *parent,
+                                     GraphCtrl *ctrl,
+                                     wxWindowID id,
+                                     const wxPoint& pos,
+                                     const wxSize& size,
+                                     long style,
+                                     const wxString& name)
+  : m_ctrl(NULL),
+    m_scale(1.0),
+    m_cols(0),
+    m_rows(0),
+    m_anyDirty(false),
+    m_fit(true),
+    m_checkBounds(false)
+{
+    // the default ctor is only for the wx RTTI
+    if (!parent)
+        return;
+
+    SetBackgroundStyle(wxBG_STYLE_PAINT);
+    Create(parent, id, pos, size, style, wxDefaultValidator, name);
+    SetGraphCtrl(ctrl);
+}
+
+GraphOverviewCtrl::~GraphOverviewCtrl()
+{
+    SetGraphCtrl(NULL);
+}
+
+void GraphOverviewCtrl::SetGraphCtrl(GraphCtrl *ctrl)
+{
+    if (ctrl == m_ctrl)
+        return;
+
+    if (m_ctrl)
+        m_ctrl->RemoveOverview(this);
+
+    m_ctrl = ctrl;
+
+    if (m_ctrl)
+        m_ctrl->AddOverview(this);
+
+    RefreshThumbnail();
+}
+
+void GraphOverviewCtrl::RefreshThumbnail()
+{
+    m_fit = true;
+    Refresh();
+}
+
+wxPoint GraphOverviewCtrl::OverviewToGraph(const wxPoint& pt) const
+{
+    return wxPoint(m_origin.x + int(floor(pt.x / m_scale)),
+                   m_origin.y + int(floor(pt.y / m_scale)));
+}
+
+wxPoint GraphOverviewCtrl::GraphToOverview(const wxPoint& ptGraph) const
+{
+    return wxPoint(int(floor((ptGraph.x - m_origin.x) * m_scale)),
+                   int(floor((ptGraph.y - m_origin.y) * m_scale)));
+}
+
+wxRect GraphOverviewCtrl::GraphToOverview(const wxRect& rcGraph) const
+{
+    // rounded outwards, so that the result covers all of rcGraph
+    const int x1 = int(floor((rcGraph.x - m_origin.x) * m_scale));
+    const int y1 = int(floor((rcGraph.y - m_origin.y) * m_scale));
+    const int x2 = int(ceil((rcGraph.GetRight() - m_origin.x) * m_scale));
+    const int y2 = int(ceil((rcGraph.GetBottom() - m_origin.y) * m_scale));
+
+    return wxRect(wxPoint(x1, y1), wxPoint(x2, y2));
+}
+
+void GraphOverviewCtrl::GraphRectChanged(const wxRect& rcGraph)
+{
+    // nothing to do if the whole thumbnail will be drawn anyway
+    if (m_fit || !m_thumbnail.IsOk())
+        return;
+
+    // the pens can draw a little outside of the bounds of the elements
+    wxRect rc = GraphToOverview(rcGraph);
+    rc.Inflate(1);
+    rc.Intersect(wxRect(m_thumbnail.GetSize()));
+    if (rc.IsEmpty())
+        return;
+
+    const int col1 = rc.x / TILE_SIZE, col2 = rc.GetRight() / TILE_SIZE;
+    const int row1 = rc.y / TILE_SIZE, row2 = rc.GetBottom() / TILE_SIZE;
+
+    for (int row = row1; row <= row2; row++)
+        for (int col = col1; col <= col2; col++)
+            m_dirty[row * m_cols + col] = true;
+
+    m_anyDirty = true;
+    RefreshRect(rc, false);
+}
+
+void GraphOverviewCtrl::GraphBoundsChanged()
+{
+    // the bounds may not be up to date yet, so only check them when painting
+    if (!m_checkBounds) {
+        m_checkBounds = true;
+        Refresh(false);
+    }
+}
+
+void GraphOverviewCtrl::ViewChanged()
+{
+    if (!m_ctrl || !m_ctrl->GetGraph() || m_fit)
+        return;
+
+    wxRect rc = GraphToOverview(GetViewRect());
+    if (rc == m_rcView)
+        return;
+
+    RefreshRect(wxRect(m_rcView).Inflate(VIEW_PEN_WIDTH), false);
+    RefreshRect(rc.Inflate(VIEW_PEN_WIDTH), false);
+}
+
+wxRect GraphOverviewCtrl::GetViewRect() const
+{
+    const wxSize cs = m_ctrl->GetCanvas()->GetClientSize();
+    const double scale = m_ctrl->GetZoom() / 100.0;
+    const wxSize size(int(ceil(cs.x / scale)), int(ceil(cs.y / scale)));
+
+    return wxRect(m_ctrl->GetScrollPosition() - size / 2, size);
+}
+
+bool GraphOverviewCtrl::NeedsFit() const
+{
+    const wxRect bounds = m_ctrl->GetGraph()->GetBounds();
+    if (bounds.IsEmpty() || !m_thumbnail.IsOk())
+        return false;
+
+    const wxSize size = m_thumbnail.GetSize();
+    const wxRect covered(m_origin, wxSize(int(size.x / m_scale),
+                                          int(size.y / m_scale)));
+    if (!covered.Contains(bounds))
+        return true;
+
+    return bounds.width * m_scale * SHRINK_FACTOR < size.x &&
+           bounds.height * m_scale * SHRINK_FACTOR < size.y;
+}
+
+void GraphOverviewCtrl::FitThumbnail()
+{
+    m_fit = false;
+    m_checkBounds = false;
+
+    const wxSize cs = GetClientSize();
+    Graph *graph = m_ctrl ? m_ctrl->GetGraph() : NULL;
+
+    if (!graph || cs.x <= 0 || cs.y <= 0) {
+        m_thumbnail = wxBitmap();
+        m_cols = m_rows = 0;
+        m_dirty.clear();
+        m_anyDirty = false;
+        return;
+    }
+
+    // an empty graph is shown around the view, at the zoom of the view
+    wxRect rc = graph->GetBounds();
+    if (rc.IsEmpty())
+        rc = GetViewRect();
+    rc.Inflate(max(rc.width, rc.height) / MARGIN_DIVISOR);
+
+    m_scale = min(double(cs.x) / max(rc.width, 1),
+                  double(cs.y) / max(rc.height, 1));
+
+    // centre the graph, the thumbnail fills the whole client area
+    m_origin.x = rc.x + int(floor((rc.width - cs.x / m_scale) / 2));
+    m_origin.y = rc.y + int(floor((rc.height - cs.y / m_scale) / 2));
+
+    if (!m_thumbnail.IsOk() || m_thumbnail.GetSize() != cs)
+        m_thumbnail = wxBitmap(cs.x, cs.y, 24);
+
+    m_cols = (cs.x + TILE_SIZE - 1) / TILE_SIZE;
+    m_rows = (cs.y + TILE_SIZE - 1) / TILE_SIZE;
+    m_dirty.assign(m_cols * m_rows, true);
+    m_anyDirty = true;
+}
+
+void GraphOverviewCtrl::DrawTiles()
+{
+    m_anyDirty = false;
+
+    Graph *graph = m_ctrl ? m_ctrl->GetGraph() : NULL;
+    if (!graph || !m_thumbnail.IsOk())
+        return;
+
+    const wxColour background = m_ctrl->GetCanvas()->GetBackgroundColour();
+    wxMemoryDC dc(m_thumbnail);
+
+    auto draw = [&](const wxRect& rc)
+    {
+        // Draw doesn't clear the background
+        dc.SetLogicalOrigin(0, 0);
+        dc.SetUserScale(1.0, 1.0);
+        dc.SetPen(*wxTRANSPARENT_PEN);
+        dc.SetBrush(wxBrush(background));
+        dc.DrawRectangle(rc);
+
+        dc.SetLogicalOrigin(m_origin.x, m_origin.y);
+        dc.SetUserScale(m_scale, m_scale);
+
+        // the part of the graph covered by the tile, rounded outwards
+        const int x1 = m_origin.x + int(floor(rc.x / m_scale));
+        const int y1 = m_origin.y + int(floor(rc.y / m_scale));
+        const int x2 = m_origin.x + int(ceil(rc.GetRight() / m_scale));
+        const int y2 = m_origin.y + int(ceil(rc.GetBottom() / m_scale));
+
+        graph->Draw(&dc, wxRect(wxPoint(x1, y1), wxPoint(x2, y2)));
+        dc.DestroyClippingRegion();
+    };
+
+    const wxRect rcBitmap(m_thumbnail.GetSize());
+
+    // when all the tiles are dirty, the graph is drawn only once
+    if (std::find(m_dirty.begin(), m_dirty.end(), false) == m_dirty.end()) {
+        draw(rcBitmap);
+    }
+    else {
+        for (int row = 0; row < m_rows; row++) {
+            for (int col = 0; col < m_cols; col++) {
+                if (m_dirty[row * m_cols + col]) {
+                    wxRect rc(col * TILE_SIZE, row * TILE_SIZE,
+                              TILE_SIZE, TILE_SIZE);
+                    draw(rc.Intersect(rcBitmap));
+                }
+            }
+        }
+    }
+
+    m_dirty.assign(m_dirty.size(), false);
+}
+
+void GraphOverviewCtrl::OnPaint(wxPaintEvent&)
+{
+    wxAutoBufferedPaintDC dc(this);
+    Graph *graph = m_ctrl ? m_ctrl->GetGraph() : NULL;
+
+    if (graph && m_checkBounds) {
+        m_checkBounds = false;
+        if (NeedsFit())
+            m_fit = true;
+    }
+    if (m_fit)
+        FitThumbnail();
+    if (m_anyDirty)
+        DrawTiles();
+
+    dc.SetBackground(wxBrush(GetBackgroundColour()));
+    dc.Clear();
+
+    if (!graph || !m_thumbnail.IsOk()) {
+        m_rcView = wxRect();
+        return;
+    }
+
+    dc.DrawBitmap(m_thumbnail, 0, 0);
+
+    m_rcView = GraphToOverview(GetViewRect());
+    dc.SetPen(wxPen(wxSystemSettings::GetColour(wxSYS_COLOUR_HIGHLIGHT),
+                    VIEW_PEN_WIDTH));
+    dc.SetBrush(*wxTRANSPARENT_BRUSH);
+    dc.DrawRectangle(m_rcView);
+}
+
+void GraphOverviewCtrl::OnSize(wxSizeEvent& event)
+{
+    RefreshThumbnail();
+    event.Skip();
+}
+
+void GraphOverviewCtrl::ScrollCtrl(const wxPoint& pt)
+{
+    if (m_ctrl && m_ctrl->GetGraph() && m_thumbnail.IsOk())
+        m_ctrl->ScrollTo(OverviewToGraph(pt));
+}
+
+void GraphOverviewCtrl::OnMouse(wxMouseEvent& event)
+{
+    if (event.LeftDown()) {
+        if (!HasCapture())
+            CaptureMouse();
+        ScrollCtrl(event.GetPosition());
+    }
+    else if (event.Dragging() && HasCapture()) {
+        ScrollCtrl(event.GetPosition());
+    }
+    else if (event.LeftUp() && HasCapture()) {
+        ReleaseMouse();
+    }
+    else {
+        event.Skip();
+    }
+}
+
+void GraphOverviewCtrl::OnCaptureLost(wxMouseCaptureLostEvent&)
+{
+    // nothing to undo, the control just stops following the mouse
+}
+
+} // namespace tt_solutions
@@ -9,6 +9,7 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include <wx/dcprint.h>
+#include <wx/dcmemory.h>
 
 #include "graphprint.h"
 
@@ -22,7 +23,7 @@ using std::max;
  * @file
  * @brief Printing support.
  *
- * This file implements GraphPrintout and GraphPages classes.
+ * This file implements GraphPrintout, GraphPages and GraphTiles classes.
  */
 
 namespace tt_solutions {
@@ -293,4 +294,112 @@ bool GraphPages::PrintPage(int printoutPage, int graphPage)
     return true;
 }
 
+// ----------------------------------------------------------------------------
+// GraphTiles
+// ----------------------------------------------------------------------------
+
+GraphTiles::GraphTiles(const Graph *graph,
+                       const wxRect& rcGraph,
+                       const wxSize& size,
+                       const wxSize& tileSize)
+  : m_graph(graph),
+    m_rcGraph(rcGraph),
+    m_size(size),
+    m_tileSize(max(tileSize.x, 1), max(tileSize.y, 1)),
+    m_scaleX(rcGraph.width > 0 ? double(size.x) / rcGraph.width : 1.0),
+    m_scaleY(rcGraph.height > 0 ? double(size.y) / rcGraph.height : 1.0),
+    m_cols((max(size.x, 0) + m_tileSize.x - 1) / m_tileSize.x),
+    m_rows((max(size.y, 0) + m_tileSize.y - 1) / m_tileSize.y)
+{
+}
+
+wxRect GraphTiles::GetTileRect(int col, int row) const
+{
+    wxRect rc(col * m_tileSize.x, row * m_tileSize.y,
+              m_tileSize.x, m_tileSize.y);
+    return rc.Intersect(wxRect(m_size));
+}
+
+wxImage GraphTiles::RenderTile(int col,
+                               int row,
+                               const wxColour& background) const
+{
+    wxCHECK_MSG(m_graph, wxImage(), _T("no graph to render"));
+
+    const wxRect rc = GetTileRect(col, row);
+    if (rc.IsEmpty())
+        return wxImage();
+
+    wxBitmap bmp(rc.width, rc.height, 24);
+    if (!bmp.IsOk())
+        return wxImage();
+
+    {
+        wxMemoryDC dc(bmp);
+
+        // Draw doesn't clear the background
+        dc.SetBackground(wxBrush(background));
+        dc.Clear();
+
+        dc.SetLogicalOrigin(m_rcGraph.x, m_rcGraph.y);
+        dc.SetDeviceOrigin(-rc.x, -rc.y);
+        dc.SetUserScale(m_scaleX, m_scaleY);
+
+        // the part of the graph covered by this tile, rounded outwards
+        const int x1 = m_rcGraph.x + int(floor(rc.x / m_scaleX));
+        const int y1 = m_rcGraph.y + int(floor(rc.y / m_scaleY));
+        const int x2 = m_rcGraph.x + int(ceil(rc.GetRight() / m_scaleX));
+        const int y2 = m_rcGraph.y + int(ceil(rc.GetBottom() / m_scaleY));
+
+        m_graph->Draw(&dc, wxRect(wxPoint(x1, y1), wxPoint(x2, y2)));
+    }
+
+    return bmp.ConvertToImage();
+}
+
+bool GraphTiles::Render(wxImage& image,
+                        const wxPoint& pos,
+                        const wxColour& background) const
+{
+    wxCHECK_MSG(image.IsOk(), false, _T("image must be created"));
+
+    for (int row = 0; row < m_rows; row++) {
+        for (int col = 0; col < m_cols; col++) {
+            const wxImage tile = RenderTile(col, row, background);
+            if (!tile.IsOk())
+                return false;
+
+            image.Paste(tile,
+                        pos.x + col * m_tileSize.x,
+                        pos.y + row * m_tileSize.y);
+        }
+    }
+
+    return true;
+}
+
+bool GraphTiles::RenderRows(const RowSink& sink,
+                            const wxColour& background) const
+{
+    for (int row = 0; row < m_rows; row++) {
+        const wxRect rcRow = GetTileRect(0, row);
+        wxImage strip(m_size.x, rcRow.height, false);
+        if (!strip.IsOk())
+            return false;
+
+        for (int col = 0; col < m_cols; col++) {
+            const wxImage tile = RenderTile(col, row, background);
+            if (!tile.IsOk())
+                return false;
+
+            strip.Paste(tile, col * m_tileSize.x, 0);
+        }
+
+        if (!sink(strip, rcRow.y))
+            return false;
+    }
+
+    return true;
+}
+
 } // namespace tt_solutions
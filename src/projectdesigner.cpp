@@ -10,7 +10,12 @@
 /////////////////////////////////////////////////////////////////////////////
 
 #include "projectdesigner.h"
+#include <wx/hashmap.h>
+#include <cmath>
 #include <cstdlib>
+#include <map>
+#include <unordered_map>
+#include <utility>
 
 /**
  * @file
@@ -27,6 +32,169 @@ using namespace tt_solutions;
 using std::min;
 using std::max;
 
+namespace {
+
+/**
+ * Cache of the sizes of the node labels.
+ *
+ * Measuring text is slow on some platforms, notably with Pango, and all the
+ * nodes measure their labels again after a font change. As most labels are
+ * shared by many nodes, their sizes are remembered by font and text, so that
+ * the cost depends on the number of distinct labels only. The resolution and
+ * the scale of the DC are part of the key too, as the same font doesn't have
+ * the same size when printing or on a monitor with a different DPI.
+ */
+class TextExtentCache
+{
+public:
+    TextExtentCache() = default;
+
+    TextExtentCache(const TextExtentCache&) = delete;
+    TextExtentCache(TextExtentCache&&) = delete;
+    TextExtentCache& operator=(const TextExtentCache&) = delete;
+    TextExtentCache& operator=(TextExtentCache&&) = delete;
+
+    /// Return the size of the text drawn with the given font.
+    wxSize Get(wxReadOnlyDC& dc, const wxFont& font, const wxString& text);
+
+private:
+    /// The number of labels remembered for a font before starting again.
+    static constexpr size_t MAX_ENTRIES = 65536;
+
+    /// The number of fonts and DCs remembered before starting again.
+    static constexpr size_t MAX_FONTS = 16;
+
+    typedef std::unordered_map<wxString, wxSize,
+                               wxStringHash, wxStringEqual> ExtentMap;
+
+    /// The label sizes by the DC resolution and scale and the native
+    /// description of their font.
+    std::unordered_map<wxString, ExtentMap,
+                       wxStringHash, wxStringEqual> m_fonts;
+};
+
+wxSize TextExtentCache::Get(wxReadOnlyDC& dc,
+                            const wxFont& font,
+                            const wxString& text)
+{
+    if (!font.IsOk())
+        return dc.GetMultiLineTextExtent(text);
+
+    const wxSize ppi = dc.GetPPI();
+    double scaleX, scaleY;
+    dc.GetUserScale(&scaleX, &scaleY);
+
+    const wxString key = wxString::Format(_T("%d,%d,%g,%g,%g,"),
+                                          ppi.x, ppi.y, scaleX, scaleY,
+                                          dc.GetContentScaleFactor());
+
+    const wxString fontKey = key + font.GetNativeFontInfoDesc();
+
+    // forget the old fonts, e.g. after zooming through many scales
+    if (m_fonts.size() >= MAX_FONTS && m_fonts.find(fontKey) == m_fonts.end())
+        m_fonts.clear();
+
+    ExtentMap& extents = m_fonts[fontKey];
+
+    auto it = extents.find(text);
+    if (it != extents.end())
+        return it->second;
+
+    if (extents.size() >= MAX_ENTRIES)
+        extents.clear();
+
+    dc.SetFont(font);
+    wxSize size = dc.GetMultiLineTextExtent(text);
+    extents[text] = size;
+
+    return size;
+}
+
+/// Return the cache shared by all the nodes.
+TextExtentCache& GetTextExtents()
+{
+    static TextExtentCache cache;
+    return cache;
+}
+
+/**
+ * Cache of the node icons composited onto their background colour.
+ *
+ * The nodes using the same icon on the same background share the bitmap,
+ * which is drawn at the icon size and scaled by the DC, so it doesn't depend
+ * on the zoom.
+ */
+class IconCache
+{
+public:
+    /// Return the bitmap of the icon drawn on the background colour.
+    static wxBitmap Get(const wxIcon& icon, const wxColour& bgcolour);
+
+    /// Release all the bitmaps.
+    static void Clear() { ms_entries.clear(); }
+
+private:
+    /// The number of bitmaps kept before starting again.
+    static constexpr size_t MAX_ENTRIES = 256;
+
+    /// The entry keeps a reference to the icon so that its data isn't reused.
+    struct Entry
+    {
+        wxIcon icon;
+        wxBitmap bitmap;
+    };
+
+    /// The icon data and the background colour identify the bitmaps.
+    typedef std::pair<const wxObjectRefData*, wxUint32> Key;
+
+    static std::map<Key, Entry> ms_entries;
+};
+
+std::map<IconCache::Key, IconCache::Entry> IconCache::ms_entries;
+
+wxBitmap IconCache::Get(const wxIcon& icon, const wxColour& bgcolour)
+{
+    Key key(icon.GetRefData(), bgcolour.GetRGBA());
+
+    auto it = ms_entries.find(key);
+    if (it != ms_entries.end())
+        return it->second.bitmap;
+
+    if (ms_entries.size() >= MAX_ENTRIES)
+        ms_entries.clear();
+
+    wxBitmap bmp(icon.GetWidth(), icon.GetHeight());
+    {
+        wxMemoryDC mdc(bmp);
+        mdc.SetBackground(bgcolour);
+        mdc.Clear();
+        mdc.DrawIcon(icon, 0, 0);
+    }
+
+    Entry& entry = ms_entries[key];
+    entry.icon = icon;
+    entry.bitmap = bmp;
+
+    return bmp;
+}
+
+/**
+ * Releases the cached bitmaps before the toolkit is shut down.
+ */
+class IconCacheModule : public wxModule
+{
+public:
+    bool OnInit() override { return true; }
+    void OnExit() override { IconCache::Clear(); }
+
+private:
+    DECLARE_DYNAMIC_CLASS(IconCacheModule)
+};
+
+IMPLEMENT_DYNAMIC_CLASS(IconCacheModule, wxModule)
+
+} // anonymous namespace
+
 // ----------------------------------------------------------------------------
 // ProjectDesigner
 // ----------------------------------------------------------------------------
@@ -70,6 +238,7 @@ ProjectDesigner::~ProjectDesigner()
 bool ProjectDesigner::SetBackgroundColour(const wxColour& colour)
 {
     m_background[0] = m_background[1] = colour;
+    m_backgroundTile = wxBitmap();
     return true;
 }
 
@@ -78,6 +247,7 @@ void ProjectDesigner::SetBackgroundGradient(const wxColour& from,
 {
     m_background[0] = from;
     m_background[1] = to;
+    m_backgroundTile = wxBitmap();
 }
 
 void ProjectDesigner::SetShowGrid(bool show)
@@ -120,66 +290,142 @@ void ProjectDesigner::OnCanvasBackground(wxEraseEvent& event)
     event.Skip();
 }
 
-void ProjectDesigner::DrawCanvasBackground(wxDC& dc)
+const wxBitmap& ProjectDesigner::GetBackgroundTile(int width)
 {
-    // Start by clearing the background in any case.
-    dc.Clear();
+    constexpr int TILE_HEIGHT = 32;
+
+    // the canvas may not have been sized yet
+    if (width <= 0)
+        return wxNullBitmap;
 
+    if (!m_backgroundTile.IsOk() || m_backgroundTile.GetWidth() != width) {
+        m_backgroundTile.Create(width, TILE_HEIGHT);
+
+        wxMemoryDC mdc(m_backgroundTile);
+        mdc.GradientFillLinear(wxRect(0, 0, width, TILE_HEIGHT),
+                               m_background[0], m_background[1]);
+    }
+
+    return m_backgroundTile;
+}
+
+void ProjectDesigner::DrawCanvasBackground(wxDC& dc)
+{
     wxASSERT(GetGraph());
     wxWindow *canvas = GetCanvas();
 
-    canvas->PrepareDC(dc);
-
-    // Draw just on the visible part of the canvas.
+    // Draw just on the part of the canvas being repainted, which is only the
+    // newly exposed strip when scrolling.
     const wxSize size{canvas->GetClientSize()};
+    if (size.x <= 0 || size.y <= 0)
+        return;
 
-    wxRect rc;
-    rc.x = dc.DeviceToLogicalX(0);
-    rc.y = dc.DeviceToLogicalY(0);
-    rc.width = dc.DeviceToLogicalXRel(size.x);
-    rc.height = dc.DeviceToLogicalYRel(size.y);
+    wxRect rcUpdate = canvas->GetUpdateClientRect();
+    if (rcUpdate.IsEmpty())
+        rcUpdate = wxRect(size);
+    else
+        rcUpdate.Intersect(wxRect(size));
 
     if (m_background[0] == m_background[1]) {
         dc.SetBackground(m_background[0]);
         dc.Clear();
     } else {
-        dc.GradientFillLinear(rc, m_background[0], m_background[1]);
+        // The gradient is horizontal, so it's the same for all rows.
+        const wxBitmap& tile = GetBackgroundTile(size.x);
+        wxMemoryDC mdc;
+        mdc.SelectObjectAsSource(tile);
+
+        const int bottom = rcUpdate.GetBottom() + 1;
+        for (int y = rcUpdate.y; y < bottom; y += tile.GetHeight()) {
+            dc.Blit(rcUpdate.x, y,
+                    rcUpdate.width, min(tile.GetHeight(), bottom - y),
+                    &mdc, rcUpdate.x, 0);
+        }
     }
 
-    if (IsGridShown()) {
-        const wxSize spacing = GetGraph()->GetGridSpacing() * AdjustedGridFactor();
+    if (!IsGridShown())
+        return;
 
-        dc.SetPen(GetForegroundColour());
-        wxCoord x1, y1, x2, y2;
+    canvas->PrepareDC(dc);
 
-        x1 = rc.x - rc.x % spacing.x;
-        if (rc.x < 0)
-            x1 -= spacing.x;
-        x2 = rc.GetRight() - rc.GetRight() % spacing.x;
-        if (rc.GetRight() > 0)
-            x2 += spacing.x;
-        y1 = rc.y;
-        y2 = rc.GetBottom();
+    const wxSize spacing = GetGraph()->GetGridSpacing() * AdjustedGridFactor();
 
-        while (x1 <= x2) {
-            dc.DrawLine(x1, y1, x1, y2 + 1);
-            x1 += spacing.x;
-        }
+    double scaleX, scaleY;
+    dc.GetUserScale(&scaleX, &scaleY);
 
-        x1 = rc.x;
-        x2 = rc.GetRight();
-        y1 = rc.y - rc.y % spacing.y;
-        if (rc.y < 0)
-            y1 -= spacing.y;
-        y2 = rc.GetBottom() - rc.GetBottom() % spacing.y;
-        if (rc.GetBottom() > 0)
-            y2 += spacing.y;
-
-        while (y1 <= y2) {
-            dc.DrawLine(x1, y1, x2 + 1, y1);
-            y1 += spacing.y;
-        }
+    const wxBitmap& grid = GetGridLayer(size, spacing, scaleX, scaleY);
+
+    // The layer starts with a grid line, find the device position of the
+    // last line at or before the top left corner of the canvas.
+    const wxCoord x0 = dc.DeviceToLogicalX(0);
+    const wxCoord y0 = dc.DeviceToLogicalY(0);
+
+    wxCoord x = x0 - x0 % spacing.x;
+    if (x > x0)
+        x -= spacing.x;
+    wxCoord y = y0 - y0 % spacing.y;
+    if (y > y0)
+        y -= spacing.y;
+
+    const wxPoint pt(dc.LogicalToDeviceX(x), dc.LogicalToDeviceY(y));
+
+    dc.SetDeviceOrigin(0, 0);
+    dc.SetUserScale(1, 1);
+
+    wxMemoryDC mdc;
+    mdc.SelectObjectAsSource(grid);
+    dc.Blit(rcUpdate.x, rcUpdate.y, rcUpdate.width, rcUpdate.height,
+            &mdc, rcUpdate.x - pt.x, rcUpdate.y - pt.y, wxCOPY, true);
+
+    canvas->PrepareDC(dc);
+}
+
+const wxBitmap& ProjectDesigner::GetGridLayer(const wxSize& size,
+                                              const wxSize& spacing,
+                                              double scaleX,
+                                              double scaleY)
+{
+    const wxColour colour = GetForegroundColour();
+    const wxRealPoint scale(scaleX, scaleY);
+
+    if (m_gridLayer.IsOk() &&
+            m_gridSize == size &&
+            m_gridSpacing == spacing &&
+            m_gridScale == scale &&
+            m_gridColour == colour)
+        return m_gridLayer;
+
+    m_gridSize = size;
+    m_gridSpacing = spacing;
+    m_gridScale = scale;
+    m_gridColour = colour;
+
+    // Leave room for shifting the layer by up to one grid cell.
+    const int width = size.x + int(std::ceil(spacing.x * scaleX)) + 1;
+    const int height = size.y + int(std::ceil(spacing.y * scaleY)) + 1;
+
+    const wxColour& maskColour = BitmapMaskColour;
+
+    m_gridLayer.Create(width, height);
+    {
+        wxMemoryDC mdc(m_gridLayer);
+        mdc.SetBackground(wxBrush(maskColour));
+        mdc.Clear();
+
+        mdc.SetUserScale(scaleX, scaleY);
+        mdc.SetPen(colour);
+
+        const wxCoord right = mdc.DeviceToLogicalX(width);
+        const wxCoord bottom = mdc.DeviceToLogicalY(height);
+
+        for (wxCoord x = 0; x <= right; x += spacing.x)
+            mdc.DrawLine(x, 0, x, bottom + 1);
+        for (wxCoord y = 0; y <= bottom; y += spacing.y)
+            mdc.DrawLine(0, y, right + 1, y);
     }
+    m_gridLayer.SetMask(new wxMask(m_gridLayer, maskColour));
+
+    return m_gridLayer;
 }
 
 // ----------------------------------------------------------------------------
@@ -248,10 +494,17 @@ void ProjectNode::SetResult(const wxString& text)
 void ProjectNode::SetIcon(const wxIcon& icon)
 {
     m_icon = icon;
+    m_iconBitmap = wxBitmap();
     Layout();
     Refresh();
 }
 
+void ProjectNode::SetBackgroundColour(const wxColour& colour)
+{
+    m_iconBitmap = wxBitmap();
+    GraphNode::SetBackgroundColour(colour);
+}
+
 int ProjectNode::HitTest(const wxPoint& pt) const
 {
     wxRect bounds = GetBounds();
@@ -300,7 +553,8 @@ int ProjectNode::GetSpacing() const
 
 // Recalculates the positions of the things within the node. Only recalcs
 // the sizes of the text labels, m_rcText and m_rcResult, when the rects
-// are null, so usual it runs quickly.
+// are null, so usual it runs quickly. Even then the sizes are usually found
+// in the cache shared with the other nodes using the same labels.
 //
 void ProjectNode::OnLayout(wxReadOnlyDC &dc)
 {
@@ -308,16 +562,13 @@ void ProjectNode::OnLayout(wxReadOnlyDC &dc)
     int border = GetBorderThickness();
     int corner = GetCornerRadius();
 
+    wxFont font;
     if (m_rcText.IsEmpty() || m_rcResult.IsEmpty())
-        dc.SetFont(GetFont());
+        font = GetFont();
 
     // figure out the bounds of the top text label
-    if (m_rcText.IsEmpty()) {
-        wxCoord h, w;
-        dc.GetMultiLineTextExtent(GetText(), &w, &h);
-        m_rcText.width = w;
-        m_rcText.height = h;
-    }
+    if (m_rcText.IsEmpty())
+        m_rcText.SetSize(GetTextExtents().Get(dc, font, GetText()));
     m_rcText.x = spacing;
     m_rcText.y = spacing;
 
@@ -334,12 +585,8 @@ void ProjectNode::OnLayout(wxReadOnlyDC &dc)
     int iconHSpace = m_rcIcon.width + spacing;
 
     // bounds of the lower text, without calculating the y position
-    if (m_rcResult.IsEmpty()) {
-        wxCoord h, w;
-        dc.GetMultiLineTextExtent(GetResult(), &w, &h);
-        m_rcResult.width = w;
-        m_rcResult.height = h;
-    }
+    if (m_rcResult.IsEmpty())
+        m_rcResult.SetSize(GetTextExtents().Get(dc, font, GetResult()));
     m_rcResult.x = spacing + iconHSpace;
 
     // calculate the position of the dividing line between the two sections
@@ -446,14 +693,11 @@ void ProjectNode::OnDraw(wxDC& dc)
             rc = m_rcIcon;
             rc.Offset(bounds.GetTopLeft());
             if (clip.Intersects(rc)) {
-                wxBitmap bmp(rc.width, rc.height);
-                wxMemoryDC mdc(bmp);
-
-                mdc.SetBrush(GetBackgroundColour());
-                mdc.Clear();
+                if (!m_iconBitmap.IsOk())
+                    m_iconBitmap = IconCache::Get(GetIcon(),
+                                                  GetBackgroundColour());
 
-                mdc.DrawIcon(GetIcon(), 0, 0);
-                dc.Blit(rc.GetTopLeft(), rc.GetSize(), &mdc, wxPoint());
+                dc.DrawBitmap(m_iconBitmap, rc.GetTopLeft());
             }
         }
     }